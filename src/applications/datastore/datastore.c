@@ -42,6 +42,74 @@
 
 #define MAINTENANCE_FREQUENCY (10 * GNUNET_CRON_SECONDS)
 
+/**
+ * How many items do we buffer for writing to the
+ * sqstore in a single batch?
+ */
+#define WRITE_BATCH_SIZE 64
+
+/**
+ * How long may an item stay in the write-behind
+ * buffer before it is written to the sqstore?
+ */
+#define WRITE_BATCH_DELAY (250 * GNUNET_CRON_MILLISECONDS)
+
+/**
+ * After how many failed attempts to write a deferred item
+ * do we stop deferring new items?  The client has already
+ * been told that the item was stored, so it is never dropped;
+ * it stays in the buffer until it could be written.  New
+ * items are meanwhile stored synchronously so that their
+ * callers learn about the failure.
+ */
+#define WRITE_RETRIES 5
+
+/**
+ * An item that was accepted by putUpdateDeferred but
+ * has not yet been written to the sqstore.
+ */
+struct PendingPut
+{
+  GNUNET_HashCode key;
+
+  /**
+   * Hash of the content.
+   */
+  GNUNET_HashCode vhash;
+
+  /**
+   * Value to store (with comp'ed priority).
+   */
+  GNUNET_DatastoreValue *value;
+
+  /**
+   * Priority given by the callers (without comp'ed
+   * priority, used if the item already exists).
+   */
+  unsigned int priority;
+
+  /**
+   * Set during the flush if the item already exists
+   * in the sqstore.
+   */
+  int exists;
+
+  /**
+   * uid of the existing item (if exists).
+   */
+  unsigned long long uid;
+
+  /**
+   * Expiration time of the existing item (if exists).
+   */
+  GNUNET_CronTime expiration;
+
+  /**
+   * How many times did writing this item fail?
+   */
+  unsigned int failures;
+};
+
 /**
  * SQ-store handle
  */
@@ -77,6 +145,21 @@ static int stat_filtered;
 
 static int stat_filter_failed;
 
+static int stat_batched;
+
+/**
+ * Write-behind buffer (protected by lock).
+ */
+static struct PendingPut pending[WRITE_BATCH_SIZE];
+
+static unsigned int pending_count;
+
+/**
+ * Is an item in the buffer that failed to be written at least
+ * WRITE_RETRIES times (protected by lock)?
+ */
+static int writes_failing;
+
 /**
  * Time at which the database was created (used for
  * content aging).
@@ -108,12 +191,177 @@ getSize ()
   return sq->getSize ();
 }
 
+/**
+ * Callback used while flushing the write-behind buffer
+ * to find out which of the pending items already exist.
+ */
+static int
+checkExistsPending (const GNUNET_HashCode * key,
+                    const GNUNET_DatastoreValue * value, void *cls,
+                    unsigned long long uid)
+{
+  struct PendingPut *pp;
+  unsigned int i;
+
+  for (i = 0; i < pending_count; i++)
+    {
+      pp = &pending[i];
+      if ((pp->exists) ||
+          (value->type != pp->value->type) ||
+          (value->size != pp->value->size) ||
+          (0 != memcmp (key, &pp->key, sizeof (GNUNET_HashCode))) ||
+          (0 != memcmp (&value[1],
+                        &pp->value[1],
+                        ntohl (value->size) -
+                        sizeof (GNUNET_DatastoreValue))))
+        continue;
+      pp->uid = uid;
+      pp->expiration = GNUNET_ntohll (value->expiration_time);
+      pp->exists = GNUNET_YES;
+    }
+  return GNUNET_OK;
+}
+
+/**
+ * Write all items from the write-behind buffer to
+ * the sqstore.  Items that could not be written stay
+ * in the buffer (at the front) for the next attempt.
+ * Caller must hold the lock.
+ */
+static void
+flushPending ()
+{
+  GNUNET_HashCode keys[WRITE_BATCH_SIZE];
+  GNUNET_HashCode vhashes[WRITE_BATCH_SIZE];
+  const GNUNET_DatastoreValue *values[WRITE_BATCH_SIZE];
+  unsigned int slots[WRITE_BATCH_SIZE];
+  int results[WRITE_BATCH_SIZE];
+  int keep[WRITE_BATCH_SIZE];
+  struct PendingPut *pp;
+  unsigned int count;
+  unsigned int written;
+  unsigned int i;
+
+  if (pending_count == 0)
+    return;
+  for (i = 0; i < pending_count; i++)
+    {
+      keys[i] = pending[i].key;
+      vhashes[i] = pending[i].vhash;
+      pending[i].exists = GNUNET_NO;
+      keep[i] = GNUNET_NO;
+    }
+  sq->get_many (pending_count, keys, vhashes, 0, &checkExistsPending, NULL);
+  count = 0;
+  for (i = 0; i < pending_count; i++)
+    {
+      pp = &pending[i];
+      if (pp->exists)
+        {
+          available += ntohl (pp->value->size);
+          if ((pp->priority != 0) ||
+              (GNUNET_ntohll (pp->value->expiration_time) > pp->expiration))
+            sq->update (pp->uid,
+                        pp->priority,
+                        GNUNET_ntohll (pp->value->expiration_time));
+          continue;
+        }
+      keys[count] = pp->key;
+      values[count] = pp->value;
+      results[count] = GNUNET_SYSERR;
+      slots[count] = i;
+      count++;
+    }
+  if (count > 0)
+    sq->put_many (count, keys, values, results);
+  written = 0;
+  writes_failing = GNUNET_NO;
+  for (i = 0; i < count; i++)
+    {
+      pp = &pending[slots[i]];
+      if (results[i] == GNUNET_OK)
+        {
+          makeAvailable (&keys[i]);
+          written++;
+          continue;
+        }
+      keep[slots[i]] = GNUNET_YES;
+      pp->failures++;
+      if (pp->failures < WRITE_RETRIES)
+        continue;
+      writes_failing = GNUNET_YES;
+      if (pp->failures == WRITE_RETRIES)
+        GNUNET_GE_LOG (coreAPI->ectx,
+                       GNUNET_GE_ERROR | GNUNET_GE_BULK | GNUNET_GE_USER,
+                       _("Failed to write deferred content to datastore "
+                         "%u times, storing new content synchronously "
+                         "until it can be written.\n"), WRITE_RETRIES);
+    }
+  if (stats != NULL)
+    stats->change (stat_batched, written);
+  /* keep the items that failed */
+  count = 0;
+  for (i = 0; i < pending_count; i++)
+    {
+      if (keep[i] == GNUNET_YES)
+        pending[count++] = pending[i];
+      else
+        GNUNET_free (pending[i].value);
+    }
+  pending_count = count;
+}
+
+/**
+ * Make sure that deferred items are visible to the
+ * sqstore and the bloom filter.
+ */
+static void
+flushPendingIfAny ()
+{
+  GNUNET_mutex_lock (lock);
+  flushPending ();
+  GNUNET_mutex_unlock (lock);
+}
+
+/**
+ * Cron-job that writes the write-behind buffer
+ * to the sqstore.
+ */
+static void
+cronFlushPending (void *unused)
+{
+  flushPendingIfAny ();
+}
+
+/**
+ * Quick check (bloom filter) if we may have content for the
+ * given key.  Deferred items are not in the bloom filter yet,
+ * so look at the write-behind buffer as well (rather than
+ * flushing it, this is called for every query).
+ */
+static int
+fastGet (const GNUNET_HashCode * key)
+{
+  unsigned int i;
+
+  GNUNET_mutex_lock (lock);
+  for (i = 0; i < pending_count; i++)
+    if (0 == memcmp (key, &pending[i].key, sizeof (GNUNET_HashCode)))
+      {
+        GNUNET_mutex_unlock (lock);
+        return GNUNET_YES;
+      }
+  GNUNET_mutex_unlock (lock);
+  return testAvailable (key);
+}
+
 static int
 get (const GNUNET_HashCode * query,
      unsigned int type, GNUNET_DatastoreValueIterator iter, void *closure)
 {
   int ret = 0;
 
+  flushPendingIfAny ();
   if (!testAvailable (query))
     {
 #if DEBUG_DATASTORE
@@ -173,6 +421,7 @@ del (const GNUNET_HashCode * query, const GNUNET_DatastoreValue * value)
   GNUNET_EncName enc;
   GNUNET_HashCode vhc;
 
+  flushPendingIfAny ();
   if (!testAvailable (query))
     {
       IF_GELOG (coreAPI->ectx,
@@ -260,6 +509,7 @@ putUpdate (const GNUNET_HashCode * key, const GNUNET_DatastoreValue * value)
   GNUNET_hash (&value[1],
                ntohl (value->size) - sizeof (GNUNET_DatastoreValue), &vhc);
   GNUNET_mutex_lock (lock);
+  flushPending ();
   sq->get (key, &vhc, ntohl (value->type), &checkExists, &cls);
   if ((!cls.exists) && (ntohl (value->type) == GNUNET_ECRS_BLOCKTYPE_DATA))
     sq->get (key, &vhc, GNUNET_ECRS_BLOCKTYPE_ONDEMAND, &checkExists, &cls);
@@ -314,6 +564,109 @@ putUpdate (const GNUNET_HashCode * key, const GNUNET_DatastoreValue * value)
   return ok;
 }
 
+/**
+ * Store an item in the datastore, possibly deferring the write
+ * so that it can be combined with other items into a single
+ * sqstore transaction.  Items that do not pass the quota and
+ * priority check right away are handled by putUpdate (they may
+ * still be updates of existing content).
+ *
+ * @return GNUNET_OK if the item was accepted, GNUNET_NO if the
+ *   datastore is full and the priority of the item is not high
+ *   enough to justify removing something else, GNUNET_SYSERR on
+ *   other serious error
+ */
+static int
+putUpdateDeferred (const GNUNET_HashCode * key,
+                   const GNUNET_DatastoreValue * value)
+{
+  struct PendingPut *pp;
+  GNUNET_HashCode vhc;
+  GNUNET_CronTime expire;
+  CE cls;
+  unsigned int i;
+  int comp_prio;
+
+  if (ntohl (value->size) < sizeof (GNUNET_DatastoreValue))
+    {
+      GNUNET_GE_BREAK (coreAPI->ectx, 0);
+      return GNUNET_SYSERR;
+    }
+  GNUNET_hash (&value[1],
+               ntohl (value->size) - sizeof (GNUNET_DatastoreValue), &vhc);
+  GNUNET_mutex_lock (lock);
+  if (writes_failing == GNUNET_YES)
+    {
+      /* deferred writes keep failing, do not accept more
+         content that we may not be able to store */
+      GNUNET_mutex_unlock (lock);
+      return putUpdate (key, value);
+    }
+  for (i = 0; i < pending_count; i++)
+    {
+      pp = &pending[i];
+      if ((0 != memcmp (&pp->vhash, &vhc, sizeof (GNUNET_HashCode))) ||
+          (0 != memcmp (&pp->key, key, sizeof (GNUNET_HashCode))) ||
+          (pp->value->type != value->type) ||
+          (pp->value->size != value->size))
+        continue;
+      /* same content is already pending, merge */
+      pp->priority += ntohl (value->priority);
+      pp->value->priority =
+        htonl (ntohl (pp->value->priority) + ntohl (value->priority));
+      expire = GNUNET_ntohll (value->expiration_time);
+      if (expire > GNUNET_ntohll (pp->value->expiration_time))
+        pp->value->expiration_time = value->expiration_time;
+      GNUNET_mutex_unlock (lock);
+      return GNUNET_OK;
+    }
+  if (ntohl (value->type) == GNUNET_ECRS_BLOCKTYPE_DATA)
+    {
+      /* indexed content must not be stored a second time;
+         let putUpdate update the ONDEMAND block instead */
+      cls.exists = GNUNET_NO;
+      cls.value = value;
+      sq->get (key, &vhc, GNUNET_ECRS_BLOCKTYPE_ONDEMAND, &checkExists,
+               &cls);
+      if (cls.exists)
+        {
+          GNUNET_mutex_unlock (lock);
+          return putUpdate (key, value);
+        }
+    }
+  if (pending_count == WRITE_BATCH_SIZE)
+    flushPending ();
+  comp_prio = comp_priority ();
+  if ((pending_count == WRITE_BATCH_SIZE) ||
+      (available < ntohl (value->size)) ||
+      (minPriority >= ntohl (value->priority) + comp_prio))
+    {
+      /* buffer still full of items that failed to write, or
+         quota check failed: do it synchronously (so that the
+         caller learns about failures) */
+      GNUNET_mutex_unlock (lock);
+      return putUpdate (key, value);
+    }
+  if (ntohl (value->priority) + comp_prio < minPriority)
+    minPriority = ntohl (value->priority) + comp_prio;
+  pp = &pending[pending_count++];
+  pp->key = *key;
+  pp->vhash = vhc;
+  pp->value = GNUNET_malloc (ntohl (value->size));
+  memcpy (pp->value, value, ntohl (value->size));
+  pp->value->priority = htonl (comp_prio + ntohl (value->priority));
+  pp->priority = ntohl (value->priority);
+  pp->exists = GNUNET_NO;
+  pp->failures = 0;
+  /* reserve the space now, flushPending corrects this
+     if the item turns out to exist already */
+  available -= ntohl (value->size);
+  if (pending_count == WRITE_BATCH_SIZE)
+    flushPending ();
+  GNUNET_mutex_unlock (lock);
+  return GNUNET_OK;
+}
+
 /**
  * @return *closure if we are below quota,
  *         GNUNET_SYSERR if we have deleted all of the expired content
@@ -401,6 +754,9 @@ provide_module_datastore (GNUNET_CoreAPIForPlugins * capi)
         stats->create (gettext_noop ("# requests filtered by bloom filter"));
       stat_filter_failed =
         stats->create (gettext_noop ("# bloom filter false positives"));
+      stat_batched =
+        stats->create (gettext_noop
+                       ("# items written to datastore in batches"));
 
       stats->
         set (stats->create (gettext_noop ("# bytes allowed in datastore")),
@@ -434,7 +790,7 @@ provide_module_datastore (GNUNET_CoreAPIForPlugins * capi)
       return NULL;
     }
   coreAPI = capi;
-  initPrefetch (capi->ectx, capi->cfg, sq);
+  initPrefetch (capi->ectx, capi->cfg, stats, sq);
   if (GNUNET_OK != initFilters (capi->ectx, capi->cfg))
     {
       GNUNET_GE_BREAK (capi->ectx, 0);
@@ -465,10 +821,14 @@ provide_module_datastore (GNUNET_CoreAPIForPlugins * capi)
   GNUNET_cron_add_job (cron,
                        &cronMaintenance,
                        MAINTENANCE_FREQUENCY, MAINTENANCE_FREQUENCY, NULL);
+  GNUNET_cron_add_job (cron,
+                       &cronFlushPending,
+                       WRITE_BATCH_DELAY, WRITE_BATCH_DELAY, NULL);
   GNUNET_cron_start (cron);
   api.getSize = &getSize;
-  api.fast_get = &testAvailable;
+  api.fast_get = &fastGet;
   api.putUpdate = &putUpdate;
+  api.putUpdateDeferred = &putUpdateDeferred;
   api.get = &get;
   api.getRandom = &getRandom;   /* in prefetch.c */
   api.del = &del;
@@ -484,8 +844,20 @@ release_module_datastore ()
 {
   GNUNET_cron_stop (cron);
   GNUNET_cron_del_job (cron, &cronMaintenance, MAINTENANCE_FREQUENCY, NULL);
+  GNUNET_cron_del_job (cron, &cronFlushPending, WRITE_BATCH_DELAY, NULL);
   GNUNET_cron_destroy (cron);
   cron = NULL;
+  GNUNET_mutex_lock (lock);
+  flushPending ();
+  if (pending_count > 0)
+    GNUNET_GE_LOG (coreAPI->ectx,
+                   GNUNET_GE_ERROR | GNUNET_GE_BULK | GNUNET_GE_USER,
+                   _("Failed to write %u deferred items to datastore.\n"),
+                   pending_count);
+  while (pending_count > 0)
+    GNUNET_free (pending[--pending_count].value);
+  writes_failing = GNUNET_NO;
+  GNUNET_mutex_unlock (lock);
   donePrefetch ();
   doneFilters ();
   coreAPI->service_release (sq);
@@ -546,6 +918,8 @@ update_module_datastore (GNUNET_UpdateAPI * uapi)
   GNUNET_State_ServiceAPI *state;
   struct FAAProgressInfo pi;
 
+  /* give the sqstore a chance to migrate its tables first */
+  uapi->service_update ("sqstore");
   if (-1 == GNUNET_GC_get_configuration_value_number (uapi->cfg,
                                                       "FS",
                                                       "QUOTA",
@@ -0,0 +1,214 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file applications/datastore/datastoretest.c
+ * @brief test for the write-behind buffer of datastore.c, using
+ *        an sqstore that can be told to fail all writes
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "gnunet_util.h"
+
+#include "datastore.c"
+
+#define ASSERT(x) do { if (! (x)) { printf("Error at %s:%d\n", __FILE__, __LINE__); goto FAILURE;} } while (0)
+
+/**
+ * Should the fake sqstore fail all writes?
+ */
+static int fail_writes;
+
+/**
+ * Number of items written to the fake sqstore.
+ */
+static unsigned int stored;
+
+static GNUNET_HashCode stored_keys[16];
+
+static unsigned long long
+fakeGetSize ()
+{
+  return 0;
+}
+
+static int
+fakePut (const GNUNET_HashCode * key, const GNUNET_DatastoreValue * value)
+{
+  if ((fail_writes == GNUNET_YES) || (stored == 16))
+    return GNUNET_SYSERR;
+  stored_keys[stored++] = *key;
+  return GNUNET_OK;
+}
+
+static int
+fakePutMany (unsigned int count,
+             const GNUNET_HashCode * keys,
+             const GNUNET_DatastoreValue * const *values, int *results)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; i++)
+    results[i] = fakePut (&keys[i], values[i]);
+  return GNUNET_OK;
+}
+
+static int
+fakeGet (const GNUNET_HashCode * key,
+         const GNUNET_HashCode * vhash,
+         unsigned int type, GNUNET_DatastoreValueIterator iter, void *closure)
+{
+  return 0;
+}
+
+static int
+fakeGetMany (unsigned int count,
+             const GNUNET_HashCode * keys,
+             const GNUNET_HashCode * vhashes,
+             unsigned int type, GNUNET_DatastoreValueIterator iter,
+             void *closure)
+{
+  return 0;
+}
+
+static int
+fakeIterate (unsigned int type, GNUNET_DatastoreValueIterator iter,
+             void *closure)
+{
+  return 0;
+}
+
+static GNUNET_SQstore_ServiceAPI fakeSQ;
+
+static void *
+request_service (const char *name)
+{
+  if (0 == strcmp (name, "sqstore"))
+    return &fakeSQ;
+  return NULL;
+}
+
+static int
+release_service (void *service)
+{
+  return GNUNET_OK;
+}
+
+static GNUNET_DatastoreValue *
+initValue (int i)
+{
+  GNUNET_DatastoreValue *value;
+
+  value = GNUNET_malloc (sizeof (GNUNET_DatastoreValue) + 8);
+  value->size = htonl (sizeof (GNUNET_DatastoreValue) + 8);
+  value->type = htonl (GNUNET_ECRS_BLOCKTYPE_DATA);
+  value->priority = htonl (1);
+  value->anonymity_level = htonl (0);
+  value->expiration_time = GNUNET_htonll (GNUNET_get_time () +
+                                          GNUNET_CRON_HOURS);
+  memset (&value[1], i, 8);
+  return value;
+}
+
+/**
+ * Items that were accepted while the sqstore failed must
+ * be written once it works again; while writes keep failing,
+ * new items must be refused.
+ */
+static int
+testFailingStore (GNUNET_Datastore_ServiceAPI * api)
+{
+  GNUNET_DatastoreValue *value;
+  GNUNET_HashCode key;
+  int i;
+
+  fail_writes = GNUNET_YES;
+  value = initValue (1);
+  GNUNET_hash (&value[1], 8, &key);
+  ASSERT (GNUNET_OK == api->putUpdateDeferred (&key, value));
+  GNUNET_free (value);
+  /* pending items are found without being written */
+  ASSERT (GNUNET_YES == api->fast_get (&key));
+  for (i = 0; i < WRITE_RETRIES; i++)
+    flushPendingIfAny ();
+  ASSERT (stored == 0);
+  /* writes keep failing, so new items are refused */
+  value = initValue (2);
+  GNUNET_hash (&value[1], 8, &key);
+  ASSERT (GNUNET_SYSERR == api->putUpdateDeferred (&key, value));
+  GNUNET_free (value);
+  /* ... but the accepted one is still written eventually */
+  fail_writes = GNUNET_NO;
+  flushPendingIfAny ();
+  value = initValue (1);
+  GNUNET_hash (&value[1], 8, &key);
+  GNUNET_free (value);
+  ASSERT (stored == 1);
+  ASSERT (0 == memcmp (&key, &stored_keys[0], sizeof (GNUNET_HashCode)));
+  ASSERT (GNUNET_YES == api->fast_get (&key));
+  /* and new items are deferred again */
+  value = initValue (3);
+  GNUNET_hash (&value[1], 8, &key);
+  ASSERT (GNUNET_OK == api->putUpdateDeferred (&key, value));
+  GNUNET_free (value);
+  flushPendingIfAny ();
+  ASSERT (stored == 2);
+  return 0;
+FAILURE:
+  return 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GNUNET_CoreAPIForPlugins capi;
+  GNUNET_Datastore_ServiceAPI *api;
+  int ret;
+
+  fakeSQ.getSize = &fakeGetSize;
+  fakeSQ.put = &fakePut;
+  fakeSQ.put_many = &fakePutMany;
+  fakeSQ.get = &fakeGet;
+  fakeSQ.get_many = &fakeGetMany;
+  fakeSQ.iterateLowPriority = &fakeIterate;
+  fakeSQ.iterateExpirationTime = &fakeIterate;
+  memset (&capi, 0, sizeof (GNUNET_CoreAPIForPlugins));
+  capi.cfg = GNUNET_GC_create ();
+  GNUNET_GC_set_configuration_value_string (capi.cfg, NULL, "FS", "DIR",
+                                            "/tmp/gnunet-datastoretest");
+  GNUNET_GC_set_configuration_value_number (capi.cfg, NULL, "FS", "QUOTA",
+                                            1);
+  capi.service_request = &request_service;
+  capi.service_release = &release_service;
+  api = provide_module_datastore (&capi);
+  if (api == NULL)
+    {
+      GNUNET_GC_free (capi.cfg);
+      return 1;
+    }
+  ret = testFailingStore (api);
+  release_module_datastore ();
+  GNUNET_disk_directory_remove (NULL, "/tmp/gnunet-datastoretest");
+  GNUNET_GC_free (capi.cfg);
+  return ret;
+}
+
+/* end of datastoretest.c */
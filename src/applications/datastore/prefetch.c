@@ -31,18 +31,72 @@
 
 #define DEBUG_PREFETCH GNUNET_NO
 
-static GNUNET_HashCode rkey;
+/**
+ * Default number of blocks in the prefetch buffer.
+ */
+#define DEFAULT_BUFFER_SIZE 16
+
+/**
+ * An entry in the prefetch buffer.
+ */
+struct PrefetchEntry
+{
+  GNUNET_HashCode key;
+
+  GNUNET_DatastoreValue *value;
+};
+
+/**
+ * Blocks that are ready to be handed out by getRandom.
+ * The first buffer_count entries are valid.
+ */
+static struct PrefetchEntry *buffer;
+
+/**
+ * Capacity of the buffer.
+ */
+static unsigned int buffer_size;
+
+/**
+ * Number of valid entries in the buffer.
+ */
+static unsigned int buffer_count;
+
+/**
+ * Times at which slots in the buffer were freed (ring of
+ * buffer_size entries, oldest first); used to compute
+ * the refill latency.
+ */
+static GNUNET_CronTime *freed;
+
+/**
+ * Index of the oldest entry in freed.
+ */
+static unsigned int freed_head;
 
-static GNUNET_DatastoreValue *rvalue;
+/**
+ * Number of entries in freed.
+ */
+static unsigned int freed_count;
 
 /**
  * SQ-store handle
  */
 static GNUNET_SQstore_ServiceAPI *sq;
 
+static GNUNET_Stats_ServiceAPI *stats;
+
+static int stat_prefetch_hits;
+
+static int stat_prefetch_misses;
+
+static int stat_prefetch_refills;
+
+static int stat_prefetch_refill_time;
+
 /**
  * Semaphore on which the RCB acquire thread waits
- * if the RCB buffer is full.
+ * if the RCB buffer is full (counts free slots).
  */
 static struct GNUNET_Semaphore *acquireMoreSignal;
 
@@ -63,21 +117,53 @@ static struct GNUNET_GE_Context *ectx;
 static struct GNUNET_GC_Configuration *cfg;
 
 
+/**
+ * Add a block to the buffer.  Blocks (and thereby keeps the
+ * migration iteration at its current position) while the
+ * buffer is full.
+ */
 static int
 acquire (const GNUNET_HashCode * key,
          const GNUNET_DatastoreValue * value, void *closure,
          unsigned long long uid)
 {
+  GNUNET_CronTime now;
+  unsigned int i;
+
   if (doneSignal)
     return GNUNET_SYSERR;
   GNUNET_semaphore_down (acquireMoreSignal, GNUNET_YES);
   if (doneSignal)
     return GNUNET_SYSERR;
   GNUNET_mutex_lock (lock);
-  GNUNET_GE_ASSERT (NULL, rvalue == NULL);
-  rkey = *key;
-  rvalue = GNUNET_malloc (ntohl (value->size));
-  memcpy (rvalue, value, ntohl (value->size));
+  GNUNET_GE_ASSERT (NULL, buffer_count < buffer_size);
+  for (i = 0; i < buffer_count; i++)
+    {
+      if (0 == memcmp (key, &buffer[i].key, sizeof (GNUNET_HashCode)))
+        {
+          /* already buffered (from an earlier pass) */
+          GNUNET_mutex_unlock (lock);
+          GNUNET_semaphore_up (acquireMoreSignal);
+          return GNUNET_OK;
+        }
+    }
+  buffer[buffer_count].key = *key;
+  buffer[buffer_count].value = GNUNET_malloc (ntohl (value->size));
+  memcpy (buffer[buffer_count].value, value, ntohl (value->size));
+  buffer_count++;
+  if (freed_count > 0)
+    {
+      now = GNUNET_get_time ();
+      if (stats != NULL)
+        {
+          stats->change (stat_prefetch_refills, 1);
+          stats->change (stat_prefetch_refill_time,
+                         (now - freed[freed_head]) /
+                         GNUNET_CRON_MILLISECONDS);
+        }
+      freed_head = (freed_head + 1) % buffer_size;
+      freed_count--;
+    }
   GNUNET_mutex_unlock (lock);
   if (doneSignal)
     return GNUNET_SYSERR;
@@ -85,7 +171,10 @@ acquire (const GNUNET_HashCode * key,
 }
 
 /**
- * Acquire new block(s) to the migration buffer.
+ * Acquire new block(s) to the migration buffer.  A pass over
+ * the migration order is only restarted once the previous
+ * pass has reached the end of the table; while the buffer is
+ * full, the pass simply waits in acquire.
  */
 static void *
 rcbAcquire (void *unused)
@@ -111,11 +200,19 @@ rcbAcquire (void *unused)
  * Select content for active migration.  Takes the best match from the
  * randomContentBuffer (if the RCB is non-empty) and returns it.
  *
+ * @param receiver if not NULL, return the entry whose key
+ *        is closest to receiver
  * @return GNUNET_SYSERR if the RCB is empty
  */
 int
-getRandom (GNUNET_HashCode * key, GNUNET_DatastoreValue ** value)
+getRandom (const GNUNET_HashCode * receiver,
+           GNUNET_HashCode * key, GNUNET_DatastoreValue ** value)
 {
+  unsigned int i;
+  unsigned int entry;
+  unsigned int dist;
+  unsigned int minDist;
+
   GNUNET_mutex_lock (lock);
   if (gather_thread == NULL)
     {
@@ -126,15 +223,40 @@ getRandom (GNUNET_HashCode * key, GNUNET_DatastoreValue ** value)
                                 GNUNET_GE_USER | GNUNET_GE_IMMEDIATE,
                                 "pthread_create");
     }
-  if (rvalue == NULL)
+  if (buffer_count == 0)
     {
       GNUNET_mutex_unlock (lock);
+      if (stats != NULL)
+        stats->change (stat_prefetch_misses, 1);
       return GNUNET_SYSERR;
     }
-  *value = rvalue;
-  *key = rkey;
-  rvalue = NULL;
+  if (receiver == NULL)
+    {
+      entry = GNUNET_random_u32 (GNUNET_RANDOM_QUALITY_WEAK, buffer_count);
+    }
+  else
+    {
+      entry = 0;
+      minDist = -1;             /* max */
+      for (i = 0; i < buffer_count; i++)
+        {
+          dist = GNUNET_hash_distance_u32 (&buffer[i].key, receiver);
+          if (dist < minDist)
+            {
+              entry = i;
+              minDist = dist;
+            }
+        }
+    }
+  *value = buffer[entry].value;
+  *key = buffer[entry].key;
+  buffer[entry] = buffer[--buffer_count];
+  buffer[buffer_count].value = NULL;
+  freed[(freed_head + freed_count) % buffer_size] = GNUNET_get_time ();
+  freed_count++;
   GNUNET_mutex_unlock (lock);
+  if (stats != NULL)
+    stats->change (stat_prefetch_hits, 1);
   GNUNET_semaphore_up (acquireMoreSignal);
   return GNUNET_OK;
 }
@@ -142,12 +264,42 @@ getRandom (GNUNET_HashCode * key, GNUNET_DatastoreValue ** value)
 void
 initPrefetch (struct GNUNET_GE_Context *e,
               struct GNUNET_GC_Configuration *c,
-              GNUNET_SQstore_ServiceAPI * s)
+              GNUNET_Stats_ServiceAPI * s, GNUNET_SQstore_ServiceAPI * q)
 {
+  unsigned long long size;
+
   ectx = e;
   cfg = c;
-  sq = s;
-  acquireMoreSignal = GNUNET_semaphore_create (1);
+  stats = s;
+  sq = q;
+  if (-1 == GNUNET_GC_get_configuration_value_number (cfg,
+                                                      "FS",
+                                                      "PREFETCHBUFFERSIZE",
+                                                      1,
+                                                      1024,
+                                                      DEFAULT_BUFFER_SIZE,
+                                                      &size))
+    size = DEFAULT_BUFFER_SIZE;
+  buffer_size = (unsigned int) size;
+  buffer_count = 0;
+  buffer = GNUNET_malloc (buffer_size * sizeof (struct PrefetchEntry));
+  memset (buffer, 0, buffer_size * sizeof (struct PrefetchEntry));
+  freed = GNUNET_malloc (buffer_size * sizeof (GNUNET_CronTime));
+  freed_head = 0;
+  freed_count = 0;
+  if (stats != NULL)
+    {
+      stat_prefetch_hits =
+        stats->create (gettext_noop ("# migration prefetch buffer hits"));
+      stat_prefetch_misses =
+        stats->create (gettext_noop ("# migration prefetch buffer misses"));
+      stat_prefetch_refills =
+        stats->create (gettext_noop ("# migration prefetch buffer refills"));
+      stat_prefetch_refill_time =
+        stats->create (gettext_noop
+                       ("# migration prefetch buffer refill time (ms)"));
+    }
+  acquireMoreSignal = GNUNET_semaphore_create (buffer_size);
   doneSignal = GNUNET_NO;
   lock = GNUNET_mutex_create (GNUNET_NO);
 }
@@ -156,6 +308,7 @@ void
 donePrefetch ()
 {
   void *unused;
+  unsigned int i;
 
   doneSignal = GNUNET_YES;
   if (gather_thread != NULL)
@@ -163,11 +316,19 @@ donePrefetch ()
   GNUNET_semaphore_up (acquireMoreSignal);
   if (gather_thread != NULL)
     GNUNET_thread_join (gather_thread, &unused);
+  gather_thread = NULL;
   GNUNET_semaphore_destroy (acquireMoreSignal);
-  GNUNET_free_non_null (rvalue);
-  rvalue = NULL;
+  for (i = 0; i < buffer_count; i++)
+    GNUNET_free (buffer[i].value);
+  GNUNET_free (buffer);
+  buffer = NULL;
+  buffer_count = 0;
+  buffer_size = 0;
+  GNUNET_free (freed);
+  freed = NULL;
   GNUNET_mutex_destroy (lock);
   lock = NULL;
+  stats = NULL;
   sq = NULL;
   cfg = NULL;
   ectx = NULL;
@@ -29,26 +29,29 @@
 #define PREFETCH_H
 
 #include "gnunet_sqstore_service.h"
+#include "gnunet_stats_service.h"
 
 /**
  * Initialize the migration module.
  */
 void initPrefetch (struct GNUNET_GE_Context *ectx,
                    struct GNUNET_GC_Configuration *cfg,
+                   GNUNET_Stats_ServiceAPI * stats,
                    GNUNET_SQstore_ServiceAPI * sq);
 
 void donePrefetch (void);
 
 /**
  * Get a random value from the datastore that has
- * a key close to the given approx value.
+ * a key close to the given receiver.
  *
+ * @param receiver hash to compare against, NULL for any
+ * @param key set to the key of the match
  * @param value set to an approximate match
- * @param type if a particular type is desired, 0
- *        for any type.
  * @return GNUNET_OK if a value was found, GNUNET_SYSERR if not
  */
-int getRandom (GNUNET_HashCode * key, GNUNET_DatastoreValue ** value);
+int getRandom (const GNUNET_HashCode * receiver,
+               GNUNET_HashCode * key, GNUNET_DatastoreValue ** value);
 
 
 /* end of prefetch.h */
@@ -0,0 +1,411 @@
+/*
+      This file is part of GNUnet
+      (C) 2008 Christian Grothoff (and other contributing authors)
+
+      GNUnet is free software; you can redistribute it and/or modify
+      it under the terms of the GNU General Public License as published
+      by the Free Software Foundation; either version 2, or (at your
+      option) any later version.
+
+      GNUnet is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      General Public License for more details.
+
+      You should have received a copy of the GNU General Public License
+      along with GNUnet; see the file COPYING.  If not, write to the
+      Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+      Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * @file module/peerindex.c
+ * @brief index of the peers in the DHT routing table, ordered
+ *        by identity, for selecting routing destinations
+ * @author Christian Grothoff
+ *
+ * The peers are kept sorted by the bits of their identity (in the
+ * order used by get_bit_distance).  Hence the peers that share the
+ * first n bits with a target form a contiguous range, and all peers
+ * with the same distance to the target can be found by walking down
+ * the (implicit) binary trie towards the target.  Each step of the
+ * walk splits off a range of peers with equal distance, so selection
+ * needs O(log^2 n) steps instead of touching every peer.
+ */
+
+#include "platform.h"
+#include <math.h>
+#include "peerindex.h"
+
+#define HASH_BITS (sizeof (GNUNET_HashCode) * 8)
+
+struct GNUNET_DHT_PeerIndex
+{
+
+  /**
+   * Peers in the index, sorted by identity.
+   */
+  const GNUNET_PeerIdentity **peers;
+
+  /**
+   * Number of peers in the index.
+   */
+  unsigned int count;
+
+  /**
+   * Allocated length of peers.
+   */
+  unsigned int size;
+
+};
+
+/**
+ * Peers in the index with the same distance to the target.
+ */
+struct Group
+{
+
+  /**
+   * First peer of the group in the index.
+   */
+  unsigned int start;
+
+  /**
+   * One past the last peer of the group in the index.
+   */
+  unsigned int end;
+
+  /**
+   * Inverse distance of each peer in the group.
+   */
+  unsigned int weight;
+
+  /**
+   * Sum of the weights of all unblocked peers in this
+   * and all previous groups.
+   */
+  unsigned long long total;
+
+};
+
+/**
+ * Inverse distance metric for each bit distance: the larger the
+ * closer the peer is to the target.  The basic idea is that if the
+ * peer would be in the n-th lowest bucket of the target, the value
+ * should be 2^n.  However, the largest value is 2^32-1, so this
+ * number is scaled.  All entries are non-zero.
+ */
+static unsigned int inverse_distance[HASH_BITS + 1];
+
+/**
+ * Get the index of the lowest bit of the two GNUNET_hash codes that
+ * differs.
+ */
+static unsigned int
+get_bit_distance (const GNUNET_HashCode * h1, const GNUNET_HashCode * h2)
+{
+  const unsigned char *c1 = (const unsigned char *) h1;
+  const unsigned char *c2 = (const unsigned char *) h2;
+  unsigned int i;
+  int diff;
+
+  i = 0;
+  while (i < HASH_BITS)
+    {
+      /* a bit only depends on the byte that contains it */
+      if (c1[i / 8] == c2[i / 8])
+        {
+          i = (i / 8 + 1) * 8;
+          continue;
+        }
+      diff = GNUNET_hash_get_bit (h1, i) - GNUNET_hash_get_bit (h2, i);
+      if (diff != 0)
+        return i;
+      i++;
+    }
+  return HASH_BITS;
+}
+
+static int
+compare_peers (const GNUNET_PeerIdentity * p1,
+               const GNUNET_PeerIdentity * p2)
+{
+  GNUNET_HashCode h1;
+  GNUNET_HashCode h2;
+  unsigned int bit;
+
+  h1 = p1->hashPubKey;
+  h2 = p2->hashPubKey;
+  bit = get_bit_distance (&h1, &h2);
+  if (bit == HASH_BITS)
+    return 0;
+  return GNUNET_hash_get_bit (&h1, bit) - GNUNET_hash_get_bit (&h2, bit);
+}
+
+/**
+ * Find the position of the given peer in the index.
+ *
+ * @param pos set to the position of the peer, or to the position
+ *        where it would have to be inserted
+ * @return GNUNET_YES if the peer is in the index
+ */
+static int
+find_peer (const struct GNUNET_DHT_PeerIndex *index,
+           const GNUNET_PeerIdentity * peer, unsigned int *pos)
+{
+  unsigned int lo;
+  unsigned int hi;
+  unsigned int mid;
+  int cmp;
+
+  lo = 0;
+  hi = index->count;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      cmp = compare_peers (index->peers[mid], peer);
+      if (cmp == 0)
+        {
+          *pos = mid;
+          return GNUNET_YES;
+        }
+      if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  *pos = lo;
+  return GNUNET_NO;
+}
+
+/**
+ * Create an empty peer index.
+ */
+struct GNUNET_DHT_PeerIndex *
+GNUNET_DHT_peer_index_create ()
+{
+  unsigned int i;
+  double d;
+
+  for (i = 0; i <= HASH_BITS; i++)
+    {
+      d = exp2 (i * 32.0 / HASH_BITS);
+      if (d > ((unsigned int) -1))
+        inverse_distance[i] = -1;
+      else
+        inverse_distance[i] = (unsigned int) d;
+    }
+  return GNUNET_malloc (sizeof (struct GNUNET_DHT_PeerIndex));
+}
+
+/**
+ * Free the index (but not the identities in it).
+ */
+void
+GNUNET_DHT_peer_index_destroy (struct GNUNET_DHT_PeerIndex *index)
+{
+  GNUNET_array_grow (index->peers, index->size, 0);
+  GNUNET_free (index);
+}
+
+/**
+ * Add a peer to the index.  The identity is not copied and must
+ * remain valid until it is removed again.  The peer must not
+ * already be in the index.
+ */
+void
+GNUNET_DHT_peer_index_add (struct GNUNET_DHT_PeerIndex *index,
+                           const GNUNET_PeerIdentity * peer)
+{
+  unsigned int pos;
+
+  if (GNUNET_YES == find_peer (index, peer, &pos))
+    {
+      GNUNET_GE_BREAK (NULL, 0);
+      return;
+    }
+  if (index->count == index->size)
+    GNUNET_array_grow (index->peers, index->size, index->size * 2 + 16);
+  memmove (&index->peers[pos + 1], &index->peers[pos],
+           (index->count - pos) * sizeof (const GNUNET_PeerIdentity *));
+  index->peers[pos] = peer;
+  index->count++;
+}
+
+/**
+ * Remove a peer from the index.
+ *
+ * @return GNUNET_OK on success, GNUNET_SYSERR if the peer
+ *         was not in the index
+ */
+int
+GNUNET_DHT_peer_index_remove (struct GNUNET_DHT_PeerIndex *index,
+                              const GNUNET_PeerIdentity * peer)
+{
+  unsigned int pos;
+
+  if (GNUNET_YES != find_peer (index, peer, &pos))
+    return GNUNET_SYSERR;
+  index->count--;
+  memmove (&index->peers[pos], &index->peers[pos + 1],
+           (index->count - pos) * sizeof (const GNUNET_PeerIdentity *));
+  return GNUNET_OK;
+}
+
+/**
+ * Select a random peer from the index that is not blocked.  Each
+ * peer is chosen with a probability proportional to its inverse
+ * distance to the target (see GNUNET_DHT_select_peer).
+ *
+ * @return GNUNET_OK on success, GNUNET_SYSERR if no peer is available
+ */
+int
+GNUNET_DHT_peer_index_select (const struct GNUNET_DHT_PeerIndex *index,
+                              GNUNET_PeerIdentity * set,
+                              const GNUNET_HashCode * target,
+                              const GNUNET_PeerIdentity * blocked,
+                              unsigned int blocked_size)
+{
+  struct Group *groups;
+  GNUNET_HashCode first;
+  GNUNET_HashCode last;
+  GNUNET_HashCode hc;
+  unsigned int *skip;
+  unsigned int skip_count;
+  unsigned int group_count;
+  unsigned int start;
+  unsigned int end;
+  unsigned int split;
+  unsigned int bit;
+  unsigned int lo;
+  unsigned int hi;
+  unsigned int mid;
+  unsigned int pos;
+  unsigned int i;
+  unsigned int j;
+  unsigned long long total;
+  unsigned long long selected;
+  int target_bit;
+
+  if (index->count == 0)
+    return GNUNET_SYSERR;
+  /* positions of the blocked peers in the index, sorted */
+  skip = NULL;
+  skip_count = 0;
+  if (blocked_size > 0)
+    skip = GNUNET_malloc (blocked_size * sizeof (unsigned int));
+  for (i = 0; i < blocked_size; i++)
+    {
+      if (GNUNET_YES != find_peer (index, &blocked[i], &pos))
+        continue;
+      for (j = 0; j < skip_count; j++)
+        if (skip[j] == pos)
+          break;
+      if (j < skip_count)
+        continue;               /* blocked twice */
+      j = skip_count++;
+      while ((j > 0) && (skip[j - 1] > pos))
+        {
+          skip[j] = skip[j - 1];
+          j--;
+        }
+      skip[j] = pos;
+    }
+
+  /* walk down towards the target; every step splits off
+     the peers that differ from the target at the next bit */
+  i = index->count;
+  if (i > HASH_BITS)
+    i = HASH_BITS;
+  groups = GNUNET_malloc ((i + 1) * sizeof (struct Group));
+  group_count = 0;
+  start = 0;
+  end = index->count;
+  while (start < end)
+    {
+      first = index->peers[start]->hashPubKey;
+      last = index->peers[end - 1]->hashPubKey;
+      split = get_bit_distance (&first, &last);
+      bit = get_bit_distance (target, &first);
+      if ((bit < split) || (split == HASH_BITS))
+        {
+          /* all remaining peers have the same distance */
+          groups[group_count].start = start;
+          groups[group_count].end = end;
+          groups[group_count].weight = inverse_distance[bit];
+          group_count++;
+          break;
+        }
+      /* peers in [start,end) agree with the target on all bits
+         before "split" and are sorted by the bit at "split" */
+      lo = start;
+      hi = end;
+      while (lo < hi)
+        {
+          mid = lo + (hi - lo) / 2;
+          hc = index->peers[mid]->hashPubKey;
+          if (GNUNET_hash_get_bit (&hc, split))
+            hi = mid;
+          else
+            lo = mid + 1;
+        }
+      target_bit = GNUNET_hash_get_bit (target, split);
+      groups[group_count].weight = inverse_distance[split];
+      if (target_bit)
+        {
+          groups[group_count].start = start;
+          groups[group_count].end = lo;
+          start = lo;
+        }
+      else
+        {
+          groups[group_count].start = lo;
+          groups[group_count].end = end;
+          end = lo;
+        }
+      group_count++;
+    }
+
+  /* prefix sums over the weights of the unblocked peers */
+  total = 0;
+  for (i = 0; i < group_count; i++)
+    {
+      pos = groups[i].end - groups[i].start;
+      for (j = 0; j < skip_count; j++)
+        if ((skip[j] >= groups[i].start) && (skip[j] < groups[i].end))
+          pos--;
+      total += (unsigned long long) pos * groups[i].weight;
+      groups[i].total = total;
+    }
+  if (total == 0)
+    {
+      GNUNET_free (groups);
+      GNUNET_free_non_null (skip);
+      return GNUNET_SYSERR;
+    }
+  selected = GNUNET_random_u64 (GNUNET_RANDOM_QUALITY_WEAK, total);
+  lo = 0;
+  hi = group_count - 1;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (groups[mid].total > selected)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+  if (lo > 0)
+    selected -= groups[lo - 1].total;
+  /* select the n-th unblocked peer of the group */
+  pos = groups[lo].start + selected / groups[lo].weight;
+  for (j = 0; j < skip_count; j++)
+    if ((skip[j] >= groups[lo].start) && (skip[j] <= pos))
+      pos++;
+  GNUNET_GE_ASSERT (NULL, pos < groups[lo].end);
+  *set = *index->peers[pos];
+  GNUNET_free (groups);
+  GNUNET_free_non_null (skip);
+  return GNUNET_OK;
+}
+
+/* end of peerindex.c */
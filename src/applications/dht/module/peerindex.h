@@ -0,0 +1,75 @@
+/*
+      This file is part of GNUnet
+      (C) 2008 Christian Grothoff (and other contributing authors)
+
+      GNUnet is free software; you can redistribute it and/or modify
+      it under the terms of the GNU General Public License as published
+      by the Free Software Foundation; either version 2, or (at your
+      option) any later version.
+
+      GNUnet is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      General Public License for more details.
+
+      You should have received a copy of the GNU General Public License
+      along with GNUnet; see the file COPYING.  If not, write to the
+      Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+      Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * @file module/peerindex.h
+ * @brief index of the peers in the DHT routing table, ordered
+ *        by identity, for selecting routing destinations
+ * @author Christian Grothoff
+ */
+
+#ifndef DHT_PEERINDEX_H
+#define DHT_PEERINDEX_H
+
+#include "gnunet_util.h"
+
+struct GNUNET_DHT_PeerIndex;
+
+/**
+ * Create an empty peer index.
+ */
+struct GNUNET_DHT_PeerIndex *GNUNET_DHT_peer_index_create (void);
+
+/**
+ * Free the index (but not the identities in it).
+ */
+void GNUNET_DHT_peer_index_destroy (struct GNUNET_DHT_PeerIndex *index);
+
+/**
+ * Add a peer to the index.  The identity is not copied and must
+ * remain valid until it is removed again.  The peer must not
+ * already be in the index.
+ */
+void GNUNET_DHT_peer_index_add (struct GNUNET_DHT_PeerIndex *index,
+                                const GNUNET_PeerIdentity * peer);
+
+/**
+ * Remove a peer from the index.
+ *
+ * @return GNUNET_OK on success, GNUNET_SYSERR if the peer
+ *         was not in the index
+ */
+int GNUNET_DHT_peer_index_remove (struct GNUNET_DHT_PeerIndex *index,
+                                  const GNUNET_PeerIdentity * peer);
+
+/**
+ * Select a random peer from the index that is not blocked.  Each
+ * peer is chosen with a probability proportional to its inverse
+ * distance to the target (see GNUNET_DHT_select_peer).
+ *
+ * @return GNUNET_OK on success, GNUNET_SYSERR if no peer is available
+ */
+int GNUNET_DHT_peer_index_select (const struct GNUNET_DHT_PeerIndex *index,
+                                  GNUNET_PeerIdentity * set,
+                                  const GNUNET_HashCode * target,
+                                  const GNUNET_PeerIdentity * blocked,
+                                  unsigned int blocked_size);
+
+#endif
@@ -181,15 +181,37 @@ typedef struct DHTQueryRecord
    */
   unsigned int result_count;
 
+  /**
+   * Position of this record in the expiration heap.
+   */
+  unsigned int heapPos;
+
 } DHTQueryRecord;
 
 /**
- * Linked list of active records.
+ * Active records, indexed by the key of the GET (records
+ * for different types share the key).
+ */
+static struct GNUNET_MultiHashMap *records;
+
+/**
+ * Binary min-heap of all active records, ordered
+ * by their expiration time.
+ */
+static DHTQueryRecord **expiry_heap;
+
+/**
+ * Allocated length of expiry_heap.
  */
-static DHTQueryRecord *records;
+static unsigned int expiry_heap_size;
 
 /**
- * Size of records
+ * Number of active records (in the heap and the map).
+ */
+static unsigned int rt_count;
+
+/**
+ * Maximum number of active records.
  */
 static unsigned int rt_size;
 
@@ -214,6 +236,16 @@ static unsigned int stat_get_requests_received;
 
 static unsigned int stat_put_requests_received;
 
+static unsigned int stat_routes_tracked;
+
+static unsigned int stat_routes_expired;
+
+static unsigned int stat_routes_evicted;
+
+static unsigned int stat_route_lookups;
+
+static unsigned int stat_route_lookup_probes;
+
 
 /**
  * To how many peers should we (on average)
@@ -244,6 +276,149 @@ get_forward_count (unsigned int hop_count, double target_replication)
 }
 
 
+static void
+expiry_heap_set (unsigned int pos, DHTQueryRecord * q)
+{
+  expiry_heap[pos] = q;
+  q->heapPos = pos;
+}
+
+static void
+expiry_heap_up (unsigned int pos)
+{
+  DHTQueryRecord *q;
+  unsigned int parent;
+
+  q = expiry_heap[pos];
+  while (pos > 0)
+    {
+      parent = (pos - 1) / 2;
+      if (expiry_heap[parent]->expire <= q->expire)
+        break;
+      expiry_heap_set (pos, expiry_heap[parent]);
+      pos = parent;
+    }
+  expiry_heap_set (pos, q);
+}
+
+static void
+expiry_heap_down (unsigned int pos)
+{
+  DHTQueryRecord *q;
+  unsigned int child;
+
+  q = expiry_heap[pos];
+  while ((child = 2 * pos + 1) < rt_count)
+    {
+      if ((child + 1 < rt_count) &&
+          (expiry_heap[child + 1]->expire < expiry_heap[child]->expire))
+        child++;
+      if (q->expire <= expiry_heap[child]->expire)
+        break;
+      expiry_heap_set (pos, expiry_heap[child]);
+      pos = child;
+    }
+  expiry_heap_set (pos, q);
+}
+
+/**
+ * Remove a record from the routing table and free it.
+ * Caller must hold the lock.
+ */
+static void
+free_record (DHTQueryRecord * q)
+{
+  DHT_Source_Route *pos;
+  DHTQueryRecord *last;
+
+  rt_count--;
+  if (q->heapPos != rt_count)
+    {
+      last = expiry_heap[rt_count];
+      expiry_heap_set (q->heapPos, last);
+      expiry_heap_up (last->heapPos);
+      expiry_heap_down (last->heapPos);
+    }
+  GNUNET_multi_hash_map_remove (records, &q->get.key, q);
+  while (q->sources != NULL)
+    {
+      pos = q->sources;
+      q->sources = pos->next;
+      GNUNET_free (pos);
+    }
+  GNUNET_array_grow (q->results, q->result_count, 0);
+  GNUNET_free (q);
+  if (stats != NULL)
+    stats->set (stat_routes_tracked, rt_count);
+}
+
+/**
+ * Free all records that expired before the given time.
+ * Caller must hold the lock.
+ */
+static void
+expire_records (GNUNET_CronTime now)
+{
+  while ((rt_count > 0) && (expiry_heap[0]->expire < now))
+    {
+      free_record (expiry_heap[0]);
+      if (stats != NULL)
+        stats->change (stat_routes_expired, 1);
+    }
+}
+
+/**
+ * Closure for find_record_iterator.
+ */
+struct FindRecordContext
+{
+  unsigned int type;
+
+  unsigned int probes;
+
+  DHTQueryRecord *result;
+};
+
+static int
+find_record_iterator (const GNUNET_HashCode * key, void *value, void *cls)
+{
+  struct FindRecordContext *ctx = cls;
+  DHTQueryRecord *q = value;
+
+  ctx->probes++;
+  if (q->get.type != ctx->type)
+    return GNUNET_YES;
+  ctx->result = q;
+  return GNUNET_NO;
+}
+
+/**
+ * Find the record for the given key and type (NBO).
+ * Caller must hold the lock.
+ *
+ * @param probes set to the number of records inspected
+ * @return NULL if no such record exists
+ */
+static DHTQueryRecord *
+find_record (const GNUNET_HashCode * key, unsigned int type,
+             unsigned int *probes)
+{
+  struct FindRecordContext ctx;
+
+  ctx.type = type;
+  ctx.probes = 0;
+  ctx.result = NULL;
+  GNUNET_multi_hash_map_get_multiple (records, key,
+                                      &find_record_iterator, &ctx);
+  if (stats != NULL)
+    {
+      stats->change (stat_route_lookups, 1);
+      stats->change (stat_route_lookup_probes, ctx.probes);
+    }
+  *probes = ctx.probes;
+  return ctx.result;
+}
+
 /**
  * Given a result, lookup in the routing table
  * where to send it next.
@@ -254,7 +429,6 @@ route_result (const GNUNET_HashCode * key,
               unsigned int size, const char *data, void *cls)
 {
   DHTQueryRecord *q;
-  unsigned int i;
   unsigned int j;
   int found;
   GNUNET_HashCode hc;
@@ -294,30 +468,27 @@ route_result (const GNUNET_HashCode * key,
   tracked = 0;
   GNUNET_mutex_lock (lock);
   now = GNUNET_get_time ();
-  for (i = 0; i < rt_size; i++)
-    {
-      q = &records[i];
-      tracked++;
-      if ((ntohl (q->get.type) != type) ||
-          (0 != memcmp (key, &q->get.key, sizeof (GNUNET_HashCode))))
-        continue;
-      found = GNUNET_NO;
-      for (j = 0; j < q->result_count; j++)
-        if (0 == memcmp (&hc, &q->results[j], sizeof (GNUNET_HashCode)))
-          {
-            found = GNUNET_YES;
-            break;
-          }
-      if (found == GNUNET_YES)
+  expire_records (now);
+  q = find_record (key, htonl (type), &tracked);
+  found = GNUNET_NO;
+  if (q != NULL)
+    for (j = 0; j < q->result_count; j++)
+      if (0 == memcmp (&hc, &q->results[j], sizeof (GNUNET_HashCode)))
         {
-#if DEBUG_ROUTING
-          GNUNET_GE_LOG (coreAPI->ectx,
-                         GNUNET_GE_DEBUG | GNUNET_GE_REQUEST |
-                         GNUNET_GE_DEVELOPER,
-                         "Seen the same result earlier, not routing it again.\n");
-#endif
+          found = GNUNET_YES;
           break;
         }
+  if (found == GNUNET_YES)
+    {
+#if DEBUG_ROUTING
+      GNUNET_GE_LOG (coreAPI->ectx,
+                     GNUNET_GE_DEBUG | GNUNET_GE_REQUEST |
+                     GNUNET_GE_DEVELOPER,
+                     "Seen the same result earlier, not routing it again.\n");
+#endif
+    }
+  else if (q != NULL)
+    {
       routed++;
       GNUNET_array_grow (q->results, q->result_count, q->result_count + 1);
       q->results[q->result_count - 1] = hc;
@@ -378,8 +549,7 @@ route_result (const GNUNET_HashCode * key,
           pos = pos->next;
         }
       if (q->result_count >= MAX_RESULTS)
-        q->expire = 0;
-      break;
+        free_record (q);
     }
   GNUNET_mutex_unlock (lock);
 #if DEBUG_ROUTING
@@ -401,8 +571,7 @@ add_route (const GNUNET_PeerIdentity * sender,
            GNUNET_ResultProcessor handler, void *cls, const DHT_MESSAGE * get)
 {
   DHTQueryRecord *q;
-  unsigned int i;
-  unsigned int rt_pos;
+  unsigned int probes;
   unsigned int diameter;
   GNUNET_CronTime expire;
   GNUNET_CronTime now;
@@ -416,47 +585,41 @@ add_route (const GNUNET_PeerIdentity * sender,
   now = GNUNET_get_time ();
   expire = now + DHT_DELAY * diameter * 4;
   GNUNET_mutex_lock (lock);
-  rt_pos = rt_size;
-  for (i = 0; i < rt_size; i++)
+  expire_records (now);
+  q = find_record (&get->key, get->type, &probes);
+  if (q != NULL)
     {
-      q = &records[i];
-      if ((q->expire > now) &&
-          ((0 != memcmp (&q->get.key,
-                         &get->key,
-                         sizeof (GNUNET_HashCode))) ||
-           (q->get.type == get->type)))
-        continue;               /* used and not an identical request */
-      if (q->expire < now)
+      /* identical request, start over */
+      GNUNET_array_grow (q->results, q->result_count, 0);
+      if (q->expire < expire)
         {
-          rt_pos = i;
-          while (q->sources != NULL)
-            {
-              pos = q->sources;
-              q->sources = pos->next;
-              GNUNET_free (pos);
-            }
-          GNUNET_array_grow (q->results, q->result_count, 0);
-          q->expire = 0;
-        }
-      if ((0 == memcmp (&q->get.key,
-                        &get->key,
-                        sizeof (GNUNET_HashCode)) &&
-           (q->get.type == get->type)))
-        {
-          GNUNET_array_grow (q->results, q->result_count, 0);
-          rt_pos = i;
-          break;
+          q->expire = expire;
+          expiry_heap_down (q->heapPos);
         }
     }
-  if (rt_pos == rt_size)
+  else
     {
-      /* do not route, no slot available */
-      GNUNET_mutex_unlock (lock);
-      return GNUNET_SYSERR;
+      if (rt_count >= rt_size)
+        {
+          /* table full, drop the record closest to expiring */
+          free_record (expiry_heap[0]);
+          if (stats != NULL)
+            stats->change (stat_routes_evicted, 1);
+        }
+      q = GNUNET_malloc (sizeof (DHTQueryRecord));
+      q->expire = expire;
+      q->get = *get;
+      GNUNET_multi_hash_map_put (records, &get->key, q,
+                                 GNUNET_MultiHashMapOption_MULTIPLE);
+      if (rt_count == expiry_heap_size)
+        GNUNET_array_grow (expiry_heap, expiry_heap_size,
+                           expiry_heap_size * 2 + 16);
+      expiry_heap_set (rt_count, q);
+      rt_count++;
+      expiry_heap_up (q->heapPos);
+      if (stats != NULL)
+        stats->set (stat_routes_tracked, rt_count);
     }
-  q = &records[rt_pos];
-  if (q->expire < expire)
-    q->expire = expire;
   q->get = *get;
   pos = GNUNET_malloc (sizeof (DHT_Source_Route));
   pos->next = q->sources;
@@ -471,7 +634,8 @@ add_route (const GNUNET_PeerIdentity * sender,
 #if DEBUG_ROUTING
   GNUNET_GE_LOG (coreAPI->ectx,
                  GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_DEVELOPER,
-                 "Tracking request in slot %u\n", rt_pos);
+                 "Tracking request (%u records probed, %u tracked)\n",
+                 probes, rt_count);
 #endif
   GNUNET_mutex_unlock (lock);
   if (stats != NULL)
@@ -753,6 +917,38 @@ GNUNET_DHT_get_start (const GNUNET_HashCode * key,
   return GNUNET_OK;
 }
 
+/**
+ * Closure for find_source_iterator.
+ */
+struct FindSourceContext
+{
+  GNUNET_ResultProcessor handler;
+
+  void *cls;
+
+  DHTQueryRecord *result;
+};
+
+/**
+ * Find the record with a source for the given local
+ * result processor.
+ */
+static int
+find_source_iterator (const GNUNET_HashCode * key, void *value, void *cls)
+{
+  struct FindSourceContext *ctx = cls;
+  DHTQueryRecord *q = value;
+  DHT_Source_Route *pos;
+
+  for (pos = q->sources; pos != NULL; pos = pos->next)
+    if ((pos->receiver == ctx->handler) && (pos->receiver_closure == ctx->cls))
+      {
+        ctx->result = q;
+        return GNUNET_NO;
+      }
+  return GNUNET_YES;
+}
+
 /**
  * Stop a DHT get operation (prevents calls to
  * the given iterator).
@@ -762,42 +958,35 @@ GNUNET_DHT_get_stop (const GNUNET_HashCode * key,
                      unsigned int type, GNUNET_ResultProcessor handler,
                      void *cls)
 {
-  unsigned int i;
+  struct FindSourceContext ctx;
   struct DHT_Source_Route *pos;
   struct DHT_Source_Route *prev;
   int done;
 
   done = GNUNET_NO;
+  ctx.handler = handler;
+  ctx.cls = cls;
+  ctx.result = NULL;
   GNUNET_mutex_lock (lock);
-  for (i = 0; i < rt_size; i++)
+  GNUNET_multi_hash_map_get_multiple (records, key,
+                                      &find_source_iterator, &ctx);
+  if (ctx.result != NULL)
     {
       prev = NULL;
-      pos = records[i].sources;
-      while (pos != NULL)
+      pos = ctx.result->sources;
+      while ((pos->receiver != handler) || (pos->receiver_closure != cls))
         {
-          if ((pos->receiver == handler) &&
-              (pos->receiver_closure == cls) &&
-              (0 == memcmp (key,
-                            &records[i].get.key, sizeof (GNUNET_HashCode))))
-            {
-              if (prev == NULL)
-                records[i].sources = pos->next;
-              else
-                prev->next = pos->next;
-              GNUNET_free (pos);
-              done = GNUNET_YES;
-              break;
-            }
           prev = pos;
           pos = prev->next;
         }
-      if (records[i].sources == NULL)
-        {
-          GNUNET_array_grow (records[i].results, records[i].result_count, 0);
-          records[i].expire = 0;
-        }
-      if (done == GNUNET_YES)
-        break;
+      if (prev == NULL)
+        ctx.result->sources = pos->next;
+      else
+        prev->next = pos->next;
+      GNUNET_free (pos);
+      done = GNUNET_YES;
+      if (ctx.result->sources == NULL)
+        free_record (ctx.result);
     }
   GNUNET_mutex_unlock (lock);
   if (done != GNUNET_YES)
@@ -869,7 +1058,8 @@ GNUNET_DHT_init_routing (GNUNET_CoreAPIForPlugins * capi)
   dstore = coreAPI->service_request ("dstore");
   if (dstore == NULL)
     return GNUNET_SYSERR;
-  GNUNET_array_grow (records, rt_size, rts);
+  rt_size = rts;
+  records = GNUNET_multi_hash_map_create (1024);
 
   lock = GNUNET_mutex_create (GNUNET_NO);
   stats = capi->service_request ("stats");
@@ -885,6 +1075,17 @@ GNUNET_DHT_init_routing (GNUNET_CoreAPIForPlugins * capi)
         stats->create (gettext_noop ("# dht put requests received"));
       stat_results_received =
         stats->create (gettext_noop ("# dht results received"));
+      stat_routes_tracked =
+        stats->create (gettext_noop ("# dht routing table entries"));
+      stat_routes_expired =
+        stats->create (gettext_noop ("# dht routing table entries expired"));
+      stat_routes_evicted =
+        stats->create (gettext_noop ("# dht routing table entries evicted"));
+      stat_route_lookups =
+        stats->create (gettext_noop ("# dht routing table lookups"));
+      stat_route_lookup_probes =
+        stats->create (gettext_noop
+                       ("# dht routing table entries probed by lookups"));
     }
 
   GNUNET_GE_LOG (coreAPI->ectx,
@@ -911,9 +1112,6 @@ GNUNET_DHT_init_routing (GNUNET_CoreAPIForPlugins * capi)
 int
 GNUNET_DHT_done_routing ()
 {
-  unsigned int i;
-  struct DHT_Source_Route *pos;
-
   coreAPI->send_callback_unregister (sizeof (DHT_MESSAGE),
                                      &extra_get_callback);
   coreAPI->p2p_ciphertext_handler_unregister (GNUNET_P2P_PROTO_DHT_GET,
@@ -928,17 +1126,11 @@ GNUNET_DHT_done_routing ()
       stats = NULL;
     }
   GNUNET_mutex_destroy (lock);
-  for (i = 0; i < rt_size; i++)
-    {
-      while (records[i].sources != NULL)
-        {
-          pos = records[i].sources;
-          records[i].sources = pos->next;
-          GNUNET_free (pos);
-        }
-      GNUNET_array_grow (records[i].results, records[i].result_count, 0);
-    }
-  GNUNET_array_grow (records, rt_size, 0);
+  while (rt_count > 0)
+    free_record (expiry_heap[rt_count - 1]);
+  GNUNET_array_grow (expiry_heap, expiry_heap_size, 0);
+  GNUNET_multi_hash_map_destroy (records);
+  records = NULL;
   coreAPI->service_release (dstore);
   return GNUNET_OK;
 }
@@ -0,0 +1,281 @@
+/*
+      This file is part of GNUnet
+      (C) 2008 Christian Grothoff (and other contributing authors)
+
+      GNUnet is free software; you can redistribute it and/or modify
+      it under the terms of the GNU General Public License as published
+      by the Free Software Foundation; either version 2, or (at your
+      option) any later version.
+
+      GNUnet is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      General Public License for more details.
+
+      You should have received a copy of the GNU General Public License
+      along with GNUnet; see the file COPYING.  If not, write to the
+      Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+      Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * @file module/selectperf.c
+ * @brief Throughput of DHT peer selection with 1k and 10k peers,
+ *        compared to scanning all peers, and a check that the
+ *        index selects peers with the same probabilities as the scan
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include <math.h>
+#include "gnunet_util.h"
+#include "peerindex.h"
+
+#define BLOCKED 4
+
+#define SELECTIONS (16 * 1024)
+
+/**
+ * Number of peers for checking the distribution.
+ */
+#define DIST_PEERS 16
+
+/**
+ * Number of selections for checking the distribution.
+ */
+#define DIST_SELECTIONS (64 * 1024)
+
+/**
+ * Inverse distance of a peer to the target, as used by the scan.
+ */
+static unsigned int
+linear_distance (const GNUNET_PeerIdentity * peer,
+                 const GNUNET_HashCode * target)
+{
+  GNUNET_HashCode hc;
+  unsigned int bit;
+  double d;
+
+  hc = peer->hashPubKey;
+  for (bit = 0; bit < sizeof (GNUNET_HashCode) * 8; bit++)
+    if (GNUNET_hash_get_bit (target, bit) != GNUNET_hash_get_bit (&hc, bit))
+      break;
+  d = exp2 (bit * 32.0 / (sizeof (GNUNET_HashCode) * 8));
+  if (d > ((unsigned int) -1))
+    return -1;
+  return (unsigned int) d;
+}
+
+/**
+ * Select a peer by scanning all peers (and all blocked peers
+ * for each of them).
+ */
+static int
+select_linear (const GNUNET_PeerIdentity * peers,
+               unsigned int count,
+               GNUNET_PeerIdentity * set,
+               const GNUNET_HashCode * target,
+               const GNUNET_PeerIdentity * blocked,
+               unsigned int blocked_size)
+{
+  unsigned long long total;
+  unsigned long long selected;
+  unsigned int distance;
+  unsigned int i;
+  unsigned int j;
+  int pass;
+
+  total = 0;
+  selected = 0;
+  for (pass = 0; pass < 2; pass++)
+    {
+      for (i = 0; i < count; i++)
+        {
+          for (j = 0; j < blocked_size; j++)
+            if (0 == memcmp (&peers[i], &blocked[j],
+                             sizeof (GNUNET_PeerIdentity)))
+              break;
+          if (j < blocked_size)
+            continue;
+          distance = linear_distance (&peers[i], target);
+          if (pass == 0)
+            {
+              total += distance;
+              continue;
+            }
+          if (distance > selected)
+            {
+              *set = peers[i];
+              return GNUNET_OK;
+            }
+          selected -= distance;
+        }
+      if (total == 0)
+        return GNUNET_SYSERR;
+      selected = GNUNET_random_u64 (GNUNET_RANDOM_QUALITY_WEAK, total);
+    }
+  return GNUNET_SYSERR;
+}
+
+/**
+ * Check that the index selects each peer as often as the scan
+ * would.  The peers agree with the target on a varying number
+ * of leading bytes, so their weights differ.
+ */
+static int
+checkDistribution ()
+{
+  struct GNUNET_DHT_PeerIndex *index;
+  GNUNET_PeerIdentity peers[DIST_PEERS];
+  GNUNET_PeerIdentity blocked[2];
+  GNUNET_PeerIdentity set;
+  GNUNET_HashCode target;
+  GNUNET_HashCode hc;
+  unsigned int counts[DIST_PEERS];
+  double weights[DIST_PEERS];
+  double total;
+  double expected;
+  double deviation;
+  unsigned int i;
+  unsigned int j;
+  int ret;
+
+  ret = GNUNET_OK;
+  GNUNET_create_random_hash (&target);
+  index = GNUNET_DHT_peer_index_create ();
+  for (i = 0; i < DIST_PEERS; i++)
+    {
+      GNUNET_create_random_hash (&hc);
+      memcpy (&hc, &target, i);
+      peers[i].hashPubKey = hc;
+      GNUNET_DHT_peer_index_add (index, &peers[i]);
+    }
+  blocked[0] = peers[3];
+  blocked[1] = peers[DIST_PEERS - 2];
+  total = 0;
+  for (i = 0; i < DIST_PEERS; i++)
+    {
+      counts[i] = 0;
+      weights[i] = linear_distance (&peers[i], &target);
+      if ((i == 3) || (i == DIST_PEERS - 2))
+        weights[i] = 0;
+      total += weights[i];
+    }
+  for (i = 0; i < DIST_SELECTIONS; i++)
+    {
+      if (GNUNET_OK !=
+          GNUNET_DHT_peer_index_select (index, &set, &target, blocked, 2))
+        {
+          ret = GNUNET_SYSERR;
+          break;
+        }
+      for (j = 0; j < DIST_PEERS; j++)
+        if (0 == memcmp (&set, &peers[j], sizeof (GNUNET_PeerIdentity)))
+          break;
+      if (j == DIST_PEERS)
+        ret = GNUNET_SYSERR;
+      else
+        counts[j]++;
+    }
+  for (i = 0; i < DIST_PEERS; i++)
+    {
+      /* allow five standard deviations */
+      expected = DIST_SELECTIONS * weights[i] / total;
+      deviation = sqrt (expected * (1 - weights[i] / total));
+      if (fabs (counts[i] - expected) > 5 * deviation + 1)
+        {
+          printf ("Peer %u selected %u times, expected %.0f\n",
+                  i, counts[i], expected);
+          ret = GNUNET_SYSERR;
+        }
+    }
+  GNUNET_DHT_peer_index_destroy (index);
+  return ret;
+}
+
+static int
+perfSelect (unsigned int count)
+{
+  struct GNUNET_DHT_PeerIndex *index;
+  GNUNET_PeerIdentity *peers;
+  GNUNET_PeerIdentity blocked[BLOCKED];
+  GNUNET_PeerIdentity set;
+  GNUNET_HashCode target;
+  GNUNET_CronTime start;
+  GNUNET_CronTime delta;
+  GNUNET_HashCode hc;
+  unsigned int i;
+  unsigned int j;
+  int ret;
+
+  ret = GNUNET_OK;
+  peers = GNUNET_malloc (count * sizeof (GNUNET_PeerIdentity));
+  index = GNUNET_DHT_peer_index_create ();
+  for (i = 0; i < count; i++)
+    {
+      GNUNET_create_random_hash (&hc);
+      peers[i].hashPubKey = hc;
+      GNUNET_DHT_peer_index_add (index, &peers[i]);
+    }
+  for (i = 0; i < BLOCKED; i++)
+    blocked[i] = peers[GNUNET_random_u32 (GNUNET_RANDOM_QUALITY_WEAK, count)];
+
+  start = GNUNET_get_time ();
+  for (i = 0; i < SELECTIONS / 16; i++)
+    {
+      GNUNET_create_random_hash (&target);
+      select_linear (peers, count, &set, &target, blocked, BLOCKED);
+    }
+  delta = GNUNET_get_time () - start;
+  if (delta == 0)
+    delta = 1;
+  printf ("Scanning %u peers: %llu selections/s\n",
+          count, (unsigned long long) SELECTIONS / 16 * 1000 / delta);
+
+  start = GNUNET_get_time ();
+  for (i = 0; i < SELECTIONS; i++)
+    {
+      GNUNET_create_random_hash (&target);
+      if (GNUNET_OK !=
+          GNUNET_DHT_peer_index_select (index, &set, &target, blocked,
+                                        BLOCKED))
+        ret = GNUNET_SYSERR;
+      for (j = 0; j < BLOCKED; j++)
+        if (0 == memcmp (&set, &blocked[j], sizeof (GNUNET_PeerIdentity)))
+          ret = GNUNET_SYSERR;
+    }
+  delta = GNUNET_get_time () - start;
+  if (delta == 0)
+    delta = 1;
+  printf ("Index of %u peers: %llu selections/s\n",
+          count, (unsigned long long) SELECTIONS * 1000 / delta);
+
+  for (i = 0; i < count; i++)
+    if (GNUNET_OK != GNUNET_DHT_peer_index_remove (index, &peers[i]))
+      ret = GNUNET_SYSERR;
+  if (GNUNET_SYSERR !=
+      GNUNET_DHT_peer_index_select (index, &set, &target, NULL, 0))
+    ret = GNUNET_SYSERR;
+  GNUNET_DHT_peer_index_destroy (index);
+  GNUNET_free (peers);
+  return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int failed;
+
+  failed = 0;
+  if (GNUNET_OK != checkDistribution ())
+    failed++;
+  if (GNUNET_OK != perfSelect (1000))
+    failed++;
+  if (GNUNET_OK != perfSelect (10000))
+    failed++;
+  if (failed != 0)
+    printf ("DHT peer selection failed\n");
+  return failed;
+}
+
+/* end of selectperf.c */
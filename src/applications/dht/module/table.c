@@ -46,8 +46,8 @@
  */
 
 #include "platform.h"
-#include <math.h>
 #include "table.h"
+#include "peerindex.h"
 #include "gnunet_protocols.h"
 #include "gnunet_util.h"
 #include "gnunet_dht_service.h"
@@ -165,6 +165,11 @@ static PeerBucket *buckets;
  */
 static unsigned int bucketCount;
 
+/**
+ * All peers in the buckets, ordered for GNUNET_DHT_select_peer.
+ */
+static struct GNUNET_DHT_PeerIndex *peer_index;
+
 /**
  * Total number of peers in routing table.
  */
@@ -314,31 +319,6 @@ findPeerEntry (const GNUNET_PeerIdentity * peer)
   return findPeerEntryInBucket (findBucketFor (peer), peer);
 }
 
-/**
- * Return a number that is the larger the closer the
- * "have" GNUNET_hash code is to the "target".  The basic
- * idea is that if "have" would be in the n-th lowest
- * bucket of "target", the returned value should be
- * 2^n.  However, the largest number we can return
- * is 2^31, so this number may have to be scaled.
- *
- * @return inverse distance metric, non-zero.
- */
-static unsigned int
-inverse_distance (const GNUNET_HashCode * target,
-                  const GNUNET_HashCode * have)
-{
-  unsigned int bucket;
-  double d;
-
-  bucket = get_bit_distance (target, have);
-  d = bucket * 32;
-  d = exp2 (d / (sizeof (GNUNET_HashCode) * 8));
-  if (d > ((unsigned int) -1))
-    return -1;
-  return (unsigned int) d;
-}
-
 /**
  * Select a peer from the routing table that would be a good routing
  * destination for sending a message for "target".  The resulting peer
@@ -357,78 +337,15 @@ GNUNET_DHT_select_peer (GNUNET_PeerIdentity * set,
                         const GNUNET_PeerIdentity * blocked,
                         unsigned int blocked_size)
 {
-  unsigned long long total_distance;
-  unsigned long long selected;
-  unsigned int distance;
-  unsigned int bc;
-  unsigned int ec;
-  unsigned int i;
-  int match;
-  const PeerBucket *bucket;
-  const PeerInfo *pi;
+  int ret;
 
   GNUNET_mutex_lock (lock);
   if (stats != NULL)
     stats->change (stat_dht_route_looks, 1);
-  total_distance = 0;
-  for (bc = 0; bc < bucketCount; bc++)
-    {
-      bucket = &buckets[bc];
-      for (ec = 0; ec < bucket->peers_size; ec++)
-        {
-          pi = bucket->peers[ec];
-          match = GNUNET_NO;
-          for (i = 0; i < blocked_size; i++)
-            {
-              if (0 ==
-                  memcmp (&pi->id, &blocked[i], sizeof (GNUNET_PeerIdentity)))
-                {
-                  match = GNUNET_YES;
-                  break;
-                }
-            }
-          if (match == GNUNET_YES)
-            continue;
-          total_distance += inverse_distance (target, &pi->id.hashPubKey);
-        }
-    }
-  if (total_distance == 0)
-    {
-      GNUNET_mutex_unlock (lock);
-      return GNUNET_SYSERR;
-    }
-  selected = GNUNET_random_u64 (GNUNET_RANDOM_QUALITY_WEAK, total_distance);
-  for (bc = 0; bc < bucketCount; bc++)
-    {
-      bucket = &buckets[bc];
-      for (ec = 0; ec < bucket->peers_size; ec++)
-        {
-          pi = bucket->peers[ec];
-          match = GNUNET_NO;
-          for (i = 0; i < blocked_size; i++)
-            {
-              if (0 ==
-                  memcmp (&pi->id, &blocked[i], sizeof (GNUNET_PeerIdentity)))
-                {
-                  match = GNUNET_YES;
-                  break;
-                }
-            }
-          if (match == GNUNET_YES)
-            continue;
-          distance = inverse_distance (target, &pi->id.hashPubKey);
-          if (distance > selected)
-            {
-              *set = pi->id;
-              GNUNET_mutex_unlock (lock);
-              return GNUNET_OK;
-            }
-          selected -= distance;
-        }
-    }
-  GNUNET_GE_BREAK (NULL, 0);
+  ret = GNUNET_DHT_peer_index_select (peer_index, set, target,
+                                      blocked, blocked_size);
   GNUNET_mutex_unlock (lock);
-  return GNUNET_SYSERR;
+  return ret;
 }
 
 /**
@@ -593,6 +510,7 @@ checkExpiration (PeerBucket * bucket)
           total_peers--;
           if (stats != NULL)
             stats->change (stat_dht_total_peers, -1);
+          GNUNET_DHT_peer_index_remove (peer_index, &peer->id);
           GNUNET_free (peer);
           bucket->peers[i] = bucket->peers[bucket->peers_size - 1];
           GNUNET_array_grow (bucket->peers, bucket->peers_size,
@@ -654,6 +572,7 @@ considerPeer (const GNUNET_PeerIdentity * sender,
   GNUNET_array_grow (bucket->peers, bucket->peers_size,
                      bucket->peers_size + 1);
   bucket->peers[bucket->peers_size - 1] = pi;
+  GNUNET_DHT_peer_index_add (peer_index, &pi->id);
   total_peers++;
   if (stats != NULL)
     stats->change (stat_dht_total_peers, 1);
@@ -775,6 +694,7 @@ GNUNET_DHT_table_init (GNUNET_CoreAPIForPlugins * capi)
       buckets[i].bstart = 512 * i / bucketCount;
       buckets[i].bend = 512 * (i + 1) / bucketCount;
     }
+  peer_index = GNUNET_DHT_peer_index_create ();
   lock = capi->global_lock_get ();
   stats = capi->service_request ("stats");
   if (stats != NULL)
@@ -838,6 +758,8 @@ GNUNET_DHT_table_done ()
       GNUNET_array_grow (buckets[i].peers, buckets[i].peers_size, 0);
     }
   GNUNET_array_grow (buckets, bucketCount, 0);
+  GNUNET_DHT_peer_index_destroy (peer_index);
+  peer_index = NULL;
   lock = NULL;
   return GNUNET_OK;
 }
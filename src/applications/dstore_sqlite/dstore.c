@@ -56,6 +56,27 @@ static unsigned long long quota;
 static char *fn;
 static char *fn_utf8;
 
+/**
+ * Handle to the database.  Opened once by db_reset; all uses are
+ * serialized by "lock".
+ */
+static sqlite3 *dbh;
+
+/**
+ * Prepared statements, compiled once when the database is opened.
+ */
+static sqlite3_stmt *update_stmt;
+
+static sqlite3_stmt *insert_stmt;
+
+static sqlite3_stmt *count_stmt;
+
+static sqlite3_stmt *select_stmt;
+
+static sqlite3_stmt *oldest_stmt;
+
+static sqlite3_stmt *delete_stmt;
+
 static GNUNET_CoreAPIForPlugins *coreAPI;
 
 static struct GNUNET_Mutex *lock;
@@ -74,6 +95,18 @@ static unsigned int stat_dstore_quota;
  */
 #define OVERHEAD ((4*2+4*2+8*2+8*2+sizeof(GNUNET_HashCode)*5+32))
 
+/**
+ * How often should the background job bring us back below
+ * the quota watermark?
+ */
+#define QUOTA_FREQUENCY (5 * GNUNET_CRON_SECONDS)
+
+/**
+ * Maximum number of entries the background job deletes per run
+ * (and the number of rows fetched per query when trimming).
+ */
+#define QUOTA_BATCH 64
+
 struct GNUNET_BloomFilter *bloom;
 
 static char *bloom_name;
@@ -124,19 +157,84 @@ db_init (sqlite3 * dbh)
   SQLITE3_EXEC (dbh, "CREATE INDEX idx_puttime ON ds080 (puttime)");
 }
 
+/**
+ * Finalize the prepared statements and close the database.
+ */
+static void
+db_close ()
+{
+  sqlite3_stmt **stmts[] = { &update_stmt, &insert_stmt, &count_stmt,
+    &select_stmt, &oldest_stmt, &delete_stmt
+  };
+  unsigned int i;
+
+  for (i = 0; i < sizeof (stmts) / sizeof (stmts[0]); i++)
+    {
+      if (*stmts[i] != NULL)
+        sqlite3_finalize (*stmts[i]);
+      *stmts[i] = NULL;
+    }
+  if (dbh != NULL)
+    {
+      if (SQLITE_OK != sqlite3_close (dbh))
+        LOG_SQLITE (dbh,
+                    GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
+                    "sqlite3_close");
+      dbh = NULL;
+    }
+}
+
+/**
+ * Compile the statements used by put, get and the quota
+ * job.
+ */
+static int
+db_prepare ()
+{
+  if ((sq_prepare (dbh,
+                   "UPDATE ds080 SET puttime=?, expire=? "
+                   "WHERE key=? AND vhash=? AND type=? AND size=?",
+                   &update_stmt) != SQLITE_OK) ||
+      (sq_prepare (dbh,
+                   "INSERT INTO ds080 "
+                   "(size, type, puttime, expire, key, vhash, value) "
+                   "VALUES (?, ?, ?, ?, ?, ?, ?)",
+                   &insert_stmt) != SQLITE_OK) ||
+      (sq_prepare (dbh,
+                   "SELECT count(*) FROM ds080 WHERE key=? AND type=? AND expire >= ?",
+                   &count_stmt) != SQLITE_OK) ||
+      (sq_prepare (dbh,
+                   "SELECT size, value FROM ds080 WHERE key=? AND type=? AND expire >= ? LIMIT 1 OFFSET ?",
+                   &select_stmt) != SQLITE_OK) ||
+      (sq_prepare (dbh,
+                   "SELECT _ROWID_, size, key FROM ds080 ORDER BY puttime ASC LIMIT ?",
+                   &oldest_stmt) != SQLITE_OK) ||
+      (sq_prepare (dbh,
+                   "DELETE FROM ds080 WHERE _ROWID_=?",
+                   &delete_stmt) != SQLITE_OK))
+    {
+      LOG_SQLITE (dbh,
+                  GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
+                  "sq_prepare");
+      return GNUNET_SYSERR;
+    }
+  return GNUNET_OK;
+}
+
 static int
 db_reset ()
 {
   int fd;
-  sqlite3 *dbh;
   char *tmpl;
   const char *tmpdir;
 
+  db_close ();
   if (fn != NULL)
     {
       UNLINK (fn);
       GNUNET_free (fn);
       GNUNET_free (fn_utf8);
+      fn = NULL;
     }
   payload = 0;
 
@@ -174,132 +272,139 @@ db_reset ()
     );
   if (SQLITE_OK != sqlite3_open (fn_utf8, &dbh))
     {
+      sqlite3_close (dbh);
+      dbh = NULL;
+      UNLINK (fn);
       GNUNET_free (fn);
       GNUNET_free (fn_utf8);
       fn = NULL;
       return GNUNET_SYSERR;
     }
   db_init (dbh);
-  sqlite3_close (dbh);
+  if (GNUNET_OK != db_prepare ())
+    {
+      db_close ();
+      UNLINK (fn);
+      GNUNET_free (fn);
+      GNUNET_free (fn_utf8);
+      fn = NULL;
+      return GNUNET_SYSERR;
+    }
   return GNUNET_OK;
 }
 
 /**
- * Check that we are within quota.
- * @return GNUNET_OK if we are.
+ * Delete the oldest entries (by puttime) until the payload
+ * is at most "target" or "limit" entries have been deleted.
+ * Must be called with the lock held.
+ *
+ * @return GNUNET_OK if the payload is now at most target
  */
 static int
-checkQuota (sqlite3 * dbh)
+trimDatabase (unsigned long long target, unsigned int limit)
 {
-  GNUNET_HashCode dkey;
-  GNUNET_HashCode vhash;
-  unsigned int dsize;
-  unsigned int dtype;
-  sqlite3_stmt *stmt;
-  sqlite3_stmt *dstmt;
+  sqlite3_int64 rowids[QUOTA_BATCH];
+  unsigned int sizes[QUOTA_BATCH];
+  GNUNET_HashCode keys[QUOTA_BATCH];
+  unsigned long long freed;
+  unsigned int batch;
+  unsigned int cnt;
+  unsigned int i;
   int err;
 
-  if (payload * 10 <= quota * 9)
-    return GNUNET_OK;           /* we seem to be about 10% off */
-#if DEBUG_DSTORE
-  GNUNET_GE_LOG (coreAPI->ectx,
-                 GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_DEVELOPER,
-                 "DStore above qutoa (have %llu, allowed %llu), will delete some data.\n",
-                 payload, quota);
-#endif
-  stmt = NULL;
-  dstmt = NULL;
-  if ((sq_prepare (dbh,
-                   "SELECT size, type, key, vhash FROM ds080 ORDER BY puttime ASC LIMIT 1",
-                   &stmt) != SQLITE_OK) ||
-      (sq_prepare (dbh,
-                   "DELETE FROM ds080 "
-                   "WHERE key=? AND vhash=? AND type=? AND size=?",
-                   &dstmt) != SQLITE_OK))
+  while ((payload > target) && (limit > 0))
     {
+#if DEBUG_DSTORE
       GNUNET_GE_LOG (coreAPI->ectx,
-                     GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
-                     _("`%s' failed at %s:%d with error: %s\n"),
-                     "sq_prepare", __FILE__, __LINE__, sqlite3_errmsg (dbh));
-      GNUNET_GE_BREAK (NULL, 0);
-      if (dstmt != NULL)
-        sqlite3_finalize (dstmt);
-      if (stmt != NULL)
-        sqlite3_finalize (stmt);
-      return GNUNET_SYSERR;
-    }
-  err = SQLITE_DONE;
-  while ((payload * 10 > quota * 9) &&  /* we seem to be about 10% off */
-         ((err = sqlite3_step (stmt)) == SQLITE_ROW))
-    {
-      dsize = sqlite3_column_int (stmt, 0);
-      dtype = sqlite3_column_int (stmt, 1);
-      GNUNET_GE_BREAK (NULL,
-                       sqlite3_column_bytes (stmt,
-                                             2) == sizeof (GNUNET_HashCode));
-      GNUNET_GE_BREAK (NULL,
-                       sqlite3_column_bytes (stmt,
-                                             3) == sizeof (GNUNET_HashCode));
-      memcpy (&dkey, sqlite3_column_blob (stmt, 2), sizeof (GNUNET_HashCode));
-      memcpy (&vhash, sqlite3_column_blob (stmt, 3),
-              sizeof (GNUNET_HashCode));
-      sqlite3_reset (stmt);
-      sqlite3_bind_blob (dstmt,
-                         1, &dkey, sizeof (GNUNET_HashCode),
-                         SQLITE_TRANSIENT);
-      sqlite3_bind_blob (dstmt,
-                         2, &vhash, sizeof (GNUNET_HashCode),
-                         SQLITE_TRANSIENT);
-      sqlite3_bind_int (dstmt, 3, dtype);
-      sqlite3_bind_int (dstmt, 4, dsize);
-      if ((err = sqlite3_step (dstmt)) != SQLITE_DONE)
+                     GNUNET_GE_DEBUG | GNUNET_GE_REQUEST |
+                     GNUNET_GE_DEVELOPER,
+                     "DStore above target (have %llu, want %llu), will delete some data.\n",
+                     payload, target);
+#endif
+      /* collect the oldest entries first; deleting while
+         the scan is active is not safe */
+      batch = (limit < QUOTA_BATCH) ? limit : QUOTA_BATCH;
+      if (SQLITE_OK != sqlite3_bind_int (oldest_stmt, 1, batch))
         {
-          GNUNET_GE_LOG (coreAPI->ectx,
-                         GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
-                         _("`%s' failed at %s:%d with error: %s\n"),
-                         "sqlite3_step", __FILE__, __LINE__,
-                         sqlite3_errmsg (dbh));
-          sqlite3_reset (dstmt);
-          GNUNET_GE_BREAK (NULL, 0);    /* should delete but cannot!? */
-          break;
+          LOG_SQLITE (dbh,
+                      GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
+                      "sqlite3_bind_xxx");
+          sqlite3_reset (oldest_stmt);
+          return GNUNET_SYSERR;
         }
-      if (sqlite3_total_changes (dbh) > 0)
+      cnt = 0;
+      freed = 0;
+      while ((payload - freed > target) &&
+             (cnt < batch) &&
+             ((err = sqlite3_step (oldest_stmt)) == SQLITE_ROW))
         {
-          if (bloom != NULL)
-            GNUNET_bloomfilter_remove (bloom, &dkey);
-          payload -= (dsize + OVERHEAD);
+          if (sqlite3_column_bytes (oldest_stmt, 2) !=
+              sizeof (GNUNET_HashCode))
+            {
+              GNUNET_GE_BREAK (NULL, 0);
+              continue;
+            }
+          rowids[cnt] = sqlite3_column_int64 (oldest_stmt, 0);
+          sizes[cnt] = sqlite3_column_int (oldest_stmt, 1);
+          memcpy (&keys[cnt],
+                  sqlite3_column_blob (oldest_stmt, 2),
+                  sizeof (GNUNET_HashCode));
+          freed += sizes[cnt] + OVERHEAD;
+          cnt++;
         }
+      sqlite3_reset (oldest_stmt);
+      if (cnt == 0)
+        break;                  /* database empty!? */
+      for (i = 0; i < cnt; i++)
+        {
+          if ((SQLITE_OK != sqlite3_bind_int64 (delete_stmt, 1, rowids[i]))
+              || (SQLITE_DONE != sqlite3_step (delete_stmt)))
+            {
+              LOG_SQLITE (dbh,
+                          GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
+                          "sqlite3_step");
+              sqlite3_reset (delete_stmt);
+              GNUNET_GE_BREAK (NULL, 0);        /* should delete but cannot!? */
+              return GNUNET_SYSERR;
+            }
+          if (sqlite3_changes (dbh) > 0)
+            {
+              if (bloom != NULL)
+                GNUNET_bloomfilter_remove (bloom, &keys[i]);
+              payload -= (sizes[i] + OVERHEAD);
+            }
 #if DEBUG_DSTORE
-      GNUNET_GE_LOG (coreAPI->ectx,
-                     GNUNET_GE_DEBUG | GNUNET_GE_REQUEST |
-                     GNUNET_GE_DEVELOPER,
-                     "Deleting %u bytes decreases DStore payload to %llu out of %llu\n",
-                     dsize, payload, quota);
+          GNUNET_GE_LOG (coreAPI->ectx,
+                         GNUNET_GE_DEBUG | GNUNET_GE_REQUEST |
+                         GNUNET_GE_DEVELOPER,
+                         "Deleting %u bytes decreases DStore payload to %llu out of %llu\n",
+                         sizes[i], payload, quota);
 #endif
-      sqlite3_reset (dstmt);
-    }
-  if (err != SQLITE_DONE)
-    {
-      GNUNET_GE_LOG (coreAPI->ectx,
-                     GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
-                     _("`%s' failed at %s:%d with error: %s\n"),
-                     "sqlite3_step", __FILE__, __LINE__,
-                     sqlite3_errmsg (dbh));
-    }
-  sqlite3_finalize (dstmt);
-  sqlite3_finalize (stmt);
-  if (payload * 10 > quota * 9)
-    {
-      /* we seem to be about 10% off */
-      GNUNET_GE_LOG (coreAPI->ectx,
-                     GNUNET_GE_ERROR | GNUNET_GE_BULK | GNUNET_GE_DEVELOPER,
-                     "Failed to delete content to drop below quota (bug?).\n",
-                     payload, quota);
-      return GNUNET_SYSERR;
+          sqlite3_reset (delete_stmt);
+        }
+      limit -= cnt;
     }
+  if (payload > target)
+    return GNUNET_SYSERR;
   return GNUNET_OK;
 }
 
+/**
+ * Cron job that incrementally brings the payload back
+ * below 90% of the quota, deleting at most QUOTA_BATCH
+ * entries per run.
+ */
+static void
+quota_job (void *unused)
+{
+  GNUNET_mutex_lock (lock);
+  if (dbh != NULL)
+    trimDatabase (quota / 10 * 9, QUOTA_BATCH);
+  GNUNET_mutex_unlock (lock);
+  if (stats != NULL)
+    stats->set (stat_dstore_size, payload);
+}
+
 /**
  * Store an item in the datastore.
  *
@@ -311,8 +416,6 @@ d_put (const GNUNET_HashCode * key,
        GNUNET_CronTime discard_time, unsigned int size, const char *data)
 {
   GNUNET_HashCode vhash;
-  sqlite3 *dbh;
-  sqlite3_stmt *stmt;
   int ret;
   GNUNET_CronTime now;
 
@@ -320,9 +423,8 @@ d_put (const GNUNET_HashCode * key,
     return GNUNET_SYSERR;
   GNUNET_hash (data, size, &vhash);
   GNUNET_mutex_lock (lock);
-  if ((fn == NULL) || (SQLITE_OK != sqlite3_open (fn_utf8, &dbh)))
+  if ((dbh == NULL) && (GNUNET_OK != db_reset ()))
     {
-      db_reset (dbh);
       GNUNET_mutex_unlock (lock);
       return GNUNET_SYSERR;
     }
@@ -335,95 +437,67 @@ d_put (const GNUNET_HashCode * key,
 #endif
 
   /* first try UPDATE */
-  if (sq_prepare (dbh,
-                  "UPDATE ds080 SET puttime=?, expire=? "
-                  "WHERE key=? AND vhash=? AND type=? AND size=?",
-                  &stmt) != SQLITE_OK)
-    {
-      GNUNET_GE_LOG (coreAPI->ectx,
-                     GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
-                     _("`%s' failed at %s:%d with error: %s\n"),
-                     "sq_prepare", __FILE__, __LINE__, sqlite3_errmsg (dbh));
-      sqlite3_close (dbh);
-      GNUNET_mutex_unlock (lock);
-      return GNUNET_SYSERR;
-    }
   if ((SQLITE_OK !=
-       sqlite3_bind_int64 (stmt, 1, now)) ||
+       sqlite3_bind_int64 (update_stmt, 1, now)) ||
       (SQLITE_OK !=
-       sqlite3_bind_int64 (stmt, 2, discard_time)) ||
+       sqlite3_bind_int64 (update_stmt, 2, discard_time)) ||
       (SQLITE_OK !=
-       sqlite3_bind_blob (stmt, 3, key, sizeof (GNUNET_HashCode),
+       sqlite3_bind_blob (update_stmt, 3, key, sizeof (GNUNET_HashCode),
                           SQLITE_TRANSIENT)) ||
       (SQLITE_OK !=
-       sqlite3_bind_blob (stmt, 4, &vhash, sizeof (GNUNET_HashCode),
+       sqlite3_bind_blob (update_stmt, 4, &vhash, sizeof (GNUNET_HashCode),
                           SQLITE_TRANSIENT)) ||
-      (SQLITE_OK != sqlite3_bind_int (stmt, 5, type)) ||
-      (SQLITE_OK != sqlite3_bind_int (stmt, 6, size)))
+      (SQLITE_OK != sqlite3_bind_int (update_stmt, 5, type)) ||
+      (SQLITE_OK != sqlite3_bind_int (update_stmt, 6, size)))
     {
-      GNUNET_GE_LOG (coreAPI->ectx,
-                     GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
-                     _("`%s' failed at %s:%d with error: %s\n"),
-                     "sqlite3_bind_xxx", __FILE__, __LINE__,
-                     sqlite3_errmsg (dbh));
-      sqlite3_finalize (stmt);
-      sqlite3_close (dbh);
+      LOG_SQLITE (dbh,
+                  GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
+                  "sqlite3_bind_xxx");
+      sqlite3_reset (update_stmt);
       GNUNET_mutex_unlock (lock);
       return GNUNET_SYSERR;
     }
-  if (SQLITE_DONE != sqlite3_step (stmt))
+  if (SQLITE_DONE != sqlite3_step (update_stmt))
     {
-      GNUNET_GE_LOG (coreAPI->ectx,
-                     GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
-                     _("`%s' failed at %s:%d with error: %s\n"),
-                     "sqlite3_step", __FILE__, __LINE__,
-                     sqlite3_errmsg (dbh));
-      sqlite3_finalize (stmt);
-      sqlite3_close (dbh);
+      LOG_SQLITE (dbh,
+                  GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
+                  "sqlite3_step");
+      sqlite3_reset (update_stmt);
       GNUNET_mutex_unlock (lock);
       return GNUNET_SYSERR;
     }
   ret = sqlite3_changes (dbh);
-  sqlite3_finalize (stmt);
+  sqlite3_reset (update_stmt);
   if (ret > 0)
     {
-      sqlite3_close (dbh);
       GNUNET_mutex_unlock (lock);
       return GNUNET_OK;
     }
-  if (GNUNET_OK != checkQuota (dbh))
-    {
-      sqlite3_close (dbh);
-      GNUNET_mutex_unlock (lock);
-      return GNUNET_SYSERR;
-    }
-  if (sq_prepare (dbh,
-                  "INSERT INTO ds080 "
-                  "(size, type, puttime, expire, key, vhash, value) "
-                  "VALUES (?, ?, ?, ?, ?, ?, ?)", &stmt) != SQLITE_OK)
+  /* the quota job normally keeps us below 90% of the quota;
+     only if it cannot keep up do we have to make room here */
+  if ((payload + size + OVERHEAD > quota) &&
+      (GNUNET_OK != trimDatabase (quota - size - OVERHEAD, (unsigned int) -1)))
     {
       GNUNET_GE_LOG (coreAPI->ectx,
-                     GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
-                     _("`%s' failed at %s:%d with error: %s\n"),
-                     "sq_prepare", __FILE__, __LINE__, sqlite3_errmsg (dbh));
-      sqlite3_close (dbh);
+                     GNUNET_GE_ERROR | GNUNET_GE_BULK | GNUNET_GE_DEVELOPER,
+                     "Failed to delete content to drop below quota (bug?).\n");
       GNUNET_mutex_unlock (lock);
       return GNUNET_SYSERR;
     }
-  if ((SQLITE_OK == sqlite3_bind_int (stmt, 1, size)) &&
-      (SQLITE_OK == sqlite3_bind_int (stmt, 2, type)) &&
-      (SQLITE_OK == sqlite3_bind_int64 (stmt, 3, now)) &&
-      (SQLITE_OK == sqlite3_bind_int64 (stmt, 4, discard_time)) &&
+  if ((SQLITE_OK == sqlite3_bind_int (insert_stmt, 1, size)) &&
+      (SQLITE_OK == sqlite3_bind_int (insert_stmt, 2, type)) &&
+      (SQLITE_OK == sqlite3_bind_int64 (insert_stmt, 3, now)) &&
+      (SQLITE_OK == sqlite3_bind_int64 (insert_stmt, 4, discard_time)) &&
       (SQLITE_OK ==
-       sqlite3_bind_blob (stmt, 5, key, sizeof (GNUNET_HashCode),
+       sqlite3_bind_blob (insert_stmt, 5, key, sizeof (GNUNET_HashCode),
                           SQLITE_TRANSIENT)) &&
       (SQLITE_OK ==
-       sqlite3_bind_blob (stmt, 6, &vhash, sizeof (GNUNET_HashCode),
+       sqlite3_bind_blob (insert_stmt, 6, &vhash, sizeof (GNUNET_HashCode),
                           SQLITE_TRANSIENT))
       && (SQLITE_OK ==
-          sqlite3_bind_blob (stmt, 7, data, size, SQLITE_TRANSIENT)))
+          sqlite3_bind_blob (insert_stmt, 7, data, size, SQLITE_TRANSIENT)))
     {
-      if (SQLITE_DONE != sqlite3_step (stmt))
+      if (SQLITE_DONE != sqlite3_step (insert_stmt))
         {
           LOG_SQLITE (dbh,
                       GNUNET_GE_ERROR | GNUNET_GE_DEVELOPER | GNUNET_GE_ADMIN
@@ -435,10 +509,6 @@ d_put (const GNUNET_HashCode * key,
           if (bloom != NULL)
             GNUNET_bloomfilter_add (bloom, key);
         }
-      if (SQLITE_OK != sqlite3_finalize (stmt))
-        LOG_SQLITE (dbh,
-                    GNUNET_GE_ERROR | GNUNET_GE_DEVELOPER | GNUNET_GE_ADMIN |
-                    GNUNET_GE_BULK, "sqlite3_finalize");
     }
   else
     {
@@ -446,14 +516,13 @@ d_put (const GNUNET_HashCode * key,
                   GNUNET_GE_ERROR | GNUNET_GE_DEVELOPER | GNUNET_GE_ADMIN |
                   GNUNET_GE_BULK, "sqlite3_bind_xxx");
     }
+  sqlite3_reset (insert_stmt);
 #if DEBUG_DSTORE
   GNUNET_GE_LOG (coreAPI->ectx,
                  GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_DEVELOPER,
                  "Storing %u bytes increases DStore payload to %llu out of %llu\n",
                  size, payload, quota);
 #endif
-  checkQuota (dbh);
-  sqlite3_close (dbh);
   GNUNET_mutex_unlock (lock);
   if (stats != NULL)
     stats->set (stat_dstore_size, payload);
@@ -474,15 +543,12 @@ static int
 d_get (const GNUNET_HashCode * key,
        unsigned int type, GNUNET_ResultProcessor handler, void *closure)
 {
-  sqlite3 *dbh;
-  sqlite3_stmt *stmt;
   GNUNET_CronTime now;
   unsigned int size;
   const char *dat;
   unsigned int cnt;
   unsigned int off;
   unsigned int total;
-  char scratch[256];
 
   GNUNET_mutex_lock (lock);
   if ((bloom != NULL) && (GNUNET_NO == GNUNET_bloomfilter_test (bloom, key)))
@@ -490,9 +556,8 @@ d_get (const GNUNET_HashCode * key,
       GNUNET_mutex_unlock (lock);
       return 0;
     }
-  if ((fn == NULL) || (SQLITE_OK != sqlite3_open (fn_utf8, &dbh)))
+  if ((dbh == NULL) && (GNUNET_OK != db_reset ()))
     {
-      db_reset (dbh);
       GNUNET_mutex_unlock (lock);
       return GNUNET_SYSERR;
     }
@@ -502,77 +567,47 @@ d_get (const GNUNET_HashCode * key,
                  GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_DEVELOPER,
                  "dstore processes get at `%llu'\n", now);
 #endif
-  if (sq_prepare (dbh,
-                  "SELECT count(*) FROM ds080 WHERE key=? AND type=? AND expire >= ?",
-                  &stmt) != SQLITE_OK)
-    {
-      GNUNET_GE_LOG (coreAPI->ectx,
-                     GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
-                     _("`%s' failed at %s:%d with error: %s\n"),
-                     "sq_prepare", __FILE__, __LINE__, sqlite3_errmsg (dbh));
-      sqlite3_close (dbh);
-      db_reset (dbh);
-      GNUNET_mutex_unlock (lock);
-      return GNUNET_SYSERR;
-    }
-  sqlite3_bind_blob (stmt, 1, key, sizeof (GNUNET_HashCode),
+  sqlite3_bind_blob (count_stmt, 1, key, sizeof (GNUNET_HashCode),
                      SQLITE_TRANSIENT);
-  sqlite3_bind_int (stmt, 2, type);
-  sqlite3_bind_int64 (stmt, 3, now);
-  if (SQLITE_ROW != sqlite3_step (stmt))
+  sqlite3_bind_int (count_stmt, 2, type);
+  sqlite3_bind_int64 (count_stmt, 3, now);
+  if (SQLITE_ROW != sqlite3_step (count_stmt))
     {
       LOG_SQLITE (dbh,
                   GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
                   GNUNET_GE_BULK, "sqlite_step");
-      sqlite3_reset (stmt);
-      sqlite3_finalize (stmt);
-      db_reset (dbh);
+      sqlite3_reset (count_stmt);
       GNUNET_mutex_unlock (lock);
       return GNUNET_SYSERR;
     }
-  total = sqlite3_column_int (stmt, 0);
-  sqlite3_reset (stmt);
-  sqlite3_finalize (stmt);
+  total = sqlite3_column_int (count_stmt, 0);
+  sqlite3_reset (count_stmt);
   if ((total == 0) || (handler == NULL))
     {
-      sqlite3_close (dbh);
       GNUNET_mutex_unlock (lock);
       return total;
     }
 
   cnt = 0;
   off = GNUNET_random_u32 (GNUNET_RANDOM_QUALITY_WEAK, total);
+  sqlite3_bind_blob (select_stmt, 1, key, sizeof (GNUNET_HashCode),
+                     SQLITE_TRANSIENT);
+  sqlite3_bind_int (select_stmt, 2, type);
+  sqlite3_bind_int64 (select_stmt, 3, now);
   while (cnt < total)
     {
       off = (off + 1) % total;
-      GNUNET_snprintf (scratch, 256,
-                       "SELECT size, value FROM ds080 WHERE key=? AND type=? AND expire >= ? LIMIT 1 OFFSET %u",
-                       off);
-      if (sq_prepare (dbh, scratch, &stmt) != SQLITE_OK)
-        {
-          GNUNET_GE_LOG (coreAPI->ectx,
-                         GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
-                         _("`%s' failed at %s:%d with error: %s\n"),
-                         "sq_prepare", __FILE__, __LINE__,
-                         sqlite3_errmsg (dbh));
-          sqlite3_close (dbh);
-          GNUNET_mutex_unlock (lock);
-          return GNUNET_SYSERR;
-        }
-      sqlite3_bind_blob (stmt, 1, key, sizeof (GNUNET_HashCode),
-                         SQLITE_TRANSIENT);
-      sqlite3_bind_int (stmt, 2, type);
-      sqlite3_bind_int64 (stmt, 3, now);
-      if (sqlite3_step (stmt) != SQLITE_ROW)
+      sqlite3_bind_int (select_stmt, 4, off);
+      if (sqlite3_step (select_stmt) != SQLITE_ROW)
         break;
-      size = sqlite3_column_int (stmt, 0);
-      if (size != sqlite3_column_bytes (stmt, 1))
+      size = sqlite3_column_int (select_stmt, 0);
+      if (size != sqlite3_column_bytes (select_stmt, 1))
         {
           GNUNET_GE_BREAK (NULL, 0);
-          sqlite3_finalize (stmt);
+          sqlite3_reset (select_stmt);
           continue;
         }
-      dat = sqlite3_column_blob (stmt, 1);
+      dat = sqlite3_column_blob (select_stmt, 1);
       cnt++;
 #if DEBUG_DSTORE
       GNUNET_GE_LOG (coreAPI->ectx,
@@ -583,12 +618,12 @@ d_get (const GNUNET_HashCode * key,
       if ((handler != NULL) &&
           (GNUNET_OK != handler (key, type, size, dat, closure)))
         {
-          sqlite3_finalize (stmt);
+          sqlite3_reset (select_stmt);
           break;
         }
-      sqlite3_finalize (stmt);
+      sqlite3_reset (select_stmt);
     }
-  sqlite3_close (dbh);
+  sqlite3_reset (select_stmt);
   GNUNET_mutex_unlock (lock);
   return cnt;
 }
@@ -638,6 +673,8 @@ provide_module_dstore_sqlite (GNUNET_CoreAPIForPlugins * capi)
         stats->create (gettext_noop ("# max bytes allowed in dstore"));
       stats->set (stat_dstore_quota, quota);
     }
+  GNUNET_cron_add_job (coreAPI->cron,
+                       &quota_job, QUOTA_FREQUENCY, QUOTA_FREQUENCY, NULL);
   return &api;
 }
 
@@ -647,6 +684,8 @@ provide_module_dstore_sqlite (GNUNET_CoreAPIForPlugins * capi)
 void
 release_module_dstore_sqlite ()
 {
+  GNUNET_cron_del_job (coreAPI->cron, &quota_job, QUOTA_FREQUENCY, NULL);
+  db_close ();
   UNLINK (fn);
   GNUNET_free (fn);
   GNUNET_free (fn_utf8);
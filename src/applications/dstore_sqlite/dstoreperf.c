@@ -0,0 +1,148 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file applications/dstore_sqlite/dstoreperf.c
+ * @brief Throughput of the dstore for mixed put/get workloads
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "gnunet_util.h"
+#include "gnunet_dstore_service.h"
+#include "core.h"
+
+/**
+ * Number of distinct keys used.
+ */
+#define KEYS 1024
+
+#define OPERATIONS (16 * 1024)
+
+static struct GNUNET_CronManager *cron;
+
+static struct GNUNET_GC_Configuration *cfg;
+
+static unsigned int found;
+
+static int
+countIt (const GNUNET_HashCode * key,
+         unsigned int type, unsigned int size, const char *data, void *cls)
+{
+  found++;
+  return GNUNET_OK;
+}
+
+/**
+ * Run a mix of puts and gets on random keys.
+ *
+ * @param puts out of every 10 operations, how many are puts
+ */
+static int
+perfMix (GNUNET_Dstore_ServiceAPI * api,
+         const GNUNET_HashCode * keys, unsigned int puts)
+{
+  GNUNET_CronTime start;
+  GNUNET_CronTime delta;
+  unsigned int i;
+  unsigned int k;
+  char buf[256];
+
+  memset (buf, 42, sizeof (buf));
+  start = GNUNET_get_time ();
+  for (i = 0; i < OPERATIONS; i++)
+    {
+      k = GNUNET_random_u32 (GNUNET_RANDOM_QUALITY_WEAK, KEYS);
+      if (i % 10 < puts)
+        {
+          /* different values for the same key, so that
+             some puts update and others insert */
+          buf[0] = (char) i;
+          if (GNUNET_OK != api->put (&keys[k],
+                                     0,
+                                     GNUNET_get_time () +
+                                     30 * GNUNET_CRON_MINUTES,
+                                     sizeof (buf), buf))
+            return GNUNET_SYSERR;
+        }
+      else if (GNUNET_SYSERR == api->get (&keys[k], 0, &countIt, NULL))
+        return GNUNET_SYSERR;
+    }
+  delta = GNUNET_get_time () - start;
+  if (delta == 0)
+    delta = 1;
+  printf ("%u0%% put, %u0%% get: %llu ops/s\n",
+          puts, 10 - puts, (unsigned long long) OPERATIONS * 1000 / delta);
+  return GNUNET_OK;
+}
+
+static int
+runTest ()
+{
+  GNUNET_Dstore_ServiceAPI *api;
+  GNUNET_HashCode *keys;
+  unsigned int i;
+  int ret;
+
+  api = GNUNET_CORE_request_service ("dstore");
+  if (api == NULL)
+    return GNUNET_SYSERR;
+  keys = GNUNET_malloc (KEYS * sizeof (GNUNET_HashCode));
+  for (i = 0; i < KEYS; i++)
+    GNUNET_create_random_hash (&keys[i]);
+  ret = GNUNET_OK;
+  if ((GNUNET_OK != perfMix (api, keys, 9)) ||
+      (GNUNET_OK != perfMix (api, keys, 5)) ||
+      (GNUNET_OK != perfMix (api, keys, 1)))
+    ret = GNUNET_SYSERR;
+  GNUNET_free (keys);
+  GNUNET_CORE_release_service (api);
+  if (found == 0)
+    {
+      printf ("No results found for any get\n");
+      return GNUNET_SYSERR;
+    }
+  return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int err;
+
+  GNUNET_disable_entropy_gathering ();
+  cfg = GNUNET_GC_create ();
+  if (-1 == GNUNET_GC_parse_configuration (cfg, "check.conf"))
+    {
+      GNUNET_GC_free (cfg);
+      return -1;
+    }
+  cron = GNUNET_cron_create (NULL);
+  GNUNET_CORE_init (NULL, cfg, cron, NULL);
+  err = 0;
+  if (GNUNET_OK != runTest ())
+    err = 1;
+  GNUNET_CORE_done ();
+  GNUNET_cron_destroy (cron);
+  GNUNET_GC_free (cfg);
+  return err;
+}
+
+/* end of dstoreperf.c */
@@ -41,6 +41,13 @@
 
 #define STRICT_CHECKS GNUNET_NO
 
+/**
+ * How many delete requests may be waiting for their
+ * result from gnunetd (unless FS/REQUEST-WINDOW says
+ * otherwise)?
+ */
+#define DELETE_WINDOW 32
+
 /**
  * Append the given key and query to the iblock[level].
  * If iblock[level] is already full, compute its chk
@@ -48,12 +55,12 @@
  * be big enough.
  *
  * This function matches exactly upload.c::pushBlock,
- * except in the call to 'GNUNET_FS_delete'.  TODO: refactor
+ * except in the call to 'GNUNET_FS_window_delete'.  TODO: refactor
  * to avoid code duplication (move to block.c, pass
- * GNUNET_FS_delete as argument!).
+ * GNUNET_FS_window_delete as argument!).
  */
 static int
-pushBlock (struct GNUNET_ClientServerConnection *sock,
+pushBlock (struct GNUNET_FS_RequestWindow *win,
            const GNUNET_EC_ContentHashKey * chk, unsigned int level,
            GNUNET_DatastoreValue ** iblocks)
 {
@@ -71,22 +78,18 @@ pushBlock (struct GNUNET_ClientServerConnection *sock,
     {
       GNUNET_EC_file_block_get_key (db, size, &ichk.key);
       GNUNET_EC_file_block_get_query (db, size, &ichk.query);
-      if (GNUNET_OK != pushBlock (sock, &ichk, level + 1, iblocks))
+      if (GNUNET_OK != pushBlock (win, &ichk, level + 1, iblocks))
         {
           GNUNET_GE_BREAK (NULL, 0);
           return GNUNET_SYSERR;
         }
       GNUNET_EC_file_block_encode (db, size, &ichk.query, &value);
-#if STRICT_CHECKS
-      if (GNUNET_SYSERR == GNUNET_FS_delete (sock, value))
+      if (GNUNET_OK != GNUNET_FS_window_delete (win, value, STRICT_CHECKS))
         {
           GNUNET_free (value);
           GNUNET_GE_BREAK (NULL, 0);
           return GNUNET_SYSERR;
         }
-#else
-      GNUNET_FS_delete (sock, value);
-#endif
       GNUNET_free (value);
       size = sizeof (GNUNET_EC_DBlock);
     }
@@ -183,6 +186,8 @@ GNUNET_ECRS_file_unindex (struct GNUNET_GE_Context *ectx,
   GNUNET_EC_DBlock *db;
   GNUNET_DatastoreValue *value;
   struct GNUNET_ClientServerConnection *sock;
+  struct GNUNET_FS_RequestWindow *win;
+  unsigned long long window;
   GNUNET_HashCode fileId;
   GNUNET_EC_ContentHashKey chk;
   GNUNET_CronTime eta;
@@ -259,6 +264,13 @@ GNUNET_ECRS_file_unindex (struct GNUNET_GE_Context *ectx,
       ((GNUNET_EC_DBlock *) & iblocks[i][1])->type =
         htonl (GNUNET_ECRS_BLOCKTYPE_DATA);
     }
+  if (-1 == GNUNET_GC_get_configuration_value_number (cfg,
+                                                      "FS",
+                                                      "REQUEST-WINDOW",
+                                                      1, 1024,
+                                                      DELETE_WINDOW, &window))
+    window = DELETE_WINDOW;
+  win = GNUNET_FS_window_create (sock, (unsigned int) window);
 
   pos = 0;
   while (pos < filesize)
@@ -292,7 +304,7 @@ GNUNET_ECRS_file_unindex (struct GNUNET_GE_Context *ectx,
                                     &chk.key);
       GNUNET_EC_file_block_get_query (db, size + sizeof (GNUNET_EC_DBlock),
                                       &chk.query);
-      if (GNUNET_OK != pushBlock (sock, &chk, 0,        /* dblocks are on level 0 */
+      if (GNUNET_OK != pushBlock (win, &chk, 0,        /* dblocks are on level 0 */
                                   iblocks))
         {
           GNUNET_GE_BREAK (ectx, 0);
@@ -301,19 +313,18 @@ GNUNET_ECRS_file_unindex (struct GNUNET_GE_Context *ectx,
       if (!wasIndexed)
         {
           if (GNUNET_OK ==
-              GNUNET_EC_file_block_encode (db, size, &chk.query, &value))
+              GNUNET_EC_file_block_encode (db,
+                                           size + sizeof (GNUNET_EC_DBlock),
+                                           &chk.query, &value))
             {
               *value = *dblock; /* copy options! */
-#if STRICT_CHECKS
-              if (GNUNET_OK != GNUNET_FS_delete (sock, value))
+              if (GNUNET_OK !=
+                  GNUNET_FS_window_delete (win, value, STRICT_CHECKS))
                 {
                   GNUNET_free (value);
                   GNUNET_GE_BREAK (ectx, 0);
                   goto FAILURE;
                 }
-#else
-              GNUNET_FS_delete (sock, value);
-#endif
               GNUNET_free (value);
             }
           else
@@ -336,26 +347,31 @@ GNUNET_ECRS_file_unindex (struct GNUNET_GE_Context *ectx,
       db = (GNUNET_EC_DBlock *) & iblocks[i][1];
       GNUNET_EC_file_block_get_key (db, size, &chk.key);
       GNUNET_EC_file_block_get_query (db, size, &chk.query);
-      if (GNUNET_OK != pushBlock (sock, &chk, i + 1, iblocks))
+      if (GNUNET_OK != pushBlock (win, &chk, i + 1, iblocks))
         {
           GNUNET_GE_BREAK (ectx, 0);
           goto FAILURE;
         }
       GNUNET_EC_file_block_encode (db, size, &chk.query, &value);
-#if STRICT_CHECKS
-      if (GNUNET_OK != GNUNET_FS_delete (sock, value))
+      if (GNUNET_OK != GNUNET_FS_window_delete (win, value, STRICT_CHECKS))
         {
           GNUNET_free (value);
           GNUNET_GE_BREAK (ectx, 0);
           goto FAILURE;
         }
-#else
-      GNUNET_FS_delete (sock, value);
-#endif
       GNUNET_free (value);
       GNUNET_free (iblocks[i]);
       iblocks[i] = NULL;
     }
+  /* wait for all deletions before we use the connection
+     for anything else */
+  i = GNUNET_FS_window_destroy (win);
+  win = NULL;
+  if (i != GNUNET_OK)
+    {
+      GNUNET_GE_BREAK (ectx, 0);
+      goto FAILURE;
+    }
 
   if (wasIndexed)
     {
@@ -382,6 +398,8 @@ GNUNET_ECRS_file_unindex (struct GNUNET_GE_Context *ectx,
   GNUNET_client_connection_destroy (sock);
   return GNUNET_OK;
 FAILURE:
+  if (win != NULL)
+    GNUNET_FS_window_destroy (win);
   for (i = 0; i <= treedepth; i++)
     GNUNET_free_non_null (iblocks[i]);
   GNUNET_free (iblocks);
@@ -40,14 +40,288 @@
 
 #define DEBUG_UPLOAD GNUNET_NO
 
+/**
+ * How many DBlocks may be between the reader and the
+ * tree builder (read, being encoded or waiting to be
+ * sent) at any time?
+ */
+#define PIPELINE_SIZE 64
+
+/**
+ * Maximum number of threads encoding DBlocks.
+ */
+#define MAX_ENCODERS 16
+
+/**
+ * Maximum number of DBlocks an encoder takes (and hashes
+ * side by side) at once.
+ */
+#define ENCODE_BATCH 8
+
+/**
+ * How many insert or index requests may be waiting
+ * for their result from gnunetd (unless FS/REQUEST-WINDOW
+ * says otherwise)?
+ */
+#define SEND_WINDOW 32
+
+/**
+ * A DBlock on its way through the pipeline.
+ */
+struct EncodeJob
+{
+  /**
+   * The block in plaintext (with the options for
+   * the datastore).
+   */
+  GNUNET_DatastoreValue *dblock;
+
+  /**
+   * The encoded block (NULL if we index or simulate).
+   */
+  GNUNET_DatastoreValue *value;
+
+  /**
+   * Signalled once the block has been encoded.
+   */
+  struct GNUNET_Semaphore *done;
+
+  GNUNET_EC_ContentHashKey chk;
+
+  /**
+   * Offset of the block in the file.
+   */
+  unsigned long long offset;
+
+  /**
+   * Did encoding the block work?
+   */
+  int ok;
+
+};
+
+/**
+ * The reader (the thread calling GNUNET_ECRS_file_upload)
+ * fills the jobs in order, a pool of encoder threads
+ * computes keys, queries and encoded blocks in parallel
+ * and the reader then passes the jobs (again in order)
+ * to the tree builder and the request window.
+ */
+struct UploadPipeline
+{
+  struct EncodeJob jobs[PIPELINE_SIZE];
+
+  struct GNUNET_ThreadHandle *encoders[MAX_ENCODERS];
+
+  /**
+   * Protects 'taken' and 'shutdown'.
+   */
+  struct GNUNET_Mutex *lock;
+
+  /**
+   * Counts the jobs that were read but not yet
+   * picked up by an encoder.
+   */
+  struct GNUNET_Semaphore *work;
+
+  /**
+   * Number of encoder threads.
+   */
+  unsigned int encoder_count;
+
+  /**
+   * Number of jobs picked up by the encoders so far.
+   */
+  unsigned long long taken;
+
+  /**
+   * Should the encoders also produce the encoded blocks?
+   */
+  int encode;
+
+  int shutdown;
+
+};
+
+/**
+ * Determine the number of CPUs of this host.
+ *
+ * @return number of CPUs, 1 if unknown
+ */
+static unsigned int
+getCPUCount ()
+{
+  long ret;
+
+  ret = -1;
+#ifdef _SC_NPROCESSORS_ONLN
+  ret = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  if (ret < 1)
+    return 1;
+  return (unsigned int) ret;
+}
+
+/**
+ * Compute the keys and queries (and, if needed, the encoded
+ * blocks) for several DBlocks.
+ */
+static void
+encodeBlocks (struct UploadPipeline *up,
+              struct EncodeJob **jobs, unsigned int count)
+{
+  const GNUNET_EC_DBlock *dbs[ENCODE_BATCH];
+  unsigned int sizes[ENCODE_BATCH];
+  GNUNET_EC_ContentHashKey chks[ENCODE_BATCH];
+  GNUNET_DatastoreValue *values[ENCODE_BATCH];
+  unsigned int i;
+
+  GNUNET_GE_ASSERT (NULL, count <= ENCODE_BATCH);
+  for (i = 0; i < count; i++)
+    {
+      dbs[i] = (const GNUNET_EC_DBlock *) &jobs[i]->dblock[1];
+      sizes[i] =
+        ntohl (jobs[i]->dblock->size) - sizeof (GNUNET_DatastoreValue);
+    }
+  GNUNET_EC_file_blocks_get_chks (dbs, sizes, count, chks,
+                                  (up->encode == GNUNET_NO) ? NULL : values);
+  for (i = 0; i < count; i++)
+    {
+      jobs[i]->chk = chks[i];
+      jobs[i]->ok = GNUNET_OK;
+      jobs[i]->value = NULL;
+      if (up->encode == GNUNET_NO)
+        continue;
+      jobs[i]->value = values[i];
+      *jobs[i]->value = *jobs[i]->dblock;       /* copy options! */
+    }
+}
+
+static void *
+encoderMain (void *cls)
+{
+  struct UploadPipeline *up = cls;
+  struct EncodeJob *jobs[ENCODE_BATCH];
+  unsigned int count;
+  unsigned int i;
+
+  while (1)
+    {
+      GNUNET_semaphore_down (up->work, GNUNET_YES);
+      /* take whatever else is already waiting, up to a batch */
+      count = 1;
+      while ((count < ENCODE_BATCH) &&
+             (GNUNET_SYSERR != GNUNET_semaphore_down (up->work, GNUNET_NO)))
+        count++;
+      GNUNET_mutex_lock (up->lock);
+      if (up->shutdown == GNUNET_YES)
+        {
+          GNUNET_mutex_unlock (up->lock);
+          /* leave the other shutdown signals to the other encoders */
+          for (i = 1; i < count; i++)
+            GNUNET_semaphore_up (up->work);
+          break;
+        }
+      for (i = 0; i < count; i++)
+        jobs[i] = &up->jobs[up->taken++ % PIPELINE_SIZE];
+      GNUNET_mutex_unlock (up->lock);
+      encodeBlocks (up, jobs, count);
+      for (i = 0; i < count; i++)
+        GNUNET_semaphore_up (jobs[i]->done);
+    }
+  return NULL;
+}
+
+/**
+ * Create the pipeline and start the encoders.
+ *
+ * @param dblock template for the DBlocks (options)
+ * @param encode should the encoders produce encoded blocks?
+ */
+static struct UploadPipeline *
+pipelineCreate (const GNUNET_DatastoreValue * dblock, int encode)
+{
+  struct UploadPipeline *up;
+  unsigned int i;
+
+  up = GNUNET_malloc (sizeof (struct UploadPipeline));
+  up->lock = GNUNET_mutex_create (GNUNET_NO);
+  up->work = GNUNET_semaphore_create (0);
+  up->encode = encode;
+  up->shutdown = GNUNET_NO;
+  for (i = 0; i < PIPELINE_SIZE; i++)
+    {
+      up->jobs[i].dblock = GNUNET_malloc (ntohl (dblock->size));
+      memcpy (up->jobs[i].dblock, dblock, ntohl (dblock->size));
+      up->jobs[i].done = GNUNET_semaphore_create (0);
+    }
+  up->encoder_count = getCPUCount ();
+  if (up->encoder_count > MAX_ENCODERS)
+    up->encoder_count = MAX_ENCODERS;
+  for (i = 0; i < up->encoder_count; i++)
+    {
+      up->encoders[i] = GNUNET_thread_create (&encoderMain, up, 128 * 1024);
+      if (up->encoders[i] == NULL)
+        break;
+    }
+  up->encoder_count = i;
+  return up;
+}
+
+/**
+ * Stop the encoders and free the pipeline (including
+ * encoded blocks that were never consumed).
+ */
+static void
+pipelineDestroy (struct UploadPipeline *up)
+{
+  void *unused;
+  unsigned int i;
+
+  GNUNET_mutex_lock (up->lock);
+  up->shutdown = GNUNET_YES;
+  GNUNET_mutex_unlock (up->lock);
+  for (i = 0; i < up->encoder_count; i++)
+    GNUNET_semaphore_up (up->work);
+  for (i = 0; i < up->encoder_count; i++)
+    GNUNET_thread_join (up->encoders[i], &unused);
+  for (i = 0; i < PIPELINE_SIZE; i++)
+    {
+      GNUNET_free_non_null (up->jobs[i].value);
+      GNUNET_free (up->jobs[i].dblock);
+      GNUNET_semaphore_destroy (up->jobs[i].done);
+    }
+  GNUNET_semaphore_destroy (up->work);
+  GNUNET_mutex_destroy (up->lock);
+  GNUNET_free (up);
+}
+
+/**
+ * Hand a job that was filled by the reader to the encoders
+ * (or encode it right away if we have no encoder threads).
+ */
+static void
+pipelineSubmit (struct UploadPipeline *up, struct EncodeJob *job)
+{
+  if (up->encoder_count == 0)
+    {
+      encodeBlocks (up, &job, 1);
+      GNUNET_semaphore_up (job->done);
+      return;
+    }
+  GNUNET_semaphore_up (up->work);
+}
+
 /**
  * Append the given key and query to the iblock[level].  If
  * iblock[level] is already full, compute its chk and push it to
  * level+1 and clear the level.  iblocks is guaranteed to be big
  * enough.
+ *
+ * @param win where to send full iblocks, NULL to simulate
  */
 static int
-pushBlock (struct GNUNET_ClientServerConnection *sock,
+pushBlock (struct GNUNET_FS_RequestWindow *win,
            const GNUNET_EC_ContentHashKey * chk,
            unsigned int level,
            GNUNET_DatastoreValue ** iblocks,
@@ -72,7 +346,7 @@ pushBlock (struct GNUNET_ClientServerConnection *sock,
     {
       GNUNET_EC_file_block_get_key (db, size, &ichk.key);
       GNUNET_EC_file_block_get_query (db, size, &ichk.query);
-      if (GNUNET_OK != pushBlock (sock,
+      if (GNUNET_OK != pushBlock (win,
                                   &ichk, level + 1, iblocks, prio,
                                   expirationTime))
         return GNUNET_SYSERR;
@@ -84,7 +358,8 @@ pushBlock (struct GNUNET_ClientServerConnection *sock,
         }
       value->priority = htonl (prio);
       value->expiration_time = GNUNET_htonll (expirationTime);
-      if (GNUNET_OK != GNUNET_FS_insert (sock, value))
+      if ((win != NULL) &&
+          (GNUNET_OK != GNUNET_FS_window_insert (win, value, GNUNET_YES)))
         {
           GNUNET_free (value);
           return GNUNET_SYSERR;
@@ -101,6 +376,61 @@ pushBlock (struct GNUNET_ClientServerConnection *sock,
   return GNUNET_OK;
 }
 
+/**
+ * Wait until the given job has been encoded, then send it
+ * (if we are not simulating) and add it to the tree.
+ *
+ * @param win where to send the blocks, NULL to simulate
+ * @param doIndex GNUNET_YES for index, GNUNET_NO for insertion
+ */
+static int
+consumeBlock (struct GNUNET_GE_Context *ectx,
+              struct EncodeJob *job,
+              struct GNUNET_FS_RequestWindow *win,
+              int doIndex,
+              const GNUNET_HashCode * fileId,
+              GNUNET_DatastoreValue ** iblocks,
+              unsigned int prio, GNUNET_CronTime expirationTime,
+              const char *filename)
+{
+  int ret;
+#if DEBUG_UPLOAD
+  GNUNET_EncName enc;
+#endif
+
+  GNUNET_semaphore_down (job->done, GNUNET_YES);
+  if (job->ok != GNUNET_OK)
+    return GNUNET_SYSERR;
+#if DEBUG_UPLOAD
+  GNUNET_hash_to_enc (&job->chk.query, &enc);
+  fprintf (stderr,
+           "Query for current block of size %u is `%s'\n",
+           ntohl (job->dblock->size) - sizeof (GNUNET_DatastoreValue) -
+           sizeof (GNUNET_EC_DBlock), (const char *) &enc);
+#endif
+  if (win != NULL)
+    {
+      if (doIndex == GNUNET_YES)
+        ret = GNUNET_FS_window_index (win, fileId, job->dblock, job->offset);
+      else
+        ret = GNUNET_FS_window_insert (win, job->value, GNUNET_YES);
+      if (ret != GNUNET_OK)
+        {
+          GNUNET_GE_LOG (ectx,
+                         GNUNET_GE_ERROR | GNUNET_GE_BULK | GNUNET_GE_USER,
+                         (doIndex == GNUNET_YES)
+                         ? _("Indexing data of file `%s' failed at position %llu.\n")
+                         : _("Inserting data of file `%s' failed at position %llu.\n"),
+                         filename, job->offset);
+          return GNUNET_SYSERR;
+        }
+    }
+  GNUNET_free_non_null (job->value);
+  job->value = NULL;
+  return pushBlock (win, &job->chk, 0,  /* dblocks are on level 0 */
+                    iblocks, prio, expirationTime);
+}
+
 /**
  * Index or insert a file.
  *
@@ -128,16 +458,21 @@ GNUNET_ECRS_file_upload (struct GNUNET_GE_Context *ectx,
 {
   unsigned long long filesize;
   unsigned long long pos;
+  unsigned long long submitted;
+  unsigned long long window;
+  unsigned long long consumed;
   unsigned int treedepth;
   int fd;
   int i;
-  int ret;
   unsigned int size;
   GNUNET_DatastoreValue **iblocks;
   GNUNET_DatastoreValue *dblock;
   GNUNET_EC_DBlock *db;
   GNUNET_DatastoreValue *value;
   struct GNUNET_ClientServerConnection *sock;
+  struct GNUNET_FS_RequestWindow *win;
+  struct UploadPipeline *up;
+  struct EncodeJob *job;
   GNUNET_HashCode fileId;
   GNUNET_EC_ContentHashKey mchk;
   GNUNET_CronTime eta;
@@ -270,7 +605,22 @@ GNUNET_ECRS_file_upload (struct GNUNET_GE_Context *ectx,
         htonl (GNUNET_ECRS_BLOCKTYPE_DATA);
     }
 
+  win = NULL;
+  if (doIndex != GNUNET_SYSERR)
+    {
+      if (-1 == GNUNET_GC_get_configuration_value_number (cfg,
+                                                          "FS",
+                                                          "REQUEST-WINDOW",
+                                                          1, 1024,
+                                                          SEND_WINDOW,
+                                                          &window))
+        window = SEND_WINDOW;
+      win = GNUNET_FS_window_create (sock, (unsigned int) window);
+    }
+  up = pipelineCreate (dblock, (doIndex == GNUNET_NO) ? GNUNET_YES : GNUNET_NO);
   pos = 0;
+  submitted = 0;
+  consumed = 0;
   while (pos < filesize)
     {
       if (upcb != NULL)
@@ -278,6 +628,17 @@ GNUNET_ECRS_file_upload (struct GNUNET_GE_Context *ectx,
       if (tt != NULL)
         if (GNUNET_OK != tt (ttClosure))
           goto FAILURE;
+      if (submitted - consumed == PIPELINE_SIZE)
+        {
+          if (GNUNET_OK !=
+              consumeBlock (ectx, &up->jobs[consumed % PIPELINE_SIZE], win,
+                            doIndex, &fileId, iblocks, priority,
+                            expirationTime, filename))
+            goto FAILURE;
+          consumed++;
+        }
+      job = &up->jobs[submitted % PIPELINE_SIZE];
+      db = (GNUNET_EC_DBlock *) & job->dblock[1];
       size = GNUNET_ECRS_DBLOCK_SIZE;
       if (size > filesize - pos)
         {
@@ -287,9 +648,10 @@ GNUNET_ECRS_file_upload (struct GNUNET_GE_Context *ectx,
       GNUNET_GE_ASSERT (ectx,
                         sizeof (GNUNET_DatastoreValue) + size +
                         sizeof (GNUNET_EC_DBlock) < GNUNET_MAX_BUFFER_SIZE);
-      dblock->size =
+      job->dblock->size =
         htonl (sizeof (GNUNET_DatastoreValue) + size +
                sizeof (GNUNET_EC_DBlock));
+      job->offset = pos;
       if (size != READ (fd, &db[1], size))
         {
           GNUNET_GE_LOG_STRERROR_FILE (ectx,
@@ -298,54 +660,8 @@ GNUNET_ECRS_file_upload (struct GNUNET_GE_Context *ectx,
                                        "READ", filename);
           goto FAILURE;
         }
-      if (tt != NULL)
-        if (GNUNET_OK != tt (ttClosure))
-          goto FAILURE;
-      GNUNET_EC_file_block_get_key (db, size + sizeof (GNUNET_EC_DBlock),
-                                    &mchk.key);
-      GNUNET_EC_file_block_get_query (db, size + sizeof (GNUNET_EC_DBlock),
-                                      &mchk.query);
-#if DEBUG_UPLOAD
-      GNUNET_hash_to_enc (&mchk.query, &enc);
-      fprintf (stderr,
-               "Query for current block of size %u is `%s'\n", size,
-               (const char *) &enc);
-#endif
-      if (doIndex == GNUNET_YES)
-        {
-          if (GNUNET_SYSERR == GNUNET_FS_index (sock, &fileId, dblock, pos))
-            {
-              GNUNET_GE_LOG (ectx,
-                             GNUNET_GE_ERROR | GNUNET_GE_BULK |
-                             GNUNET_GE_USER,
-                             _
-                             ("Indexing data of file `%s' failed at position %llu.\n"),
-                             filename, pos);
-              goto FAILURE;
-            }
-        }
-      else
-        {
-          value = NULL;
-          if (GNUNET_OK !=
-              GNUNET_EC_file_block_encode (db,
-                                           size + sizeof (GNUNET_EC_DBlock),
-                                           &mchk.query, &value))
-            {
-              GNUNET_GE_BREAK (ectx, 0);
-              goto FAILURE;
-            }
-          GNUNET_GE_ASSERT (ectx, value != NULL);
-          *value = *dblock;     /* copy options! */
-          if ((doIndex == GNUNET_NO) &&
-              (GNUNET_OK != (ret = GNUNET_FS_insert (sock, value))))
-            {
-              GNUNET_GE_BREAK (ectx, ret == GNUNET_NO);
-              GNUNET_free (value);
-              goto FAILURE;
-            }
-          GNUNET_free (value);
-        }
+      pipelineSubmit (up, job);
+      submitted++;
       pos += size;
       now = GNUNET_get_time ();
       if (pos > 0)
@@ -354,9 +670,15 @@ GNUNET_ECRS_file_upload (struct GNUNET_GE_Context *ectx,
                                    (((double) (now - start) / (double) pos))
                                    * (double) filesize);
         }
-      if (GNUNET_OK != pushBlock (sock, &mchk, 0,       /* dblocks are on level 0 */
-                                  iblocks, priority, expirationTime))
+    }
+  while (consumed < submitted)
+    {
+      if (GNUNET_OK !=
+          consumeBlock (ectx, &up->jobs[consumed % PIPELINE_SIZE], win,
+                        doIndex, &fileId, iblocks, priority, expirationTime,
+                        filename))
         goto FAILURE;
+      consumed++;
     }
   if (tt != NULL)
     if (GNUNET_OK != tt (ttClosure))
@@ -396,7 +718,7 @@ GNUNET_ECRS_file_upload (struct GNUNET_GE_Context *ectx,
                      "Query for current block at level %u is `%s'.\n", i,
                      &enc);
 #endif
-      if (GNUNET_OK != pushBlock (sock,
+      if (GNUNET_OK != pushBlock (win,
                                   &mchk, i + 1, iblocks, priority,
                                   expirationTime))
         {
@@ -411,8 +733,9 @@ GNUNET_ECRS_file_upload (struct GNUNET_GE_Context *ectx,
         }
       value->expiration_time = GNUNET_htonll (expirationTime);
       value->priority = htonl (priority);
-      if ((doIndex != GNUNET_SYSERR) &&
-          (GNUNET_SYSERR == GNUNET_FS_insert (sock, value)))
+      /* only a hard error (not GNUNET_NO) aborts the upload here */
+      if ((win != NULL) &&
+          (GNUNET_OK != GNUNET_FS_window_insert (win, value, GNUNET_NO)))
         {
           GNUNET_GE_BREAK (ectx, 0);
           GNUNET_free (value);
@@ -429,6 +752,20 @@ GNUNET_ECRS_file_upload (struct GNUNET_GE_Context *ectx,
   GNUNET_GE_LOG (ectx, GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_USER,
                  "Query for top block is %s\n", &enc);
 #endif
+  if (win != NULL)
+    {
+      i = GNUNET_FS_window_destroy (win);
+      win = NULL;
+      if (i != GNUNET_OK)
+        {
+          GNUNET_GE_LOG (ectx,
+                         GNUNET_GE_ERROR | GNUNET_GE_BULK | GNUNET_GE_USER,
+                         _("Uploading file `%s' failed.\n"), filename);
+          goto FAILURE;
+        }
+    }
+  pipelineDestroy (up);
+  up = NULL;
   /* build URI */
   fid.file_length = GNUNET_htonll (filesize);
   db = (GNUNET_EC_DBlock *) & iblocks[treedepth][1];
@@ -448,6 +785,10 @@ GNUNET_ECRS_file_upload (struct GNUNET_GE_Context *ectx,
   GNUNET_client_connection_destroy (sock);
   return GNUNET_OK;
 FAILURE:
+  if (win != NULL)
+    GNUNET_FS_window_destroy (win);
+  if (up != NULL)
+    pipelineDestroy (up);
   for (i = 0; i <= treedepth; i++)
     GNUNET_free_non_null (iblocks[i]);
   GNUNET_free (iblocks);
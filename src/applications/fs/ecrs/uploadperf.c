@@ -0,0 +1,147 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file applications/fs/ecrs/uploadperf.c
+ * @brief Throughput of GNUNET_ECRS_file_upload for a large file
+ *        (1 GB unless a size in MB is given on the command line)
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "gnunet_util.h"
+#include "gnunet_ecrs_lib.h"
+
+#define START_DAEMON 1
+
+#define FILENAME "/tmp/gnunet-uploadperf/UPLOADPERF"
+
+static struct GNUNET_GC_Configuration *cfg;
+
+static int
+createFile (unsigned long long mb)
+{
+  char block[1024 * 1024];
+  unsigned long long i;
+  unsigned int j;
+  int fd;
+
+  GNUNET_disk_directory_create_for_file (NULL, FILENAME);
+  fd = GNUNET_disk_file_open (NULL, FILENAME, O_WRONLY | O_CREAT | O_TRUNC,
+                              S_IWUSR | S_IRUSR);
+  if (fd == -1)
+    return GNUNET_SYSERR;
+  for (i = 0; i < mb; i++)
+    {
+      memset (block, (int) i, sizeof (block));
+      /* make every 32k block unique */
+      for (j = 0; j < sizeof (block); j += 32 * 1024)
+        {
+          memcpy (&block[j], &i, sizeof (i));
+          memcpy (&block[j + sizeof (i)], &j, sizeof (j));
+        }
+      if (sizeof (block) != WRITE (fd, block, sizeof (block)))
+        {
+          CLOSE (fd);
+          return GNUNET_SYSERR;
+        }
+    }
+  CLOSE (fd);
+  return GNUNET_OK;
+}
+
+static int
+uploadFile (const char *what, int doIndex, unsigned long long mb)
+{
+  struct GNUNET_ECRS_URI *uri;
+  GNUNET_CronTime start;
+  GNUNET_CronTime delta;
+  int ret;
+
+  start = GNUNET_get_time ();
+  ret = GNUNET_ECRS_file_upload (NULL, cfg, FILENAME, doIndex, 0, 0,
+                                 GNUNET_get_time () + 2 * GNUNET_CRON_HOURS,
+                                 NULL, NULL, NULL, NULL, &uri);
+  if (ret != GNUNET_OK)
+    {
+      printf ("Upload (%s) failed\n", what);
+      return GNUNET_SYSERR;
+    }
+  delta = GNUNET_get_time () - start;
+  if (delta == 0)
+    delta = 1;
+  printf ("Upload (%s) of %llu MB: %.1f MB/s\n",
+          what, mb, (double) mb * 1000 / delta);
+  GNUNET_ECRS_uri_destroy (uri);
+  return GNUNET_OK;
+}
+
+int
+main (int argc, char *argv[])
+{
+#if START_DAEMON
+  pid_t daemon;
+#endif
+  unsigned long long mb;
+  int ok;
+
+  mb = 1024;
+  if (argc > 1)
+    mb = strtoull (argv[1], NULL, 10);
+  if (mb == 0)
+    return -1;
+  cfg = GNUNET_GC_create ();
+  if (-1 == GNUNET_GC_parse_configuration (cfg, "check.conf"))
+    {
+      GNUNET_GC_free (cfg);
+      return -1;
+    }
+  if (GNUNET_OK != createFile (mb))
+    {
+      GNUNET_GC_free (cfg);
+      return -1;
+    }
+#if START_DAEMON
+  daemon = GNUNET_daemon_start (NULL, cfg, "peer.conf", GNUNET_NO);
+  GNUNET_GE_ASSERT (NULL, daemon > 0);
+  ok = GNUNET_wait_for_daemon_running (NULL, cfg, 30 * GNUNET_CRON_SECONDS);
+  GNUNET_thread_sleep (5 * GNUNET_CRON_SECONDS);        /* give apps time to start */
+#else
+  ok = GNUNET_OK;
+#endif
+  /* encoding only, nothing is sent to gnunetd */
+  if (ok == GNUNET_OK)
+    ok = uploadFile ("simulated", GNUNET_SYSERR, mb);
+  /* the datastore quota is too small to insert 1 GB,
+     so we measure the round trips by indexing */
+  if (ok == GNUNET_OK)
+    ok = uploadFile ("indexed", GNUNET_YES, mb);
+  if (ok == GNUNET_OK)
+    ok = GNUNET_ECRS_file_unindex (NULL, cfg, FILENAME, NULL, NULL, NULL,
+                                   NULL);
+#if START_DAEMON
+  GNUNET_GE_ASSERT (NULL, GNUNET_OK == GNUNET_daemon_stop (NULL, daemon));
+#endif
+  UNLINK (FILENAME);
+  GNUNET_GC_free (cfg);
+  return (ok == GNUNET_OK) ? 0 : 1;
+}
+
+/* end of uploadperf.c */
@@ -28,6 +28,38 @@
 #include "gnunet_protocols.h"
 #include "ecrs_core.h"
 
+/**
+ * Create a datastore value holding the given DBlock encrypted
+ * with the given key (the hash of the plaintext).
+ */
+static GNUNET_DatastoreValue *
+encrypt_block (const GNUNET_EC_DBlock * data,
+               unsigned int len, const GNUNET_HashCode * hc)
+{
+  GNUNET_AES_SessionKey skey;
+  GNUNET_AES_InitializationVector iv;   /* initial value */
+  GNUNET_DatastoreValue *val;
+  GNUNET_EC_DBlock *db;
+
+  GNUNET_hash_to_AES_key (hc, &skey, &iv);
+  val = GNUNET_malloc (sizeof (GNUNET_DatastoreValue) + len);
+  val->size = htonl (sizeof (GNUNET_DatastoreValue) + len);
+  val->type = htonl (GNUNET_ECRS_BLOCKTYPE_DATA);
+  val->priority = htonl (0);
+  val->anonymity_level = htonl (0);
+  val->expiration_time = GNUNET_htonll (0);
+  db = (GNUNET_EC_DBlock *) & val[1];
+  db->type = htonl (GNUNET_ECRS_BLOCKTYPE_DATA);
+  GNUNET_GE_ASSERT (NULL,
+                    len - sizeof (GNUNET_EC_DBlock) < GNUNET_MAX_BUFFER_SIZE);
+  GNUNET_GE_ASSERT (NULL,
+                    len - sizeof (GNUNET_EC_DBlock) ==
+                    GNUNET_AES_encrypt (&data[1],
+                                        len - sizeof (GNUNET_EC_DBlock),
+                                        &skey, &iv, &db[1]));
+  return val;
+}
+
 /**
  * Perform on-demand content encoding.
  *
@@ -50,31 +82,14 @@ GNUNET_EC_file_block_encode (const GNUNET_EC_DBlock * data,
                              GNUNET_DatastoreValue ** value)
 {
   GNUNET_HashCode hc;
-  GNUNET_AES_SessionKey skey;
-  GNUNET_AES_InitializationVector iv;   /* initial value */
   GNUNET_DatastoreValue *val;
-  GNUNET_EC_DBlock *db;
 
   GNUNET_GE_ASSERT (NULL, len >= sizeof (GNUNET_EC_DBlock));
   GNUNET_GE_ASSERT (NULL, (data != NULL) && (query != NULL));
   GNUNET_hash (&data[1], len - sizeof (GNUNET_EC_DBlock), &hc);
-  GNUNET_hash_to_AES_key (&hc, &skey, &iv);
-  val = GNUNET_malloc (sizeof (GNUNET_DatastoreValue) + len);
-  val->size = htonl (sizeof (GNUNET_DatastoreValue) + len);
-  val->type = htonl (GNUNET_ECRS_BLOCKTYPE_DATA);
-  val->priority = htonl (0);
-  val->anonymity_level = htonl (0);
-  val->expiration_time = GNUNET_htonll (0);
-  db = (GNUNET_EC_DBlock *) & val[1];
-  db->type = htonl (GNUNET_ECRS_BLOCKTYPE_DATA);
-  GNUNET_GE_ASSERT (NULL,
-                    len - sizeof (GNUNET_EC_DBlock) < GNUNET_MAX_BUFFER_SIZE);
-  GNUNET_GE_ASSERT (NULL,
-                    len - sizeof (GNUNET_EC_DBlock) ==
-                    GNUNET_AES_encrypt (&data[1],
-                                        len - sizeof (GNUNET_EC_DBlock),
-                                        &skey, &iv, &db[1]));
-  GNUNET_hash (&db[1], len - sizeof (GNUNET_EC_DBlock), &hc);
+  val = encrypt_block (data, len, &hc);
+  GNUNET_hash (&((GNUNET_EC_DBlock *) & val[1])[1],
+               len - sizeof (GNUNET_EC_DBlock), &hc);
   if (0 != memcmp (query, &hc, sizeof (GNUNET_HashCode)))
     {
       GNUNET_free (val);
@@ -85,6 +100,67 @@ GNUNET_EC_file_block_encode (const GNUNET_EC_DBlock * data,
   return GNUNET_OK;
 }
 
+/**
+ * Compute key and query (and optionally the encoded blocks) for
+ * several DBlocks at once.  Gives the same results as calling
+ * GNUNET_EC_file_block_get_key, GNUNET_EC_file_block_get_query and
+ * GNUNET_EC_file_block_encode on each block, but hashes every
+ * plaintext and ciphertext only once, using GNUNET_hash_multiple.
+ *
+ * @param data the blocks in plaintext
+ * @param lens the length of each block
+ * @param count number of blocks
+ * @param chks set to the key and query of each block
+ * @param values set to the encoded blocks (as with
+ *        GNUNET_EC_file_block_encode), NULL if not needed
+ */
+void
+GNUNET_EC_file_blocks_get_chks (const GNUNET_EC_DBlock * const *data,
+                                const unsigned int *lens,
+                                unsigned int count,
+                                GNUNET_EC_ContentHashKey * chks,
+                                GNUNET_DatastoreValue ** values)
+{
+  GNUNET_DatastoreValue **vals;
+  const void **blocks;
+  unsigned int *sizes;
+  GNUNET_HashCode *hcs;
+  unsigned int i;
+
+  if (count == 0)
+    return;
+  vals = GNUNET_malloc (count * sizeof (GNUNET_DatastoreValue *));
+  blocks = GNUNET_malloc (count * sizeof (const void *));
+  sizes = GNUNET_malloc (count * sizeof (unsigned int));
+  hcs = GNUNET_malloc (count * sizeof (GNUNET_HashCode));
+  for (i = 0; i < count; i++)
+    {
+      GNUNET_GE_ASSERT (NULL, lens[i] >= sizeof (GNUNET_EC_DBlock));
+      blocks[i] = &data[i][1];
+      sizes[i] = lens[i] - sizeof (GNUNET_EC_DBlock);
+    }
+  GNUNET_hash_multiple (blocks, sizes, count, hcs);
+  for (i = 0; i < count; i++)
+    {
+      chks[i].key = hcs[i];
+      vals[i] = encrypt_block (data[i], lens[i], &hcs[i]);
+      blocks[i] = &((GNUNET_EC_DBlock *) & vals[i][1])[1];
+    }
+  GNUNET_hash_multiple (blocks, sizes, count, hcs);
+  for (i = 0; i < count; i++)
+    {
+      chks[i].query = hcs[i];
+      if (values != NULL)
+        values[i] = vals[i];
+      else
+        GNUNET_free (vals[i]);
+    }
+  GNUNET_free (hcs);
+  GNUNET_free (sizes);
+  GNUNET_free (blocks);
+  GNUNET_free (vals);
+}
+
 /**
  * Get the key that will be used to decrypt
  * a certain block of data.
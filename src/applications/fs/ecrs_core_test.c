@@ -58,12 +58,64 @@ testEC ()
   return 0;
 }
 
+/**
+ * Check that GNUNET_EC_file_blocks_get_chks agrees with the
+ * functions for a single block (for blocks of different sizes).
+ */
+static int
+testChks ()
+{
+  GNUNET_EC_DBlock *data[5];
+  unsigned int lens[5];
+  GNUNET_EC_ContentHashKey chks[5];
+  GNUNET_DatastoreValue *values[5];
+  GNUNET_DatastoreValue *value;
+  GNUNET_HashCode query;
+  GNUNET_HashCode key;
+  int ret;
+  int i;
+
+  for (i = 0; i < 5; i++)
+    {
+      lens[i] = sizeof (GNUNET_EC_DBlock) + 1 + 7001 * i;
+      data[i] = GNUNET_malloc (lens[i]);
+      memset (&data[i][1], rand (), lens[i] - sizeof (GNUNET_EC_DBlock));
+      data[i]->type = htonl (GNUNET_ECRS_BLOCKTYPE_DATA);
+    }
+  GNUNET_EC_file_blocks_get_chks ((const GNUNET_EC_DBlock * const *) data,
+                                  lens, 5, chks, values);
+  ret = 0;
+  for (i = 0; i < 5; i++)
+    {
+      GNUNET_EC_file_block_get_key (data[i], lens[i], &key);
+      GNUNET_EC_file_block_get_query (data[i], lens[i], &query);
+      if ((0 != memcmp (&key, &chks[i].key, sizeof (GNUNET_HashCode))) ||
+          (0 != memcmp (&query, &chks[i].query, sizeof (GNUNET_HashCode))))
+        ret = 1;
+      if (GNUNET_OK !=
+          GNUNET_EC_file_block_encode (data[i], lens[i], &query, &value))
+        ret = 1;
+      else
+        {
+          if (0 != memcmp (value, values[i], ntohl (value->size)))
+            ret = 1;
+          GNUNET_free (value);
+        }
+      GNUNET_free (values[i]);
+      GNUNET_free (data[i]);
+    }
+  if (ret != 0)
+    fprintf (stderr, "Error at %s:%d\n", __FILE__, __LINE__);
+  return ret;
+}
+
 int
 main (int argc, char *argv[])
 {
   int failureCount = 0;
 
   failureCount += testEC ();
+  failureCount += testChks ();
   fprintf (stderr, "\n");
   if (failureCount != 0)
     return 1;
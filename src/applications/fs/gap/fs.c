@@ -148,7 +148,7 @@ handle_cs_insert_request (struct GNUNET_ClientHandle *sock,
 #endif
   memcpy (&datum[1],
           &ri[1], ntohs (req->size) - sizeof (CS_fs_request_insert_MESSAGE));
-  ret = datastore->putUpdate (&query, datum);
+  ret = datastore->putUpdateDeferred (&query, datum);
   if (ret == GNUNET_NO)
     {
       cectx = coreAPI->cs_log_context_create (sock);
@@ -47,6 +47,80 @@
  */
 #define HAVE_MORE_FREQUENCY (100 * GNUNET_CRON_MILLISECONDS)
 
+/**
+ * Number of buckets of the local lookup latency histogram.
+ */
+#define LATENCY_BUCKETS 4
+
+/**
+ * A lookup in the local datastore that is waiting for
+ * (or being processed by) a lookup thread.
+ */
+struct LookupJob
+{
+  struct LookupJob *next;
+
+  /**
+   * gap_id of the request (the request itself may have
+   * been freed by the time the lookup is done).
+   */
+  unsigned long long request_id;
+
+  /**
+   * Copy of the bloomfilter of the request (maybe NULL).
+   */
+  struct GNUNET_BloomFilter *bloomfilter;
+
+  /**
+   * When was the job queued?
+   */
+  GNUNET_CronTime queued;
+
+  /**
+   * Primary query of the request.
+   */
+  GNUNET_HashCode query;
+
+  /**
+   * Type of the request.
+   */
+  unsigned int type;
+
+  /**
+   * Value of the request when the job was queued.
+   */
+  unsigned int value;
+
+  /**
+   * Mutator used for the bloom filter.
+   */
+  int bloomfilter_mutator;
+
+  /**
+   * Should the request be forwarded if the lookup does
+   * not find a unique result?
+   */
+  int forward;
+};
+
+/**
+ * A reply found in the local datastore.
+ */
+struct LocalResult
+{
+  struct LocalResult *next;
+
+  /**
+   * The reply message.
+   */
+  P2P_gap_reply_MESSAGE *msg;
+
+  /**
+   * Hash of the content (for the bloomfilter).
+   */
+  GNUNET_HashCode hc;
+};
+
 /**
  * The GAP routing table.
  */
@@ -88,6 +162,71 @@ static int stat_gap_content_found_locally;
 
 static int stat_trust_earned;
 
+static int stat_gap_lookup_queue;
+
+static int stat_gap_lookup_shed;
+
+static int stat_gap_lookup_latency[LATENCY_BUCKETS];
+
+/**
+ * Upper bounds for the buckets of the latency histogram.
+ */
+static const GNUNET_CronTime latency_limit[LATENCY_BUCKETS - 1] = {
+  10 * GNUNET_CRON_MILLISECONDS,
+  100 * GNUNET_CRON_MILLISECONDS,
+  GNUNET_CRON_SECONDS
+};
+
+/**
+ * Lock for the lookup queue.
+ */
+static struct GNUNET_Mutex *lookup_lock;
+
+/**
+ * Signaled whenever a job is queued (or on shutdown).
+ */
+static struct GNUNET_Semaphore *lookup_signal;
+
+/**
+ * Head of the lookup queue.
+ */
+static struct LookupJob *lookup_head;
+
+/**
+ * Tail of the lookup queue.
+ */
+static struct LookupJob *lookup_tail;
+
+/**
+ * Number of jobs in the lookup queue.
+ */
+static unsigned int lookup_queue_size;
+
+/**
+ * Maximum number of jobs in the lookup queue.
+ */
+static unsigned int lookup_queue_max;
+
+/**
+ * Last gap_id handed out to a request.
+ */
+static unsigned long long last_gap_id;
+
+/**
+ * Lookup threads.
+ */
+static struct GNUNET_ThreadHandle **lookup_threads;
+
+/**
+ * Number of lookup threads.
+ */
+static unsigned int lookup_thread_count;
+
+/**
+ * Set to GNUNET_YES to stop the lookup threads.
+ */
+static int lookup_shutdown;
+
 
 
 static unsigned int
@@ -118,20 +257,26 @@ send_delayed (void *cls)
 
 struct DVPClosure
 {
-  struct RequestList *request;
+  struct LookupJob *job;
+  struct LocalResult *results;
   unsigned int iteration_count;
   unsigned int result_count;
+  unsigned int have_more;
 };
 
 /**
  * An iterator over a set of Datastore items.  This
- * function is called whenever GAP is processing a
- * request.  It should
+ * function is called by a lookup thread whenever GAP
+ * is processing a request.  It should
  * 1) abort if the load is getting too high
  * 2) try on-demand encoding (and if that fails,
  *    discard the entry)
- * 3) assemble a response and inject it via
- *    loopback WITH a delay
+ * 3) assemble a response and add it to the results
+ *    of the lookup (they are injected via loopback
+ *    WITH a delay once the lookup is complete)
+ *
+ * Since it does not hold GNUNET_FS_lock, it must only
+ * use the state captured in the job.
  *
  * @param datum called with the next item
  * @param closure user-defined extra argument
@@ -147,7 +292,8 @@ datastore_value_processor (const GNUNET_HashCode * key,
                            value, void *closure, unsigned long long uid)
 {
   struct DVPClosure *cls = closure;
-  struct RequestList *req = cls->request;
+  struct LookupJob *job = cls->job;
+  struct LocalResult *res;
   P2P_gap_reply_MESSAGE *msg;
   GNUNET_DatastoreValue *enc;
   unsigned int size;
@@ -160,10 +306,10 @@ datastore_value_processor (const GNUNET_HashCode * key,
 
   want_more = GNUNET_OK;
   cls->iteration_count++;
-  if (cls->iteration_count > 10 * (1 + req->value))
+  if (cls->iteration_count > 10 * (1 + job->value))
     {
       if (cls->result_count > 0)
-        req->have_more += GNUNET_GAP_HAVE_MORE_INCREMENT;
+        cls->have_more += GNUNET_GAP_HAVE_MORE_INCREMENT;
       want_more = GNUNET_SYSERR;
     }
   enc = NULL;
@@ -174,13 +320,16 @@ datastore_value_processor (const GNUNET_HashCode * key,
         return GNUNET_NO;
       value = enc;
     }
-  if (req->bloomfilter != NULL)
+  GNUNET_hash (&value[1],
+               ntohl (value->size) - sizeof (GNUNET_DatastoreValue), &hc);
+  if (job->bloomfilter != NULL)
     {
-      GNUNET_hash (&value[1],
-                   ntohl (value->size) - sizeof (GNUNET_DatastoreValue), &hc);
-      GNUNET_FS_HELPER_mingle_hash (&hc, req->bloomfilter_mutator, &mhc);
-      if (GNUNET_YES == GNUNET_bloomfilter_test (req->bloomfilter, &mhc))
-        return want_more;       /* not useful */
+      GNUNET_FS_HELPER_mingle_hash (&hc, job->bloomfilter_mutator, &mhc);
+      if (GNUNET_YES == GNUNET_bloomfilter_test (job->bloomfilter, &mhc))
+        {
+          GNUNET_free_non_null (enc);
+          return want_more;     /* not useful */
+        }
     }
   et = GNUNET_ntohll (value->expiration_time);
   now = GNUNET_get_time ();
@@ -196,7 +345,10 @@ datastore_value_processor (const GNUNET_HashCode * key,
   else
     {
       if (ntohl (value->type) == GNUNET_ECRS_BLOCKTYPE_KEYWORD)
-        return want_more;       /* expired KSK -- ignore! */
+        {
+          GNUNET_free_non_null (enc);
+          return want_more;     /* expired KSK -- ignore! */
+        }
       /* indicate entry has expired */
       et = -1;
     }
@@ -209,22 +361,17 @@ datastore_value_processor (const GNUNET_HashCode * key,
   msg->reserved = htonl (0);
   msg->expiration = GNUNET_htonll (et);
   memcpy (&msg[1], &value[1], size - sizeof (P2P_gap_reply_MESSAGE));
+  res = GNUNET_malloc (sizeof (struct LocalResult));
+  res->msg = msg;
+  res->hc = hc;
+  res->next = cls->results;
+  cls->results = res;
   cls->result_count++;
-  if (cls->result_count > 2 * (1 + req->value))
+  if (cls->result_count > 2 * (1 + job->value))
     {
-      req->have_more += GNUNET_GAP_HAVE_MORE_INCREMENT;
+      cls->have_more += GNUNET_GAP_HAVE_MORE_INCREMENT;
       want_more = GNUNET_SYSERR;
     }
-  if (stats != NULL)
-    {
-      stats->change (stat_trust_earned, req->value_offered);
-      req->value_offered = 0;
-    }
-  req->remaining_value = 0;
-  GNUNET_cron_add_job (cron,
-                       send_delayed,
-                       GNUNET_random_u32 (GNUNET_RANDOM_QUALITY_WEAK,
-                                          GNUNET_GAP_TTL_DECREMENT), 0, msg);
   ret =
     (ntohl (value->type) ==
      GNUNET_ECRS_BLOCKTYPE_DATA) ? GNUNET_SYSERR : want_more;
@@ -232,10 +379,228 @@ datastore_value_processor (const GNUNET_HashCode * key,
   return ret;
 }
 
+/**
+ * Free a lookup job.
+ */
+static void
+free_lookup (struct LookupJob *job)
+{
+  if (job->bloomfilter != NULL)
+    GNUNET_bloomfilter_free (job->bloomfilter);
+  GNUNET_free (job);
+}
+
+/**
+ * Find the request of a lookup job in the routing table.
+ * Must be called while holding GNUNET_FS_lock.
+ *
+ * @return NULL if the request is no longer in the table
+ */
+static struct RequestList *
+find_request (const struct LookupJob *job)
+{
+  struct RequestList *rl;
+
+  rl = table[get_table_index (&job->query)];
+  while (rl != NULL)
+    {
+      if ((rl->gap_id == job->request_id) &&
+          (rl->type == job->type) &&
+          (0 == memcmp (&rl->queries[0], &job->query,
+                        sizeof (GNUNET_HashCode))))
+        return rl;
+      rl = rl->next;
+    }
+  return NULL;
+}
+
+/**
+ * Perform a lookup in the local datastore and inject the
+ * results (with a delay) if the request is still active.
+ */
+static void
+process_lookup (struct LookupJob *job)
+{
+  struct DVPClosure cls;
+  struct RequestList *req;
+  struct LocalResult *res;
+  GNUNET_HashCode mhc;
+  GNUNET_CronTime delay;
+  unsigned int i;
+  int ret;
+
+  cls.job = job;
+  cls.results = NULL;
+  cls.iteration_count = 0;
+  cls.result_count = 0;
+  cls.have_more = 0;
+  ret = datastore->get (&job->query, job->type,
+                        &datastore_value_processor, &cls);
+  if ((job->type == GNUNET_ECRS_BLOCKTYPE_DATA) && (ret != 1))
+    ret = datastore->get (&job->query,
+                          GNUNET_ECRS_BLOCKTYPE_ONDEMAND,
+                          &datastore_value_processor, &cls);
+  GNUNET_mutex_lock (GNUNET_FS_lock);
+  req = find_request (job);
+  if (req != NULL)
+    req->have_more += cls.have_more;
+  /* if not found or not unique, forward */
+  if ((req != NULL) &&
+      (job->forward == GNUNET_YES) &&
+      (ret != 1) &&
+      (0 != (req->policy & GNUNET_FS_RoutingPolicy_FORWARD)) &&
+      (req->plan_entries == NULL))
+    GNUNET_FS_PLAN_request (NULL, req->response_target, req);
+  while (NULL != (res = cls.results))
+    {
+      cls.results = res->next;
+      if (req != NULL)
+        {
+          if (req->bloomfilter != NULL)
+            GNUNET_FS_HELPER_mingle_hash (&res->hc,
+                                          req->bloomfilter_mutator, &mhc);
+          if ((req->bloomfilter == NULL) ||
+              (GNUNET_YES != GNUNET_bloomfilter_test (req->bloomfilter,
+                                                      &mhc)))
+            {
+              if (stats != NULL)
+                {
+                  stats->change (stat_trust_earned, req->value_offered);
+                  req->value_offered = 0;
+                }
+              req->remaining_value = 0;
+              GNUNET_cron_add_job (cron,
+                                   send_delayed,
+                                   GNUNET_random_u32
+                                   (GNUNET_RANDOM_QUALITY_WEAK,
+                                    GNUNET_GAP_TTL_DECREMENT), 0, res->msg);
+              res->msg = NULL;
+            }
+        }
+      GNUNET_free_non_null (res->msg);
+      GNUNET_free (res);
+    }
+  GNUNET_mutex_unlock (GNUNET_FS_lock);
+  if (stats != NULL)
+    {
+      delay = GNUNET_get_time () - job->queued;
+      i = 0;
+      while ((i < LATENCY_BUCKETS - 1) && (delay >= latency_limit[i]))
+        i++;
+      stats->change (stat_gap_lookup_latency[i], 1);
+    }
+}
+
+/**
+ * Queue a lookup in the local datastore for the given
+ * request.  Must be called while holding GNUNET_FS_lock.
+ * If the queue is full, the lookup is skipped.  If no
+ * lookup thread could be started, the lookup is done
+ * right away.
+ *
+ * @param rl the request
+ * @param forward GNUNET_YES if the lookup should forward
+ *        the request unless it finds a unique result
+ * @return GNUNET_OK if the lookup was queued, GNUNET_NO
+ *         if it was skipped
+ */
+static int
+queue_lookup (struct RequestList *rl, int forward)
+{
+  struct LookupJob *job;
+  char *bf;
+
+  job = GNUNET_malloc (sizeof (struct LookupJob));
+  job->request_id = rl->gap_id;
+  job->queued = GNUNET_get_time ();
+  job->query = rl->queries[0];
+  job->type = rl->type;
+  job->value = rl->value;
+  job->forward = forward;
+  if (rl->bloomfilter != NULL)
+    {
+      bf = GNUNET_malloc (rl->bloomfilter_size);
+      if (GNUNET_OK == GNUNET_bloomfilter_get_raw_data (rl->bloomfilter,
+                                                        bf,
+                                                        rl->bloomfilter_size))
+        job->bloomfilter = GNUNET_bloomfilter_init (coreAPI->ectx,
+                                                    bf,
+                                                    rl->bloomfilter_size,
+                                                    GNUNET_GAP_BLOOMFILTER_K);
+      job->bloomfilter_mutator = rl->bloomfilter_mutator;
+      GNUNET_free (bf);
+    }
+  if (lookup_thread_count == 0)
+    {
+      process_lookup (job);
+      free_lookup (job);
+      return GNUNET_OK;
+    }
+  GNUNET_mutex_lock (lookup_lock);
+  if (lookup_queue_size >= lookup_queue_max)
+    {
+      GNUNET_mutex_unlock (lookup_lock);
+      if (job->bloomfilter != NULL)
+        GNUNET_bloomfilter_free (job->bloomfilter);
+      GNUNET_free (job);
+      if (stats != NULL)
+        stats->change (stat_gap_lookup_shed, 1);
+      return GNUNET_NO;
+    }
+  if (lookup_tail == NULL)
+    lookup_head = job;
+  else
+    lookup_tail->next = job;
+  lookup_tail = job;
+  lookup_queue_size++;
+  if (stats != NULL)
+    stats->set (stat_gap_lookup_queue, lookup_queue_size);
+  GNUNET_mutex_unlock (lookup_lock);
+  GNUNET_semaphore_up (lookup_signal);
+  return GNUNET_OK;
+}
+
+/**
+ * Main method of the lookup threads.
+ */
+static void *
+lookup_thread_main (void *unused)
+{
+  struct LookupJob *job;
+
+  while (1)
+    {
+      GNUNET_semaphore_down (lookup_signal, GNUNET_YES);
+      GNUNET_mutex_lock (lookup_lock);
+      if (lookup_shutdown == GNUNET_YES)
+        {
+          GNUNET_mutex_unlock (lookup_lock);
+          break;
+        }
+      job = lookup_head;
+      if (job == NULL)
+        {
+          GNUNET_mutex_unlock (lookup_lock);
+          continue;
+        }
+      lookup_head = job->next;
+      if (lookup_head == NULL)
+        lookup_tail = NULL;
+      lookup_queue_size--;
+      if (stats != NULL)
+        stats->set (stat_gap_lookup_queue, lookup_queue_size);
+      GNUNET_mutex_unlock (lookup_lock);
+      process_lookup (job);
+      free_lookup (job);
+    }
+  return NULL;
+}
+
 /**
  * Execute a GAP query.  Determines where to forward
  * the query and when (and captures state for the response).
- * Also check the local datastore.
+ * Also queues a lookup in the local datastore (which is
+ * performed asynchronously by the lookup threads).
  *
  * @param respond_to where to send replies
  * @param priority how important is the request for us?
@@ -263,14 +628,13 @@ GNUNET_FS_GAP_execute_query (const GNUNET_PeerIdentity * respond_to,
 {
   struct RequestList *rl;
   struct RequestList *prev;
-  struct DVPClosure cls;
   PID_INDEX peer;
   unsigned int index;
   GNUNET_CronTime now;
   GNUNET_CronTime newTTL;
   GNUNET_CronTime minTTL;
   unsigned int total;
-  int ret;
+  int forward_later;
 
   GNUNET_GE_ASSERT (NULL, query_count > 0);
   GNUNET_mutex_lock (GNUNET_FS_lock);
@@ -398,6 +762,7 @@ GNUNET_FS_GAP_execute_query (const GNUNET_PeerIdentity * respond_to,
   rl->expiration = newTTL;
   rl->response_target = peer;
   rl->policy = policy;
+  rl->gap_id = ++last_gap_id;
   rl->next = table[index];
   active_request_count++;
   total_priority += rl->value;
@@ -406,17 +771,14 @@ GNUNET_FS_GAP_execute_query (const GNUNET_PeerIdentity * respond_to,
     stats->change (stat_gap_query_routed, 1);
   /* check local data store */
 CHECK:
-  cls.request = rl;
-  cls.iteration_count = 0;
-  cls.result_count = 0;
-  ret = datastore->get (&queries[0], type, &datastore_value_processor, &cls);
-  if ((type == GNUNET_ECRS_BLOCKTYPE_DATA) && (ret != 1))
-    ret = datastore->get (&queries[0],
-                          GNUNET_ECRS_BLOCKTYPE_ONDEMAND,
-                          &datastore_value_processor, &cls);
-
-  /* if not found or not unique, forward */
-  if (((ret != 1) || (type != GNUNET_ECRS_BLOCKTYPE_DATA)) &&
+  /* a DATA query is only forwarded once the lookup did not
+     find it locally; other types may have more results
+     elsewhere, so forward those right away */
+  forward_later = ((type == GNUNET_ECRS_BLOCKTYPE_DATA) &&
+                   (0 != (policy & GNUNET_FS_RoutingPolicy_FORWARD)))
+    ? GNUNET_YES : GNUNET_NO;
+  if (((GNUNET_OK != queue_lookup (rl, forward_later)) ||
+       (forward_later == GNUNET_NO)) &&
       (0 != (policy & GNUNET_FS_RoutingPolicy_FORWARD)) &&
       (rl->plan_entries == NULL))
     GNUNET_FS_PLAN_request (NULL, peer, rl);
@@ -629,7 +991,6 @@ have_more_processor (void *unused)
   static unsigned int pos;
   struct RequestList *req;
   GNUNET_CronTime now;
-  struct DVPClosure cls;
 
   GNUNET_mutex_lock (GNUNET_FS_lock);
   now = GNUNET_get_time ();
@@ -645,11 +1006,7 @@ have_more_processor (void *unused)
       if (req->have_more > 0)
         {
           req->have_more--;
-          cls.request = req;
-          cls.iteration_count = 0;
-          cls.result_count = 0;
-          datastore->get (&req->queries[0], req->type,
-                          &datastore_value_processor, &cls);
+          queue_lookup (req, GNUNET_NO);
         }
       req = req->next;
     }
@@ -662,6 +1019,9 @@ int
 GNUNET_FS_GAP_init (GNUNET_CoreAPIForPlugins * capi)
 {
   unsigned long long ts;
+  unsigned long long lt;
+  unsigned long long lq;
+  unsigned int i;
 
   coreAPI = capi;
   datastore = capi->service_request ("datastore");
@@ -676,6 +1036,15 @@ GNUNET_FS_GAP_init (GNUNET_CoreAPIForPlugins * capi)
                                                 GNUNET_GAP_MIN_INDIRECTION_TABLE_SIZE,
                                                 &ts))
     return GNUNET_SYSERR;
+  if ((-1 ==
+       GNUNET_GC_get_configuration_value_number (coreAPI->cfg, "GAP",
+                                                 "LOOKUP-THREADS",
+                                                 1, 64, 2, &lt)) ||
+      (-1 ==
+       GNUNET_GC_get_configuration_value_number (coreAPI->cfg, "GAP",
+                                                 "LOOKUP-QUEUE",
+                                                 1, 65536, 256, &lq)))
+    return GNUNET_SYSERR;
   table_size = ts;
   table = GNUNET_malloc (sizeof (struct RequestList *) * table_size);
   memset (table, 0, sizeof (struct RequestList *) * table_size);
@@ -702,9 +1071,53 @@ GNUNET_FS_GAP_init (GNUNET_CoreAPIForPlugins * capi)
         stats->create (gettext_noop
                        ("# gap queries refreshed existing record"));
       stat_trust_earned = stats->create (gettext_noop ("# trust earned"));
+      stat_gap_lookup_queue =
+        stats->create (gettext_noop ("# gap local lookups queued"));
+      stat_gap_lookup_shed =
+        stats->create (gettext_noop
+                       ("# gap local lookups dropped (queue full)"));
+      stat_gap_lookup_latency[0] =
+        stats->create (gettext_noop
+                       ("# gap local lookups done in less than 10 ms"));
+      stat_gap_lookup_latency[1] =
+        stats->create (gettext_noop
+                       ("# gap local lookups done in 10-100 ms"));
+      stat_gap_lookup_latency[2] =
+        stats->create (gettext_noop
+                       ("# gap local lookups done in 100-1000 ms"));
+      stat_gap_lookup_latency[3] =
+        stats->create (gettext_noop
+                       ("# gap local lookups done in more than 1 s"));
     }
   cron = GNUNET_cron_create (coreAPI->ectx);
   GNUNET_cron_start (cron);
+  lookup_lock = GNUNET_mutex_create (GNUNET_NO);
+  lookup_signal = GNUNET_semaphore_create (0);
+  lookup_queue_max = lq;
+  lookup_shutdown = GNUNET_NO;
+  lookup_threads =
+    GNUNET_malloc (sizeof (struct GNUNET_ThreadHandle *) * lt);
+  lookup_thread_count = 0;
+  for (i = 0; i < lt; i++)
+    {
+      lookup_threads[lookup_thread_count] =
+        GNUNET_thread_create (&lookup_thread_main, NULL, 128 * 1024);
+      if (lookup_threads[lookup_thread_count] == NULL)
+        {
+          GNUNET_GE_LOG_STRERROR (coreAPI->ectx,
+                                  GNUNET_GE_ERROR | GNUNET_GE_ADMIN |
+                                  GNUNET_GE_USER | GNUNET_GE_IMMEDIATE,
+                                  "pthread_create");
+          continue;
+        }
+      lookup_thread_count++;
+    }
+  if (lookup_thread_count == 0)
+    GNUNET_GE_LOG (coreAPI->ectx,
+                   GNUNET_GE_WARNING | GNUNET_GE_ADMIN | GNUNET_GE_USER |
+                   GNUNET_GE_IMMEDIATE,
+                   _("Could not start any GAP lookup thread, "
+                     "doing datastore lookups synchronously.\n"));
   return 0;
 }
 
@@ -713,9 +1126,30 @@ GNUNET_FS_GAP_done ()
 {
   unsigned int i;
   struct RequestList *rl;
+  struct LookupJob *job;
+  void *unused;
 
   GNUNET_cron_del_job (coreAPI->cron,
                        &have_more_processor, HAVE_MORE_FREQUENCY, NULL);
+  GNUNET_mutex_lock (lookup_lock);
+  lookup_shutdown = GNUNET_YES;
+  GNUNET_mutex_unlock (lookup_lock);
+  for (i = 0; i < lookup_thread_count; i++)
+    GNUNET_semaphore_up (lookup_signal);
+  for (i = 0; i < lookup_thread_count; i++)
+    GNUNET_thread_join (lookup_threads[i], &unused);
+  GNUNET_free (lookup_threads);
+  lookup_threads = NULL;
+  lookup_thread_count = 0;
+  while (NULL != (job = lookup_head))
+    {
+      lookup_head = job->next;
+      free_lookup (job);
+    }
+  lookup_tail = NULL;
+  lookup_queue_size = 0;
+  GNUNET_semaphore_destroy (lookup_signal);
+  GNUNET_mutex_destroy (lookup_lock);
   GNUNET_cron_stop (cron);
   GNUNET_cron_destroy (cron);
   for (i = 0; i < table_size; i++)
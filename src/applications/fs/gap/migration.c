@@ -130,9 +130,11 @@ activeMigrationCallback (const GNUNET_PeerIdentity * receiver,
   unsigned int dist;
   unsigned int minDist;
   struct MigrationRecord *rec;
+  GNUNET_HashCode receiver_hash;
 
   if (content_size == 0)
     return 0;
+  receiver_hash = receiver->hashPubKey;
   index = GNUNET_FS_PT_intern (receiver);
   GNUNET_mutex_lock (GNUNET_FS_lock);
   now = GNUNET_get_time ();
@@ -148,7 +150,8 @@ activeMigrationCallback (const GNUNET_PeerIdentity * receiver,
           if (discard_time >= now - MAX_POLL_FREQUENCY)
             continue;
           discard_time = now;
-          if (GNUNET_OK != datastore->getRandom (&rec->key, &rec->value))
+          if (GNUNET_OK != datastore->getRandom
+              (&receiver_hash, &rec->key, &rec->value))
             {
               rec->value = NULL;        /* just to be sure... */
               continue;
@@ -175,7 +178,7 @@ activeMigrationCallback (const GNUNET_PeerIdentity * receiver,
         }
       if (match == 0)
         {
-          dist = GNUNET_hash_distance_u32 (&rec->key, &receiver->hashPubKey);
+          dist = GNUNET_hash_distance_u32 (&rec->key, &receiver_hash);
           if (dist <= minDist)
             {
               entry = i;
@@ -202,7 +205,8 @@ activeMigrationCallback (const GNUNET_PeerIdentity * receiver,
       rec->value = NULL;
       GNUNET_FS_PT_decrement_rcs (rec->receiverIndices, rec->sentCount);
       rec->sentCount = 0;
-      if (GNUNET_OK != datastore->getRandom (&rec->key, &rec->value))
+      if (GNUNET_OK != datastore->getRandom
+          (&receiver_hash, &rec->key, &rec->value))
         {
           rec->value = NULL;    /* just to be sure... */
           discard_entry = -1;
@@ -32,6 +32,7 @@
 #include "gnunet_protocols.h"
 #include "gnunet_datastore_service.h"
 #include "gnunet_state_service.h"
+#include "gnunet_stats_service.h"
 #include "ecrs_core.h"
 #include "shared.h"
 #include "ondemand.h"
@@ -66,6 +67,89 @@ typedef struct
 
 } OnDemandBlock;
 
+/**
+ * How many indexed files do we keep open?
+ */
+#define FILE_CACHE_SIZE 16
+
+/**
+ * How long do we keep using an open indexed file before
+ * opening it again (and thereby noticing that the file
+ * was removed or replaced)?
+ */
+#define FILE_CACHE_TTL (60 * GNUNET_CRON_SECONDS)
+
+/**
+ * An open indexed file.
+ */
+struct FileCacheEntry
+{
+  /**
+   * Hash of the file.
+   */
+  GNUNET_HashCode fileId;
+
+  /**
+   * Serializes seeking and reading.
+   */
+  struct GNUNET_Mutex *io_lock;
+
+  /**
+   * When did we open the file?
+   */
+  GNUNET_CronTime opened;
+
+  /**
+   * When did we last use the file?
+   */
+  GNUNET_CronTime last_used;
+
+  /**
+   * The open file.
+   */
+  int fd;
+
+  /**
+   * Number of threads currently using the file.
+   */
+  unsigned int rc;
+
+  /**
+   * GNUNET_NO if the entry was removed from the cache
+   * (the last user closes the file).
+   */
+  int valid;
+};
+
+/**
+ * An on-demand encoded block.
+ */
+struct BlockCacheEntry
+{
+  /**
+   * Entries are kept in LRU order (head is most
+   * recently used).
+   */
+  struct BlockCacheEntry *next;
+
+  struct BlockCacheEntry *prev;
+
+  /**
+   * Query for the block.
+   */
+  GNUNET_HashCode query;
+
+  /**
+   * Hash of the file the block was read from.
+   */
+  GNUNET_HashCode fileId;
+
+  /**
+   * The encoded block.
+   */
+  GNUNET_DatastoreValue *value;
+};
+
 /**
  * Name of the directory where we store symlinks to indexed
  * files.
@@ -78,6 +162,314 @@ static GNUNET_Datastore_ServiceAPI *datastore;
 
 static GNUNET_CoreAPIForPlugins *coreAPI;
 
+static GNUNET_Stats_ServiceAPI *stats;
+
+static int stat_file_cache_hits;
+
+static int stat_file_cache_misses;
+
+static int stat_block_cache_hits;
+
+static int stat_block_cache_misses;
+
+static int stat_block_cache_bytes;
+
+/**
+ * Lock for the file and block caches.
+ */
+static struct GNUNET_Mutex *cache_lock;
+
+/**
+ * Indexed files that are currently open.
+ */
+static struct FileCacheEntry *file_cache[FILE_CACHE_SIZE];
+
+/**
+ * Map from queries to recently encoded blocks.
+ */
+static struct GNUNET_MultiHashMap *block_map;
+
+/**
+ * Most recently used encoded block.
+ */
+static struct BlockCacheEntry *block_head;
+
+/**
+ * Least recently used encoded block.
+ */
+static struct BlockCacheEntry *block_tail;
+
+/**
+ * Number of bytes in the encoded blocks in the cache.
+ */
+static unsigned long long block_cache_size;
+
+/**
+ * Maximum number of bytes in encoded blocks in the cache.
+ */
+static unsigned long long block_cache_max;
+
+/**
+ * Close an open indexed file.  Called with the cache
+ * lock held once the file is no longer cached or used.
+ */
+static void
+free_file_entry (struct FileCacheEntry *entry)
+{
+  CLOSE (entry->fd);
+  GNUNET_mutex_destroy (entry->io_lock);
+  GNUNET_free (entry);
+}
+
+/**
+ * Remove the file in the given slot from the cache.
+ * Called with the cache lock held.
+ */
+static void
+detach_file_entry (unsigned int slot)
+{
+  struct FileCacheEntry *entry;
+
+  entry = file_cache[slot];
+  file_cache[slot] = NULL;
+  entry->valid = GNUNET_NO;
+  if (entry->rc == 0)
+    free_file_entry (entry);
+}
+
+/**
+ * Obtain an open handle for the given indexed file.
+ *
+ * @param fn name of the (link to the) indexed file
+ * @return NULL if the file could not be opened
+ */
+static struct FileCacheEntry *
+acquire_file (const GNUNET_HashCode * fileId, const char *fn)
+{
+  struct FileCacheEntry *entry;
+  GNUNET_CronTime now;
+  unsigned int i;
+  unsigned int slot;
+  int fd;
+
+  now = GNUNET_get_time ();
+  GNUNET_mutex_lock (cache_lock);
+  for (i = 0; i < FILE_CACHE_SIZE; i++)
+    {
+      entry = file_cache[i];
+      if ((entry == NULL) ||
+          (0 != memcmp (&entry->fileId, fileId, sizeof (GNUNET_HashCode))))
+        continue;
+      if (entry->opened + FILE_CACHE_TTL < now)
+        {
+          detach_file_entry (i);
+          break;
+        }
+      entry->rc++;
+      entry->last_used = now;
+      GNUNET_mutex_unlock (cache_lock);
+      if (stats != NULL)
+        stats->change (stat_file_cache_hits, 1);
+      return entry;
+    }
+  GNUNET_mutex_unlock (cache_lock);
+  if (stats != NULL)
+    stats->change (stat_file_cache_misses, 1);
+  if ((GNUNET_YES != GNUNET_disk_file_test (coreAPI->ectx,
+                                            fn)) ||
+      (-1 == (fd = GNUNET_disk_file_open (coreAPI->ectx,
+                                          fn, O_LARGEFILE | O_RDONLY, 0))))
+    return NULL;
+  entry = GNUNET_malloc (sizeof (struct FileCacheEntry));
+  entry->fileId = *fileId;
+  entry->io_lock = GNUNET_mutex_create (GNUNET_NO);
+  entry->opened = now;
+  entry->last_used = now;
+  entry->fd = fd;
+  entry->rc = 1;
+  entry->valid = GNUNET_YES;
+  GNUNET_mutex_lock (cache_lock);
+  slot = FILE_CACHE_SIZE;
+  for (i = 0; i < FILE_CACHE_SIZE; i++)
+    {
+      if (file_cache[i] == NULL)
+        {
+          slot = i;
+          break;
+        }
+      if ((file_cache[i]->rc == 0) &&
+          ((slot == FILE_CACHE_SIZE) ||
+           (file_cache[i]->last_used < file_cache[slot]->last_used)))
+        slot = i;
+    }
+  if (slot == FILE_CACHE_SIZE)
+    {
+      /* all cached files are in use, do not cache this one */
+      entry->valid = GNUNET_NO;
+    }
+  else
+    {
+      if (file_cache[slot] != NULL)
+        detach_file_entry (slot);
+      file_cache[slot] = entry;
+    }
+  GNUNET_mutex_unlock (cache_lock);
+  return entry;
+}
+
+/**
+ * Done using an indexed file.
+ */
+static void
+release_file (struct FileCacheEntry *entry)
+{
+  GNUNET_mutex_lock (cache_lock);
+  entry->rc--;
+  if ((entry->valid == GNUNET_NO) && (entry->rc == 0))
+    free_file_entry (entry);
+  GNUNET_mutex_unlock (cache_lock);
+}
+
+/**
+ * Remove an encoded block from the cache.  Called with
+ * the cache lock held.
+ */
+static void
+remove_block (struct BlockCacheEntry *entry)
+{
+  GNUNET_multi_hash_map_remove (block_map, &entry->query, entry);
+  if (entry->prev == NULL)
+    block_head = entry->next;
+  else
+    entry->prev->next = entry->next;
+  if (entry->next == NULL)
+    block_tail = entry->prev;
+  else
+    entry->next->prev = entry->prev;
+  block_cache_size -= ntohl (entry->value->size);
+  GNUNET_free (entry->value);
+  GNUNET_free (entry);
+}
+
+/**
+ * Look for a recently encoded block.
+ *
+ * @param enc set to a copy of the block on success
+ * @return GNUNET_OK if the block was found
+ */
+static int
+get_cached_block (const GNUNET_HashCode * query,
+                  const GNUNET_HashCode * fileId,
+                  GNUNET_DatastoreValue ** enc)
+{
+  struct BlockCacheEntry *entry;
+  unsigned int size;
+
+  if (block_cache_max == 0)
+    return GNUNET_NO;
+  GNUNET_mutex_lock (cache_lock);
+  entry = GNUNET_multi_hash_map_get (block_map, query);
+  if ((entry == NULL) ||
+      (0 != memcmp (&entry->fileId, fileId, sizeof (GNUNET_HashCode))))
+    {
+      GNUNET_mutex_unlock (cache_lock);
+      if (stats != NULL)
+        stats->change (stat_block_cache_misses, 1);
+      return GNUNET_NO;
+    }
+  if (entry->prev != NULL)
+    {
+      /* move to head */
+      entry->prev->next = entry->next;
+      if (entry->next == NULL)
+        block_tail = entry->prev;
+      else
+        entry->next->prev = entry->prev;
+      entry->prev = NULL;
+      entry->next = block_head;
+      block_head->prev = entry;
+      block_head = entry;
+    }
+  size = ntohl (entry->value->size);
+  *enc = GNUNET_malloc (size);
+  memcpy (*enc, entry->value, size);
+  GNUNET_mutex_unlock (cache_lock);
+  if (stats != NULL)
+    {
+      stats->change (stat_block_cache_hits, 1);
+      stats->change (stat_block_cache_bytes, size);
+    }
+  return GNUNET_OK;
+}
+
+/**
+ * Add an encoded block to the cache.
+ */
+static void
+cache_block (const GNUNET_HashCode * query,
+             const GNUNET_HashCode * fileId,
+             const GNUNET_DatastoreValue * enc)
+{
+  struct BlockCacheEntry *entry;
+  unsigned int size;
+
+  size = ntohl (enc->size);
+  if (size > block_cache_max)
+    return;
+  GNUNET_mutex_lock (cache_lock);
+  if (GNUNET_YES == GNUNET_multi_hash_map_contains (block_map, query))
+    {
+      GNUNET_mutex_unlock (cache_lock);
+      return;
+    }
+  while (block_cache_size + size > block_cache_max)
+    remove_block (block_tail);
+  entry = GNUNET_malloc (sizeof (struct BlockCacheEntry));
+  entry->query = *query;
+  entry->fileId = *fileId;
+  entry->value = GNUNET_malloc (size);
+  memcpy (entry->value, enc, size);
+  entry->next = block_head;
+  if (block_head == NULL)
+    block_tail = entry;
+  else
+    block_head->prev = entry;
+  block_head = entry;
+  block_cache_size += size;
+  GNUNET_multi_hash_map_put (block_map, query, entry,
+                             GNUNET_MultiHashMapOption_UNIQUE_FAST);
+  GNUNET_mutex_unlock (cache_lock);
+}
+
+/**
+ * Remove all cached state for the given indexed file
+ * (because it became unavailable, changed or was
+ * unindexed).
+ */
+static void
+forget_file (const GNUNET_HashCode * fileId)
+{
+  struct BlockCacheEntry *pos;
+  struct BlockCacheEntry *next;
+  unsigned int i;
+
+  GNUNET_mutex_lock (cache_lock);
+  for (i = 0; i < FILE_CACHE_SIZE; i++)
+    if ((file_cache[i] != NULL) &&
+        (0 == memcmp (&file_cache[i]->fileId,
+                      fileId, sizeof (GNUNET_HashCode))))
+      detach_file_entry (i);
+  pos = block_head;
+  while (pos != NULL)
+    {
+      next = pos->next;
+      if (0 == memcmp (&pos->fileId, fileId, sizeof (GNUNET_HashCode)))
+        remove_block (pos);
+      pos = next;
+    }
+  GNUNET_mutex_unlock (cache_lock);
+}
+
 /**
  * Get the name of the symbolic link corresponding
  * to the given hash of an indexed file.
@@ -137,6 +529,7 @@ publish_unavailable_mark (const GNUNET_HashCode * fileId)
   char *fn;
   int ret;
 
+  forget_file (fileId);
   now = GNUNET_get_time ();
   GNUNET_hash_to_enc (fileId, &enc);
   GNUNET_snprintf (unavail_key, 256, "FIRST_UNVAILABLE-%s", (char *) &enc);
@@ -225,6 +618,7 @@ GNUNET_FS_ONDEMAND_index_prepare_with_symlink (struct GNUNET_GE_Context *ectx,
       return GNUNET_NO;
     }
   GNUNET_free (serverFN);
+  forget_file (fileId);
   remove_unavailable_mark (fileId);
   return GNUNET_YES;
 }
@@ -322,7 +716,7 @@ GNUNET_FS_ONDEMAND_add_indexed_content (struct GNUNET_GE_Context *ectx,
       }
   }
 #endif
-  return datastore->putUpdate (&key, &odb.header);
+  return datastore->putUpdateDeferred (&key, &odb.header);
 }
 
 /**
@@ -351,6 +745,7 @@ delete_content_asynchronously (const GNUNET_DatastoreValue * dbv,
 {
   GNUNET_HashCode *ctx;
 
+  forget_file (&((const OnDemandBlock *) dbv)->fileId);
   ctx = GNUNET_malloc (sizeof (GNUNET_HashCode) + ntohl (dbv->size));
   *ctx = *query;
   memcpy (&ctx[1], dbv, ntohl (dbv->size));
@@ -374,10 +769,10 @@ GNUNET_FS_ONDEMAND_get_indexed_content (const GNUNET_DatastoreValue * dbv,
   char *fn;
   char *iobuf;
   int blen;
-  int fileHandle;
   int ret;
   const OnDemandBlock *odb;
   GNUNET_EC_DBlock *db;
+  struct FileCacheEntry *file;
   struct stat linkStat;
 
 
@@ -388,69 +783,73 @@ GNUNET_FS_ONDEMAND_get_indexed_content (const GNUNET_DatastoreValue * dbv,
       return GNUNET_SYSERR;
     }
   odb = (const OnDemandBlock *) dbv;
-  fn = get_indexed_filename (&odb->fileId);
-  if ((GNUNET_YES != GNUNET_disk_file_test (coreAPI->ectx,
-                                            fn)) ||
-      (-1 == (fileHandle = GNUNET_disk_file_open (coreAPI->ectx,
-                                                  fn, O_LARGEFILE | O_RDONLY,
-                                                  0))))
-    {
-      GNUNET_GE_LOG_STRERROR_FILE (coreAPI->ectx,
-                                   GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
-                                   GNUNET_GE_USER | GNUNET_GE_BULK, "open",
-                                   fn);
-      /* Is the symlink (still) there? */
-      if (LSTAT (fn, &linkStat) == -1)
-        delete_content_asynchronously (dbv, query);
-      else
-        publish_unavailable_mark (&odb->fileId);
-      GNUNET_free (fn);
-      return GNUNET_SYSERR;
-    }
-
-  if (GNUNET_ntohll (odb->fileOffset) != LSEEK (fileHandle,
-                                                GNUNET_ntohll
-                                                (odb->fileOffset), SEEK_SET))
-    {
-      GNUNET_GE_LOG_STRERROR_FILE (coreAPI->ectx,
-                                   GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
-                                   GNUNET_GE_USER | GNUNET_GE_BULK, "lseek",
-                                   fn);
-      GNUNET_free (fn);
-      CLOSE (fileHandle);
-      delete_content_asynchronously (dbv, query);
-      return GNUNET_SYSERR;
-    }
-  db = GNUNET_malloc (sizeof (GNUNET_EC_DBlock) + ntohl (odb->blockSize));
-  db->type = htonl (GNUNET_ECRS_BLOCKTYPE_DATA);
-  iobuf = (char *) &db[1];
-  blen = READ (fileHandle, iobuf, ntohl (odb->blockSize));
-  if (blen != ntohl (odb->blockSize))
+  if (GNUNET_OK != get_cached_block (query, &odb->fileId, enc))
     {
-      GNUNET_GE_LOG_STRERROR_FILE (coreAPI->ectx,
-                                   GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
-                                   GNUNET_GE_USER | GNUNET_GE_BULK, "read",
-                                   fn);
-      GNUNET_free (fn);
+      fn = get_indexed_filename (&odb->fileId);
+      file = acquire_file (&odb->fileId, fn);
+      if (file == NULL)
+        {
+          GNUNET_GE_LOG_STRERROR_FILE (coreAPI->ectx,
+                                       GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
+                                       GNUNET_GE_USER | GNUNET_GE_BULK,
+                                       "open", fn);
+          /* Is the symlink (still) there? */
+          if (LSTAT (fn, &linkStat) == -1)
+            delete_content_asynchronously (dbv, query);
+          else
+            publish_unavailable_mark (&odb->fileId);
+          GNUNET_free (fn);
+          return GNUNET_SYSERR;
+        }
+      GNUNET_mutex_lock (file->io_lock);
+      if (GNUNET_ntohll (odb->fileOffset) != LSEEK (file->fd,
+                                                    GNUNET_ntohll
+                                                    (odb->fileOffset),
+                                                    SEEK_SET))
+        {
+          GNUNET_mutex_unlock (file->io_lock);
+          GNUNET_GE_LOG_STRERROR_FILE (coreAPI->ectx,
+                                       GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
+                                       GNUNET_GE_USER | GNUNET_GE_BULK,
+                                       "lseek", fn);
+          GNUNET_free (fn);
+          release_file (file);
+          delete_content_asynchronously (dbv, query);
+          return GNUNET_SYSERR;
+        }
+      db = GNUNET_malloc (sizeof (GNUNET_EC_DBlock) + ntohl (odb->blockSize));
+      db->type = htonl (GNUNET_ECRS_BLOCKTYPE_DATA);
+      iobuf = (char *) &db[1];
+      blen = READ (file->fd, iobuf, ntohl (odb->blockSize));
+      GNUNET_mutex_unlock (file->io_lock);
+      release_file (file);
+      if (blen != ntohl (odb->blockSize))
+        {
+          GNUNET_GE_LOG_STRERROR_FILE (coreAPI->ectx,
+                                       GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
+                                       GNUNET_GE_USER | GNUNET_GE_BULK,
+                                       "read", fn);
+          GNUNET_free (fn);
+          GNUNET_free (db);
+          delete_content_asynchronously (dbv, query);
+          return GNUNET_SYSERR;
+        }
+      ret = GNUNET_EC_file_block_encode (db,
+                                         ntohl (odb->blockSize) +
+                                         sizeof (GNUNET_EC_DBlock), query,
+                                         enc);
       GNUNET_free (db);
-      CLOSE (fileHandle);
-      delete_content_asynchronously (dbv, query);
-      return GNUNET_SYSERR;
-    }
-  CLOSE (fileHandle);
-  ret = GNUNET_EC_file_block_encode (db,
-                                     ntohl (odb->blockSize) +
-                                     sizeof (GNUNET_EC_DBlock), query, enc);
-  GNUNET_free (db);
-  GNUNET_free (fn);
-  if (ret == GNUNET_SYSERR)
-    {
-      GNUNET_GE_LOG (coreAPI->ectx,
-                     GNUNET_GE_WARNING | GNUNET_GE_BULK | GNUNET_GE_USER,
-                     _
-                     ("Indexed content changed (does not match its hash).\n"));
-      delete_content_asynchronously (dbv, query);
-      return GNUNET_SYSERR;
+      GNUNET_free (fn);
+      if (ret == GNUNET_SYSERR)
+        {
+          GNUNET_GE_LOG (coreAPI->ectx,
+                         GNUNET_GE_WARNING | GNUNET_GE_BULK | GNUNET_GE_USER,
+                         _
+                         ("Indexed content changed (does not match its hash).\n"));
+          delete_content_asynchronously (dbv, query);
+          return GNUNET_SYSERR;
+        }
+      cache_block (query, &odb->fileId, *enc);
     }
   (*enc)->anonymity_level = dbv->anonymity_level;
   (*enc)->expiration_time = dbv->expiration_time;
@@ -507,6 +906,7 @@ GNUNET_FS_ONDEMAND_delete_indexed_content (struct GNUNET_GE_Context *ectx,
   GNUNET_EC_DBlock *block;
   GNUNET_EncName enc;
 
+  forget_file (fileId);
   fn = get_indexed_filename (fileId);
   fd = GNUNET_disk_file_open (ectx, fn, O_RDONLY | O_LARGEFILE, 0);
   if (fd == -1)
@@ -585,6 +985,7 @@ int
 GNUNET_FS_ONDEMAND_init (GNUNET_CoreAPIForPlugins * capi)
 {
   char *tmp;
+  unsigned long long cache_kb;
 
   coreAPI = capi;
   GNUNET_GC_get_configuration_value_filename (capi->cfg,
@@ -617,13 +1018,54 @@ GNUNET_FS_ONDEMAND_init (GNUNET_CoreAPIForPlugins * capi)
       GNUNET_free (index_directory);
       return GNUNET_SYSERR;
     }
-
+  if (-1 == GNUNET_GC_get_configuration_value_number (capi->cfg,
+                                                      "FS",
+                                                      "ONDEMAND-CACHE",
+                                                      0,
+                                                      1024 * 1024,
+                                                      4 * 1024, &cache_kb))
+    cache_kb = 0;
+  block_cache_max = cache_kb * 1024;
+  block_cache_size = 0;
+  block_map = GNUNET_multi_hash_map_create (1024);
+  cache_lock = GNUNET_mutex_create (GNUNET_NO);
+  stats = capi->service_request ("stats");
+  if (stats != NULL)
+    {
+      stat_file_cache_hits =
+        stats->create (gettext_noop ("# on-demand open file cache hits"));
+      stat_file_cache_misses =
+        stats->create (gettext_noop ("# on-demand open file cache misses"));
+      stat_block_cache_hits =
+        stats->create (gettext_noop ("# on-demand block cache hits"));
+      stat_block_cache_misses =
+        stats->create (gettext_noop ("# on-demand block cache misses"));
+      stat_block_cache_bytes =
+        stats->create (gettext_noop
+                       ("# bytes of on-demand blocks served from cache"));
+    }
   return 0;
 }
 
 int
 GNUNET_FS_ONDEMAND_done ()
 {
+  unsigned int i;
+
+  for (i = 0; i < FILE_CACHE_SIZE; i++)
+    if (file_cache[i] != NULL)
+      detach_file_entry (i);
+  while (block_head != NULL)
+    remove_block (block_head);
+  GNUNET_multi_hash_map_destroy (block_map);
+  block_map = NULL;
+  GNUNET_mutex_destroy (cache_lock);
+  cache_lock = NULL;
+  if (stats != NULL)
+    {
+      coreAPI->service_release (stats);
+      stats = NULL;
+    }
   coreAPI->service_release (state);
   state = NULL;
   coreAPI->service_release (datastore);
@@ -50,53 +50,152 @@ typedef struct
    * reference counter
    */
   unsigned int rc;
+
+  /**
+   * Next entry in the same hash bucket (if rc > 0),
+   * next free entry (if rc == 0); 0 for none.
+   */
+  PID_INDEX next;
 } PID_Entry;
 
 static unsigned int size;
 
 static PID_Entry *table;
 
+/**
+ * Hash index into the table (heads of the bucket chains,
+ * 0 for empty buckets).  The number of buckets is always
+ * a power of two.
+ */
+static PID_INDEX *buckets;
+
+static unsigned int bucket_count;
+
+/**
+ * Head of the list of unused entries (0 for none).
+ */
+static PID_INDEX free_list;
+
+/**
+ * Number of entries in use.
+ */
+static unsigned int used;
+
+/**
+ * Compute the bucket for the given peer (the hash of the
+ * public key is uniformly distributed, so we can just use
+ * its first bits).
+ */
+static unsigned int
+get_bucket (const GNUNET_HashCode * id)
+{
+  return id->bits[0] & (bucket_count - 1);
+}
+
+/**
+ * Double the size of the hash index and rehash all
+ * entries that are in use.
+ */
+static void
+grow_buckets ()
+{
+  unsigned int i;
+  unsigned int b;
+
+  GNUNET_free_non_null (buckets);
+  if (bucket_count == 0)
+    bucket_count = 16;
+  else
+    bucket_count *= 2;
+  buckets = GNUNET_malloc (bucket_count * sizeof (PID_INDEX));
+  memset (buckets, 0, bucket_count * sizeof (PID_INDEX));
+  for (i = 1; i < size; i++)
+    {
+      if (table[i].rc == 0)
+        continue;
+      b = get_bucket (&table[i].id);
+      table[i].next = buckets[b];
+      buckets[b] = i;
+    }
+}
+
+/**
+ * Remove an entry whose reference count dropped to zero
+ * from the hash index and add it to the free list.
+ * Caller must hold the lock.
+ */
+static void
+release_entry (PID_INDEX id)
+{
+  PID_INDEX *pos;
+
+  pos = &buckets[get_bucket (&table[id].id)];
+  while (*pos != id)
+    {
+      GNUNET_GE_ASSERT (ectx, *pos != 0);
+      pos = &table[*pos].next;
+    }
+  *pos = table[id].next;
+  table[id].next = free_list;
+  free_list = id;
+  used--;
+}
 
 PID_INDEX
 GNUNET_FS_PT_intern (const GNUNET_PeerIdentity * pid)
 {
+  GNUNET_HashCode hc;
   PID_INDEX ret;
-  PID_INDEX zero;
+  unsigned int b;
+  unsigned int i;
+  unsigned int first;
 
   if (pid == NULL)
     return 0;
-  zero = size;
+  /* peer identities are packed; do not take the address of the
+     (possibly unaligned) member */
+  hc = pid->hashPubKey;
   GNUNET_mutex_lock (GNUNET_FS_lock);
-  for (ret = 1; ret < size; ret++)
+  if (bucket_count == 0)
+    grow_buckets ();
+  ret = buckets[get_bucket (&hc)];
+  while (ret != 0)
     {
-      if (0 == memcmp (&pid->hashPubKey,
-                       &table[ret].id, sizeof (GNUNET_HashCode)))
+      if (0 == memcmp (&hc, &table[ret].id, sizeof (GNUNET_HashCode)))
         {
           table[ret].rc++;
           if (stats != NULL)
-            {
-              stats->change (stat_pid_rc, 1);
-              if (table[ret].rc == 1)
-                stats->change (stat_pid_entries, 1);
-            }
+            stats->change (stat_pid_rc, 1);
           GNUNET_mutex_unlock (GNUNET_FS_lock);
           return ret;
         }
-      else if ((zero == size) && (table[ret].rc == 0))
+      ret = table[ret].next;
+    }
+  if (free_list == 0)
+    {
+      /* entry 0 is never used */
+      first = (size == 0) ? 1 : size;
+      GNUNET_array_grow (table, size, (size == 0) ? 16 : size * 2);
+      for (i = size - 1; i >= first; i--)
         {
-          zero = ret;
+          table[i].next = free_list;
+          free_list = i;
         }
     }
-  ret = zero;
-  if (ret == size)
+  ret = free_list;
+  free_list = table[ret].next;
+  GNUNET_GE_ASSERT (ectx, (ret > 0) && (ret < size));
+  table[ret].id = hc;
+  table[ret].rc = 1;
+  used++;
+  if (used > 2 * bucket_count)
+    grow_buckets ();            /* also links the new entry */
+  else
     {
-      GNUNET_array_grow (table, size, size + 16);
+      b = get_bucket (&hc);
+      table[ret].next = buckets[b];
+      buckets[b] = ret;
     }
-  if (ret == 0)
-    ret = 1;
-  GNUNET_GE_ASSERT (ectx, ret < size);
-  table[ret].id = pid->hashPubKey;
-  table[ret].rc = 1;
   GNUNET_mutex_unlock (GNUNET_FS_lock);
   if (stats != NULL)
     {
@@ -120,8 +219,12 @@ GNUNET_FS_PT_decrement_rcs (const PID_INDEX * ids, unsigned int count)
       GNUNET_GE_ASSERT (ectx, id < size);
       GNUNET_GE_ASSERT (ectx, table[id].rc > 0);
       table[id].rc--;
-      if ((table[id].rc == 0) && (stats != NULL))
-        stats->change (stat_pid_entries, -1);
+      if (table[id].rc == 0)
+        {
+          release_entry (id);
+          if (stats != NULL)
+            stats->change (stat_pid_entries, -1);
+        }
     }
   GNUNET_mutex_unlock (GNUNET_FS_lock);
   if (stats != NULL)
@@ -138,6 +241,8 @@ GNUNET_FS_PT_change_rc (PID_INDEX id, int delta)
   GNUNET_GE_ASSERT (ectx, table[id].rc > 0);
   GNUNET_GE_ASSERT (ectx, (delta >= 0) || (table[id].rc >= -delta));
   table[id].rc += delta;
+  if (table[id].rc == 0)
+    release_entry (id);
   if (stats != NULL)
     {
       stats->change (stat_pid_rc, delta);
@@ -190,6 +295,11 @@ GNUNET_FS_PT_done ()
   for (i = 0; i < size; i++)
     GNUNET_GE_ASSERT (ectx, table[i].rc == 0);
   GNUNET_array_grow (table, size, 0);
+  GNUNET_free_non_null (buckets);
+  buckets = NULL;
+  bucket_count = 0;
+  free_list = 0;
+  used = 0;
   stats = NULL;
   ectx = NULL;
 }
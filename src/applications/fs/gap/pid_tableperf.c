@@ -0,0 +1,108 @@
+/*
+      This file is part of GNUnet
+      (C) 2008 Christian Grothoff (and other contributing authors)
+
+      GNUnet is free software; you can redistribute it and/or modify
+      it under the terms of the GNU General Public License as published
+      by the Free Software Foundation; either version 2, or (at your
+      option) any later version.
+
+      GNUnet is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      General Public License for more details.
+
+      You should have received a copy of the GNU General Public License
+      along with GNUnet; see the file COPYING.  If not, write to the
+      Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+      Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * @file fs/gap/pid_tableperf.c
+ * @brief performance test for the peer-ID table
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "pid_table.h"
+#include "shared.h"
+
+/**
+ * Number of distinct peers.
+ */
+#define PEERS 10000
+
+/**
+ * Number of intern/resolve/decrement operations.
+ */
+#define OPS (1000 * 1000)
+
+struct GNUNET_Mutex *GNUNET_FS_lock;
+
+int
+main (int argc, char *argv[])
+{
+  GNUNET_PeerIdentity *peers;
+  GNUNET_PeerIdentity pid;
+  PID_INDEX *ids;
+  GNUNET_CronTime start;
+  unsigned int i;
+  int ret;
+
+  ret = 0;
+  GNUNET_FS_lock = GNUNET_mutex_create (GNUNET_YES);
+  GNUNET_FS_PT_init (NULL, NULL);
+  peers = GNUNET_malloc (PEERS * sizeof (GNUNET_PeerIdentity));
+  ids = GNUNET_malloc (OPS * sizeof (PID_INDEX));
+  for (i = 0; i < PEERS; i++)
+    GNUNET_create_random_hash (&peers[i].hashPubKey);
+
+  start = GNUNET_get_time ();
+  for (i = 0; i < OPS; i++)
+    ids[i] = GNUNET_FS_PT_intern (&peers[i % PEERS]);
+  printf ("Interning %u PIDs took %llu ms\n", OPS,
+          GNUNET_get_time () - start);
+
+  start = GNUNET_get_time ();
+  for (i = 0; i < OPS; i++)
+    {
+      GNUNET_FS_PT_resolve (ids[i], &pid);
+      if ((ret == 0) &&
+          (0 != memcmp (&pid, &peers[i % PEERS],
+                        sizeof (GNUNET_PeerIdentity))))
+        {
+          printf ("Resolved wrong PID at %s:%u\n", __FILE__, __LINE__);
+          ret = 1;
+        }
+    }
+  printf ("Resolving %u PIDs took %llu ms\n", OPS,
+          GNUNET_get_time () - start);
+
+  start = GNUNET_get_time ();
+  for (i = 0; i < OPS; i++)
+    GNUNET_FS_PT_change_rc (ids[i], -1);
+  printf ("Decrementing %u PIDs took %llu ms\n", OPS,
+          GNUNET_get_time () - start);
+
+  /* all entries are free again, they must be re-used */
+  for (i = 0; i < PEERS; i++)
+    {
+      ids[i] = GNUNET_FS_PT_intern (&peers[PEERS - 1 - i]);
+      if ((ids[i] == 0) || (ids[i] > PEERS))
+        {
+          printf ("PID index %u not recycled at %s:%u\n", ids[i],
+                  __FILE__, __LINE__);
+          ret = 1;
+          break;
+        }
+    }
+  GNUNET_FS_PT_decrement_rcs (ids, i);
+  GNUNET_FS_PT_done ();
+  GNUNET_free (ids);
+  GNUNET_free (peers);
+  GNUNET_mutex_destroy (GNUNET_FS_lock);
+  return ret;
+}
+
+/* end of pid_tableperf.c */
@@ -94,6 +94,12 @@ struct RequestList
    */
   GNUNET_CronTime last_request_time;
 
+  /**
+   * Unique number of this request in the GAP routing table
+   * (used by the GAP lookup threads to find it again).
+   */
+  unsigned long long gap_id;
+
   /**
    * Size of the bloomfilter (in bytes); must be a power of 2.
    */
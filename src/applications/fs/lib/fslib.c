@@ -40,6 +40,14 @@
  */
 #define AUTO_RETRY 5
 
+/**
+ * Which results count as a failure of a request
+ * in a request window?
+ */
+#define FAIL_NEVER 0
+#define FAIL_ON_SYSERR 1
+#define FAIL_ON_NO 2
+
 /**
  * In memory, the search handle is followed
  * by a copy of the corresponding request of
@@ -461,24 +469,20 @@ GNUNET_FS_stop_search (struct
 
 
 /**
- * Insert a block.
+ * Build the request for inserting a block.
  *
- * @param block the block (properly encoded and all)
- * @return GNUNET_OK on success, GNUNET_SYSERR on error, GNUNET_NO on transient error
+ * @return NULL if the block is malformed
  */
-int
-GNUNET_FS_insert (struct GNUNET_ClientServerConnection *sock,
-                  const GNUNET_DatastoreValue * block)
+static CS_fs_request_insert_MESSAGE *
+make_insert_request (const GNUNET_DatastoreValue * block)
 {
-  int ret;
   CS_fs_request_insert_MESSAGE *ri;
   unsigned int size;
-  int retry;
 
   if (ntohl (block->size) <= sizeof (GNUNET_DatastoreValue))
     {
       GNUNET_GE_BREAK (NULL, 0);
-      return GNUNET_SYSERR;
+      return NULL;
     }
   size = ntohl (block->size) - sizeof (GNUNET_DatastoreValue);
   ri = GNUNET_malloc (sizeof (CS_fs_request_insert_MESSAGE) + size);
@@ -488,6 +492,79 @@ GNUNET_FS_insert (struct GNUNET_ClientServerConnection *sock,
   ri->expiration = block->expiration_time;
   ri->anonymity_level = block->anonymity_level;
   memcpy (&ri[1], &block[1], size);
+  return ri;
+}
+
+/**
+ * Build the request for indexing a block.
+ */
+static CS_fs_request_index_MESSAGE *
+make_index_request (const GNUNET_HashCode * fileHc,
+                    const GNUNET_DatastoreValue * block,
+                    unsigned long long offset)
+{
+  CS_fs_request_index_MESSAGE *ri;
+  unsigned int size;
+#if DEBUG_FSLIB
+  GNUNET_HashCode hc;
+  GNUNET_EncName enc;
+#endif
+
+  size = ntohl (block->size) - sizeof (GNUNET_DatastoreValue);
+  ri = GNUNET_malloc (sizeof (CS_fs_request_index_MESSAGE) + size);
+  ri->header.size = htons (sizeof (CS_fs_request_index_MESSAGE) + size);
+  ri->header.type = htons (GNUNET_CS_PROTO_GAP_INDEX);
+  ri->priority = block->priority;
+  ri->expiration = block->expiration_time;
+  ri->anonymity_level = block->anonymity_level;
+  ri->fileId = *fileHc;
+  ri->fileOffset = GNUNET_htonll (offset);
+  memcpy (&ri[1], &block[1], size);
+#if DEBUG_FSLIB
+  GNUNET_EC_file_block_get_query ((const GNUNET_EC_DBlock *) &block[1], size,
+                                  &hc);
+  GNUNET_hash_to_enc (&hc, &enc);
+  fprintf (stderr,
+           "Sending index request for `%s' to gnunetd)\n",
+           (const char *) &enc);
+#endif
+  return ri;
+}
+
+/**
+ * Build the request for deleting a block.
+ */
+static GNUNET_MessageHeader *
+make_delete_request (const GNUNET_DatastoreValue * block)
+{
+  CS_fs_request_delete_MESSAGE *rd;
+  unsigned int size;
+
+  size = ntohl (block->size) - sizeof (GNUNET_DatastoreValue);
+  rd = GNUNET_malloc (sizeof (CS_fs_request_delete_MESSAGE) + size);
+  rd->header.size = htons (sizeof (CS_fs_request_delete_MESSAGE) + size);
+  rd->header.type = htons (GNUNET_CS_PROTO_GAP_DELETE);
+  memcpy (&rd[1], &block[1], size);
+  return &rd->header;
+}
+
+/**
+ * Insert a block.
+ *
+ * @param block the block (properly encoded and all)
+ * @return GNUNET_OK on success, GNUNET_SYSERR on error, GNUNET_NO on transient error
+ */
+int
+GNUNET_FS_insert (struct GNUNET_ClientServerConnection *sock,
+                  const GNUNET_DatastoreValue * block)
+{
+  int ret;
+  CS_fs_request_insert_MESSAGE *ri;
+  int retry;
+
+  ri = make_insert_request (block);
+  if (ri == NULL)
+    return GNUNET_SYSERR;
   retry = AUTO_RETRY;
   do
     {
@@ -566,31 +643,9 @@ GNUNET_FS_index (struct GNUNET_ClientServerConnection *sock,
 {
   int ret;
   CS_fs_request_index_MESSAGE *ri;
-  unsigned int size;
   int retry;
-#if DEBUG_FSLIB
-  GNUNET_HashCode hc;
-  GNUNET_EncName enc;
-#endif
 
-  size = ntohl (block->size) - sizeof (GNUNET_DatastoreValue);
-  ri = GNUNET_malloc (sizeof (CS_fs_request_index_MESSAGE) + size);
-  ri->header.size = htons (sizeof (CS_fs_request_index_MESSAGE) + size);
-  ri->header.type = htons (GNUNET_CS_PROTO_GAP_INDEX);
-  ri->priority = block->priority;
-  ri->expiration = block->expiration_time;
-  ri->anonymity_level = block->anonymity_level;
-  ri->fileId = *fileHc;
-  ri->fileOffset = GNUNET_htonll (offset);
-  memcpy (&ri[1], &block[1], size);
-#if DEBUG_FSLIB
-  GNUNET_EC_file_block_get_query ((const GNUNET_EC_DBlock *) &block[1], size,
-                                  &hc);
-  GNUNET_hash_to_enc (&hc, &enc);
-  fprintf (stderr,
-           "Sending index request for `%s' to gnunetd)\n",
-           (const char *) &enc);
-#endif
+  ri = make_index_request (fileHc, block, offset);
   retry = AUTO_RETRY;
   do
     {
@@ -614,6 +669,250 @@ GNUNET_FS_index (struct GNUNET_ClientServerConnection *sock,
   return ret;
 }
 
+/**
+ * Requests that were written to gnunetd but whose
+ * results have not been read yet.  gnunetd answers
+ * the requests of a client in order, so the results
+ * are matched to the oldest outstanding request.
+ */
+struct GNUNET_FS_RequestWindow
+{
+  struct GNUNET_ClientServerConnection *sock;
+
+  /**
+   * Ring of outstanding requests, the oldest at 'head'.
+   */
+  GNUNET_MessageHeader **pending;
+
+  /**
+   * How often may each outstanding request still be
+   * retried if gnunetd reports a transient error?
+   */
+  int *retries;
+
+  /**
+   * Which results count as a failure (FAIL_*) for
+   * each outstanding request?
+   */
+  int *fail_on;
+
+  /**
+   * Size of the ring.
+   */
+  unsigned int size;
+
+  unsigned int head;
+
+  /**
+   * Number of outstanding requests.
+   */
+  unsigned int count;
+
+  /**
+   * Did any request fail?
+   */
+  int failed;
+};
+
+/**
+ * Forget about all outstanding requests without reading
+ * their results (after an error on the connection).
+ */
+static void
+window_drop (struct GNUNET_FS_RequestWindow *win)
+{
+  win->failed = GNUNET_YES;
+  while (win->count > 0)
+    {
+      GNUNET_free (win->pending[win->head]);
+      win->pending[win->head] = NULL;
+      win->head = (win->head + 1) % win->size;
+      win->count--;
+    }
+}
+
+static void window_collect (struct GNUNET_FS_RequestWindow *win);
+
+/**
+ * Write a request and append it to the window, first
+ * waiting for the oldest result if the window is full.
+ * Takes ownership of the request.
+ */
+static int
+window_send (struct GNUNET_FS_RequestWindow *win,
+             GNUNET_MessageHeader * req, int retry, int fail_on)
+{
+  unsigned int idx;
+
+  while ((win->count == win->size) && (win->failed == GNUNET_NO))
+    window_collect (win);
+  if (win->failed == GNUNET_YES)
+    {
+      GNUNET_free (req);
+      return GNUNET_SYSERR;
+    }
+  if (GNUNET_OK != GNUNET_client_connection_write (win->sock, req))
+    {
+      GNUNET_free (req);
+      window_drop (win);
+      return GNUNET_SYSERR;
+    }
+  idx = (win->head + win->count) % win->size;
+  win->pending[idx] = req;
+  win->retries[idx] = retry;
+  win->fail_on[idx] = fail_on;
+  win->count++;
+  return GNUNET_OK;
+}
+
+/**
+ * Read the result for the oldest outstanding request.
+ * Requests that failed with a transient error are
+ * written again (at the end of the window).
+ */
+static void
+window_collect (struct GNUNET_FS_RequestWindow *win)
+{
+  GNUNET_MessageHeader *req;
+  int retry;
+  int fail_on;
+  int ret;
+
+  req = win->pending[win->head];
+  retry = win->retries[win->head];
+  fail_on = win->fail_on[win->head];
+  if (GNUNET_OK != GNUNET_client_connection_read_result (win->sock, &ret))
+    {
+      GNUNET_GE_BREAK (NULL, GNUNET_shutdown_test ());
+      window_drop (win);
+      return;
+    }
+  win->pending[win->head] = NULL;
+  win->head = (win->head + 1) % win->size;
+  win->count--;
+  if ((ret == GNUNET_NO) && (retry > 0))
+    {
+      window_send (win, req, retry - 1, fail_on);
+      return;
+    }
+  if (((ret == GNUNET_SYSERR) && (fail_on != FAIL_NEVER)) ||
+      ((ret == GNUNET_NO) && (fail_on == FAIL_ON_NO)))
+    win->failed = GNUNET_YES;
+  GNUNET_free (req);
+}
+
+/**
+ * Create a window for sending insert and index requests
+ * without waiting for each result.
+ *
+ * @param size maximum number of outstanding requests
+ */
+struct GNUNET_FS_RequestWindow *
+GNUNET_FS_window_create (struct GNUNET_ClientServerConnection *sock,
+                         unsigned int size)
+{
+  struct GNUNET_FS_RequestWindow *win;
+
+  if (size == 0)
+    size = 1;
+  win = GNUNET_malloc (sizeof (struct GNUNET_FS_RequestWindow));
+  win->sock = sock;
+  win->size = size;
+  win->pending = GNUNET_malloc (size * sizeof (GNUNET_MessageHeader *));
+  win->retries = GNUNET_malloc (size * sizeof (int));
+  win->fail_on = GNUNET_malloc (size * sizeof (int));
+  win->failed = GNUNET_NO;
+  return win;
+}
+
+/**
+ * Insert a block without waiting for the result.
+ *
+ * @param block the block (properly encoded and all)
+ * @param strict GNUNET_YES if a GNUNET_NO result from gnunetd
+ *        (after retrying) counts as a failure
+ * @return GNUNET_OK if the request was sent, GNUNET_SYSERR
+ *         on error (or if an earlier request failed)
+ */
+int
+GNUNET_FS_window_insert (struct GNUNET_FS_RequestWindow *win,
+                         const GNUNET_DatastoreValue * block, int strict)
+{
+  CS_fs_request_insert_MESSAGE *ri;
+
+  ri = make_insert_request (block);
+  if (ri == NULL)
+    {
+      win->failed = GNUNET_YES;
+      return GNUNET_SYSERR;
+    }
+  return window_send (win, &ri->header, AUTO_RETRY,
+                      (strict == GNUNET_YES) ? FAIL_ON_NO : FAIL_ON_SYSERR);
+}
+
+/**
+ * Index a block without waiting for the result.
+ *
+ * @param fileHc the GNUNET_hash of the entire file
+ * @param block the data from the file (in plaintext)
+ * @param offset the offset of the block into the file
+ * @return GNUNET_OK if the request was sent, GNUNET_SYSERR
+ *         on error (or if an earlier request failed)
+ */
+int
+GNUNET_FS_window_index (struct GNUNET_FS_RequestWindow *win,
+                        const GNUNET_HashCode * fileHc,
+                        const GNUNET_DatastoreValue * block,
+                        unsigned long long offset)
+{
+  CS_fs_request_index_MESSAGE *ri;
+
+  ri = make_index_request (fileHc, block, offset);
+  return window_send (win, &ri->header, AUTO_RETRY, FAIL_ON_SYSERR);
+}
+
+/**
+ * Delete a block without waiting for the result.
+ *
+ * @param block the block (properly encoded and all)
+ * @param strict GNUNET_YES if content that gnunetd fails
+ *        to find counts as a failure
+ * @return GNUNET_OK if the request was sent, GNUNET_SYSERR
+ *         on error (or if an earlier request failed)
+ */
+int
+GNUNET_FS_window_delete (struct GNUNET_FS_RequestWindow *win,
+                         const GNUNET_DatastoreValue * block, int strict)
+{
+  GNUNET_MessageHeader *rd;
+
+  rd = make_delete_request (block);
+  return window_send (win, rd, AUTO_RETRY,
+                      (strict == GNUNET_YES) ? FAIL_ON_SYSERR : FAIL_NEVER);
+}
+
+/**
+ * Wait for the results of all outstanding requests
+ * and free the window.
+ *
+ * @return GNUNET_OK if all requests succeeded,
+ *         GNUNET_SYSERR if any of them failed
+ */
+int
+GNUNET_FS_window_destroy (struct GNUNET_FS_RequestWindow *win)
+{
+  int ret;
+
+  while (win->count > 0)
+    window_collect (win);
+  ret = (win->failed == GNUNET_YES) ? GNUNET_SYSERR : GNUNET_OK;
+  GNUNET_free (win->pending);
+  GNUNET_free (win->retries);
+  GNUNET_free (win->fail_on);
+  GNUNET_free (win);
+  return ret;
+}
+
 /**
  * Delete a block.  The arguments are the same as the ones for
  * GNUNET_FS_insert.
@@ -627,19 +926,14 @@ GNUNET_FS_delete (struct GNUNET_ClientServerConnection *sock,
                   const GNUNET_DatastoreValue * block)
 {
   int ret;
-  CS_fs_request_delete_MESSAGE *rd;
-  unsigned int size;
+  GNUNET_MessageHeader *rd;
   int retry;
 
-  size = ntohl (block->size) - sizeof (GNUNET_DatastoreValue);
-  rd = GNUNET_malloc (sizeof (CS_fs_request_delete_MESSAGE) + size);
-  rd->header.size = htons (sizeof (CS_fs_request_delete_MESSAGE) + size);
-  rd->header.type = htons (GNUNET_CS_PROTO_GAP_DELETE);
-  memcpy (&rd[1], &block[1], size);
+  rd = make_delete_request (block);
   retry = AUTO_RETRY;
   do
     {
-      if (GNUNET_OK != GNUNET_client_connection_write (sock, &rd->header))
+      if (GNUNET_OK != GNUNET_client_connection_write (sock, rd))
         {
           GNUNET_free (rd);
           GNUNET_GE_BREAK (NULL, 0);
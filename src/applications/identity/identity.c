@@ -65,6 +65,11 @@
 
 #define CRON_DISCARDS_HOSTS_AFTER (3 * GNUNET_CRON_MONTHS)
 
+/**
+ * Number of counters in the blacklist filter (must be a power of 2).
+ */
+#define BLACKLIST_FILTER_SIZE 4096
+
 typedef struct
 {
 
@@ -104,6 +109,11 @@ typedef struct
    */
   unsigned int trust;
 
+  /**
+   * position of this entry in hosts_
+   */
+  unsigned int index;
+
 } HostEntry;
 
 /**
@@ -121,6 +131,21 @@ static unsigned int sizeOfHosts_ = 0;
  */
 static unsigned int numberOfHosts_;
 
+/**
+ * Maps the hash of the public key of each known host
+ * to its entry in hosts_.
+ */
+static struct GNUNET_MultiHashMap *hostMap_;
+
+/**
+ * Counting filter over the known hosts that are (or recently
+ * were) blacklisted, that is those with a non-zero "until".
+ * Only modified while holding lock_, but read without it
+ * by isBlacklisted: if either counter for a peer is zero,
+ * the peer is not blacklisted.  All accesses are atomic.
+ */
+static unsigned int blacklistFilter_[BLACKLIST_FILTER_SIZE];
+
 /**
  * A lock for accessing knownHosts
  */
@@ -175,14 +200,54 @@ get_host_filename (const GNUNET_PeerIdentity * id, unsigned short protocol)
 static HostEntry *
 lookup_host_entry (const GNUNET_PeerIdentity * id)
 {
-  int i;
+  GNUNET_HashCode hc;
 
   GNUNET_GE_ASSERT (ectx, numberOfHosts_ <= sizeOfHosts_);
-  for (i = 0; i < numberOfHosts_; i++)
-    if ((0 ==
-         memcmp (id, &hosts_[i]->identity, sizeof (GNUNET_PeerIdentity))))
-      return hosts_[i];
-  return NULL;
+  hc = id->hashPubKey;
+  return GNUNET_multi_hash_map_get (hostMap_, &hc);
+}
+
+/**
+ * Get the two counters of the blacklist filter for the given peer.
+ */
+static void
+get_filter_slots (const GNUNET_PeerIdentity * id,
+                  unsigned int *a, unsigned int *b)
+{
+  *a = id->hashPubKey.bits[0] & (BLACKLIST_FILTER_SIZE - 1);
+  *b = id->hashPubKey.bits[1] & (BLACKLIST_FILTER_SIZE - 1);
+}
+
+/**
+ * Set the blacklisting deadline of a host and keep the
+ * blacklist filter in sync.  Call only when synchronized!
+ *
+ * @param until new deadline, 0 for not blacklisted
+ */
+static void
+set_blacklisted_until (HostEntry * entry, GNUNET_CronTime until)
+{
+  unsigned int a;
+  unsigned int b;
+
+  /* isBlacklisted only considers known hosts */
+  if ((entry >= &tempHosts[0]) && (entry < &tempHosts[MAX_TEMP_HOSTS]))
+    {
+      entry->until = until;
+      return;
+    }
+  get_filter_slots (&entry->identity, &a, &b);
+  if ((entry->until == 0) && (until != 0))
+    {
+      __sync_add_and_fetch (&blacklistFilter_[a], 1);
+      __sync_add_and_fetch (&blacklistFilter_[b], 1);
+    }
+  else if ((entry->until != 0) && (until == 0))
+    {
+      __sync_sub_and_fetch (&blacklistFilter_[a], 1);
+      __sync_sub_and_fetch (&blacklistFilter_[b], 1);
+    }
+  entry->until = until;
 }
 
 /**
@@ -196,6 +261,7 @@ add_host_to_known_hosts (const GNUNET_PeerIdentity * identity,
                          unsigned short protocol)
 {
   HostEntry *entry;
+  GNUNET_HashCode hc;
   int i;
   GNUNET_EncName fil;
   char *fn;
@@ -236,7 +302,11 @@ add_host_to_known_hosts (const GNUNET_PeerIdentity * identity,
 
       if (numberOfHosts_ == sizeOfHosts_)
         GNUNET_array_grow (hosts_, sizeOfHosts_, sizeOfHosts_ + 32);
+      entry->index = numberOfHosts_;
       hosts_[numberOfHosts_++] = entry;
+      hc = identity->hashPubKey;
+      GNUNET_multi_hash_map_put (hostMap_, &hc, entry,
+                                 GNUNET_MultiHashMapOption_UNIQUE_FAST);
     }
   for (i = 0; i < entry->protocolCount; i++)
     {
@@ -490,64 +560,64 @@ delHostFromKnown (const GNUNET_PeerIdentity * identity,
                   unsigned short protocol)
 {
   HostEntry *entry;
+  GNUNET_HashCode hc;
   char *fn;
-  int i;
   int j;
 
   GNUNET_GE_ASSERT (ectx, numberOfHosts_ <= sizeOfHosts_);
   GNUNET_GE_ASSERT (ectx, protocol != GNUNET_TRANSPORT_PROTOCOL_NUMBER_ANY);
   GNUNET_mutex_lock (lock_);
-  for (i = 0; i < numberOfHosts_; i++)
+  entry = lookup_host_entry (identity);
+  if (entry != NULL)
     {
-      if ((0 == memcmp (identity,
-                        &hosts_[i]->identity, sizeof (GNUNET_PeerIdentity))))
+      for (j = 0; j < entry->protocolCount; j++)
         {
-          entry = hosts_[i];
-          for (j = 0; j < entry->protocolCount; j++)
+          if (protocol == entry->protocols[j])
             {
-              if (protocol == entry->protocols[j])
-                {
-                  entry->protocols[j]
-                    = entry->protocols[entry->protocolCount - 1];
-                  GNUNET_array_grow (entry->protocols,
-                                     entry->protocolCount,
-                                     entry->protocolCount - 1);
-                }
+              entry->protocols[j]
+                = entry->protocols[entry->protocolCount - 1];
+              GNUNET_array_grow (entry->protocols,
+                                 entry->protocolCount,
+                                 entry->protocolCount - 1);
             }
-          for (j = 0; j < entry->helloCount; j++)
+        }
+      for (j = 0; j < entry->helloCount; j++)
+        {
+          if (protocol == ntohs (entry->hellos[j]->protocol))
             {
-              if (protocol == ntohs (entry->hellos[j]->protocol))
-                {
-                  GNUNET_free (entry->hellos[j]);
-                  entry->hellos[j] = entry->hellos[entry->helloCount - 1];
-                  GNUNET_array_grow (entry->hellos,
-                                     entry->helloCount,
-                                     entry->helloCount - 1);
-                }
+              GNUNET_free (entry->hellos[j]);
+              entry->hellos[j] = entry->hellos[entry->helloCount - 1];
+              GNUNET_array_grow (entry->hellos,
+                                 entry->helloCount,
+                                 entry->helloCount - 1);
             }
-          /* also remove hello file itself */
-          fn = get_host_filename (identity, protocol);
-          if (0 != UNLINK (fn))
-            GNUNET_GE_LOG_STRERROR_FILE (ectx,
-                                         GNUNET_GE_WARNING | GNUNET_GE_USER |
-                                         GNUNET_GE_BULK, "unlink", fn);
-          GNUNET_free (fn);
-
-          if (entry->protocolCount == 0)
+        }
+      /* also remove hello file itself */
+      fn = get_host_filename (identity, protocol);
+      if (0 != UNLINK (fn))
+        GNUNET_GE_LOG_STRERROR_FILE (ectx,
+                                     GNUNET_GE_WARNING | GNUNET_GE_USER |
+                                     GNUNET_GE_BULK, "unlink", fn);
+      GNUNET_free (fn);
+
+      if (entry->protocolCount == 0)
+        {
+          if (entry->helloCount > 0)
             {
-              if (entry->helloCount > 0)
-                {
-                  for (j = 0; j < entry->helloCount; j++)
-                    GNUNET_free (entry->hellos[j]);
-                  GNUNET_array_grow (entry->hellos, entry->helloCount, 0);
-                }
-              hosts_[i] = hosts_[--numberOfHosts_];
-              GNUNET_free (entry);
+              for (j = 0; j < entry->helloCount; j++)
+                GNUNET_free (entry->hellos[j]);
+              GNUNET_array_grow (entry->hellos, entry->helloCount, 0);
             }
-          GNUNET_mutex_unlock (lock_);
-          GNUNET_GE_ASSERT (ectx, numberOfHosts_ <= sizeOfHosts_);
-          return;               /* deleted */
+          set_blacklisted_until (entry, 0);
+          hc = identity->hashPubKey;
+          GNUNET_multi_hash_map_remove (hostMap_, &hc, entry);
+          hosts_[entry->index] = hosts_[--numberOfHosts_];
+          hosts_[entry->index]->index = entry->index;
+          GNUNET_free (entry);
         }
+      GNUNET_mutex_unlock (lock_);
+      GNUNET_GE_ASSERT (ectx, numberOfHosts_ <= sizeOfHosts_);
+      return;                   /* deleted */
     }
   GNUNET_mutex_unlock (lock_);
 }
@@ -884,7 +954,7 @@ blacklistHost (const GNUNET_PeerIdentity * identity,
     }
   if (entry->delta > 4 * GNUNET_CRON_HOURS)
     entry->delta = 4 * GNUNET_CRON_HOURS;
-  entry->until = now + entry->delta;
+  set_blacklisted_until (entry, now + entry->delta);
   entry->strict = strict;
   GNUNET_hash_to_enc (&identity->hashPubKey, &hn);
 #if DEBUG_IDENTITY
@@ -910,8 +980,18 @@ isBlacklisted (const GNUNET_PeerIdentity * identity, int strict)
 {
   GNUNET_CronTime now;
   HostEntry *entry;
+  unsigned int a;
+  unsigned int b;
 
   GNUNET_GE_ASSERT (ectx, numberOfHosts_ <= sizeOfHosts_);
+  /* fast path: most peers were never blacklisted, so
+     answer those without taking the lock; if the peer is
+     being blacklisted concurrently we may still say no,
+     which is what we would have said a moment earlier */
+  get_filter_slots (identity, &a, &b);
+  if ((0 == __sync_add_and_fetch (&blacklistFilter_[a], 0)) ||
+      (0 == __sync_add_and_fetch (&blacklistFilter_[b], 0)))
+    return GNUNET_NO;
   GNUNET_mutex_lock (lock_);
   entry = lookup_host_entry (identity);
   if (entry == NULL)
@@ -920,6 +1000,8 @@ isBlacklisted (const GNUNET_PeerIdentity * identity, int strict)
       return GNUNET_NO;
     }
   now = GNUNET_get_time ();
+  if ((entry->until != 0) && (now >= entry->until))
+    set_blacklisted_until (entry, 0);   /* expired */
   if ((now < entry->until)
       && ((entry->strict == GNUNET_YES) || (strict == GNUNET_NO)))
     {
@@ -979,7 +1061,7 @@ whitelistHost (const GNUNET_PeerIdentity * identity)
       return GNUNET_SYSERR;
     }
   entry->delta = 30 * GNUNET_CRON_SECONDS;
-  entry->until = 0;
+  set_blacklisted_until (entry, 0);
   entry->strict = GNUNET_NO;
   GNUNET_mutex_unlock (lock_);
   return GNUNET_OK;
@@ -1412,6 +1494,7 @@ provide_module_identity (GNUNET_CoreAPIForPlugins * capi)
   GNUNET_free (gnHome);
 
   lock_ = GNUNET_mutex_create (GNUNET_YES);
+  hostMap_ = GNUNET_multi_hash_map_create (1024);
   initPrivateKey (capi->ectx, capi->cfg);
   getPeerIdentity (getPublicPrivateKey (), &myIdentity);
   cronScanDirectoryDataHosts (NULL);
@@ -1486,6 +1569,9 @@ release_module_identity ()
     }
   GNUNET_array_grow (hosts_, sizeOfHosts_, 0);
   numberOfHosts_ = 0;
+  GNUNET_multi_hash_map_destroy (hostMap_);
+  hostMap_ = NULL;
+  memset (blacklistFilter_, 0, sizeof (blacklistFilter_));
 
   GNUNET_free (networkIdDirectory);
   networkIdDirectory = NULL;
@@ -0,0 +1,140 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file applications/identity/identityperf.c
+ * @brief Throughput of isBlacklisted with 100k known hosts
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "gnunet_util.h"
+#include "gnunet_identity_service.h"
+#include "gnunet_core.h"
+#include "core.h"
+
+#define HOSTS (100 * 1000)
+
+/**
+ * Blacklist every BLACKLIST_EVERY-th host.
+ */
+#define BLACKLIST_EVERY 100
+
+#define ROUNDS 10
+
+static struct GNUNET_CronManager *cron;
+
+static struct GNUNET_GC_Configuration *cfg;
+
+static void
+report (const char *what, GNUNET_CronTime start)
+{
+  GNUNET_CronTime delta;
+
+  delta = GNUNET_get_time () - start;
+  if (delta == 0)
+    delta = 1;
+  printf ("isBlacklisted (%s): %llu ops/s\n",
+          what, (unsigned long long) ROUNDS * HOSTS * 1000 / delta);
+}
+
+static int
+runTest ()
+{
+  GNUNET_Identity_ServiceAPI *identity;
+  GNUNET_PeerIdentity *known;
+  GNUNET_PeerIdentity *unknown;
+  GNUNET_CronTime start;
+  unsigned int hits;
+  int i;
+  int r;
+
+  identity = GNUNET_CORE_request_service ("identity");
+  if (identity == NULL)
+    return GNUNET_SYSERR;
+  known = GNUNET_malloc_large (HOSTS * sizeof (GNUNET_PeerIdentity));
+  unknown = GNUNET_malloc_large (HOSTS * sizeof (GNUNET_PeerIdentity));
+  start = GNUNET_get_time ();
+  for (i = 0; i < HOSTS; i++)
+    {
+      GNUNET_create_random_hash (&known[i].hashPubKey);
+      GNUNET_create_random_hash (&unknown[i].hashPubKey);
+      /* adds the host; trust 0 again so that nothing is stored */
+      identity->changeHostTrust (&known[i], 1);
+      identity->changeHostTrust (&known[i], -1);
+    }
+  printf ("Adding %u hosts took %llu ms\n", HOSTS,
+          GNUNET_get_time () - start);
+  for (i = 0; i < HOSTS; i += BLACKLIST_EVERY)
+    identity->blacklistHost (&known[i], 3600, GNUNET_YES);
+
+  hits = 0;
+  start = GNUNET_get_time ();
+  for (r = 0; r < ROUNDS; r++)
+    for (i = 0; i < HOSTS; i++)
+      if (GNUNET_YES == identity->isBlacklisted (&known[i], GNUNET_YES))
+        hits++;
+  report ("known hosts", start);
+  start = GNUNET_get_time ();
+  for (r = 0; r < ROUNDS; r++)
+    for (i = 0; i < HOSTS; i++)
+      if (GNUNET_YES == identity->isBlacklisted (&unknown[i], GNUNET_NO))
+        hits++;
+  report ("unknown hosts", start);
+
+  for (i = 0; i < HOSTS; i += BLACKLIST_EVERY)
+    identity->whitelistHost (&known[i]);
+  GNUNET_free (known);
+  GNUNET_free (unknown);
+  GNUNET_CORE_release_service (identity);
+  if (hits != ROUNDS * ((HOSTS + BLACKLIST_EVERY - 1) / BLACKLIST_EVERY))
+    {
+      printf ("Expected %u blacklisted hosts, found %u\n",
+              ROUNDS * ((HOSTS + BLACKLIST_EVERY - 1) / BLACKLIST_EVERY),
+              hits);
+      return GNUNET_SYSERR;
+    }
+  return GNUNET_OK;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int err;
+
+  GNUNET_disable_entropy_gathering ();
+  cfg = GNUNET_GC_create ();
+  if (-1 == GNUNET_GC_parse_configuration (cfg, "check.conf"))
+    {
+      GNUNET_GC_free (cfg);
+      return -1;
+    }
+  cron = GNUNET_cron_create (NULL);
+  GNUNET_CORE_init (NULL, cfg, cron, NULL);
+  err = 0;
+  if (GNUNET_OK != runTest ())
+    err = 1;
+  GNUNET_CORE_done ();
+  GNUNET_cron_destroy (cron);
+  GNUNET_GC_free (cfg);
+  return err;
+}
+
+/* end of identityperf.c */
@@ -1033,6 +1033,63 @@ update (unsigned long long vkey, int delta, GNUNET_CronTime expire)
 }
 
 
+/**
+ * Store several items (no native batch support, simply
+ * calls put for each of them).
+ *
+ * @return number of items stored, GNUNET_SYSERR on error
+ */
+static int
+put_many (unsigned int count,
+          const GNUNET_HashCode * keys,
+          const GNUNET_DatastoreValue * const *values, int *results)
+{
+  unsigned int i;
+  int done;
+  int ret;
+
+  done = 0;
+  for (i = 0; i < count; i++)
+    {
+      ret = put (&keys[i], values[i]);
+      if (ret == GNUNET_OK)
+        done++;
+      if (results != NULL)
+        results[i] = ret;
+    }
+  return done;
+}
+
+/**
+ * Iterate over the results for several keys (no native
+ * batch support, simply calls get for each of them).
+ *
+ * @return the number of results processed,
+ *         GNUNET_SYSERR on error
+ */
+static int
+get_many (unsigned int count,
+          const GNUNET_HashCode * keys,
+          const GNUNET_HashCode * vhashes,
+          unsigned int type, GNUNET_DatastoreValueIterator iter,
+          void *closure)
+{
+  unsigned int i;
+  int total;
+  int ret;
+
+  total = 0;
+  for (i = 0; i < count; i++)
+    {
+      ret = get (&keys[i],
+                 (vhashes == NULL) ? NULL : &vhashes[i], type, iter, closure);
+      if (ret == GNUNET_SYSERR)
+        return (total == 0) ? GNUNET_SYSERR : total;
+      total += ret;
+    }
+  return total;
+}
+
 /**
  * Get the current on-disk size of the SQ store.
  * Estimates are fine, if that's the only thing
@@ -1123,6 +1180,8 @@ provide_module_sqstore_mysql (GNUNET_CoreAPIForPlugins * capi)
   api.iterateAllNow = &iterateAllNow;
   api.drop = &drop;
   api.update = &update;
+  api.put_many = &put_many;
+  api.get_many = &get_many;
   return &api;
 }
 
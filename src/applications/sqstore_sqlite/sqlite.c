@@ -51,37 +51,52 @@
  */
 #define LOG_SQLITE(db, level, cmd) do { GNUNET_GE_LOG(ectx, level, _("`%s' failed at %s:%d with error: %s\n"), cmd, __FILE__, __LINE__, sqlite3_errmsg(db->dbh)); } while(0)
 
+/*
+ * Schema notes: 'hashkey' is the first 64 bit of 'hash' (in big
+ * endian, as a signed integer).  It is used for the primary lookup
+ * and as the tie-breaker in the iterations below, which keeps the
+ * indices small compared to indexing the full 512-bit hash.  The
+ * indices (see createIndices) are chosen such that each of the
+ * queries below can be answered by walking a single index in order.
+ */
+
 #define SELECT_IT_LOW_PRIORITY_1 \
-  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn080 WHERE (prio = ? AND hash > ?) "\
-  "ORDER BY hash ASC LIMIT 1"
+  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn090 WHERE (prio = ? AND hashkey > ?) "\
+  "ORDER BY hashkey ASC LIMIT 1"
 
 #define SELECT_IT_LOW_PRIORITY_2 \
-  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn080 WHERE (prio > ?) "\
-  "ORDER BY prio ASC, hash ASC LIMIT 1"
+  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn090 WHERE (prio > ?) "\
+  "ORDER BY prio ASC, hashkey ASC LIMIT 1"
 
 #define SELECT_IT_NON_ANONYMOUS_1 \
-  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn080 WHERE (prio = ? AND hash < ? AND anonLevel = 0) "\
-  " ORDER BY hash DESC LIMIT 1"
+  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn090 WHERE (prio = ? AND hashkey < ? AND anonLevel = 0) "\
+  " ORDER BY hashkey DESC LIMIT 1"
 
 #define SELECT_IT_NON_ANONYMOUS_2 \
-  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn080 WHERE (prio < ? AND anonLevel = 0)"\
-  " ORDER BY prio DESC, hash DESC LIMIT 1"
+  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn090 WHERE (prio < ? AND anonLevel = 0)"\
+  " ORDER BY prio DESC, hashkey DESC LIMIT 1"
 
 #define SELECT_IT_EXPIRATION_TIME_1 \
-  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn080 WHERE (expire = ? AND hash > ?) "\
-  " ORDER BY hash ASC LIMIT 1"
+  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn090 WHERE (expire = ? AND hashkey > ?) "\
+  " ORDER BY hashkey ASC LIMIT 1"
 
 #define SELECT_IT_EXPIRATION_TIME_2 \
-  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn080 WHERE (expire > ?) "\
-  " ORDER BY expire ASC, hash ASC LIMIT 1"
+  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn090 WHERE (expire > ?) "\
+  " ORDER BY expire ASC, hashkey ASC LIMIT 1"
 
 #define SELECT_IT_MIGRATION_ORDER_1 \
-  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn080 WHERE (expire = ? AND hash < ?) "\
-  " ORDER BY hash DESC LIMIT 1"
+  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn090 WHERE (expire = ? AND hashkey < ?) "\
+  " ORDER BY hashkey DESC LIMIT 1"
 
 #define SELECT_IT_MIGRATION_ORDER_2 \
-  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn080 WHERE (expire < ?) "\
-  " ORDER BY expire DESC, hash DESC LIMIT 1"
+  "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_ FROM gn090 WHERE (expire < ?) "\
+  " ORDER BY expire DESC, hashkey DESC LIMIT 1"
+
+/**
+ * How many rows should be moved per transaction when
+ * migrating from the gn080 table?
+ */
+#define MIGRATION_CHUNK_SIZE 4096
 
 /**
  * After how many ms "busy" should a DB operation fail for good?
@@ -117,6 +132,10 @@ typedef struct
   sqlite3_stmt *updPrio;
 
   sqlite3_stmt *insertContent;
+
+  sqlite3_stmt *selectByHash;
+
+  sqlite3_stmt *selectByHashVhash;
 } sqliteHandle;
 
 static GNUNET_Stats_ServiceAPI *stats;
@@ -165,25 +184,47 @@ sq_prepare (sqlite3 * dbh, const char *zSql,    /* SQL statement, UTF-8 encoded
 #define CHECK(a) if (! a) { fprintf(stderr, "%s\n", e); sqlite3_free(e); }
 #endif
 
+/**
+ * Compute the 'hashkey' column value for the given hash.
+ */
+static long long
+getHashKey (const GNUNET_HashCode * key)
+{
+  unsigned long long k;
+
+  memcpy (&k, key, sizeof (unsigned long long));
+  return (long long) GNUNET_ntohll (k);
+}
+
+/**
+ * SQL function "hashkey(hash)" (used to compute the
+ * hashkey column when migrating old tables).
+ */
+static void
+sqlite_hashkey (sqlite3_context * ctx, int argc, sqlite3_value ** argv)
+{
+  if ((argc != 1) ||
+      (sqlite3_value_bytes (argv[0]) != sizeof (GNUNET_HashCode)))
+    {
+      sqlite3_result_int64 (ctx, 0);
+      return;
+    }
+  sqlite3_result_int64 (ctx, getHashKey (sqlite3_value_blob (argv[0])));
+}
+
 static void
 createIndices (sqlite3 * dbh)
 {
   /* create indices */
   sqlite3_exec (dbh,
-                "CREATE INDEX idx_hash ON gn080 (hash)", NULL, NULL, ENULL);
-  sqlite3_exec (dbh,
-                "CREATE INDEX idx_hash_vhash ON gn080 (hash,vhash)", NULL,
-                NULL, ENULL);
-  sqlite3_exec (dbh, "CREATE INDEX idx_prio ON gn080 (prio)", NULL, NULL,
-                ENULL);
-  sqlite3_exec (dbh, "CREATE INDEX idx_expire ON gn080 (expire)", NULL, NULL,
+                "CREATE INDEX idx_hashkey ON gn090 (hashkey)", NULL, NULL,
                 ENULL);
-  sqlite3_exec (dbh, "CREATE INDEX idx_comb3 ON gn080 (prio,anonLevel)", NULL,
-                NULL, ENULL);
-  sqlite3_exec (dbh, "CREATE INDEX idx_comb4 ON gn080 (prio,hash,anonLevel)",
+  sqlite3_exec (dbh,
+                "CREATE INDEX idx_prio_hashkey ON gn090 (prio,hashkey,anonLevel)",
+                NULL, NULL, ENULL);
+  sqlite3_exec (dbh,
+                "CREATE INDEX idx_expire_hashkey ON gn090 (expire,hashkey)",
                 NULL, NULL, ENULL);
-  sqlite3_exec (dbh, "CREATE INDEX idx_comb7 ON gn080 (expire,hash)", NULL,
-                NULL, ENULL);
 }
 
 /**
@@ -240,19 +281,20 @@ getDBHandle ()
   /* We have to do it here, because otherwise precompiling SQL might fail */
   CHECK (SQLITE_OK ==
          sq_prepare (ret->dbh,
-                     "SELECT 1 FROM sqlite_master WHERE tbl_name = 'gn080'",
+                     "SELECT 1 FROM sqlite_master WHERE tbl_name = 'gn090'",
                      &stmt));
   if (sqlite3_step (stmt) == SQLITE_DONE)
     {
       if (sqlite3_exec (ret->dbh,
-                        "CREATE TABLE gn080 ("
+                        "CREATE TABLE gn090 ("
                         "  size INTEGER NOT NULL DEFAULT 0,"
                         "  type INTEGER NOT NULL DEFAULT 0,"
                         "  prio INTEGER NOT NULL DEFAULT 0,"
                         "  anonLevel INTEGER NOT NULL DEFAULT 0,"
                         "  expire INTEGER NOT NULL DEFAULT 0,"
-                        "  hash TEXT NOT NULL DEFAULT '',"
-                        "  vhash TEXT NOT NULL DEFAULT '',"
+                        "  hashkey INTEGER NOT NULL DEFAULT 0,"
+                        "  hash BLOB NOT NULL DEFAULT '',"
+                        "  vhash BLOB NOT NULL DEFAULT '',"
                         "  value BLOB NOT NULL DEFAULT '')", NULL, NULL,
                         NULL) != SQLITE_OK)
         {
@@ -290,14 +332,22 @@ getDBHandle ()
   sqlite3_finalize (stmt);
 
   if ((sq_prepare (ret->dbh,
-                   "UPDATE gn080 SET prio = prio + ?, expire = MAX(expire,?) WHERE "
+                   "UPDATE gn090 SET prio = prio + ?, expire = MAX(expire,?) WHERE "
                    "_ROWID_ = ?",
                    &ret->updPrio) != SQLITE_OK) ||
       (sq_prepare (ret->dbh,
-                   "INSERT INTO gn080 (size, type, prio, "
-                   "anonLevel, expire, hash, vhash, value) VALUES "
-                   "(?, ?, ?, ?, ?, ?, ?, ?)",
-                   &ret->insertContent) != SQLITE_OK))
+                   "INSERT INTO gn090 (size, type, prio, "
+                   "anonLevel, expire, hashkey, hash, vhash, value) VALUES "
+                   "(?, ?, ?, ?, ?, ?, ?, ?, ?)",
+                   &ret->insertContent) != SQLITE_OK) ||
+      (sq_prepare (ret->dbh,
+                   "SELECT size, type, prio, anonLevel, expire, hash, value, _ROWID_ "
+                   "FROM gn090 WHERE hashkey=? AND hash=?",
+                   &ret->selectByHash) != SQLITE_OK) ||
+      (sq_prepare (ret->dbh,
+                   "SELECT size, type, prio, anonLevel, expire, hash, value, _ROWID_ "
+                   "FROM gn090 WHERE hashkey=? AND hash=? AND vhash=?",
+                   &ret->selectByHashVhash) != SQLITE_OK))
     {
       LOG_SQLITE (ret,
                   GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
@@ -306,6 +356,10 @@ getDBHandle ()
         sqlite3_finalize (ret->updPrio);
       if (ret->insertContent != NULL)
         sqlite3_finalize (ret->insertContent);
+      if (ret->selectByHash != NULL)
+        sqlite3_finalize (ret->selectByHash);
+      if (ret->selectByHashVhash != NULL)
+        sqlite3_finalize (ret->selectByHashVhash);
       GNUNET_free (ret);
       return NULL;
     }
@@ -314,6 +368,132 @@ getDBHandle ()
   return ret;
 }
 
+/**
+ * Check if the database still contains the gn080 table
+ * (used by GNUnet 0.8.0 and earlier).
+ */
+static int
+hasOldTable (sqliteHandle * handle)
+{
+  sqlite3_stmt *stmt;
+  int ret;
+
+  if (sq_prepare (handle->dbh,
+                  "SELECT 1 FROM sqlite_master WHERE tbl_name = 'gn080'",
+                  &stmt) != SQLITE_OK)
+    {
+      LOG_SQLITE (handle,
+                  GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
+                  GNUNET_GE_BULK, "sq_prepare");
+      return GNUNET_NO;
+    }
+  ret = (sqlite3_step (stmt) == SQLITE_ROW) ? GNUNET_YES : GNUNET_NO;
+  sqlite3_finalize (stmt);
+  return ret;
+}
+
+/**
+ * Move all entries from the gn080 table to the gn090 table.
+ * The rows are moved in chunks (one transaction per chunk)
+ * so that the journal stays small and the migration can be
+ * interrupted and resumed at any time.
+ *
+ * @return GNUNET_OK on success (or if there was nothing
+ *         to migrate), GNUNET_SYSERR on error
+ */
+static int
+migrateOldTable (sqliteHandle * handle)
+{
+  sqlite3_stmt *ins;
+  sqlite3_stmt *del;
+  unsigned long long moved;
+  int changes;
+  int ret;
+
+  if (GNUNET_YES != hasOldTable (handle))
+    return GNUNET_OK;
+  if ((SQLITE_OK != sqlite3_create_function (handle->dbh,
+                                             "hashkey",
+                                             1,
+                                             SQLITE_UTF8,
+                                             NULL,
+                                             &sqlite_hashkey,
+                                             NULL, NULL)) ||
+      (sq_prepare (handle->dbh,
+                   "INSERT INTO gn090 (size, type, prio, anonLevel, expire, "
+                   "hashkey, hash, vhash, value) "
+                   "SELECT size, type, prio, anonLevel, expire, hashkey(hash), "
+                   "hash, vhash, value FROM gn080 ORDER BY _ROWID_ ASC LIMIT ?",
+                   &ins) != SQLITE_OK))
+    {
+      LOG_SQLITE (handle,
+                  GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
+                  GNUNET_GE_BULK, "sq_prepare");
+      return GNUNET_SYSERR;
+    }
+  if (sq_prepare (handle->dbh,
+                  "DELETE FROM gn080 WHERE _ROWID_ IN "
+                  "(SELECT _ROWID_ FROM gn080 ORDER BY _ROWID_ ASC LIMIT ?)",
+                  &del) != SQLITE_OK)
+    {
+      LOG_SQLITE (handle,
+                  GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
+                  GNUNET_GE_BULK, "sq_prepare");
+      sqlite3_finalize (ins);
+      return GNUNET_SYSERR;
+    }
+  GNUNET_GE_LOG (ectx,
+                 GNUNET_GE_INFO | GNUNET_GE_USER | GNUNET_GE_IMMEDIATE,
+                 _("Migrating SQLite datastore to new format "
+                   "(this may take a while).\n"));
+  ret = GNUNET_OK;
+  moved = 0;
+  do
+    {
+      changes = 0;
+      sqlite3_bind_int (ins, 1, MIGRATION_CHUNK_SIZE);
+      sqlite3_bind_int (del, 1, MIGRATION_CHUNK_SIZE);
+      if ((SQLITE_OK !=
+           sqlite3_exec (handle->dbh, "BEGIN", NULL, NULL, NULL)) ||
+          (SQLITE_DONE != sqlite3_step (ins)) ||
+          ((changes = sqlite3_changes (handle->dbh)) < 0) ||
+          (SQLITE_DONE != sqlite3_step (del)) ||
+          (SQLITE_OK !=
+           sqlite3_exec (handle->dbh, "COMMIT", NULL, NULL, NULL)))
+        {
+          LOG_SQLITE (handle,
+                      GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
+                      GNUNET_GE_BULK, "sqlite3_step");
+          sqlite3_exec (handle->dbh, "ROLLBACK", NULL, NULL, NULL);
+          ret = GNUNET_SYSERR;
+        }
+      sqlite3_reset (ins);
+      sqlite3_reset (del);
+      moved += changes;
+      if (changes > 0)
+        GNUNET_GE_LOG (ectx,
+                       GNUNET_GE_INFO | GNUNET_GE_USER | GNUNET_GE_IMMEDIATE,
+                       _("Migrated %llu entries.\n"), moved);
+    }
+  while ((ret == GNUNET_OK) && (changes > 0));
+  sqlite3_finalize (ins);
+  sqlite3_finalize (del);
+  if ((ret == GNUNET_OK) &&
+      (SQLITE_OK !=
+       sqlite3_exec (handle->dbh, "DROP TABLE gn080", NULL, NULL, NULL)))
+    {
+      LOG_SQLITE (handle,
+                  GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
+                  GNUNET_GE_BULK, "sqlite3_exec");
+      ret = GNUNET_SYSERR;
+    }
+  if (ret == GNUNET_OK)
+    GNUNET_GE_LOG (ectx,
+                   GNUNET_GE_INFO | GNUNET_GE_USER | GNUNET_GE_IMMEDIATE,
+                   _("Completed datastore migration.\n"));
+  return ret;
+}
+
 /**
  * @brief Returns the storage needed for the specfied int
  */
@@ -388,7 +568,7 @@ delete_by_rowid (sqliteHandle * handle, unsigned long long rid)
   sqlite3_stmt *stmt;
 
   if (sq_prepare (handle->dbh,
-                  "DELETE FROM gn080 WHERE _ROWID_ = ?", &stmt) != SQLITE_OK)
+                  "DELETE FROM gn090 WHERE _ROWID_ = ?", &stmt) != SQLITE_OK)
     {
       LOG_SQLITE (handle,
                   GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
@@ -409,7 +589,7 @@ delete_by_rowid (sqliteHandle * handle, unsigned long long rid)
 }
 
 /**
- * Given a full row from gn080 table (size,type,priority,anonLevel,expire,GNUNET_hash,value),
+ * Given a full row from gn090 table (size,type,priority,anonLevel,expire,GNUNET_hash,value),
  * assemble it into a GNUNET_DatastoreValue representation.
  */
 static GNUNET_DatastoreValue *
@@ -437,7 +617,7 @@ assembleDatum (sqliteHandle * handle, sqlite3_stmt * stmt,
         LOG_SQLITE (handle,
                     GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
                     GNUNET_GE_BULK, "sqlite3_reset");
-      if (sq_prepare (dbh, "DELETE FROM gn080 WHERE size < ?", &stmtd) !=
+      if (sq_prepare (dbh, "DELETE FROM gn090 WHERE size < ?", &stmtd) !=
           SQLITE_OK)
         {
           LOG_SQLITE (handle,
@@ -474,7 +654,7 @@ assembleDatum (sqliteHandle * handle, sqlite3_stmt * stmt,
                     GNUNET_GE_BULK, "sqlite3_reset");
       if (sq_prepare
           (dbh,
-           "DELETE FROM gn080 WHERE NOT ((LENGTH(hash) = ?) AND (size = LENGTH(value) + ?))",
+           "DELETE FROM gn090 WHERE NOT ((LENGTH(hash) = ?) AND (size = LENGTH(value) + ?))",
            &stmtd) != SQLITE_OK)
         {
           LOG_SQLITE (handle,
@@ -650,6 +830,7 @@ sqlite_iterate (unsigned int type,
   GNUNET_DatastoreValue *datum;
   unsigned int lastPrio;
   unsigned long long lastExp;
+  long long lastHashKey;
   GNUNET_HashCode key_1;
   GNUNET_HashCode key_2;
   GNUNET_HashCode key;
@@ -686,13 +867,13 @@ sqlite_iterate (unsigned int type,
     {
       lastPrio = 0;
       lastExp = 0;
-      memset (&key, 0, sizeof (GNUNET_HashCode));
+      lastHashKey = -0x7FFFFFFFFFFFFFFFLL - 1;
     }
   else
     {
       lastPrio = 0x7FFFFFFF;
       lastExp = 0x7FFFFFFFFFFFFFFFLL;
-      memset (&key, 255, sizeof (GNUNET_HashCode));
+      lastHashKey = 0x7FFFFFFFFFFFFFFFLL;
     }
   last_datum_2 = NULL;
   while (1)
@@ -707,8 +888,7 @@ sqlite_iterate (unsigned int type,
           sqlite3_bind_int64 (stmt_1, 1, lastExp);
           sqlite3_bind_int64 (stmt_2, 1, lastExp);
         }
-      sqlite3_bind_blob (stmt_1, 2, &key, sizeof (GNUNET_HashCode),
-                         SQLITE_TRANSIENT);
+      sqlite3_bind_int64 (stmt_1, 2, lastHashKey);
       now = GNUNET_get_time ();
       datum_1 = NULL;
       datum_2 = last_datum_2;
@@ -855,6 +1035,7 @@ sqlite_iterate (unsigned int type,
         }
       lastPrio = ntohl (datum->priority);
       lastExp = GNUNET_ntohll (datum->expiration_time);
+      lastHashKey = getHashKey (&key);
       GNUNET_free (datum);
     }
   sqlite3_finalize (stmt_1);
@@ -965,7 +1146,7 @@ iterateAllNow (GNUNET_DatastoreValueIterator iter, void *closure)
      http://permalink.gmane.org/gmane.network.gnunet.devel/1363 */
   if (sq_prepare (dbh,
                   "SELECT size,type,prio,anonLevel,expire,hash,value,_ROWID_"
-                  " FROM gn080 WHERE _ROWID_ > :1 ORDER BY _ROWID_ ASC LIMIT 1",
+                  " FROM gn090 WHERE _ROWID_ > :1 ORDER BY _ROWID_ ASC LIMIT 1",
                   &stmt) != SQLITE_OK)
     {
       LOG_SQLITE (handle,
@@ -1057,6 +1238,8 @@ sqlite_shutdown ()
       GNUNET_thread_release_self (h->tid);
       sqlite3_finalize (h->updPrio);
       sqlite3_finalize (h->insertContent);
+      sqlite3_finalize (h->selectByHash);
+      sqlite3_finalize (h->selectByHashVhash);
       if (sqlite3_close (h->dbh) != SQLITE_OK)
         LOG_SQLITE (h,
                     GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
@@ -1126,10 +1309,9 @@ get (const GNUNET_HashCode * key,
   dbh = handle->dbh;
 
   GNUNET_snprintf (scratch, 256,
-                   "SELECT count(*) FROM gn080 WHERE hash=:1%s%s",
-                   vhash == NULL ? "" : " AND vhash=:2",
-                   type == 0 ? "" : (vhash ==
-                                     NULL) ? " AND type=:2" : " AND type=:3");
+                   "SELECT count(*) FROM gn090 WHERE hashkey=? AND hash=?%s%s",
+                   vhash == NULL ? "" : " AND vhash=?",
+                   type == 0 ? "" : " AND type=?");
   if (sq_prepare (dbh, scratch, &stmt) != SQLITE_OK)
     {
       LOG_SQLITE (handle,
@@ -1139,9 +1321,11 @@ get (const GNUNET_HashCode * key,
       return GNUNET_SYSERR;
     }
   sqoff = 1;
-  ret = sqlite3_bind_blob (stmt,
-                           sqoff++,
-                           key, sizeof (GNUNET_HashCode), SQLITE_TRANSIENT);
+  ret = sqlite3_bind_int64 (stmt, sqoff++, getHashKey (key));
+  if (ret == SQLITE_OK)
+    ret = sqlite3_bind_blob (stmt,
+                             sqoff++,
+                             key, sizeof (GNUNET_HashCode), SQLITE_TRANSIENT);
   if ((vhash != NULL) && (ret == SQLITE_OK))
     ret = sqlite3_bind_blob (stmt,
                              sqoff++,
@@ -1183,12 +1367,10 @@ get (const GNUNET_HashCode * key,
 
   GNUNET_snprintf (scratch, 256,
                    "SELECT size, type, prio, anonLevel, expire, hash, value, _ROWID_ "
-                   "FROM gn080 WHERE hash=:1%s%s AND _ROWID_ >= :%d "
-                   "ORDER BY _ROWID_ ASC LIMIT 1 OFFSET :d",
-                   vhash == NULL ? "" : " AND vhash=:2",
-                   type == 0 ? "" : (vhash ==
-                                     NULL) ? " AND type=:2" : " AND type=:3",
-                   sqoff, sqoff + 1);
+                   "FROM gn090 WHERE hashkey=? AND hash=?%s%s AND _ROWID_ >= ? "
+                   "ORDER BY _ROWID_ ASC LIMIT 1 OFFSET ?",
+                   vhash == NULL ? "" : " AND vhash=?",
+                   type == 0 ? "" : " AND type=?");
   if (sq_prepare (dbh, scratch, &stmt) != SQLITE_OK)
     {
       LOG_SQLITE (handle,
@@ -1207,10 +1389,12 @@ get (const GNUNET_HashCode * key,
       else
         limit_off = 0;
       sqoff = 1;
-      ret = sqlite3_bind_blob (stmt,
-                               sqoff++,
-                               key, sizeof (GNUNET_HashCode),
-                               SQLITE_TRANSIENT);
+      ret = sqlite3_bind_int64 (stmt, sqoff++, getHashKey (key));
+      if (ret == SQLITE_OK)
+        ret = sqlite3_bind_blob (stmt,
+                                 sqoff++,
+                                 key, sizeof (GNUNET_HashCode),
+                                 SQLITE_TRANSIENT);
       if ((vhash != NULL) && (ret == SQLITE_OK))
         ret = sqlite3_bind_blob (stmt,
                                  sqoff++,
@@ -1268,13 +1452,15 @@ get (const GNUNET_HashCode * key,
 }
 
 /**
- * Write content to the db.  Always adds a new record
- * (does NOT overwrite existing data).
+ * Write content to the db using the precompiled insert
+ * statement of the given handle.  Caller must hold the lock.
  *
  * @return GNUNET_SYSERR on error, GNUNET_NO on temporary error, GNUNET_OK if ok.
  */
 static int
-put (const GNUNET_HashCode * key, const GNUNET_DatastoreValue * value)
+insertContent (sqliteHandle * dbh,
+               const GNUNET_HashCode * key,
+               const GNUNET_DatastoreValue * value)
 {
   int n;
   sqlite3_stmt *stmt;
@@ -1282,7 +1468,6 @@ put (const GNUNET_HashCode * key, const GNUNET_DatastoreValue * value)
   unsigned int size, type, prio, anon;
   unsigned long long expir;
   GNUNET_HashCode vhash;
-  sqliteHandle *dbh;
 #if DEBUG_SQLITE
   GNUNET_EncName enc;
 
@@ -1306,24 +1491,21 @@ put (const GNUNET_HashCode * key, const GNUNET_DatastoreValue * value)
   expir = GNUNET_ntohll (value->expiration_time);
   contentSize = size - sizeof (GNUNET_DatastoreValue);
   GNUNET_hash (&value[1], contentSize, &vhash);
-  GNUNET_mutex_lock (lock);
-  dbh = getDBHandle ();
-  if (lastSync > 1000)
-    syncStats (dbh);
   stmt = dbh->insertContent;
   if ((SQLITE_OK != sqlite3_bind_int (stmt, 1, size)) ||
       (SQLITE_OK != sqlite3_bind_int (stmt, 2, type)) ||
       (SQLITE_OK != sqlite3_bind_int (stmt, 3, prio)) ||
       (SQLITE_OK != sqlite3_bind_int (stmt, 4, anon)) ||
       (SQLITE_OK != sqlite3_bind_int64 (stmt, 5, expir)) ||
+      (SQLITE_OK != sqlite3_bind_int64 (stmt, 6, getHashKey (key))) ||
       (SQLITE_OK !=
-       sqlite3_bind_blob (stmt, 6, key, sizeof (GNUNET_HashCode),
+       sqlite3_bind_blob (stmt, 7, key, sizeof (GNUNET_HashCode),
                           SQLITE_TRANSIENT)) ||
       (SQLITE_OK !=
-       sqlite3_bind_blob (stmt, 7, &vhash, sizeof (GNUNET_HashCode),
+       sqlite3_bind_blob (stmt, 8, &vhash, sizeof (GNUNET_HashCode),
                           SQLITE_TRANSIENT))
       || (SQLITE_OK !=
-          sqlite3_bind_blob (stmt, 8, &value[1], contentSize,
+          sqlite3_bind_blob (stmt, 9, &value[1], contentSize,
                              SQLITE_TRANSIENT)))
     {
       LOG_SQLITE (dbh,
@@ -1333,7 +1515,6 @@ put (const GNUNET_HashCode * key, const GNUNET_DatastoreValue * value)
         LOG_SQLITE (dbh,
                     GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
                     GNUNET_GE_BULK, "sqlite3_reset");
-      GNUNET_mutex_unlock (lock);
       return GNUNET_SYSERR;
     }
 
@@ -1343,7 +1524,6 @@ put (const GNUNET_HashCode * key, const GNUNET_DatastoreValue * value)
       if (n == SQLITE_BUSY)
         {
           sqlite3_reset (stmt);
-          GNUNET_mutex_unlock (lock);
           GNUNET_GE_BREAK (NULL, 0);
           return GNUNET_NO;
         }
@@ -1351,7 +1531,6 @@ put (const GNUNET_HashCode * key, const GNUNET_DatastoreValue * value)
                   GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
                   GNUNET_GE_BULK, "sqlite3_step");
       sqlite3_reset (stmt);
-      GNUNET_mutex_unlock (lock);
       return GNUNET_SYSERR;
     }
   if (SQLITE_OK != sqlite3_reset (stmt))
@@ -1365,10 +1544,240 @@ put (const GNUNET_HashCode * key, const GNUNET_DatastoreValue * value)
                  GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_USER,
                  "SQLite: done writing content\n");
 #endif
-  GNUNET_mutex_unlock (lock);
   return GNUNET_OK;
 }
 
+/**
+ * Write content to the db.  Always adds a new record
+ * (does NOT overwrite existing data).
+ *
+ * @return GNUNET_SYSERR on error, GNUNET_NO on temporary error, GNUNET_OK if ok.
+ */
+static int
+put (const GNUNET_HashCode * key, const GNUNET_DatastoreValue * value)
+{
+  sqliteHandle *dbh;
+  int ret;
+
+  GNUNET_mutex_lock (lock);
+  dbh = getDBHandle ();
+  if (lastSync > 1000)
+    syncStats (dbh);
+  ret = insertContent (dbh, key, value);
+  GNUNET_mutex_unlock (lock);
+  return ret;
+}
+
+/**
+ * Write several records to the db in a single transaction.
+ * Always adds new records (does NOT overwrite existing data).
+ *
+ * @param results maybe NULL, otherwise set to the
+ *        result of the individual insert operations
+ * @return number of records written, GNUNET_SYSERR on error
+ */
+static int
+put_many (unsigned int count,
+          const GNUNET_HashCode * keys,
+          const GNUNET_DatastoreValue * const *values, int *results)
+{
+  sqliteHandle *dbh;
+  unsigned long long old_payload;
+  unsigned int old_sync;
+  unsigned int i;
+  int ret;
+  int done;
+
+  GNUNET_mutex_lock (lock);
+  dbh = getDBHandle ();
+  if (lastSync > 1000)
+    syncStats (dbh);
+  if (SQLITE_OK != sqlite3_exec (dbh->dbh, "BEGIN", NULL, NULL, NULL))
+    {
+      LOG_SQLITE (dbh,
+                  GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
+                  GNUNET_GE_BULK, "sqlite3_exec");
+      GNUNET_mutex_unlock (lock);
+      return GNUNET_SYSERR;
+    }
+  old_payload = payload;
+  old_sync = lastSync;
+  done = 0;
+  for (i = 0; i < count; i++)
+    {
+      ret = insertContent (dbh, &keys[i], values[i]);
+      if (ret == GNUNET_OK)
+        done++;
+      if (results != NULL)
+        results[i] = ret;
+    }
+  if (SQLITE_OK != sqlite3_exec (dbh->dbh, "COMMIT", NULL, NULL, NULL))
+    {
+      LOG_SQLITE (dbh,
+                  GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
+                  GNUNET_GE_BULK, "sqlite3_exec");
+      sqlite3_exec (dbh->dbh, "ROLLBACK", NULL, NULL, NULL);
+      payload = old_payload;
+      lastSync = old_sync;
+      if (results != NULL)
+        for (i = 0; i < count; i++)
+          results[i] = GNUNET_SYSERR;
+      GNUNET_mutex_unlock (lock);
+      return GNUNET_SYSERR;
+    }
+  GNUNET_mutex_unlock (lock);
+  return done;
+}
+
+/**
+ * Result of a get_many lookup that still needs to be
+ * passed to the iterator.
+ */
+struct ManyResult
+{
+  GNUNET_HashCode key;
+
+  GNUNET_DatastoreValue *value;
+
+  unsigned long long rowid;
+};
+
+/**
+ * Iterate over all entries matching any of the given keys (and
+ * optionally value hashes) and the given type.  All matching rows
+ * are read in a single transaction using the precompiled statements;
+ * the iterator is called after the database lock has been released.
+ *
+ * @return the number of results processed,
+ *         GNUNET_SYSERR on error
+ */
+static int
+get_many (unsigned int count,
+          const GNUNET_HashCode * keys,
+          const GNUNET_HashCode * vhashes,
+          unsigned int type, GNUNET_DatastoreValueIterator iter,
+          void *closure)
+{
+  sqliteHandle *handle;
+  sqlite3_stmt *stmt;
+  struct ManyResult *results;
+  unsigned int result_count;
+  unsigned int result_size;
+  unsigned int processed;
+  GNUNET_DatastoreValue *datum;
+  GNUNET_HashCode rkey;
+  unsigned long long rowid;
+  unsigned int i;
+  int ret;
+  int n;
+
+  if (count == 0)
+    return 0;
+  results = NULL;
+  result_count = 0;
+  result_size = 0;
+  ret = GNUNET_OK;
+  GNUNET_mutex_lock (lock);
+  handle = getDBHandle ();
+  if (SQLITE_OK != sqlite3_exec (handle->dbh, "BEGIN", NULL, NULL, NULL))
+    {
+      LOG_SQLITE (handle,
+                  GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
+                  GNUNET_GE_BULK, "sqlite3_exec");
+      GNUNET_mutex_unlock (lock);
+      return GNUNET_SYSERR;
+    }
+  stmt = (vhashes == NULL) ? handle->selectByHash : handle->selectByHashVhash;
+  for (i = 0; (i < count) && (ret == GNUNET_OK); i++)
+    {
+      if ((SQLITE_OK !=
+           sqlite3_bind_int64 (stmt, 1, getHashKey (&keys[i]))) ||
+          (SQLITE_OK !=
+           sqlite3_bind_blob (stmt, 2, &keys[i], sizeof (GNUNET_HashCode),
+                              SQLITE_TRANSIENT)) ||
+          ((vhashes != NULL) &&
+           (SQLITE_OK !=
+            sqlite3_bind_blob (stmt, 3, &vhashes[i],
+                               sizeof (GNUNET_HashCode), SQLITE_TRANSIENT))))
+        {
+          LOG_SQLITE (handle,
+                      GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
+                      GNUNET_GE_BULK, "sqlite3_bind_XXXX");
+          ret = GNUNET_SYSERR;
+          break;
+        }
+      while (SQLITE_ROW == (n = sqlite3_step (stmt)))
+        {
+          if ((type != 0) && (sqlite3_column_int (stmt, 1) != type))
+            continue;
+          datum = assembleDatum (handle, stmt, &rkey, &rowid);
+          if (datum == NULL)
+            {
+              n = SQLITE_DONE;  /* invalid data, statement was reset */
+              break;
+            }
+          if (iter == NULL)
+            {
+              GNUNET_free (datum);
+              result_count++;
+              continue;
+            }
+          if (result_count == result_size)
+            GNUNET_array_grow (results, result_size,
+                               (result_size == 0) ? 16 : result_size * 2);
+          results[result_count].key = rkey;
+          results[result_count].value = datum;
+          results[result_count].rowid = rowid;
+          result_count++;
+        }
+      if (n != SQLITE_DONE)
+        {
+          LOG_SQLITE (handle,
+                      GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
+                      GNUNET_GE_BULK, "sqlite3_step");
+          ret = GNUNET_SYSERR;
+        }
+      sqlite3_reset (stmt);
+    }
+  if (SQLITE_OK != sqlite3_exec (handle->dbh, "COMMIT", NULL, NULL, NULL))
+    {
+      LOG_SQLITE (handle,
+                  GNUNET_GE_ERROR | GNUNET_GE_ADMIN | GNUNET_GE_USER |
+                  GNUNET_GE_BULK, "sqlite3_exec");
+      sqlite3_exec (handle->dbh, "ROLLBACK", NULL, NULL, NULL);
+    }
+  GNUNET_mutex_unlock (lock);
+  if (ret == GNUNET_SYSERR)
+    {
+      for (i = 0; i < result_count; i++)
+        GNUNET_free (results[i].value);
+      GNUNET_array_grow (results, result_size, 0);
+      return GNUNET_SYSERR;
+    }
+  if (iter == NULL)
+    return result_count;
+  processed = 0;
+  for (i = 0; i < result_count; i++)
+    {
+      if (ret != GNUNET_SYSERR)
+        {
+          processed++;
+          ret = iter (&results[i].key, results[i].value, closure,
+                      results[i].rowid);
+          if (ret == GNUNET_NO)
+            {
+              GNUNET_mutex_lock (lock);
+              payload -= getContentDatastoreSize (results[i].value);
+              delete_by_rowid (getDBHandle (), results[i].rowid);
+              GNUNET_mutex_unlock (lock);
+            }
+        }
+      GNUNET_free (results[i].value);
+    }
+  GNUNET_array_grow (results, result_size, 0);
+  return processed;
+}
+
 /**
  * Update the priority for a particular key
  * in the datastore.
@@ -1454,6 +1863,16 @@ provide_module_sqstore_sqlite (GNUNET_CoreAPIForPlugins * capi)
       return NULL;
     }
 
+  /* the migration is done by gnunet-update (which gnunetd
+     insists on after an upgrade); it is resumable, so an
+     interrupted one just needs to be run again */
+  if (GNUNET_YES == hasOldTable (dbh))
+    GNUNET_GE_LOG (ectx,
+                   GNUNET_GE_WARNING | GNUNET_GE_IMMEDIATE | GNUNET_GE_USER |
+                   GNUNET_GE_ADMIN,
+                   _
+                   ("SQLite datastore was not fully migrated to the new format, content in the old format is not available until you run `%s'.\n"),
+                   "gnunet-update");
   payload = getStat (dbh, "PAYLOAD");
   if (payload == GNUNET_SYSERR)
     {
@@ -1487,6 +1906,8 @@ provide_module_sqstore_sqlite (GNUNET_CoreAPIForPlugins * capi)
   api.iterateAllNow = &iterateAllNow;
   api.drop = &drop;
   api.update = &update;
+  api.put_many = &put_many;
+  api.get_many = &get_many;
   return &api;
 }
 
@@ -1514,7 +1935,8 @@ release_module_sqstore_sqlite ()
 /**
  * Update sqlite database module.
  *
- * Currently only makes sure that the sqlite indices are created.
+ * Migrates the content from the old (gn080) table to the current
+ * schema and makes sure that the sqlite indices are created.
  */
 void
 update_module_sqstore_sqlite (GNUNET_UpdateAPI * uapi)
@@ -1523,6 +1945,7 @@ update_module_sqstore_sqlite (GNUNET_UpdateAPI * uapi)
   char *dir;
   char *afsdir;
 
+  ectx = uapi->ectx;
   payload = 0;
   lastSync = 0;
   afsdir = NULL;
@@ -1531,16 +1954,23 @@ update_module_sqstore_sqlite (GNUNET_UpdateAPI * uapi)
                                               "DIR",
                                               GNUNET_DEFAULT_DAEMON_VAR_DIRECTORY
                                               "/data/fs/", &afsdir);
-  dir = GNUNET_malloc (strlen (afsdir) + 8 + 2);        /* 8 = "content/" */
+  dir = GNUNET_malloc (strlen (afsdir) + strlen ("/content/gnunet.dat") + 2);
   strcpy (dir, afsdir);
-  strcat (dir, "/content/");
+  strcat (dir, "/content/gnunet.dat");
   GNUNET_free (afsdir);
-  if (GNUNET_OK != GNUNET_disk_directory_create (ectx, dir))
+  if (GNUNET_OK != GNUNET_disk_directory_create_for_file (ectx, dir))
     {
       GNUNET_free (dir);
       return;
     }
-  fn = dir;
+  fn = GNUNET_convert_string_to_utf8 (ectx, dir, strlen (dir),
+#ifdef ENABLE_NLS
+                                      nl_langinfo (CODESET)
+#else
+                                      "UTF-8"   /* good luck */
+#endif
+    );
+  GNUNET_free (dir);
   lock = GNUNET_mutex_create (GNUNET_NO);
   dbh = getDBHandle ();
   if (dbh == NULL)
@@ -1550,6 +1980,13 @@ update_module_sqstore_sqlite (GNUNET_UpdateAPI * uapi)
       fn = NULL;
       return;
     }
+  if (GNUNET_OK != migrateOldTable (dbh))
+    GNUNET_GE_LOG (ectx,
+                   GNUNET_GE_ERROR | GNUNET_GE_IMMEDIATE | GNUNET_GE_USER |
+                   GNUNET_GE_ADMIN,
+                   _
+                   ("Failed to migrate SQLite datastore to the new format, run `%s' to try again.\n"),
+                   "gnunet-update");
   createIndices (dbh->dbh);
   sqlite_shutdown ();
   GNUNET_mutex_destroy (lock);
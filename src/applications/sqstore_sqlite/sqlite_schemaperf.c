@@ -0,0 +1,301 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+/*
+ * @file applications/sqstore_sqlite/sqlite_schemaperf.c
+ * @brief Benchmark comparing the old (gn080) and the current (gn090)
+ *        layout of the sqlite datastore.
+ * @author Christian Grothoff
+ *
+ * For each schema, this benchmark inserts a number of blocks (in
+ * transactions of the size used by the datastore's write-behind
+ * buffer), then measures the latency of lookups by key and finally
+ * reports the size of the database file.  The number of blocks can
+ * be given on the command line; the default is small enough for
+ * "make check", use "sqlite_schemaperf_test 10000000" for a full-scale
+ * comparison.
+ *
+ * The table definitions must be kept in sync with sqlite.c.
+ */
+
+#include "platform.h"
+#include "gnunet_util.h"
+#include <sqlite3.h>
+
+#define DB_DIR "/tmp/gnunet-sqlite-schemaperf/"
+
+/**
+ * Default number of blocks to insert.
+ */
+#define DEFAULT_BLOCKS 10000
+
+/**
+ * Size of the payload of each block.
+ */
+#define BLOCK_SIZE 1024
+
+/**
+ * Number of blocks per transaction.
+ */
+#define BATCH_SIZE 64
+
+/**
+ * Number of lookups to time.
+ */
+#define LOOKUPS 2000
+
+struct Schema
+{
+  const char *name;
+
+  const char *create;
+
+  const char *indices[8];
+
+  const char *insert;
+
+  const char *lookup;
+
+  /**
+   * Does the schema have a hashkey column?
+   */
+  int use_hashkey;
+};
+
+static struct Schema schemas[] = {
+  {"gn080",
+   "CREATE TABLE gn080 ("
+   "  size INTEGER NOT NULL DEFAULT 0,"
+   "  type INTEGER NOT NULL DEFAULT 0,"
+   "  prio INTEGER NOT NULL DEFAULT 0,"
+   "  anonLevel INTEGER NOT NULL DEFAULT 0,"
+   "  expire INTEGER NOT NULL DEFAULT 0,"
+   "  hash TEXT NOT NULL DEFAULT '',"
+   "  vhash TEXT NOT NULL DEFAULT '',"
+   "  value BLOB NOT NULL DEFAULT '')",
+   {"CREATE INDEX idx_hash ON gn080 (hash)",
+    "CREATE INDEX idx_hash_vhash ON gn080 (hash,vhash)",
+    "CREATE INDEX idx_prio ON gn080 (prio)",
+    "CREATE INDEX idx_expire ON gn080 (expire)",
+    "CREATE INDEX idx_comb3 ON gn080 (prio,anonLevel)",
+    "CREATE INDEX idx_comb4 ON gn080 (prio,hash,anonLevel)",
+    "CREATE INDEX idx_comb7 ON gn080 (expire,hash)",
+    NULL},
+   "INSERT INTO gn080 (size, type, prio, anonLevel, expire, hash, vhash, value)"
+   " VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+   "SELECT size, type, prio, anonLevel, expire, hash, value, _ROWID_ "
+   "FROM gn080 WHERE hash=?",
+   GNUNET_NO},
+  {"gn090",
+   "CREATE TABLE gn090 ("
+   "  size INTEGER NOT NULL DEFAULT 0,"
+   "  type INTEGER NOT NULL DEFAULT 0,"
+   "  prio INTEGER NOT NULL DEFAULT 0,"
+   "  anonLevel INTEGER NOT NULL DEFAULT 0,"
+   "  expire INTEGER NOT NULL DEFAULT 0,"
+   "  hashkey INTEGER NOT NULL DEFAULT 0,"
+   "  hash BLOB NOT NULL DEFAULT '',"
+   "  vhash BLOB NOT NULL DEFAULT '',"
+   "  value BLOB NOT NULL DEFAULT '')",
+   {"CREATE INDEX idx_hashkey ON gn090 (hashkey)",
+    "CREATE INDEX idx_prio_hashkey ON gn090 (prio,hashkey,anonLevel)",
+    "CREATE INDEX idx_expire_hashkey ON gn090 (expire,hashkey)",
+    NULL},
+   "INSERT INTO gn090 (size, type, prio, anonLevel, expire, hashkey, hash, vhash, value)"
+   " VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)",
+   "SELECT size, type, prio, anonLevel, expire, hash, value, _ROWID_ "
+   "FROM gn090 WHERE hashkey=? AND hash=?",
+   GNUNET_YES},
+  {NULL, NULL, {NULL}, NULL, NULL, GNUNET_NO},
+};
+
+static long long
+getHashKey (const GNUNET_HashCode * key)
+{
+  unsigned long long k;
+
+  memcpy (&k, key, sizeof (unsigned long long));
+  return (long long) GNUNET_ntohll (k);
+}
+
+/**
+ * Compute the key of the i-th block (deterministic so that
+ * we do not have to keep all keys in memory).
+ */
+static void
+makeKey (unsigned int i, GNUNET_HashCode * key)
+{
+  GNUNET_hash (&i, sizeof (unsigned int), key);
+}
+
+static int
+insertBlocks (sqlite3 * dbh, struct Schema *schema, unsigned int blocks)
+{
+  sqlite3_stmt *stmt;
+  GNUNET_HashCode key;
+  GNUNET_HashCode vhash;
+  char value[BLOCK_SIZE];
+  unsigned int i;
+  int off;
+
+  if (SQLITE_OK != sqlite3_prepare (dbh, schema->insert, -1, &stmt, NULL))
+    return GNUNET_SYSERR;
+  for (i = 0; i < blocks; i++)
+    {
+      if ((i % BATCH_SIZE) == 0)
+        sqlite3_exec (dbh, "BEGIN", NULL, NULL, NULL);
+      makeKey (i, &key);
+      memset (value, i, BLOCK_SIZE);
+      memcpy (value, &key, sizeof (GNUNET_HashCode));
+      GNUNET_hash (value, BLOCK_SIZE, &vhash);
+      off = 1;
+      sqlite3_bind_int (stmt, off++, BLOCK_SIZE);
+      sqlite3_bind_int (stmt, off++, 1);
+      sqlite3_bind_int (stmt, off++, GNUNET_random_u32
+                        (GNUNET_RANDOM_QUALITY_WEAK, 1000));
+      sqlite3_bind_int (stmt, off++, 1);
+      sqlite3_bind_int64 (stmt, off++, GNUNET_random_u64
+                          (GNUNET_RANDOM_QUALITY_WEAK,
+                           1000 * GNUNET_CRON_DAYS));
+      if (schema->use_hashkey)
+        sqlite3_bind_int64 (stmt, off++, getHashKey (&key));
+      sqlite3_bind_blob (stmt, off++, &key, sizeof (GNUNET_HashCode),
+                         SQLITE_TRANSIENT);
+      sqlite3_bind_blob (stmt, off++, &vhash, sizeof (GNUNET_HashCode),
+                         SQLITE_TRANSIENT);
+      sqlite3_bind_blob (stmt, off++, value, BLOCK_SIZE, SQLITE_TRANSIENT);
+      if (SQLITE_DONE != sqlite3_step (stmt))
+        {
+          fprintf (stderr, "Insert failed: %s\n", sqlite3_errmsg (dbh));
+          sqlite3_finalize (stmt);
+          return GNUNET_SYSERR;
+        }
+      sqlite3_reset (stmt);
+      if (((i + 1) % BATCH_SIZE) == 0)
+        sqlite3_exec (dbh, "COMMIT", NULL, NULL, NULL);
+    }
+  if ((blocks % BATCH_SIZE) != 0)
+    sqlite3_exec (dbh, "COMMIT", NULL, NULL, NULL);
+  sqlite3_finalize (stmt);
+  return GNUNET_OK;
+}
+
+static int
+lookupBlocks (sqlite3 * dbh, struct Schema *schema, unsigned int blocks)
+{
+  sqlite3_stmt *stmt;
+  GNUNET_HashCode key;
+  unsigned int i;
+  int off;
+  int found;
+
+  if (SQLITE_OK != sqlite3_prepare (dbh, schema->lookup, -1, &stmt, NULL))
+    return GNUNET_SYSERR;
+  found = 0;
+  for (i = 0; i < LOOKUPS; i++)
+    {
+      makeKey (GNUNET_random_u32 (GNUNET_RANDOM_QUALITY_WEAK, blocks), &key);
+      off = 1;
+      if (schema->use_hashkey)
+        sqlite3_bind_int64 (stmt, off++, getHashKey (&key));
+      sqlite3_bind_blob (stmt, off++, &key, sizeof (GNUNET_HashCode),
+                         SQLITE_TRANSIENT);
+      while (SQLITE_ROW == sqlite3_step (stmt))
+        found++;
+      sqlite3_reset (stmt);
+    }
+  sqlite3_finalize (stmt);
+  return (found == LOOKUPS) ? GNUNET_OK : GNUNET_SYSERR;
+}
+
+static int
+test (struct Schema *schema, unsigned int blocks)
+{
+  sqlite3 *dbh;
+  char fn[128];
+  unsigned long long size;
+  GNUNET_CronTime start;
+  GNUNET_CronTime insert_time;
+  GNUNET_CronTime lookup_time;
+  unsigned int i;
+  int ret;
+
+  GNUNET_snprintf (fn, sizeof (fn), "%s%s.db", DB_DIR, schema->name);
+  UNLINK (fn);
+  if (SQLITE_OK != sqlite3_open (fn, &dbh))
+    return GNUNET_SYSERR;
+  sqlite3_exec (dbh, "PRAGMA temp_store=MEMORY", NULL, NULL, NULL);
+  sqlite3_exec (dbh, "PRAGMA synchronous=OFF", NULL, NULL, NULL);
+  sqlite3_exec (dbh, "PRAGMA count_changes=OFF", NULL, NULL, NULL);
+  sqlite3_exec (dbh, "PRAGMA page_size=4092", NULL, NULL, NULL);
+  sqlite3_exec (dbh, schema->create, NULL, NULL, NULL);
+  for (i = 0; schema->indices[i] != NULL; i++)
+    sqlite3_exec (dbh, schema->indices[i], NULL, NULL, NULL);
+
+  start = GNUNET_get_time ();
+  ret = insertBlocks (dbh, schema, blocks);
+  insert_time = GNUNET_get_time () - start;
+  if (ret == GNUNET_OK)
+    {
+      start = GNUNET_get_time ();
+      ret = lookupBlocks (dbh, schema, blocks);
+      lookup_time = GNUNET_get_time () - start;
+    }
+  sqlite3_close (dbh);
+  if (ret != GNUNET_OK)
+    {
+      fprintf (stderr, "Benchmark for schema `%s' failed.\n", schema->name);
+      UNLINK (fn);
+      return GNUNET_SYSERR;
+    }
+  size = 0;
+  GNUNET_disk_file_size (NULL, fn, &size, GNUNET_NO);
+  printf ("%s: %u blocks, %llu inserts/s, %llu us/lookup, %llu bytes on disk (%llu bytes/block)\n",
+          schema->name,
+          blocks,
+          (unsigned long long) blocks * GNUNET_CRON_SECONDS / (insert_time +
+                                                               1),
+          lookup_time * 1000 / LOOKUPS, size, size / blocks);
+  UNLINK (fn);
+  return GNUNET_OK;
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned int blocks;
+  unsigned int i;
+  int ret;
+
+  blocks = DEFAULT_BLOCKS;
+  if ((argc > 1) && ((1 != sscanf (argv[1], "%u", &blocks)) || (blocks == 0)))
+    {
+      fprintf (stderr, "Usage: %s [BLOCKS]\n", argv[0]);
+      return 1;
+    }
+  GNUNET_disk_directory_create (NULL, DB_DIR);
+  ret = 0;
+  for (i = 0; schemas[i].name != NULL; i++)
+    if (GNUNET_OK != test (&schemas[i], blocks))
+      ret = 1;
+  GNUNET_disk_directory_remove (NULL, DB_DIR);
+  return ret;
+}
+
+/* end of sqlite_schemaperf.c */
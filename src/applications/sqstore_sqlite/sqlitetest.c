@@ -156,8 +156,13 @@ static int
 test (GNUNET_SQstore_ServiceAPI * api)
 {
   GNUNET_DatastoreValue *value;
+  GNUNET_DatastoreValue *values[16];
   GNUNET_HashCode key;
+  GNUNET_HashCode keys[16];
+  GNUNET_HashCode vhashes[16];
+  int results[16];
   unsigned long long oldSize;
+  int ret;
   int i;
 
   now = 1000000;
@@ -249,6 +254,31 @@ test (GNUNET_SQstore_ServiceAPI * api)
                               api));
   ASSERT (0 ==
           api->iterateExpirationTime (GNUNET_ECRS_BLOCKTYPE_ANY, NULL, NULL));
+
+  /* test batch operations */
+  for (i = 0; i < 16; i++)
+    {
+      values[i] = initValue (i);
+      memset (&keys[i], 256 - i, sizeof (GNUNET_HashCode));
+      GNUNET_hash (&values[i][1],
+                   ntohl (values[i]->size) - sizeof (GNUNET_DatastoreValue),
+                   &vhashes[i]);
+    }
+  ret = api->put_many (16, keys,
+                       (const GNUNET_DatastoreValue * const *) values,
+                       results);
+  for (i = 0; i < 16; i++)
+    GNUNET_free (values[i]);
+  ASSERT (16 == ret);
+  for (i = 0; i < 16; i++)
+    ASSERT (results[i] == GNUNET_OK);
+  ASSERT (16 == api->get_many (16, keys, NULL, 0, NULL, NULL));
+  ASSERT (16 == api->get_many (16, keys, vhashes, 0, NULL, NULL));
+  ASSERT (0 == api->get_many (15, &keys[1], vhashes, 0, NULL, NULL));
+  i = 7;
+  ASSERT (1 == api->get_many (16, keys, NULL, 7, &checkValue, &i));
+  ASSERT (16 == api->get_many (16, keys, NULL, 0, &iterateDelete, NULL));
+  ASSERT (0 == api->get_many (16, keys, NULL, 0, NULL, NULL));
   api->drop ();
 
   return GNUNET_OK;
@@ -208,6 +208,12 @@ GNUNET_STATS_cs_message_type_to_string (unsigned short type)
     case GNUNET_CS_PROTO_STATS_GET_P2P_MESSAGE_SUPPORTED:
       name = "GNUNET_CS_PROTO_STATS_GET_P2P_MESSAGE_SUPPORTED";
       break;
+    case GNUNET_CS_PROTO_STATS_GET_HANDLER_STATISTICS:
+      name = "GNUNET_CS_PROTO_STATS_GET_HANDLER_STATISTICS";
+      break;
+    case GNUNET_CS_PROTO_STATS_HANDLER_STATISTICS:
+      name = "GNUNET_CS_PROTO_STATS_HANDLER_STATISTICS";
+      break;
 
     case GNUNET_CS_PROTO_TBENCH_REQUEST:
       name = "GNUNET_CS_PROTO_TBENCH_REQUEST";
@@ -423,4 +429,78 @@ GNUNET_STATS_get_available_protocols (struct GNUNET_GE_Context *ectx,
   return GNUNET_OK;
 }
 
+/**
+ * Request statistics about the handlers of each p2p message
+ * type from TCP socket.
+ * @param sock the socket to use
+ * @param processor function to call for each message type
+ * @return GNUNET_OK on success, GNUNET_SYSERR on error
+ */
+int
+GNUNET_STATS_get_handler_statistics (struct GNUNET_GE_Context *ectx,
+                                     struct GNUNET_ClientServerConnection
+                                     *sock,
+                                     GNUNET_STATS_HandlerStatisticsProcessor
+                                     processor, void *cls)
+{
+  CS_stats_handler_reply_MESSAGE *reply;
+  GNUNET_MessageHeader csHdr;
+  unsigned int histogram[GNUNET_CORE_HANDLER_HISTOGRAM_BUCKETS];
+  unsigned int i;
+  int ret;
+
+  ret = GNUNET_OK;
+  csHdr.size = htons (sizeof (GNUNET_MessageHeader));
+  csHdr.type = htons (GNUNET_CS_PROTO_STATS_GET_HANDLER_STATISTICS);
+  if (GNUNET_SYSERR == GNUNET_client_connection_write (sock, &csHdr))
+    return GNUNET_SYSERR;
+  while (1)
+    {
+      reply = NULL;
+      if (GNUNET_SYSERR ==
+          GNUNET_client_connection_read (sock,
+                                         (GNUNET_MessageHeader **) & reply))
+        return GNUNET_SYSERR;
+      if (ntohs (reply->header.type) == GNUNET_CS_PROTO_RETURN_VALUE)
+        break;                  /* end of list */
+      if ((ntohs (reply->header.type) !=
+           GNUNET_CS_PROTO_STATS_HANDLER_STATISTICS)
+          || (ntohs (reply->header.size) !=
+              sizeof (CS_stats_handler_reply_MESSAGE)))
+        {
+          GNUNET_GE_BREAK (ectx, 0);
+          GNUNET_free (reply);
+          return GNUNET_SYSERR;
+        }
+      /* keep reading after the processor aborted so that
+         the connection stays in sync */
+      if (ret == GNUNET_OK)
+        {
+          for (i = 0; i < GNUNET_CORE_HANDLER_HISTOGRAM_BUCKETS; i++)
+            histogram[i] = ntohl (reply->histogram[i]);
+          ret = processor (ntohs (reply->type),
+                           GNUNET_ntohll (reply->count),
+                           GNUNET_ntohll (reply->bytes),
+                           GNUNET_ntohll (reply->time),
+                           histogram,
+                           GNUNET_CORE_HANDLER_HISTOGRAM_BUCKETS, cls);
+        }
+      GNUNET_free (reply);
+    }
+  GNUNET_free (reply);
+  return GNUNET_OK;
+}
+
+/**
+ * Get the smallest handler time (in microseconds) that is
+ * counted in the given bucket of a handler histogram.
+ */
+unsigned long long
+GNUNET_STATS_handler_histogram_bucket_start (unsigned int bucket)
+{
+  if (bucket < 4)
+    return bucket;
+  return (4ULL + bucket % 4) << (bucket / 4 - 1);
+}
+
 /* end of clientapi.c */
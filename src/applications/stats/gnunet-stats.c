@@ -33,6 +33,8 @@
 
 static int lastIp2p = 42;       /* not GNUNET_YES or GNUNET_NO */
 
+static int handlerHeaderPrinted = GNUNET_NO;
+
 static char *cfgFilename = GNUNET_DEFAULT_CLIENT_CONFIG_FILE;
 
 /**
@@ -75,6 +77,61 @@ printProtocols (unsigned short type, int isP2P, void *cls)
   return GNUNET_OK;
 }
 
+/**
+ * Get the handler time (in microseconds) below which the given
+ * percentile of the messages in the histogram was processed.
+ */
+static unsigned long long
+getPercentile (const unsigned int *histogram,
+               unsigned int buckets,
+               unsigned long long count, unsigned int percentile)
+{
+  unsigned long long seen;
+  unsigned int i;
+
+  seen = 0;
+  for (i = 0; i < buckets; i++)
+    {
+      seen += histogram[i];
+      if (seen * 100 >= count * percentile)
+        return GNUNET_STATS_handler_histogram_bucket_start (i + 1);
+    }
+  return GNUNET_STATS_handler_histogram_bucket_start (buckets);
+}
+
+static int
+printHandlerStatistics (unsigned short type,
+                        unsigned long long count,
+                        unsigned long long bytes,
+                        unsigned long long time,
+                        const unsigned int *histogram,
+                        unsigned int buckets, void *cls)
+{
+  FILE *stream = cls;
+  const char *name;
+
+  if (handlerHeaderPrinted != GNUNET_YES)
+    {
+      fprintf (stream,
+               _("Peer-to-peer message handlers (times in microseconds):\n"));
+      fprintf (stream, "%-32s %12s %14s %8s %8s %8s %8s\n",
+               _("type"), _("messages"), _("bytes"),
+               _("average"), "p50", "p90", "p99");
+      handlerHeaderPrinted = GNUNET_YES;
+    }
+  name = GNUNET_STATS_p2p_message_type_to_string (type);
+  if (name == NULL)
+    fprintf (stream, "%-32u", type);
+  else
+    fprintf (stream, "%-32s", name);
+  fprintf (stream, " %12llu %14llu %8llu %8llu %8llu %8llu\n",
+           count, bytes, time / count,
+           getPercentile (histogram, buckets, count, 50),
+           getPercentile (histogram, buckets, count, 90),
+           getPercentile (histogram, buckets, count, 99));
+  return GNUNET_OK;
+}
+
 /**
  * All gnunet-transport-check command line options
  */
@@ -86,6 +143,10 @@ static struct GNUNET_CommandLineOption gnunetstatsOptions[] = {
   {'p', "protocols", NULL,
    gettext_noop ("prints supported protocol messages"),
    0, &GNUNET_getopt_configure_set_option, "STATS:PRINT-PROTOCOLS=YES"},
+  {'t', "handler-times", NULL,
+   gettext_noop
+   ("prints the number of messages and the time spent in their handlers for each peer-to-peer message type"),
+   0, &GNUNET_getopt_configure_set_option, "STATS:PRINT-HANDLER-TIMES=YES"},
   GNUNET_COMMAND_LINE_OPTION_VERSION (PACKAGE_VERSION), /* -v */
   GNUNET_COMMAND_LINE_OPTION_END,
 };
@@ -132,6 +193,17 @@ main (int argc, char *const *argv)
         GNUNET_STATS_get_available_protocols (ectx, sock, &printProtocols,
                                               stdout);
     }
+  if ((GNUNET_YES == GNUNET_GC_get_configuration_value_yesno (cfg,
+                                                              "STATS",
+                                                              "PRINT-HANDLER-TIMES",
+                                                              GNUNET_NO))
+      && (res == GNUNET_OK))
+    {
+      res =
+        GNUNET_STATS_get_handler_statistics (ectx, sock,
+                                             &printHandlerStatistics,
+                                             stdout);
+    }
   if (res != GNUNET_OK)
     fprintf (stderr, _("Error reading information from gnunetd.\n"));
   GNUNET_client_connection_destroy (sock);
@@ -50,6 +50,29 @@
 
 #define HAVE_MEMSTATS GNUNET_NO
 
+/**
+ * Number of slots per counter.  Each thread updates one of the
+ * slots (so that threads do not contend for the same cache
+ * line); the value of a counter is the sum of its slots.
+ */
+#define STAT_STRIPES 16
+
+/**
+ * Number of counters per block of slots.
+ */
+#define STAT_BLOCK_SIZE 64
+
+/**
+ * Maximum number of blocks (and thus of counters / STAT_BLOCK_SIZE).
+ */
+#define MAX_STAT_BLOCKS 256
+
+/**
+ * Unused slots after each row of a block, at least
+ * one cache line.
+ */
+#define STAT_PADDING 8
+
 /* *************** service *************** */
 
 /**
@@ -59,18 +82,45 @@ static GNUNET_CronTime startTime;
 
 struct StatEntry
 {
-  unsigned long long value;
   char *description;
   unsigned int descStrLen;
+  int handle;
+};
+
+/**
+ * Slots for STAT_BLOCK_SIZE counters.  Row "s" is updated
+ * by the threads that map to stripe "s".
+ */
+struct StatBlock
+{
+  unsigned long long
+    values[STAT_STRIPES][STAT_BLOCK_SIZE + STAT_PADDING];
 };
 
-static struct StatEntry *entries;
+static struct StatEntry **entries;
 
 /**
  * Size of the entries array
  */
+static unsigned int entriesSize;
+
+/**
+ * Number of counters.  Only increases while the module is
+ * loaded, after the slots of the new counter were allocated.
+ */
 static unsigned int statCounters;
 
+/**
+ * The slots of all counters.  Blocks are never moved, so they
+ * can be accessed without holding the lock.
+ */
+static struct StatBlock *blocks[MAX_STAT_BLOCKS];
+
+/**
+ * Map from the hash of a description to its entry.
+ */
+static struct GNUNET_MultiHashMap *entryMap;
+
 /**
  * lock for the stat module
  */
@@ -85,6 +135,33 @@ static GNUNET_CoreAPIForPlugins *coreAPI;
 extern volatile int GNUNET_memory_usage;
 #endif
 
+/**
+ * Get the stripe of the calling thread.  We use the address of the
+ * stack of the thread (at a granularity that is coarser than the
+ * call depth, but finer than the stack size of any thread) since
+ * not all platforms support thread-local variables.
+ */
+static unsigned int
+get_stripe ()
+{
+  int here;
+  unsigned long long addr;
+
+  addr = (unsigned long) &here;
+  addr = (addr >> 15) * 0x9E3779B97F4A7C15ULL;
+  return (unsigned int) (addr >> 32) % STAT_STRIPES;
+}
+
+/**
+ * Get the slot of the given counter for the given stripe.
+ */
+static unsigned long long *
+get_slot (int handle, unsigned int stripe)
+{
+  return &blocks[handle / STAT_BLOCK_SIZE]->values[stripe][handle %
+                                                            STAT_BLOCK_SIZE];
+}
+
 /**
  * Get a handle to a statistical entity.
  *
@@ -94,20 +171,40 @@ extern volatile int GNUNET_memory_usage;
 static int
 statHandle (const char *name)
 {
+  GNUNET_HashCode hc;
+  struct StatEntry *entry;
   int i;
+
   GNUNET_GE_ASSERT (NULL, name != NULL);
+  GNUNET_hash (name, strlen (name), &hc);
   GNUNET_mutex_lock (statLock);
-  for (i = 0; i < statCounters; i++)
-    if (0 == strcmp (entries[i].description, name))
-      {
-        GNUNET_mutex_unlock (statLock);
-        return i;
-      }
-  GNUNET_array_grow (entries, statCounters, statCounters + 1);
-  i = statCounters - 1;
-  entries[i].description = GNUNET_strdup (name);
-  entries[i].descStrLen = strlen (name);
-  entries[i].value = 0;
+  entry = GNUNET_multi_hash_map_get (entryMap, &hc);
+  if (entry != NULL)
+    {
+      GNUNET_mutex_unlock (statLock);
+      return entry->handle;
+    }
+  i = statCounters;
+  if (i >= MAX_STAT_BLOCKS * STAT_BLOCK_SIZE)
+    {
+      GNUNET_GE_BREAK (NULL, 0);
+      GNUNET_mutex_unlock (statLock);
+      return -1;
+    }
+  if (blocks[i / STAT_BLOCK_SIZE] == NULL)
+    blocks[i / STAT_BLOCK_SIZE] = GNUNET_malloc (sizeof (struct StatBlock));
+  if (i == entriesSize)
+    GNUNET_array_grow (entries, entriesSize, entriesSize * 2 + 16);
+  entry = GNUNET_malloc (sizeof (struct StatEntry));
+  entry->description = GNUNET_strdup (name);
+  entry->descStrLen = strlen (name);
+  entry->handle = i;
+  entries[i] = entry;
+  GNUNET_multi_hash_map_put (entryMap, &hc, entry,
+                             GNUNET_MultiHashMapOption_UNIQUE_FAST);
+  /* make the slots visible before the handle becomes valid */
+  __sync_synchronize ();
+  statCounters++;
   GNUNET_mutex_unlock (statLock);
   return i;
 }
@@ -122,14 +219,28 @@ statHandle (const char *name)
 static void
 statSet (const int handle, const unsigned long long value)
 {
-  GNUNET_mutex_lock (statLock);
+  unsigned long long others;
+  unsigned long long old;
+  unsigned long long *slot;
+  unsigned int i;
+
   if ((handle < 0) || (handle >= statCounters))
     {
       GNUNET_GE_BREAK (NULL, 0);
-      GNUNET_mutex_unlock (statLock);
       return;
     }
-  entries[handle].value = value;
+  GNUNET_mutex_lock (statLock);
+  /* concurrent changes to other slots are counted as
+     happening after the set */
+  others = 0;
+  for (i = 1; i < STAT_STRIPES; i++)
+    others += __sync_add_and_fetch (get_slot (handle, i), 0);
+  slot = get_slot (handle, 0);
+  do
+    {
+      old = *slot;
+    }
+  while (!__sync_bool_compare_and_swap (slot, old, value - others));
   GNUNET_mutex_unlock (statLock);
 }
 
@@ -137,15 +248,16 @@ static unsigned long long
 statGet (const int handle)
 {
   unsigned long long ret;
-  GNUNET_mutex_lock (statLock);
+  unsigned int i;
+
   if ((handle < 0) || (handle >= statCounters))
     {
       GNUNET_GE_BREAK (NULL, 0);
-      GNUNET_mutex_unlock (statLock);
       return -1;
     }
-  ret = entries[handle].value;
-  GNUNET_mutex_unlock (statLock);
+  ret = 0;
+  for (i = 0; i < STAT_STRIPES; i++)
+    ret += __sync_add_and_fetch (get_slot (handle, i), 0);
   return ret;
 }
 
@@ -159,15 +271,13 @@ statGet (const int handle)
 static void
 statChange (const int handle, const int delta)
 {
-  GNUNET_mutex_lock (statLock);
   if ((handle < 0) || (handle >= statCounters))
     {
       GNUNET_GE_BREAK (NULL, 0);
-      GNUNET_mutex_unlock (statLock);
       return;
     }
-  entries[handle].value += delta;
-  GNUNET_mutex_unlock (statLock);
+  __sync_fetch_and_add (get_slot (handle, get_stripe ()),
+                        (unsigned long long) (long long) delta);
 }
 
 
@@ -181,8 +291,19 @@ release_module_stats ()
 
   GNUNET_mutex_destroy (statLock);
   for (i = 0; i < statCounters; i++)
-    GNUNET_free (entries[i].description);
-  GNUNET_array_grow (entries, statCounters, 0);
+    {
+      GNUNET_free (entries[i]->description);
+      GNUNET_free (entries[i]);
+    }
+  GNUNET_array_grow (entries, entriesSize, 0);
+  statCounters = 0;
+  for (i = 0; i < MAX_STAT_BLOCKS; i++)
+    {
+      GNUNET_free_non_null (blocks[i]);
+      blocks[i] = NULL;
+    }
+  GNUNET_multi_hash_map_destroy (entryMap);
+  entryMap = NULL;
 }
 
 
@@ -201,6 +322,7 @@ provide_module_stats (GNUNET_CoreAPIForPlugins * capi)
   api.get = &statGet;
   startTime = GNUNET_get_time ();
   statLock = GNUNET_mutex_create (GNUNET_YES);
+  entryMap = GNUNET_multi_hash_map_create (256);
   return &api;
 }
 
@@ -316,6 +438,7 @@ sendStatistics (struct GNUNET_ClientHandle *sock,
   immediateUpdates ();
   statMsg = GNUNET_malloc (GNUNET_MAX_BUFFER_SIZE);
   statMsg->header.type = htons (GNUNET_CS_PROTO_STATS_STATISTICS);
+  GNUNET_mutex_lock (statLock);
   statMsg->totalCounters = htonl (statCounters);
   statMsg->startTime = GNUNET_htonll (startTime);
   values = (unsigned long long*) &statMsg[1];
@@ -329,12 +452,12 @@ sendStatistics (struct GNUNET_ClientHandle *sock,
       moff = 0;
       while ( (pos < statCounters) &&
 	      (moff + sizeof (unsigned long long)
-	       + entries[pos].descStrLen + 1
+	       + entries[pos]->descStrLen + 1
 	       < GNUNET_MAX_BUFFER_SIZE - sizeof (CS_stats_reply_MESSAGE)))
         {
           moff += sizeof (unsigned long long);  /* value */
-	  values[pos - start] = GNUNET_htonll (entries[pos].value);
-          moff += entries[pos].descStrLen + 1;
+	  values[pos - start] = GNUNET_htonll (statGet (pos));
+          moff += entries[pos]->descStrLen + 1;
           pos++;
         }
       end = pos;
@@ -346,9 +469,9 @@ sendStatistics (struct GNUNET_ClientHandle *sock,
       for (pos = start; pos < end; pos++)
         {
           memcpy (&text[moff], 
-		  entries[pos].description,
-                  entries[pos].descStrLen + 1);
-          moff += entries[pos].descStrLen + 1;
+		  entries[pos]->description,
+                  entries[pos]->descStrLen + 1);
+          moff += entries[pos]->descStrLen + 1;
         }
       msize = moff 
 	+ sizeof(unsigned long long) * mcnt 
@@ -356,15 +479,61 @@ sendStatistics (struct GNUNET_ClientHandle *sock,
       GNUNET_GE_ASSERT (NULL,
                         msize < GNUNET_MAX_BUFFER_SIZE);
       statMsg->header.size = htons (msize);
+      GNUNET_mutex_unlock (statLock);
       if (GNUNET_SYSERR ==
           coreAPI->cs_send_message (sock, &statMsg->header, GNUNET_YES))
-        break;                  /* abort, socket error! */
+        {
+          GNUNET_mutex_lock (statLock);
+          break;                /* abort, socket error! */
+        }
+      GNUNET_mutex_lock (statLock);
       start = end;
     }
+  GNUNET_mutex_unlock (statLock);
   GNUNET_free (statMsg);
   return GNUNET_OK;
 }
 
+/**
+ * Send statistics about the handlers of each p2p message type
+ * to the client, followed by GNUNET_OK.
+ */
+static int
+sendHandlerStatistics (struct GNUNET_ClientHandle *sock,
+                       const GNUNET_MessageHeader * message)
+{
+  CS_stats_handler_reply_MESSAGE reply;
+  struct GNUNET_CORE_HandlerStatistics hs;
+  unsigned int type;
+  unsigned int i;
+
+  if (ntohs (message->size) != sizeof (GNUNET_MessageHeader))
+    {
+      GNUNET_GE_BREAK (NULL, 0);
+      return GNUNET_SYSERR;
+    }
+  memset (&reply, 0, sizeof (CS_stats_handler_reply_MESSAGE));
+  reply.header.size = htons (sizeof (CS_stats_handler_reply_MESSAGE));
+  reply.header.type = htons (GNUNET_CS_PROTO_STATS_HANDLER_STATISTICS);
+  for (type = 0; type < GNUNET_P2P_PROTO_MAX_USED; type++)
+    {
+      if ((GNUNET_OK !=
+           coreAPI->p2p_handler_statistics_get (type, &hs))
+          || (hs.count == 0))
+        continue;
+      reply.type = htons (type);
+      reply.count = GNUNET_htonll (hs.count);
+      reply.bytes = GNUNET_htonll (hs.bytes);
+      reply.time = GNUNET_htonll (hs.time);
+      for (i = 0; i < GNUNET_CORE_HANDLER_HISTOGRAM_BUCKETS; i++)
+        reply.histogram[i] = htonl (hs.histogram[i]);
+      if (GNUNET_SYSERR ==
+          coreAPI->cs_send_message (sock, &reply.header, GNUNET_YES))
+        return GNUNET_SYSERR;
+    }
+  return coreAPI->cs_send_value (sock, GNUNET_OK);
+}
+
 /**
  * Handle a request to see if a particular p2p message is supported.
  */
@@ -452,6 +621,8 @@ initialize_module_stats (GNUNET_CoreAPIForPlugins * capi)
     (GNUNET_CS_PROTO_STATS_GET_CS_MESSAGE_SUPPORTED, &handleMessageSupported);
   capi->cs_handler_register (GNUNET_CS_PROTO_TRAFFIC_COUNT,
                              &processGetConnectionCountRequest);
+  capi->cs_handler_register (GNUNET_CS_PROTO_STATS_GET_HANDLER_STATISTICS,
+                             &sendHandlerStatistics);
   capi->p2p_ciphertext_handler_register (GNUNET_P2P_PROTO_NOISE,
                                          &processNoise);
   GNUNET_GE_ASSERT (capi->ectx,
@@ -484,6 +655,8 @@ done_module_stats ()
     (GNUNET_CS_PROTO_STATS_GET_CS_MESSAGE_SUPPORTED, &handleMessageSupported);
   coreAPI->cs_handler_unregister (GNUNET_CS_PROTO_TRAFFIC_COUNT,
                                   &processGetConnectionCountRequest);
+  coreAPI->cs_handler_unregister
+    (GNUNET_CS_PROTO_STATS_GET_HANDLER_STATISTICS, &sendHandlerStatistics);
   coreAPI->p2p_ciphertext_handler_unregister (GNUNET_P2P_PROTO_NOISE,
                                               &processNoise);
   myCoreAPI->service_release (stats);
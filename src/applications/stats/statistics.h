@@ -26,6 +26,7 @@
 #define CHAT_CHAT_H
 
 #include "gnunet_util.h"
+#include "gnunet_core.h"
 
 /**
  * Statistics message. Contains the timestamp and an aribtrary
@@ -85,4 +86,49 @@ typedef struct
 
 } CS_stats_get_supported_MESSAGE;
 
+/**
+ * Statistics about the handlers of one p2p message type.
+ * The stats module sends one of these for each type that
+ * was received at least once, followed by a return value
+ * (GNUNET_OK) once all types have been sent.
+ */
+typedef struct
+{
+  GNUNET_MessageHeader header;
+
+  /**
+   * The p2p message type (XX_P2P_PROTO_XXXX).
+   */
+  unsigned short type GNUNET_PACKED;
+
+  /**
+   * For alignment, always zero.
+   */
+  unsigned short reserved GNUNET_PACKED;
+
+  /**
+   * Number of messages processed (network byte order).
+   */
+  unsigned long long count GNUNET_PACKED;
+
+  /**
+   * Total size of these messages (network byte order).
+   */
+  unsigned long long bytes GNUNET_PACKED;
+
+  /**
+   * Total time spent in the handlers in microseconds
+   * (network byte order).
+   */
+  unsigned long long time GNUNET_PACKED;
+
+  /**
+   * Latency histogram (network byte order), see
+   * GNUNET_CORE_HANDLER_HISTOGRAM_BUCKETS.
+   */
+  unsigned int histogram[GNUNET_CORE_HANDLER_HISTOGRAM_BUCKETS]
+    GNUNET_PACKED;
+
+} CS_stats_handler_reply_MESSAGE;
+
 #endif
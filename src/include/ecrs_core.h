@@ -194,6 +194,22 @@ int GNUNET_EC_file_block_encode (const GNUNET_EC_DBlock * data,
                                  const GNUNET_HashCode * query,
                                  GNUNET_DatastoreValue ** value);
 
+/**
+ * Compute key and query (and optionally the encoded blocks) for
+ * several DBlocks at once, hashing them with GNUNET_hash_multiple.
+ *
+ * @param data the blocks in plaintext
+ * @param lens the length of each block
+ * @param count number of blocks
+ * @param chks set to the key and query of each block
+ * @param values set to the encoded blocks, NULL if not needed
+ */
+void GNUNET_EC_file_blocks_get_chks (const GNUNET_EC_DBlock * const *data,
+                                     const unsigned int *lens,
+                                     unsigned int count,
+                                     GNUNET_EC_ContentHashKey * chks,
+                                     GNUNET_DatastoreValue ** values);
+
 /**
  * Get the query that will be used to query for
  * a certain block of data.
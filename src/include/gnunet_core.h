@@ -71,6 +71,44 @@ extern "C"
  */
 #define GNUNET_P2P_MESSAGE_OVERHEAD 76
 
+/**
+ * Number of buckets in the latency histograms that the core keeps
+ * for the handlers of each p2p message type.  Latencies are measured
+ * in microseconds.  Latencies below 4 have one bucket each, every
+ * larger power of two is split into four buckets; hence bucket "b"
+ * (for b >= 4) starts at (4 + b % 4) << (b / 4 - 1).  The last
+ * bucket also counts all larger latencies.
+ */
+#define GNUNET_CORE_HANDLER_HISTOGRAM_BUCKETS 128
+
+/**
+ * Statistics about the handlers of one p2p message type.
+ */
+struct GNUNET_CORE_HandlerStatistics
+{
+
+  /**
+   * Number of messages of this type that were processed.
+   */
+  unsigned long long count;
+
+  /**
+   * Total size of these messages.
+   */
+  unsigned long long bytes;
+
+  /**
+   * Total time (in microseconds) spent in the handlers.
+   */
+  unsigned long long time;
+
+  /**
+   * Number of messages by the time spent in the handlers.
+   */
+  unsigned int histogram[GNUNET_CORE_HANDLER_HISTOGRAM_BUCKETS];
+
+};
+
 /**
  * Opaque handle for a session representation on the transport
  * layer side
@@ -460,6 +498,19 @@ typedef struct
   int (*p2p_message_handler_registered_test) (unsigned short type,
                                               unsigned short handlerType);
 
+  /**
+   * Get statistics about the handlers for messages of the given
+   * p2p type (since gnunetd was started).
+   *
+   * @param type the message type
+   * @param stats set to the statistics for the type
+   * @return GNUNET_OK on success, GNUNET_SYSERR if no
+   *         statistics are kept for the type
+   */
+  int (*p2p_handler_statistics_get) (unsigned short type,
+                                     struct GNUNET_CORE_HandlerStatistics *
+                                     stats);
+
   /* ***************** connection management ******************* */
 
   /**
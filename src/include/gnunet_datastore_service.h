@@ -139,6 +139,23 @@ typedef struct
   int (*putUpdate) (const GNUNET_HashCode * key,
                     const GNUNET_DatastoreValue * value);
 
+  /**
+   * Store an item in the datastore like putUpdate, but
+   * allow the datastore to write it later (together with
+   * other items) to reduce the per-item cost.  Items
+   * that have been accepted are visible to subsequent
+   * get, fast_get and del operations.  If writing an
+   * accepted item fails, the datastore retries it with
+   * the following batches.
+   *
+   * @return GNUNET_OK if the item was accepted, GNUNET_NO if the
+   *   datastore is full and the priority of the item is not high
+   *   enough to justify removing something else, GNUNET_SYSERR
+   *   on other serious error
+   */
+  int (*putUpdateDeferred) (const GNUNET_HashCode * key,
+                            const GNUNET_DatastoreValue * value);
+
   /**
    * Iterate over the results for a particular key
    * in the datastore.
@@ -164,11 +181,14 @@ typedef struct
   /**
    * Get a random value from the datastore.
    *
+   * @param receiver if not NULL, prefer content with a key
+   *        close to this hash (i.e. the receiver's identity)
    * @param key set to the key of the match
    * @param value set to an approximate match
    * @return GNUNET_OK if a value was found, GNUNET_SYSERR if not
    */
-  int (*getRandom) (GNUNET_HashCode * key, GNUNET_DatastoreValue ** value);
+  int (*getRandom) (const GNUNET_HashCode * receiver,
+                    GNUNET_HashCode * key, GNUNET_DatastoreValue ** value);
 
   /**
    * Explicitly remove some content from the database.
@@ -142,6 +142,77 @@ int GNUNET_FS_index (struct GNUNET_ClientServerConnection *sock,
                      const GNUNET_DatastoreValue * block,
                      unsigned long long offset);
 
+/**
+ * Handle for sending insert, index and delete requests to
+ * gnunetd without waiting for the result of each request.
+ * gnunetd answers the requests of a client in the order in
+ * which they were received, so the results are matched to
+ * the requests by their position in the window.  The
+ * connection must not be used for anything else while the
+ * window exists.
+ */
+struct GNUNET_FS_RequestWindow;
+
+/**
+ * Create a window for sending insert, index and delete requests.
+ *
+ * @param size maximum number of requests whose result
+ *        has not been read yet
+ */
+struct GNUNET_FS_RequestWindow *GNUNET_FS_window_create (struct
+                                                         GNUNET_ClientServerConnection
+                                                         *sock,
+                                                         unsigned int size);
+
+/**
+ * Insert a block (like GNUNET_FS_insert) without waiting
+ * for the result.
+ *
+ * @param block the block (properly encoded and all)
+ * @param strict GNUNET_YES if a GNUNET_NO result from gnunetd
+ *        (after retrying) counts as a failure, GNUNET_NO
+ *        if only GNUNET_SYSERR does
+ * @return GNUNET_OK if the request was sent, GNUNET_SYSERR
+ *         on error (or if an earlier request failed)
+ */
+int GNUNET_FS_window_insert (struct GNUNET_FS_RequestWindow *win,
+                             const GNUNET_DatastoreValue * block,
+                             int strict);
+
+/**
+ * Index a block (like GNUNET_FS_index) without waiting
+ * for the result.
+ *
+ * @return GNUNET_OK if the request was sent, GNUNET_SYSERR
+ *         on error (or if an earlier request failed)
+ */
+int GNUNET_FS_window_index (struct GNUNET_FS_RequestWindow *win,
+                            const GNUNET_HashCode * fileHc,
+                            const GNUNET_DatastoreValue * block,
+                            unsigned long long offset);
+
+/**
+ * Delete a block (like GNUNET_FS_delete) without waiting
+ * for the result.
+ *
+ * @param strict GNUNET_YES if content that gnunetd fails
+ *        to find counts as a failure
+ * @return GNUNET_OK if the request was sent, GNUNET_SYSERR
+ *         on error (or if an earlier request failed)
+ */
+int GNUNET_FS_window_delete (struct GNUNET_FS_RequestWindow *win,
+                             const GNUNET_DatastoreValue * block,
+                             int strict);
+
+/**
+ * Wait for the results of all outstanding requests
+ * and free the window.
+ *
+ * @return GNUNET_OK if all requests succeeded,
+ *         GNUNET_SYSERR if any of them failed
+ */
+int GNUNET_FS_window_destroy (struct GNUNET_FS_RequestWindow *win);
+
 /**
  * Delete a block.  The arguments are the same as the ones for
  * GNUNET_FS_insert.
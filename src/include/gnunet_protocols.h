@@ -250,6 +250,18 @@ extern "C"
  */
 #define GNUNET_CS_PROTO_STATS_GET_P2P_MESSAGE_SUPPORTED 39
 
+/**
+ * client to stats module: request statistics about the
+ * p2p message handlers
+ */
+#define GNUNET_CS_PROTO_STATS_GET_HANDLER_STATISTICS 72
+
+/**
+ * stats module to client: statistics about the handlers
+ * of one p2p message type
+ */
+#define GNUNET_CS_PROTO_STATS_HANDLER_STATISTICS 73
+
 
 /* ********** CS TBENCH application messages ********** */
 
@@ -115,6 +115,46 @@ typedef struct
    */
   int (*update) (unsigned long long uid, int delta, GNUNET_CronTime expire);
 
+  /**
+   * Store several items in the datastore.  Implementations should
+   * use a single transaction for the entire batch; the semantics
+   * are otherwise the same as calling put for each item.
+   *
+   * @param count number of items
+   * @param keys array of count keys
+   * @param values array of count values
+   * @param results maybe NULL, otherwise set to the
+   *        individual result of each put
+   * @return number of items stored, GNUNET_SYSERR on error
+   */
+  int (*put_many) (unsigned int count,
+                   const GNUNET_HashCode * keys,
+                   const GNUNET_DatastoreValue * const *values,
+                   int *results);
+
+  /**
+   * Iterate over the results for several keys in the datastore.
+   * The order in which the keys are processed is not specified.
+   *
+   * @param count number of keys
+   * @param keys array of count keys
+   * @param vhashes maybe NULL, otherwise an array of count
+   *        hashes of the values that should be matched
+   * @param type entries of which type are relevant?
+   *     Use 0 for any type.
+   * @param iter maybe NULL (to just count); iter
+   *     should return GNUNET_SYSERR to abort the
+   *     iteration, GNUNET_NO to delete the entry and
+   *     continue and GNUNET_OK to continue iterating
+   * @return the number of results processed,
+   *         GNUNET_SYSERR on error
+   */
+  int (*get_many) (unsigned int count,
+                   const GNUNET_HashCode * keys,
+                   const GNUNET_HashCode * vhashes,
+                   unsigned int type, GNUNET_DatastoreValueIterator iter,
+                   void *closure);
+
   /**
    * Iterate over the items in the datastore in ascending
    * order of priority.
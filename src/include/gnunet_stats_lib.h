@@ -90,6 +90,48 @@ int GNUNET_STATS_get_available_protocols (struct GNUNET_GE_Context *ectx,
                                           GNUNET_STATS_ProtocolProcessor
                                           processor, void *cls);
 
+/**
+ * @param type the p2p message type
+ * @param count number of messages of this type that were processed
+ * @param bytes total size of these messages
+ * @param time total time spent in the handlers (in microseconds)
+ * @param histogram number of messages by the time spent in the
+ *        handlers (see GNUNET_STATS_handler_histogram_bucket_start)
+ * @param buckets number of entries in histogram
+ * @return GNUNET_OK to continue, GNUNET_SYSERR to abort iteration
+ */
+typedef int (*GNUNET_STATS_HandlerStatisticsProcessor) (unsigned short type,
+                                                        unsigned long long
+                                                        count,
+                                                        unsigned long long
+                                                        bytes,
+                                                        unsigned long long
+                                                        time,
+                                                        const unsigned int
+                                                        *histogram,
+                                                        unsigned int buckets,
+                                                        void *cls);
+
+/**
+ * Request statistics about the handlers of each p2p message
+ * type from TCP socket.
+ * @param sock the socket to use
+ * @param processor function to call for each message type
+ * @return GNUNET_OK on success, GNUNET_SYSERR on error
+ */
+int GNUNET_STATS_get_handler_statistics (struct GNUNET_GE_Context *ectx,
+                                         struct GNUNET_ClientServerConnection
+                                         *sock,
+                                         GNUNET_STATS_HandlerStatisticsProcessor
+                                         processor, void *cls);
+
+/**
+ * Get the smallest handler time (in microseconds) that is
+ * counted in the given bucket of a handler histogram.
+ */
+unsigned long long GNUNET_STATS_handler_histogram_bucket_start (unsigned int
+                                                                bucket);
+
 #if 0                           /* keep Emacsens' auto-indent happy */
 {
 #endif
@@ -70,7 +70,7 @@ typedef struct
 
   /**
    * The message itself. The GNUnet core will call 'GNUNET_free' once
-   * processing of msg is complete.
+   * processing of msg is complete (unless buffer is set).
    */
   char *msg;
 
@@ -79,6 +79,13 @@ typedef struct
    */
   unsigned int size;
 
+  /**
+   * If not NULL, msg points into this buffer (to which the
+   * packet holds a reference) and the GNUnet core will call
+   * 'GNUNET_buffer_release' on it instead of freeing msg.
+   */
+  struct GNUNET_Buffer *buffer;
+
 } GNUNET_TransportPacket;
 
 /**
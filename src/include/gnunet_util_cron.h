@@ -82,7 +82,7 @@ void GNUNET_cron_resume_jobs (struct GNUNET_CronManager *mgr, int checkself);
 int GNUNET_cron_test_running (struct GNUNET_CronManager *mgr);
 
 /**
- * Add a cron-job to the delta list.
+ * Add a cron-job to the job table.
  * @param method which method should we run
  * @param delta how many milliseconds until we run the method
  * @param deltaRepeat if this is a periodic, the time between
@@ -94,6 +94,25 @@ void GNUNET_cron_add_job (struct GNUNET_CronManager *mgr,
                           unsigned int delta, unsigned int deltaRepeat,
                           void *data);
 
+/**
+ * Add a cron-job that may run for a long time (or block).  Such
+ * jobs are run by a worker thread and thus do not delay the other
+ * cron-jobs.  If a periodic long-running job is still running when
+ * it is due again, that run is skipped.  Long-running jobs must not
+ * call GNUNET_cron_suspend_jobs (suspending waits for the workers
+ * to become idle).
+ *
+ * @param method which method should we run
+ * @param delta how many milliseconds until we run the method
+ * @param deltaRepeat if this is a periodic, the time between
+ *        the runs, otherwise 0.
+ * @param data argument to pass to the method
+ */
+void GNUNET_cron_add_long_job (struct GNUNET_CronManager *mgr,
+                               GNUNET_CronJob method,
+                               unsigned int delta, unsigned int deltaRepeat,
+                               void *data);
+
 /**
  * If the specified cron-job exists in th delta-list, move it to the
  * head of the list.  If it is running, do nothing.  If it is does not
@@ -233,6 +233,64 @@ int GNUNET_AES_decrypt (const GNUNET_AES_SessionKey * sessionkey,
                         const GNUNET_AES_InitializationVector * iv,
                         void *result);
 
+/**
+ * @brief cipher context for a session key (reference counted)
+ */
+struct GNUNET_AES_Context;
+
+/**
+ * Create a cipher context for the given session key.  The
+ * key schedule is computed (and the key checked) only once;
+ * operations on the context do not take the global gcrypt
+ * lock.  Use this instead of GNUNET_AES_encrypt and
+ * GNUNET_AES_decrypt if a key is used for many blocks.
+ *
+ * @return NULL on error (the reference count of a new
+ *         context is one)
+ */
+struct GNUNET_AES_Context *GNUNET_AES_context_create (const
+                                                      GNUNET_AES_SessionKey *
+                                                      sessionkey);
+
+/**
+ * Obtain another reference to the cipher context.
+ */
+void GNUNET_AES_context_retain (struct GNUNET_AES_Context *ctx);
+
+/**
+ * Release a reference to the cipher context; the
+ * context is destroyed once the last reference is gone.
+ */
+void GNUNET_AES_context_release (struct GNUNET_AES_Context *ctx);
+
+/**
+ * Encrypt a block using a cipher context.
+ * @param block the block to encrypt
+ * @param len the size of the block
+ * @param iv the initialization vector to use
+ * @param result the output parameter in which to store the encrypted result
+ * @returns the size of the encrypted block, -1 for errors
+ */
+int GNUNET_AES_context_encrypt (struct GNUNET_AES_Context *ctx,
+                                const void *block,
+                                unsigned short len,
+                                const GNUNET_AES_InitializationVector * iv,
+                                void *result);
+
+/**
+ * Decrypt a block using a cipher context.
+ * @param block the data to decrypt, encoded as returned by encrypt
+ * @param size how big is the block?
+ * @param iv the initialization vector to use
+ * @param result address to store the result at
+ * @return -1 on failure, size of decrypted block on success
+ */
+int GNUNET_AES_context_decrypt (struct GNUNET_AES_Context *ctx,
+                                const void *block,
+                                unsigned short size,
+                                const GNUNET_AES_InitializationVector * iv,
+                                void *result);
+
 /**
  * Convert GNUNET_hash to ASCII encoding.
  * @param block the GNUNET_hash code
@@ -269,6 +327,18 @@ unsigned int GNUNET_hash_distance_u32 (const GNUNET_HashCode * a,
 void GNUNET_hash (const void *block, unsigned int size,
                   GNUNET_HashCode * ret);
 
+/**
+ * Hash several independent blocks at once (faster than calling
+ * GNUNET_hash for each if the CPU supports it).
+ * @param blocks the blocks to hash
+ * @param sizes the length of each block
+ * @param count number of blocks
+ * @param ret array of count hashcodes to write the results to
+ */
+void GNUNET_hash_multiple (const void *const *blocks,
+                           const unsigned int *sizes,
+                           unsigned int count, GNUNET_HashCode * ret);
+
 
 /**
  * Compute the GNUNET_hash of an entire file.
@@ -173,6 +173,16 @@ struct GNUNET_SocketHandle;
  */
 struct GNUNET_SelectHandle;
 
+/**
+ * @brief pool of reference counted network buffers
+ */
+struct GNUNET_BufferPool;
+
+/**
+ * @brief reference counted network buffer
+ */
+struct GNUNET_Buffer;
+
 /**
  * @brief callback for handling messages received by select
  *
@@ -390,6 +400,68 @@ int GNUNET_socket_send_to (struct GNUNET_SocketHandle *s,
                            size_t * sent, const char *dst,
                            unsigned int dstlen);
 
+/**
+ * A datagram for GNUNET_socket_recv_from_multiple and
+ * GNUNET_socket_send_to_multiple.
+ */
+struct GNUNET_Datagram
+{
+
+  /**
+   * The payload.
+   */
+  char *data;
+
+  /**
+   * Size of the payload (when receiving: size of the
+   * data area, set to the size of the datagram).
+   */
+  unsigned int size;
+
+  /**
+   * Address of the peer.
+   */
+  char *addr;
+
+  /**
+   * Length of the address (when receiving: size of the
+   * address area, set to the length of the address).
+   */
+  unsigned int addr_len;
+
+};
+
+/**
+ * Receive up to count datagrams from the given socket
+ * with as few system calls as possible.  Unlike the other
+ * functions here, the datagram functions do not change the
+ * mode of the socket; in blocking mode they wait for the
+ * socket instead.  The socket should be non-blocking.
+ *
+ * @param received set to the number of datagrams received
+ * @return GNUNET_SYSERR on error, GNUNET_YES on success or
+ *         GNUNET_NO if the operation would have blocked
+ */
+int GNUNET_socket_recv_from_multiple (struct GNUNET_SocketHandle *s,
+                                      GNUNET_NC_KIND nc,
+                                      struct GNUNET_Datagram *dgrams,
+                                      unsigned int count,
+                                      unsigned int *received);
+
+/**
+ * Send the given datagrams with as few system calls as
+ * possible.  Datagrams are never sent partially.
+ *
+ * @param sent set to the number of datagrams sent
+ * @return GNUNET_SYSERR on error, GNUNET_YES on success or
+ *         GNUNET_NO if the operation would have blocked
+ *         before the first datagram was sent
+ */
+int GNUNET_socket_send_to_multiple (struct GNUNET_SocketHandle *s,
+                                    GNUNET_NC_KIND nc,
+                                    struct GNUNET_Datagram *dgrams,
+                                    unsigned int count, unsigned int *sent);
+
 /**
  * Check if socket is valid
  * @return GNUNET_YES if valid, GNUNET_NO otherwise
@@ -445,6 +517,17 @@ struct GNUNET_SelectHandle *GNUNET_select_create (const char *desc,
  */
 void GNUNET_select_destroy (struct GNUNET_SelectHandle *sh);
 
+/**
+ * Choose the backend for select handles created from now on.
+ * epoll is used by default where available; it only looks at
+ * sockets with pending events and thus scales to many more
+ * connections than select.
+ *
+ * @param enable GNUNET_YES to use epoll (if supported),
+ *        GNUNET_NO to always use select
+ */
+void GNUNET_select_set_epoll (int enable);
+
 /**
  * Queue the given message with the select thread.
  *
@@ -461,6 +544,37 @@ int GNUNET_select_write (struct GNUNET_SelectHandle *sh,
                          const GNUNET_MessageHeader * msg, int mayBlock,
                          int force);
 
+/**
+ * Part of a message written with GNUNET_select_writev.
+ */
+struct GNUNET_IOVec
+{
+  const void *base;
+
+  unsigned int size;
+};
+
+/**
+ * Queue a message that is given in parts (typically a header
+ * and the payload) with the select thread.  The parts are
+ * copied straight into the write buffer of the connection,
+ * so the caller does not have to assemble the message first.
+ *
+ * @param iov the parts of the message
+ * @param iovcnt number of parts
+ * @param mayBlock if GNUNET_YES, blocks this thread until message
+ *        has been sent
+ * @param force message is important, queue even if
+ *        there is not enough space
+ * @return GNUNET_OK if the message was sent or queued
+ *         GNUNET_NO if there was not enough memory to queue it,
+ *         GNUNET_SYSERR if the sock does not belong with this select
+ */
+int GNUNET_select_writev (struct GNUNET_SelectHandle *sh,
+                          struct GNUNET_SocketHandle *sock,
+                          const struct GNUNET_IOVec *iov,
+                          unsigned int iovcnt, int mayBlock, int force);
+
 
 /**
  * Would select queue or send the given message at this time?
@@ -508,6 +622,98 @@ int GNUNET_select_update_closure (struct GNUNET_SelectHandle *sh,
 int GNUNET_select_disconnect (struct GNUNET_SelectHandle *sh,
                               struct GNUNET_SocketHandle *sock);
 
+/**
+ * Get the buffer that holds the message currently being
+ * passed to the message handler of this select.  May only
+ * be called from within the message handler.  A handler
+ * that wants to keep the message (without copying it) must
+ * call GNUNET_buffer_retain on the buffer and release it
+ * once it is done; the message stays valid until then.
+ */
+struct GNUNET_Buffer *GNUNET_select_get_message_buffer (struct
+                                                        GNUNET_SelectHandle
+                                                        *sh);
+
+/**
+ * How many times did this select allocate memory for read
+ * and write buffers so far?  Sending and receiving normally
+ * reuse the buffers, so this should grow much slower than
+ * the number of messages.
+ */
+unsigned long long GNUNET_select_get_allocations (struct
+                                                  GNUNET_SelectHandle *sh);
+
+/* ***************** buffer pool **************** */
+
+/**
+ * Create a buffer pool.
+ *
+ * @param quota maximum number of bytes in buffers that
+ *        were allocated without force (0 for unlimited);
+ *        buffers allocated with force do not count
+ */
+struct GNUNET_BufferPool *GNUNET_buffer_pool_create (unsigned long long
+                                                     quota);
+
+/**
+ * Destroy a buffer pool.  The memory is released once
+ * all buffers from the pool have been released.
+ */
+void GNUNET_buffer_pool_destroy (struct GNUNET_BufferPool *pool);
+
+/**
+ * Get a buffer from the pool.  The buffer starts
+ * with a reference count of one.
+ *
+ * @param size minimum size of the buffer
+ * @param force allocate even if this exceeds the quota
+ * @return NULL if the quota does not permit the allocation
+ */
+struct GNUNET_Buffer *GNUNET_buffer_pool_get (struct GNUNET_BufferPool
+                                              *pool, unsigned int size,
+                                              int force);
+
+/**
+ * How many bytes are currently in buffers allocated
+ * from the pool?
+ */
+unsigned long long GNUNET_buffer_pool_get_usage (struct GNUNET_BufferPool
+                                                 *pool);
+
+/**
+ * How many times did the pool allocate memory
+ * (for a slab or a large buffer) so far?
+ */
+unsigned long long GNUNET_buffer_pool_get_allocations (struct
+                                                       GNUNET_BufferPool
+                                                       *pool);
+
+/**
+ * Get the data area of the buffer.
+ */
+char *GNUNET_buffer_get_data (struct GNUNET_Buffer *buf);
+
+/**
+ * Get the usable size of the buffer.
+ */
+unsigned int GNUNET_buffer_get_size (const struct GNUNET_Buffer *buf);
+
+/**
+ * Is anyone but the caller holding a reference to the buffer?
+ */
+int GNUNET_buffer_test_shared (const struct GNUNET_Buffer *buf);
+
+/**
+ * Obtain another reference to the buffer.
+ */
+void GNUNET_buffer_retain (struct GNUNET_Buffer *buf);
+
+/**
+ * Release a reference to the buffer.  The buffer returns
+ * to the pool once the last reference is gone.
+ */
+void GNUNET_buffer_release (struct GNUNET_Buffer *buf);
+
 /**
  * Convert a string to an IP address. May block!
  *
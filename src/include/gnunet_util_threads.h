@@ -166,6 +166,17 @@ void GNUNET_mutex_lock_at_file_line_ (struct GNUNET_Mutex *mutex,
 
 #define GNUNET_mutex_lock(mutex) GNUNET_mutex_lock_at_file_line_(mutex, __FILE__, __LINE__)
 
+/**
+ * Try to lock the mutex without blocking.
+ *
+ * @return GNUNET_OK if the lock was acquired,
+ *         GNUNET_NO if the mutex is held by another thread
+ */
+int GNUNET_mutex_trylock_at_file_line_ (struct GNUNET_Mutex *mutex,
+                                        const char *file, unsigned int line);
+
+#define GNUNET_mutex_trylock(mutex) GNUNET_mutex_trylock_at_file_line_(mutex, __FILE__, __LINE__)
+
 void GNUNET_mutex_unlock (struct GNUNET_Mutex *mutex);
 
 struct GNUNET_Semaphore *GNUNET_semaphore_create (int value);
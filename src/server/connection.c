@@ -158,6 +158,13 @@
  */
 #define MAX_SEND_BUFFER_SIZE (EXPECTED_MTU * 8)
 
+/**
+ * When selecting messages for transmission, how many messages that
+ * do not fit into the remaining space do we skip (looking for smaller
+ * ones) before we give up?
+ */
+#define MAX_SKIPPED_ENTRIES 32
+
 /**
  * How often is another peer allowed to transmit above
  * the limit before we shutdown the connection?
@@ -167,6 +174,12 @@
  */
 #define MAX_VIOLATIONS 10
 
+/**
+ * Upper bound for the number of buckets in the connection table.
+ * Each bucket is protected by its own lock.
+ */
+#define CONNECTION_MAX_BUCKETS 256
+
 /**
  * Status constants
  *
@@ -327,6 +340,17 @@ typedef struct
 
 #define SE_PLACEMENT_FLAG 3
 
+/* *********** orders of the send queues ********** */
+
+/* highest priority per byte first (transmission) */
+#define SQ_PRIORITY 0
+/* lowest priority per byte first (dropping) */
+#define SQ_DROP 1
+/* earliest transmission time first (expiration) */
+#define SQ_DEADLINE 2
+
+#define SQ_COUNT 3
+
 /**
  * Entry in the send buffer.  Contains the size of the message, the
  * priority, when the message was passed to ciphertext_send, a callback to
@@ -362,6 +386,17 @@ typedef struct
    */
   int knapsackSolution;
 
+  /**
+   * position of the entry in each of the send queues
+   */
+  unsigned int queuePos[SQ_COUNT];
+
+  /**
+   * when was the entry added to the send buffer (entries
+   * with the same priority per byte are sent in this order)
+   */
+  unsigned int seq;
+
   /**
    * how long is this message part expected to be?
    */
@@ -374,6 +409,28 @@ typedef struct
 
 } SendEntry;
 
+/**
+ * Binary heap of the entries in the send buffer of a connection.
+ */
+typedef struct
+{
+  /**
+   * the heap (see sendEntryBefore for the order)
+   */
+  SendEntry **entries;
+
+  /**
+   * number of entries in the heap
+   */
+  unsigned int count;
+
+  /**
+   * allocated length of entries
+   */
+  unsigned int size;
+
+} SendQueue;
+
 /**
  * A tsession is a token provided by the transport
  * API to refer to a connection of the transport
@@ -429,6 +486,16 @@ typedef struct BufferEntry_
    */
   GNUNET_Int32Time skey_remote_created;
 
+  /**
+   * cipher context for skey_local (NULL if not yet created)
+   */
+  struct GNUNET_AES_Context *skey_local_ctx;
+
+  /**
+   * cipher context for skey_remote (NULL if not yet created)
+   */
+  struct GNUNET_AES_Context *skey_remote_ctx;
+
   /**
    * is this host alive? timestamp of the time of the last-active
    * point (as witnessed by some higher-level application, typically
@@ -470,9 +537,43 @@ typedef struct BufferEntry_
   unsigned int sendBufferSize;
 
   /**
-   * buffer of entries waiting to be transmitted
+   * entries waiting to be transmitted, one heap for each
+   * order (SQ_XXX); all heaps contain the same entries
+   * (except for SQ_PRIORITY while messages are selected)
+   */
+  SendQueue sendBuffer[SQ_COUNT];
+
+  /**
+   * total length of the entries in the send buffer
+   */
+  unsigned long long sendBufferBytes;
+
+  /**
+   * number of entries in the send buffer with
+   * at least GNUNET_EXTREME_PRIORITY
+   */
+  unsigned int sendBufferExtreme;
+
+  /**
+   * seq for the next entry added to the send buffer
+   */
+  unsigned int sendBufferSeq;
+
+  /**
+   * entries considered by the last selectMessagesToSend;
+   * those selected have knapsackSolution set
+   */
+  SendEntry **candidates;
+
+  /**
+   * number of entries in candidates
    */
-  SendEntry **sendBuffer;
+  unsigned int candidateCount;
+
+  /**
+   * allocated length of candidates
+   */
+  unsigned int candidateSize;
 
   /**
    * time of the last send-attempt (to avoid
@@ -550,7 +651,9 @@ typedef struct BufferEntry_
   unsigned int violations;
 
   /**
-   * are we currently in "sendBuffer" for this entry?
+   * are we currently in "sendBuffer" for this entry?  While set,
+   * the entry must not be freed, recycled or moved to another
+   * bucket (sendBuffer releases the bucket lock while transmitting).
    */
   int inSendBuffer;
 
@@ -629,6 +732,13 @@ static unsigned int CONNECTION_MAX_HOSTS_;
  */
 static int disable_random_padding = GNUNET_NO;
 
+/**
+ * Experimental configuration: only solve the knapsack problem
+ * exactly if that may improve on the greedy selection by more
+ * than this many percent.
+ */
+static unsigned long long knapsack_margin = 5;
+
 /**
  * Send callbacks for making better use of noise padding...
  */
@@ -645,10 +755,46 @@ static struct DisconnectNotificationList *disconnect_notification_list;
 static struct ConnectNotificationList *connect_notification_list;
 
 /**
- * Lock for the connection module.
+ * Number of buckets that the connection table should have
+ * (CONNECTION_MAX_HOSTS_ lags behind if a resize had to be
+ * deferred).
+ */
+static unsigned int CONNECTION_target_hosts_;
+
+/**
+ * Lock for the connection module (the "table lock").  It must be
+ * held for passes over the entire table (liveness, bandwidth
+ * assignment, resizing) and whenever the connection module calls
+ * into other modules (which may share this lock, see
+ * GNUNET_CORE_connection_get_lock).  If both the table lock and a
+ * bucket lock are needed, the table lock must be acquired first.
  */
 static struct GNUNET_Mutex *lock;
 
+/**
+ * Lock for one bucket of the connection table.
+ */
+struct BucketLock
+{
+  struct GNUNET_Mutex *lock;
+
+  /**
+   * How often does the owner of the lock hold it?
+   * (only meaningful for the thread holding the lock)
+   */
+  unsigned int depth;
+};
+
+/**
+ * Bucket locks, one for each slot of CONNECTION_buffer_.  A bucket
+ * lock protects the overflow chain of the bucket and all of the
+ * fields of the BufferEntries in it.  A thread that does not hold
+ * the table lock may hold at most one bucket lock at a time and must
+ * not call into other modules (other than leaf services such as
+ * stats or the transport's send path) while holding it.
+ */
+static struct BucketLock bucket_locks[CONNECTION_MAX_BUCKETS];
+
 /**
  * What is the available downstream bandwidth (in bytes
  * per minute)?
@@ -724,17 +870,142 @@ static int stat_transport_switches;
 
 static int stat_avg_lifetime;
 
+static int stat_table_lock_contention;
+
+static int stat_bucket_lock_contention;
+
+static int stat_select_greedy;
+
+static int stat_select_knapsack;
+
 /* ******************** CODE ********************* */
 
+/**
+ * Acquire the table lock (and count contention).
+ */
+static void
+lockTable ()
+{
+  if (GNUNET_OK != GNUNET_mutex_trylock (lock))
+    {
+      if (stats != NULL)
+        stats->change (stat_table_lock_contention, 1);
+      GNUNET_mutex_lock (lock);
+    }
+}
+
+/**
+ * Acquire the lock of the given bucket (and count contention).
+ *
+ * @param index index of the bucket in CONNECTION_buffer_
+ */
+static void
+lockBucket (unsigned int index)
+{
+  struct BucketLock *bl;
+
+  bl = &bucket_locks[index];
+  if (GNUNET_OK != GNUNET_mutex_trylock (bl->lock))
+    {
+      if (stats != NULL)
+        stats->change (stat_bucket_lock_contention, 1);
+      GNUNET_mutex_lock (bl->lock);
+    }
+  bl->depth++;
+}
+
+/**
+ * Release the lock of the given bucket.
+ *
+ * @param index index of the bucket in CONNECTION_buffer_
+ */
+static void
+unlockBucket (unsigned int index)
+{
+  struct BucketLock *bl;
+
+  bl = &bucket_locks[index];
+  GNUNET_GE_ASSERT (NULL, bl->depth > 0);
+  bl->depth--;
+  GNUNET_mutex_unlock (bl->lock);
+}
+
+/**
+ * Acquire the lock of the bucket that a peer belongs to.
+ *
+ * @param peer the peer
+ * @return index of the bucket that was locked
+ */
+static unsigned int
+lockBucketOfPeer (const GNUNET_PeerIdentity * peer)
+{
+  unsigned int index;
+  unsigned int check;
+
+  index = GNUNET_CORE_connection_compute_index_of_peer (peer);
+  while (1)
+    {
+      lockBucket (index);
+      /* the table may have been resized while we were waiting */
+      check = GNUNET_CORE_connection_compute_index_of_peer (peer);
+      if (check == index)
+        return index;
+      unlockBucket (index);
+      index = check;
+    }
+}
+
+/**
+ * Acquire all bucket locks.  The table lock must be held.
+ */
+static void
+lockAllBuckets ()
+{
+  unsigned int i;
+
+  for (i = 0; i < CONNECTION_MAX_BUCKETS; i++)
+    lockBucket (i);
+}
+
+/**
+ * Release all bucket locks.
+ */
+static void
+unlockAllBuckets ()
+{
+  unsigned int i;
+
+  for (i = CONNECTION_MAX_BUCKETS; i > 0; i--)
+    unlockBucket (i - 1);
+}
+
+/**
+ * Exchange the lock of the given bucket (held exactly once) for the
+ * table lock and the bucket lock, respecting the lock order.  Used
+ * before calling into other modules.  The caller must ensure that
+ * the entries of the bucket are not freed while the bucket lock is
+ * released (see BufferEntry.inSendBuffer).
+ *
+ * @param index index of the bucket in CONNECTION_buffer_
+ */
+static void
+escalateBucketLock (unsigned int index)
+{
+  unlockBucket (index);
+  lockTable ();
+  lockBucket (index);
+}
+
 static void
 check_invariants ()
 {
   int i;
   BufferEntry *root;
 
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   for (i = 0; i < CONNECTION_MAX_HOSTS_; i++)
     {
+      lockBucket (i);
       root = CONNECTION_buffer_[i];
       while (NULL != root)
         {
@@ -746,6 +1017,7 @@ check_invariants ()
                                                             __FILE__));
           root = root->overflowChain;
         }
+      unlockBucket (i);
     }
   GNUNET_mutex_unlock (lock);
 }
@@ -795,7 +1067,6 @@ initBufferEntry ()
   memset (be, 0, sizeof (BufferEntry));
   be->isAlive = 0;
   be->status = STAT_DOWN;
-  be->sendBuffer = NULL;
   be->sendBufferSize = 0;
   be->overflowChain = NULL;
   be->session.tsession = NULL;
@@ -871,44 +1142,264 @@ gcd (int a, int b)
 }
 
 /**
- * Approximate a solution to the 0-1 knapsack problem
- * using a greedy heuristic.  This function assumes that
- * the entries in the sendBuffer are ALREADY sorted
- * (by priority/len).
+ * Does entry a go before entry b in the given send queue?
+ */
+static int
+sendEntryBefore (unsigned int queue, const SendEntry * a, const SendEntry * b)
+{
+  unsigned long long da;
+  unsigned long long db;
+
+  if (queue == SQ_DEADLINE)
+    {
+      if (a->transmissionTime != b->transmissionTime)
+        return a->transmissionTime < b->transmissionTime;
+      return (int) (a->seq - b->seq) < 0;
+    }
+  /* compare priority per byte without dividing */
+  da = (unsigned long long) a->pri * b->len;
+  db = (unsigned long long) b->pri * a->len;
+  if (queue == SQ_PRIORITY)
+    {
+      if (da != db)
+        return da > db;
+      return (int) (a->seq - b->seq) < 0;       /* older first */
+    }
+  if (da != db)
+    return da < db;
+  return (int) (a->seq - b->seq) > 0;   /* newer first */
+}
+
+static void
+sendQueueSet (BufferEntry * be, unsigned int queue, unsigned int pos,
+              SendEntry * se)
+{
+  be->sendBuffer[queue].entries[pos] = se;
+  se->queuePos[queue] = pos;
+}
+
+static void
+sendQueueUp (BufferEntry * be, unsigned int queue, unsigned int pos)
+{
+  SendQueue *q = &be->sendBuffer[queue];
+  SendEntry *se;
+  unsigned int parent;
+
+  se = q->entries[pos];
+  while (pos > 0)
+    {
+      parent = (pos - 1) / 2;
+      if (!sendEntryBefore (queue, se, q->entries[parent]))
+        break;
+      sendQueueSet (be, queue, pos, q->entries[parent]);
+      pos = parent;
+    }
+  sendQueueSet (be, queue, pos, se);
+}
+
+static void
+sendQueueDown (BufferEntry * be, unsigned int queue, unsigned int pos)
+{
+  SendQueue *q = &be->sendBuffer[queue];
+  SendEntry *se;
+  unsigned int child;
+
+  se = q->entries[pos];
+  while ((child = 2 * pos + 1) < q->count)
+    {
+      if ((child + 1 < q->count) &&
+          sendEntryBefore (queue, q->entries[child + 1], q->entries[child]))
+        child++;
+      if (!sendEntryBefore (queue, q->entries[child], se))
+        break;
+      sendQueueSet (be, queue, pos, q->entries[child]);
+      pos = child;
+    }
+  sendQueueSet (be, queue, pos, se);
+}
+
+static void
+sendQueueInsert (BufferEntry * be, unsigned int queue, SendEntry * se)
+{
+  SendQueue *q = &be->sendBuffer[queue];
+
+  if (q->count == q->size)
+    GNUNET_array_grow (q->entries, q->size, q->size * 2 + 16);
+  q->entries[q->count] = se;
+  sendQueueUp (be, queue, q->count++);
+}
+
+static void
+sendQueueRemove (BufferEntry * be, unsigned int queue, SendEntry * se)
+{
+  SendQueue *q = &be->sendBuffer[queue];
+  unsigned int pos;
+
+  pos = se->queuePos[queue];
+  GNUNET_GE_ASSERT (ectx, (pos < q->count) && (q->entries[pos] == se));
+  q->count--;
+  if (pos == q->count)
+    return;
+  sendQueueSet (be, queue, pos, q->entries[q->count]);
+  sendQueueDown (be, queue, pos);
+  sendQueueUp (be, queue, pos);
+}
+
+/**
+ * Insert an entry into the send buffer.  Assumes that access
+ * to be is already synchronized.
  *
- * The code falls back to this function if the CPU is
- * too busy.  As long as the CPU is idle, solveKnapsack
- * is used.
+ * @param be the connection
+ * @param se the entry to add
+ */
+static void
+insertSendEntry (BufferEntry * be, SendEntry * se)
+{
+  unsigned int i;
+
+  GNUNET_GE_ASSERT (ectx, se->len != 0);
+  se->seq = be->sendBufferSeq++;
+  for (i = 0; i < SQ_COUNT; i++)
+    sendQueueInsert (be, i, se);
+  be->sendBufferSize++;
+  be->sendBufferBytes += se->len;
+  if (se->pri >= GNUNET_EXTREME_PRIORITY)
+    be->sendBufferExtreme++;
+}
+
+/**
+ * Take an entry out of the send buffer (the caller
+ * becomes responsible for freeing it).
+ */
+static void
+removeSendEntry (BufferEntry * be, SendEntry * se)
+{
+  unsigned int i;
+
+  for (i = 0; i < SQ_COUNT; i++)
+    sendQueueRemove (be, i, se);
+  be->sendBufferSize--;
+  be->sendBufferBytes -= se->len;
+  if (se->pri >= GNUNET_EXTREME_PRIORITY)
+    be->sendBufferExtreme--;
+}
+
+/**
+ * Free all entries in the send buffer.
+ */
+static void
+discardSendBuffer (BufferEntry * be)
+{
+  SendQueue *q = &be->sendBuffer[SQ_DEADLINE];
+  unsigned int i;
+
+  for (i = 0; i < q->count; i++)
+    {
+      GNUNET_free_non_null (q->entries[i]->closure);
+      GNUNET_free (q->entries[i]);
+    }
+  for (i = 0; i < SQ_COUNT; i++)
+    {
+      GNUNET_array_grow (be->sendBuffer[i].entries, be->sendBuffer[i].size,
+                         0);
+      be->sendBuffer[i].count = 0;
+    }
+  GNUNET_array_grow (be->candidates, be->candidateSize, 0);
+  be->candidateCount = 0;
+  be->sendBufferSize = 0;
+  be->sendBufferBytes = 0;
+  be->sendBufferExtreme = 0;
+}
+
+/**
+ * Take the entry with the highest priority per byte that was not
+ * yet considered out of the SQ_PRIORITY queue and add it to the
+ * candidates of the current selection.  requeueCandidates must be
+ * called once the selection is done.
+ *
+ * @return NULL if all entries have been considered
+ */
+static SendEntry *
+nextCandidate (BufferEntry * be)
+{
+  SendEntry *se;
+
+  if (be->sendBuffer[SQ_PRIORITY].count == 0)
+    return NULL;
+  se = be->sendBuffer[SQ_PRIORITY].entries[0];
+  sendQueueRemove (be, SQ_PRIORITY, se);
+  if (be->candidateCount == be->candidateSize)
+    GNUNET_array_grow (be->candidates, be->candidateSize,
+                       be->candidateSize * 2 + 16);
+  be->candidates[be->candidateCount++] = se;
+  se->knapsackSolution = GNUNET_NO;
+  return se;
+}
+
+/**
+ * Put the candidates of the current selection back into
+ * the SQ_PRIORITY queue (they remain candidates).
+ */
+static void
+requeueCandidates (BufferEntry * be)
+{
+  unsigned int i;
+
+  for (i = 0; i < be->candidateCount; i++)
+    sendQueueInsert (be, SQ_PRIORITY, be->candidates[i]);
+}
+
+/**
+ * Approximate a solution to the 0-1 knapsack problem using a greedy
+ * heuristic: consider the entries by priority per byte and take
+ * every entry that still fits.  The entries that were considered
+ * become the candidates for solveKnapsack.
  *
  * @param be the send buffer that is scheduled
  * @param available what is the maximum length available?
+ * @param bound set to an upper bound for the priority that an
+ *        optimal solution can achieve
  * @return the overall priority that was achieved
  */
 static unsigned int
-approximateKnapsack (BufferEntry * be, unsigned int available)
+approximateKnapsack (BufferEntry * be, unsigned int available,
+                     unsigned long long *bound)
 {
-  unsigned int i;
-  unsigned int count;
-  SendEntry **entries;
-  int max;
-  int left;
+  SendEntry *entry;
+  unsigned int left;
+  unsigned int max;
+  unsigned int skipped;
 
-  entries = be->sendBuffer;
-  count = be->sendBufferSize;
   left = available;
   max = 0;
-
-  for (i = 0; i < count; i++)
+  skipped = 0;
+  *bound = 0;
+  while ((left >= sizeof (GNUNET_MessageHeader)) &&
+         (skipped <= MAX_SKIPPED_ENTRIES) &&
+         (NULL != (entry = nextCandidate (be))))
     {
-      if (entries[i]->len <= left)
+      if (entry->len <= left)
         {
-          entries[i]->knapsackSolution = GNUNET_YES;
-          left -= entries[i]->len;
-          max += entries[i]->pri;
+          entry->knapsackSolution = GNUNET_YES;
+          left -= entry->len;
+          max += entry->pri;
+          continue;
         }
-      else
+      /* the optimum can not beat filling the remaining
+         space with (a fraction of) the first entry that
+         does not fit (LP relaxation) */
+      if (skipped == 0)
+        *bound = max + (unsigned long long) left * entry->pri / entry->len
+          + 1;
+      skipped++;
+    }
+  if (skipped == 0)
+    {
+      *bound = max;
+      if (be->sendBuffer[SQ_PRIORITY].count > 0)
         {
-          entries[i]->knapsackSolution = GNUNET_NO;
+          entry = be->sendBuffer[SQ_PRIORITY].entries[0];
+          *bound += (unsigned long long) left * entry->pri / entry->len + 1;
         }
     }
   return max;
@@ -918,6 +1409,7 @@ approximateKnapsack (BufferEntry * be, unsigned int available)
  * Solve the 0-1 knapsack problem.  Given "count" "entries" of
  * different "len" and "pri"ority and the amount of space "available",
  * compute the "solution", which is the set of entries to transport.
+ * The entries are the candidates found by approximateKnapsack.
  *
  * Solving this problem is NP complete in "count", but given that
  * available is small, the complexity is actually
@@ -940,8 +1432,8 @@ solveKnapsack (BufferEntry * be, unsigned int available)
 #define VARR(i,j) v[(i)+(j)*(count+1)]
 
   ENTRY ();
-  entries = be->sendBuffer;
-  count = be->sendBufferSize;
+  entries = be->candidates;
+  count = be->candidateCount;
 
   /* fast test: schedule everything? */
   max = 0;
@@ -1104,9 +1596,8 @@ checkSendFrequency (BufferEntry * be)
   int load;
   unsigned int i;
 
-  for (i = 0; i < be->sendBufferSize; i++)
-    if (be->sendBuffer[i]->pri >= GNUNET_EXTREME_PRIORITY)
-      return GNUNET_OK;
+  if (be->sendBufferExtreme > 0)
+    return GNUNET_OK;
 
   if (be->max_bpm == 0)
     be->max_bpm = 1;
@@ -1152,7 +1643,8 @@ checkSendFrequency (BufferEntry * be)
 }
 
 /**
- * Select a subset of the messages for sending.
+ * Select a subset of the messages for sending.  The selected
+ * messages are the candidates of be with knapsackSolution set.
  *
  * @param *priority is set to the achieved message priority
  * @return total number of bytes of messages selected
@@ -1162,54 +1654,52 @@ static unsigned int
 selectMessagesToSend (BufferEntry * be, unsigned int *priority)
 {
   unsigned int totalMessageSize;
+  unsigned int available;
+  unsigned int skipped;
+  unsigned long long bound;
   SendEntry *entry;
+  SendEntry *first;
   int i;
   int j;
   int approxProb;
+  int exact;
   GNUNET_CronTime deadline;
 
   totalMessageSize = 0;
   (*priority) = 0;
-
-  for (i = be->sendBufferSize - 1; i >= 0; i--)
-    be->sendBuffer[i]->knapsackSolution = GNUNET_NO;
+  be->candidateCount = 0;
 
   if (be->session.mtu == 0)
     {
       totalMessageSize = sizeof (GNUNET_TransportPacket_HEADER);
       deadline = (GNUNET_CronTime) - 1L;        /* infinity */
 
-      i = 0;
-      /* assumes entries are sorted by priority! */
-      while (i < be->sendBufferSize)
+      /* candidates come by priority per byte */
+      first = nextCandidate (be);
+      entry = first;
+      while ((entry != NULL) &&
+             (totalMessageSize + entry->len < GNUNET_MAX_BUFFER_SIZE - 64) &&
+             (entry->pri >= GNUNET_EXTREME_PRIORITY))
         {
-          entry = be->sendBuffer[i];
-          if ((totalMessageSize + entry->len < GNUNET_MAX_BUFFER_SIZE - 64) &&
-              (entry->pri >= GNUNET_EXTREME_PRIORITY))
-            {
-              entry->knapsackSolution = GNUNET_YES;
-              if (entry->transmissionTime < deadline)
-                deadline = entry->transmissionTime;
-              (*priority) += entry->pri;
-              totalMessageSize += entry->len;
-            }
-          else
-            {
-              entry->knapsackSolution = GNUNET_NO;
-              break;
-            }
-          i++;
+          entry->knapsackSolution = GNUNET_YES;
+          if (entry->transmissionTime < deadline)
+            deadline = entry->transmissionTime;
+          (*priority) += entry->pri;
+          totalMessageSize += entry->len;
+          entry = nextCandidate (be);
         }
-      if ((i == 0) && (be->sendBuffer[i]->len > be->available_send_window))
+      if ((first == NULL) ||
+          ((entry == first) && (first->len > be->available_send_window)))
         {
+          requeueCandidates (be);
           return 0;             /* always wait for the highest-priority
                                    message (otherwise large messages may
                                    starve! */
         }
-      while ((i < be->sendBufferSize) &&
+      skipped = 0;
+      while ((entry != NULL) &&
              (be->available_send_window > totalMessageSize))
         {
-          entry = be->sendBuffer[i];
           if ((entry->len + totalMessageSize <= be->available_send_window) &&
               (totalMessageSize + entry->len < GNUNET_MAX_BUFFER_SIZE - 64))
             {
@@ -1221,18 +1711,21 @@ selectMessagesToSend (BufferEntry * be, unsigned int *priority)
             }
           else
             {
-              entry->knapsackSolution = GNUNET_NO;
               if (totalMessageSize == sizeof (GNUNET_TransportPacket_HEADER))
                 {
                   /* if the highest-priority message does not yet
                      fit, wait for send window to grow so that
                      we can get it out (otherwise we would starve
                      high-priority, large messages) */
+                  requeueCandidates (be);
                   return 0;
                 }
+              if (++skipped > MAX_SKIPPED_ENTRIES)
+                break;
             }
-          i++;
+          entry = nextCandidate (be);
         }
+      requeueCandidates (be);
       if ((totalMessageSize == sizeof (GNUNET_TransportPacket_HEADER)) ||
           (((*priority) < GNUNET_EXTREME_PRIORITY) &&
            ((totalMessageSize / sizeof (GNUNET_TransportPacket_HEADER)) < 4)
@@ -1243,14 +1736,21 @@ selectMessagesToSend (BufferEntry * be, unsigned int *priority)
              a small message if there is nothing else to do! */
           return 0;
         }
+      if (stats != NULL)
+        stats->change (stat_select_greedy, 1);
     }
   else
     {                           /* if (be->session.mtu == 0) */
-      /* solve knapsack problem, compute accumulated priority */
+      available = be->session.mtu - sizeof (GNUNET_TransportPacket_HEADER);
+      (*priority) = approximateKnapsack (be, available, &bound);
+      /* only solve the knapsack problem exactly if that
+         may be significantly better than the greedy solution */
+      exact = (bound * 100 >
+               (unsigned long long) (*priority) * (100 + knapsack_margin));
       approxProb = GNUNET_cpu_get_load (ectx, cfg);
       if (approxProb < 0)
         approxProb = 50;        /* failed to determine load, assume 50% */
-      if (approxProb > 50)
+      if ((exact) && (approxProb > 50))
         {
           if (approxProb > 100)
             approxProb = 100;
@@ -1259,51 +1759,37 @@ selectMessagesToSend (BufferEntry * be, unsigned int *priority)
           /* control CPU load probabilistically! */
           if (GNUNET_random_u32 (GNUNET_RANDOM_QUALITY_WEAK, 1 + approxProb)
               == 0)
-            {
-              (*priority) = approximateKnapsack (be,
-                                                 be->session.mtu -
-                                                 sizeof
-                                                 (GNUNET_TransportPacket_HEADER));
-#if DEBUG_COLLECT_PRIO
-              FPRINTF (prioFile, "%llu 0 %u\n", GNUNET_get_time (),
-                       *priority);
-#endif
-            }
-          else
-            {
-              (*priority) = solveKnapsack (be,
-                                           be->session.mtu -
-                                           sizeof
-                                           (GNUNET_TransportPacket_HEADER));
+            exact = GNUNET_NO;
+        }
+      if (exact)
+        {
+          (*priority) = solveKnapsack (be, available);
+          if (stats != NULL)
+            stats->change (stat_select_knapsack, 1);
 #if DEBUG_COLLECT_PRIO
-              FPRINTF (prioFile, "%llu 1 %u\n", GNUNET_get_time (),
-                       *priority);
+          FPRINTF (prioFile, "%llu 1 %u\n", GNUNET_get_time (), *priority);
 #endif
-            }
         }
       else
-        {                       /* never approximate < 50% CPU load */
-          (*priority) = solveKnapsack (be,
-                                       be->session.mtu -
-                                       sizeof
-                                       (GNUNET_TransportPacket_HEADER));
+        {
+          if (stats != NULL)
+            stats->change (stat_select_greedy, 1);
 #if DEBUG_COLLECT_PRIO
-          FPRINTF (prioFile, "%llu 2 %u\n", GNUNET_get_time (), *priority);
+          FPRINTF (prioFile, "%llu 0 %u\n", GNUNET_get_time (), *priority);
 #endif
         }
+      requeueCandidates (be);
       j = 0;
       totalMessageSize = 0;
-      for (i = 0; i < be->sendBufferSize; i++)
+      for (i = 0; i < be->candidateCount; i++)
         {
-          if (be->sendBuffer[i]->knapsackSolution == GNUNET_YES)
+          if (be->candidates[i]->knapsackSolution == GNUNET_YES)
             {
-              totalMessageSize += be->sendBuffer[i]->len;
+              totalMessageSize += be->candidates[i]->len;
               j++;
             }
         }
-      if ((j == 0) ||
-          (totalMessageSize >
-           be->session.mtu - sizeof (GNUNET_TransportPacket_HEADER)))
+      if ((j == 0) || (totalMessageSize > available))
         {
           GNUNET_GE_BREAK (ectx, 0);
           GNUNET_GE_LOG (ectx,
@@ -1311,17 +1797,16 @@ selectMessagesToSend (BufferEntry * be, unsigned int *priority)
                          GNUNET_GE_DEVELOPER,
                          _
                          ("`%s' selected %d out of %d messages (MTU: %d).\n"),
-                         __FUNCTION__, j, be->sendBufferSize,
-                         be->session.mtu -
-                         sizeof (GNUNET_TransportPacket_HEADER));
+                         __FUNCTION__, j, be->candidateCount, available);
 
-          for (j = 0; j < be->sendBufferSize; j++)
+          for (j = 0; j < be->candidateCount; j++)
             GNUNET_GE_LOG (ectx,
                            GNUNET_GE_ERROR | GNUNET_GE_BULK |
                            GNUNET_GE_DEVELOPER,
                            _
                            ("Message details: %u: length %d, priority: %d\n"),
-                           j, be->sendBuffer[j]->len, be->sendBuffer[j]->pri);
+                           j, be->candidates[j]->len,
+                           be->candidates[j]->pri);
           return 0;
         }
 
@@ -1347,7 +1832,30 @@ selectMessagesToSend (BufferEntry * be, unsigned int *priority)
   return totalMessageSize;
 }
 
-
+/**
+ * Drop an entry from the send buffer.
+ */
+static void
+dropSendEntry (BufferEntry * be, SendEntry * entry)
+{
+#if DEBUG_CONNECTION
+  GNUNET_GE_LOG (ectx,
+                 GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_USER,
+                 "expiring message, expired %ds ago, queue size is %llu (bandwidth stressed)\n",
+                 (int) ((GNUNET_get_time () -
+                         entry->transmissionTime) / GNUNET_CRON_SECONDS),
+                 be->sendBufferBytes);
+#endif
+  if (stats != NULL)
+    {
+      stats->change (stat_messagesDropped, 1);
+      stats->change (stat_sizeMessagesDropped, entry->len);
+    }
+  removeSendEntry (be, entry);
+  GNUNET_free_non_null (entry->closure);
+  GNUNET_free (entry);
+}
+
 /**
  * Expire old messages from SendBuffer (to avoid
  * running out of memory).
@@ -1356,13 +1864,12 @@ static void
 expireSendBufferEntries (BufferEntry * be)
 {
   unsigned long long msgCap;
-  int i;
   SendEntry *entry;
   GNUNET_CronTime expired;
   int load;
-  unsigned long long usedBytes;
-  int j;
 
+  /* the candidates may be freed below */
+  be->candidateCount = 0;
   /* if it's more than one connection "lifetime" old, always kill it! */
   be->lastSendAttempt = GNUNET_get_time ();
   expired = be->lastSendAttempt - SECONDS_PINGATTEMPT * GNUNET_CRON_SECONDS;
@@ -1382,58 +1889,40 @@ expireSendBufferEntries (BufferEntry * be)
       msgCap += (MAX_SEND_BUFFER_SIZE - EXPECTED_MTU) / load;
     }
 
-  usedBytes = 0;
-  /* allow at least msgCap bytes in buffer */
-  for (i = 0; i < be->sendBufferSize; i++)
+  while (be->sendBuffer[SQ_DEADLINE].count > 0)
     {
-      entry = be->sendBuffer[i];
-      if (entry == NULL)
-        continue;
-
-      if ((entry->transmissionTime <= expired) || (usedBytes > msgCap))
-        {
-#if DEBUG_CONNECTION
-          GNUNET_GE_LOG (ectx,
-                         GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_USER,
-                         "expiring message, expired %ds ago, queue size is %llu (bandwidth stressed)\n",
-                         (int) ((GNUNET_get_time () -
-                                 entry->transmissionTime) /
-                                GNUNET_CRON_SECONDS), usedBytes);
-#endif
-          if (stats != NULL)
-            {
-              stats->change (stat_messagesDropped, 1);
-              stats->change (stat_sizeMessagesDropped, entry->len);
-            }
-          GNUNET_free_non_null (entry->closure);
-          GNUNET_free (entry);
-          be->sendBuffer[i] = NULL;
-        }
-      else
-        usedBytes += entry->len;
+      entry = be->sendBuffer[SQ_DEADLINE].entries[0];
+      if (entry->transmissionTime > expired)
+        break;
+      dropSendEntry (be, entry);
+    }
+  /* allow at least msgCap bytes in buffer (for the
+     entries with the highest priority per byte) */
+  while (be->sendBuffer[SQ_DROP].count > 0)
+    {
+      entry = be->sendBuffer[SQ_DROP].entries[0];
+      if (be->sendBufferBytes - entry->len <= msgCap)
+        break;
+      dropSendEntry (be, entry);
     }
-
-  /* cleanup/compact sendBuffer */
-  j = 0;
-  for (i = 0; i < be->sendBufferSize; i++)
-    if (be->sendBuffer[i] != NULL)
-      be->sendBuffer[j++] = be->sendBuffer[i];
-  GNUNET_array_grow (be->sendBuffer, be->sendBufferSize, j);
 }
 
 /**
- * For each SendEntry of the BE that has
- * been selected by the knapsack solver,
+ * For each of the given SendEntries (which have
+ * been selected by the knapsack solver),
  * call the callback and make sure that the
  * bytes are ready in entry->closure for
  * transmission.<p>
  *
  * If the preparation fails for an entry,
- * free it.
+ * free it (and set its slot to NULL).
+ *
+ * @param entries the selected entries
+ * @param count number of entries
  * @return number of prepared entries
  */
 static unsigned int
-prepareSelectedMessages (BufferEntry * be)
+prepareSelectedMessages (SendEntry ** entries, unsigned int count)
 {
   unsigned int ret;
   int i;
@@ -1441,69 +1930,51 @@ prepareSelectedMessages (BufferEntry * be)
   SendEntry *entry;
 
   ret = 0;
-  for (i = 0; i < be->sendBufferSize; i++)
+  for (i = 0; i < count; i++)
     {
-      entry = be->sendBuffer[i];
-
-      if (entry->knapsackSolution == GNUNET_YES)
+      entry = entries[i];
+      if (entry->callback != NULL)
         {
-          if (entry->callback != NULL)
+          tmpMsg = GNUNET_malloc (entry->len);
+          if (GNUNET_OK ==
+              entry->callback (tmpMsg, entry->closure, entry->len))
             {
-              tmpMsg = GNUNET_malloc (entry->len);
-              if (GNUNET_OK ==
-                  entry->callback (tmpMsg, entry->closure, entry->len))
-                {
-                  entry->callback = NULL;
-                  entry->closure = tmpMsg;
-                  ret++;
-                }
-              else
-                {
-                  GNUNET_free (tmpMsg);
-                  entry->callback = NULL;
-                  entry->closure = NULL;
-                  GNUNET_free (entry);
-                  be->sendBuffer[i] = NULL;
-                }
+              entry->callback = NULL;
+              entry->closure = tmpMsg;
+              ret++;
             }
           else
             {
-              ret++;
+              GNUNET_free (tmpMsg);
+              entry->callback = NULL;
+              entry->closure = NULL;
+              GNUNET_free (entry);
+              entries[i] = NULL;
             }
-#if 0
-          {
-            GNUNET_MessageHeader *hdr;
-            GNUNET_EncName enc;
-
-            hdr = (GNUNET_MessageHeader *) entry->closure;
-            IF_GELOG (ectx,
-                      GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_USER,
-                      GNUNET_hash_to_enc (&be->session.sender.hashPubKey,
-                                          &enc));
-            GNUNET_GE_LOG (ectx,
-                           GNUNET_GE_DEBUG | GNUNET_GE_REQUEST |
-                           GNUNET_GE_USER,
-                           "Core selected message of type %u and size %u for sending to peer `%s'.\n",
-                           ntohs (hdr->type), ntohs (hdr->size), &enc);
-          }
-#endif
+        }
+      else
+        {
+          ret++;
         }
     }
   return ret;
 }
 
 /**
- * Compute a random permuation of the send buffer
- * entry such that the selected messages obey
+ * Compute a random permuation of the selected
+ * entries such that the messages obey
  * the SE flags.
  *
+ * @param entries the selected entries (may contain NULLs)
+ * @param count number of entries
  * @param  selected_total set to the number of
  *         entries returned
  * @return allocated (caller-frees) buffer with
  *         permuted SendEntries
  */
 static SendEntry **
-permuteSendBuffer (BufferEntry * be, unsigned int *selected_total)
+permuteSendBuffer (SendEntry ** entries, unsigned int count,
+                   unsigned int *selected_total)
 {
   unsigned int tailpos;
   unsigned int headpos;
@@ -1515,25 +1986,17 @@ permuteSendBuffer (BufferEntry * be, unsigned int *selected_total)
   SendEntry *tmp;
 
   stotal = 0;
-  for (i = 0; i < be->sendBufferSize; i++)
-    {
-      if (be->sendBuffer[i] == NULL)
-        continue;
-      if (be->sendBuffer[i]->knapsackSolution == GNUNET_YES)
-        stotal++;
-    }
+  for (i = 0; i < count; i++)
+    if (entries[i] != NULL)
+      stotal++;
   *selected_total = stotal;
   if (stotal == 0)
     return NULL;
   ret = GNUNET_malloc (stotal * sizeof (SendEntry *));
   j = 0;
-  for (i = 0; i < be->sendBufferSize; i++)
-    {
-      if (be->sendBuffer[i] == NULL)
-        continue;
-      if (be->sendBuffer[i]->knapsackSolution == GNUNET_YES)
-        ret[j++] = be->sendBuffer[i];
-    }
+  for (i = 0; i < count; i++)
+    if (entries[i] != NULL)
+      ret[j++] = entries[i];
   for (j = 0; j < stotal; j++)
     {
       rnd = GNUNET_random_u32 (GNUNET_RANDOM_QUALITY_WEAK, stotal);
@@ -1568,32 +2031,25 @@ permuteSendBuffer (BufferEntry * be, unsigned int *selected_total)
 }
 
 /**
- * Free entries in send buffer that were
- * selected as the knapsack solution or
- * that are dead (callback and closure NULL).
+ * Free the given (selected) entries.
+ *
+ * @param entries the selected entries (may contain NULLs)
+ * @param count number of entries
  */
 static void
-freeSelectedEntries (BufferEntry * be)
+freeSelectedEntries (SendEntry ** entries, unsigned int count)
 {
   int i;
   SendEntry *entry;
 
-  for (i = 0; i < be->sendBufferSize; i++)
+  for (i = 0; i < count; i++)
     {
-      entry = be->sendBuffer[i];
-      GNUNET_GE_ASSERT (ectx, entry != NULL);
-      if (entry->knapsackSolution == GNUNET_YES)
-        {
-          GNUNET_GE_ASSERT (ectx, entry->callback == NULL);
-          GNUNET_free_non_null (entry->closure);
-          GNUNET_free (entry);
-          be->sendBuffer[i] = NULL;
-        }
-      else if ((entry->callback == NULL) && (entry->closure == NULL))
-        {
-          GNUNET_free (entry);
-          be->sendBuffer[i] = NULL;
-        }
+      entry = entries[i];
+      if (entry == NULL)
+        continue;
+      GNUNET_free_non_null (entry->closure);
+      GNUNET_free (entry);
+      entries[i] = NULL;
     }
 }
 
@@ -1605,11 +2061,8 @@ freeSelectedEntries (BufferEntry * be)
 static void
 fragmentIfNecessary (BufferEntry * be)
 {
-  SendEntry **entries;
   SendEntry *entry;
   unsigned int i;
-  unsigned int ret;
-  unsigned int j;
   int changed;
 
   if (be->session.mtu == 0)
@@ -1620,18 +2073,13 @@ fragmentIfNecessary (BufferEntry * be)
   while (changed)
     {
       changed = GNUNET_NO;
-      entries = be->sendBuffer;
-      ret = be->sendBufferSize;
-      for (i = 0; i < ret; i++)
+      for (i = 0; i < be->sendBufferSize; i++)
         {
-          entry = entries[i];
+          entry = be->sendBuffer[SQ_DEADLINE].entries[i];
           if (entry->len <=
               be->session.mtu - sizeof (GNUNET_TransportPacket_HEADER))
             continue;
-          ret--;
-          for (j = i; j < ret; j++)
-            entries[j] = entries[j + 1];        /* preserve ordering */
-          GNUNET_array_grow (be->sendBuffer, be->sendBufferSize, ret);
+          removeSendEntry (be, entry);
           /* calling fragment will change be->sendBuffer;
              thus we need to restart from the beginning afterwards... */
           be->consider_transport_switch = GNUNET_YES;
@@ -1675,11 +2123,17 @@ ensureTransportConnected (BufferEntry * be)
 }
 
 /**
- * Send a buffer; assumes that access is already synchronized.  This
- * message solves the knapsack problem, assembles the message
- * (callback to build parts from knapsack, callbacks for padding,
- * random noise padding, crc, encryption) and finally hands the
- * message to the transport service.
+ * Send a buffer.  The caller must hold the lock of the bucket of "be"
+ * (exactly once).  This method solves the knapsack problem, assembles
+ * the message (callback to build parts from knapsack, callbacks for
+ * padding, random noise padding, crc, encryption) and finally hands
+ * the message to the transport service.<p>
+ *
+ * Only the message selection is done under the bucket lock.  The
+ * callbacks that build the message are run under the table lock,
+ * while encryption and transmission are done without holding any
+ * lock of the connection module.  Meanwhile, "inSendBuffer" keeps
+ * the entry from being freed, recycled or moved to another bucket.
  *
  * @param be connection of the buffer that is to be transmitted
  * @return GNUNET_YES if we might want to be re-run
@@ -1691,6 +2145,7 @@ sendBuffer (BufferEntry * be)
   unsigned int j;
   unsigned int p;
   unsigned int rsi;
+  unsigned int bucket;
   struct SendCallbackList *pos;
   GNUNET_TransportPacket_HEADER *p2pHdr;
   unsigned int priority;
@@ -1699,8 +2154,16 @@ sendBuffer (BufferEntry * be)
   unsigned int totalMessageSize;
   int ret;
   SendEntry **entries;
+  SendEntry **selected;
+  unsigned int scount;
   unsigned int stotal;
   GNUNET_TSession *tsession;
+  GNUNET_AES_SessionKey skey;
+  struct GNUNET_AES_Context *skey_ctx;
+  GNUNET_PeerIdentity receiver;
+  unsigned int sequenceNumber;
+  unsigned int bandwidth;
+  unsigned short mtu;
 
   ENTRY ();
   /* fast ways out */
@@ -1714,9 +2177,20 @@ sendBuffer (BufferEntry * be)
     {
       return GNUNET_NO;         /* must not run */
     }
+  bucket = GNUNET_CORE_connection_compute_index_of_peer (&be->session.sender);
+  if (bucket_locks[bucket].depth != 1)
+    return GNUNET_NO;           /* nested call, leave it to cronDecreaseLiveness */
   be->inSendBuffer = GNUNET_YES;
-  if ((GNUNET_OK != ensureTransportConnected (be)) ||
-      (GNUNET_OK != checkSendFrequency (be)))
+  if (be->session.tsession == NULL)
+    {
+      /* connecting calls into the transport service */
+      escalateBucketLock (bucket);
+      if (be->status == STAT_UP)
+        ensureTransportConnected (be);
+      GNUNET_mutex_unlock (lock);
+    }
+  if ((be->status != STAT_UP) ||
+      (be->session.tsession == NULL) || (GNUNET_OK != checkSendFrequency (be)))
     {
       be->inSendBuffer = GNUNET_NO;
       return GNUNET_NO;
@@ -1754,6 +2228,7 @@ sendBuffer (BufferEntry * be)
   if (ret == GNUNET_SYSERR)
     {
       /* transport session is gone! re-establish! */
+      escalateBucketLock (bucket);
       tsession = be->session.tsession;
       be->session.tsession = NULL;
       if (tsession != NULL)
@@ -1778,13 +2253,9 @@ sendBuffer (BufferEntry * be)
           notify_disconnect (be);
           if (stats != NULL)
             stats->change (stat_closedTransport, 1);
-          for (i = 0; i < be->sendBufferSize; i++)
-            {
-              GNUNET_free_non_null (be->sendBuffer[i]->closure);
-              GNUNET_free (be->sendBuffer[i]);
-            }
-          GNUNET_array_grow (be->sendBuffer, be->sendBufferSize, 0);
+          discardSendBuffer (be);
         }
+      GNUNET_mutex_unlock (lock);
       /* This may have changed the MTU => need to re-do
          everything.  Since we don't want to possibly
          loop forever, give it another shot later;
@@ -1810,35 +2281,54 @@ sendBuffer (BufferEntry * be)
       be->inSendBuffer = GNUNET_NO;
       return GNUNET_NO;         /* deferr further */
     }
-
-  /* get permutation of SendBuffer Entries
-     such that SE_FLAGS are obeyed */
-  if (0 != prepareSelectedMessages (be))
+  /* keep the transport session alive while we do not hold the
+     bucket lock */
+  tsession = be->session.tsession;
+  if (GNUNET_OK != transport->associate (tsession, __FILE__))
     {
-      entries = permuteSendBuffer (be, &stotal);
-      if ((stotal == 0) || (entries == NULL))
-        {
-          /* no messages selected!? */
-          GNUNET_GE_BREAK (ectx, 0);
-          be->inSendBuffer = GNUNET_NO;
-          GNUNET_free (entries);
-          return GNUNET_NO;
-        }
+      expireSendBufferEntries (be);
+      be->inSendBuffer = GNUNET_NO;
+      return GNUNET_NO;
     }
-  else
+
+  /* take the selected entries out of the send buffer; from
+     here on, they belong to us */
+  selected = GNUNET_malloc (be->candidateCount * sizeof (SendEntry *));
+  scount = 0;
+  for (i = 0; i < be->candidateCount; i++)
     {
-      entries = NULL;
-      stotal = 0;
+      if (be->candidates[i]->knapsackSolution != GNUNET_YES)
+        continue;
+      selected[scount++] = be->candidates[i];
+      removeSendEntry (be, be->candidates[i]);
     }
-
-  /* build message */
+  be->candidateCount = 0;
+  skey = be->skey_local;
+  skey_ctx = be->skey_local_ctx;
+  if (skey_ctx != NULL)
+    GNUNET_AES_context_retain (skey_ctx);
+  receiver = be->session.sender;
+  mtu = be->session.mtu;
+  sequenceNumber = be->lastSequenceNumberSend++;
+  bandwidth =
+    be->idealized_limit * (MAX_VIOLATIONS - be->violations) / MAX_VIOLATIONS;
+  unlockBucket (bucket);
+
+  /* build message; the callbacks belong to other modules
+     and expect to be called with the table lock held */
+  lockTable ();
+  entries = NULL;
+  stotal = 0;
+  /* get permutation of SendBuffer Entries
+     such that SE_FLAGS are obeyed */
+  if ((0 != prepareSelectedMessages (selected, scount)) &&
+      (NULL == (entries = permuteSendBuffer (selected, scount, &stotal))))
+    GNUNET_GE_BREAK (ectx, 0);  /* no messages selected!? */
   plaintextMsg = GNUNET_malloc (totalMessageSize);
   p2pHdr = (GNUNET_TransportPacket_HEADER *) plaintextMsg;
   p2pHdr->timeStamp = htonl (GNUNET_get_time_int32 (NULL));
-  p2pHdr->sequenceNumber = htonl (be->lastSequenceNumberSend);
-  p2pHdr->bandwidth =
-    htonl (be->idealized_limit * (MAX_VIOLATIONS - be->violations) /
-           MAX_VIOLATIONS);
+  p2pHdr->sequenceNumber = htonl (sequenceNumber);
+  p2pHdr->bandwidth = htonl (bandwidth);
   p = sizeof (GNUNET_TransportPacket_HEADER);
   for (i = 0; i < stotal; i++)
     {
@@ -1854,12 +2344,12 @@ sendBuffer (BufferEntry * be)
     }
   GNUNET_free_non_null (entries);
   entries = NULL;
+  ret = GNUNET_NO;
   if (p > totalMessageSize)
     {
       GNUNET_GE_BREAK (ectx, 0);
-      GNUNET_free (plaintextMsg);
-      be->inSendBuffer = GNUNET_NO;
-      return GNUNET_NO;
+      GNUNET_mutex_unlock (lock);
+      goto CLEANUP;
     }
   /* still room left? try callbacks! */
   pos = scl_head;
@@ -1868,27 +2358,24 @@ sendBuffer (BufferEntry * be)
       if ((pos->minimumPadding + p >= p) &&
           (pos->minimumPadding + p <= totalMessageSize))
         {
-          rsi = pos->callback (&be->session.sender,
+          rsi = pos->callback (&receiver,
                                &plaintextMsg[p], totalMessageSize - p);
           GNUNET_GE_BREAK (ectx, rsi + p <= totalMessageSize);
           if ((rsi + p < p) || (rsi + p > totalMessageSize))
             {
               GNUNET_GE_BREAK (ectx, 0);
-              GNUNET_free (plaintextMsg);
-              be->inSendBuffer = GNUNET_NO;
-              return GNUNET_NO;
+              GNUNET_mutex_unlock (lock);
+              goto CLEANUP;
             }
           p += rsi;
         }
       pos = pos->next;
     }
-  if (((be->session.mtu != 0) &&
-       (p > be->session.mtu)) || (p > totalMessageSize))
+  GNUNET_mutex_unlock (lock);
+  if (((mtu != 0) && (p > mtu)) || (p > totalMessageSize))
     {
       GNUNET_GE_BREAK (ectx, 0);
-      GNUNET_free (plaintextMsg);
-      be->inSendBuffer = GNUNET_NO;
-      return GNUNET_NO;
+      goto CLEANUP;
     }
   /* finally padd with noise */
   if ((p + sizeof (GNUNET_MessageHeader) <= totalMessageSize) &&
@@ -1908,47 +2395,38 @@ sendBuffer (BufferEntry * be)
       if (stats != NULL)
         stats->change (stat_noise_sent, noiseLen);
     }
-  if (((be->session.mtu != 0) &&
-       (p > be->session.mtu)) || (p > totalMessageSize))
+  if (((mtu != 0) && (p > mtu)) || (p > totalMessageSize))
     {
       GNUNET_GE_BREAK (ectx, 0);
-      GNUNET_free (plaintextMsg);
-      be->inSendBuffer = GNUNET_NO;
-      return GNUNET_NO;
+      goto CLEANUP;
     }
 
+  /* encrypt and transmit without holding any lock */
   encryptedMsg = GNUNET_malloc (p);
   GNUNET_hash (&p2pHdr->sequenceNumber,
                p - sizeof (GNUNET_HashCode),
                (GNUNET_HashCode *) encryptedMsg);
-  ret = GNUNET_AES_encrypt (&p2pHdr->sequenceNumber, p - sizeof (GNUNET_HashCode), &be->skey_local, (const GNUNET_AES_InitializationVector *) encryptedMsg,     /* IV */
-                            &((GNUNET_TransportPacket_HEADER *)
-                              encryptedMsg)->sequenceNumber);
+  if (skey_ctx != NULL)
+    ret = GNUNET_AES_context_encrypt (skey_ctx, &p2pHdr->sequenceNumber, p - sizeof (GNUNET_HashCode), (const GNUNET_AES_InitializationVector *) encryptedMsg,     /* IV */
+                                      &((GNUNET_TransportPacket_HEADER *)
+                                        encryptedMsg)->sequenceNumber);
+  else
+    ret = GNUNET_AES_encrypt (&p2pHdr->sequenceNumber, p - sizeof (GNUNET_HashCode), &skey, (const GNUNET_AES_InitializationVector *) encryptedMsg, /* IV */
+                              &((GNUNET_TransportPacket_HEADER *)
+                                encryptedMsg)->sequenceNumber);
   if (stats != NULL)
     stats->change (stat_encrypted, p - sizeof (GNUNET_HashCode));
-  GNUNET_GE_ASSERT (ectx, be->session.tsession != NULL);
-  ret = transport->send (be->session.tsession, encryptedMsg, p, GNUNET_NO);
+  ret = transport->send (tsession, encryptedMsg, p, GNUNET_NO);
   if ((ret == GNUNET_NO) && (priority >= GNUNET_EXTREME_PRIORITY))
-    {
-      ret =
-        transport->send (be->session.tsession, encryptedMsg, p, GNUNET_YES);
-    }
+    ret = transport->send (tsession, encryptedMsg, p, GNUNET_YES);
+  GNUNET_free (encryptedMsg);
   if (ret == GNUNET_YES)
     {
       if (stats != NULL)
         stats->change (stat_transmitted, p);
-      be->available_send_window -= p;
-      be->lastSequenceNumberSend++;
-      GNUNET_CORE_connection_reserve_downstream_bandwidth (&be->
-                                                           session.sender, 0);
-      if (be->idealized_limit > be->max_transmitted_limit)
-        be->max_transmitted_limit = be->idealized_limit;
-      else                      /* age */
-        be->max_transmitted_limit
-          = (be->idealized_limit + be->max_transmitted_limit * 3) / 4;
-
       if (rsnSize > 0)
         {
+          lockTable ();
           j = sizeof (GNUNET_TransportPacket_HEADER);
           while (j < p)
             {
@@ -1961,43 +2439,83 @@ sendBuffer (BufferEntry * be)
                   break;
                 }
               for (rsi = 0; rsi < rsnSize; rsi++)
-                rsns[rsi] (&be->session.sender, part);
+                rsns[rsi] (&receiver, part);
               j += plen;
             }
+          GNUNET_mutex_unlock (lock);
         }
-      freeSelectedEntries (be);
     }
-  if ((ret == GNUNET_SYSERR) && (be->session.tsession != NULL))
+
+CLEANUP:
+  GNUNET_free (plaintextMsg);
+  if (skey_ctx != NULL)
+    GNUNET_AES_context_release (skey_ctx);
+  /* the transport may call back into the connection module
+     when the session is released, so this needs the table lock */
+  lockTable ();
+  transport->disconnect (tsession, __FILE__);
+  if (ret != GNUNET_SYSERR)
+    GNUNET_mutex_unlock (lock);
+  lockBucket (bucket);
+  /* nothing went out: give the sequence number back so that the
+     receiver does not see a gap (unless the session was re-keyed
+     in the meantime, which resets the counter) */
+  if ((ret != GNUNET_YES) &&
+      (be->lastSequenceNumberSend == sequenceNumber + 1))
+    be->lastSequenceNumberSend = sequenceNumber;
+  if (ret == GNUNET_YES)
+    {
+      be->available_send_window -= p;
+      GNUNET_CORE_connection_reserve_downstream_bandwidth (&be->
+                                                           session.sender, 0);
+      if (be->idealized_limit > be->max_transmitted_limit)
+        be->max_transmitted_limit = be->idealized_limit;
+      else                      /* age */
+        be->max_transmitted_limit
+          = (be->idealized_limit + be->max_transmitted_limit * 3) / 4;
+      freeSelectedEntries (selected, scount);
+    }
+  else if ((ret == GNUNET_NO) && (be->status == STAT_UP))
+    {
+      /* keep (prepared) messages for the next attempt */
+      for (i = 0; i < scount; i++)
+        if (selected[i] != NULL)
+          insertSendEntry (be, selected[i]);
+    }
+  else if (ret == GNUNET_NO)
+    {
+      /* connection was shut down in the meantime */
+      freeSelectedEntries (selected, scount);
+    }
+  else
     {
+      freeSelectedEntries (selected, scount);
+      if (be->session.tsession == tsession)
+        {
 #if DEBUG_CONNECTION
-      GNUNET_EncName enc;
-      IF_GELOG (ectx,
-                GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_DEVELOPER,
-                GNUNET_hash_to_enc (&be->session.sender.hashPubKey, &enc));
-      GNUNET_GE_LOG (ectx,
-                     GNUNET_GE_DEBUG | GNUNET_GE_REQUEST |
-                     GNUNET_GE_DEVELOPER,
-                     "Session is DOWN for `%s' due to transmission error\n",
-                     &enc);
+          GNUNET_EncName enc;
+          IF_GELOG (ectx,
+                    GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_DEVELOPER,
+                    GNUNET_hash_to_enc (&be->session.sender.hashPubKey,
+                                        &enc));
+          GNUNET_GE_LOG (ectx,
+                         GNUNET_GE_DEBUG | GNUNET_GE_REQUEST |
+                         GNUNET_GE_DEVELOPER,
+                         "Session is DOWN for `%s' due to transmission error\n",
+                         &enc);
 #endif
-      tsession = be->session.tsession;
-      be->session.tsession = NULL;
-      be->status = STAT_DOWN;
-      be->time_established = 0;
-      notify_disconnect (be);
-      if (stats != NULL)
-        stats->change (stat_closedTransport, 1);
-      transport->disconnect (tsession, __FILE__);
-      for (i = 0; i < be->sendBufferSize; i++)
-        {
-          GNUNET_free_non_null (be->sendBuffer[i]->closure);
-          GNUNET_free (be->sendBuffer[i]);
+          be->session.tsession = NULL;
+          be->status = STAT_DOWN;
+          be->time_established = 0;
+          notify_disconnect (be);
+          if (stats != NULL)
+            stats->change (stat_closedTransport, 1);
+          transport->disconnect (tsession, __FILE__);
+          discardSendBuffer (be);
         }
-      GNUNET_array_grow (be->sendBuffer, be->sendBufferSize, 0);
+      GNUNET_mutex_unlock (lock);
     }
-
-  GNUNET_free (encryptedMsg);
-  GNUNET_free (plaintextMsg);
+  GNUNET_free (selected);
   expireSendBufferEntries (be);
   be->inSendBuffer = GNUNET_NO;
   return GNUNET_NO;
@@ -2016,11 +2534,6 @@ appendToBuffer (BufferEntry * be, SendEntry * se)
 #if DEBUG_CONNECTION
   GNUNET_EncName enc;
 #endif
-  float apri;
-  unsigned int i;
-  SendEntry **ne;
-  unsigned long long queueSize;
-
   ENTRY ();
   if ((se == NULL) || (se->len == 0))
     {
@@ -2058,21 +2571,12 @@ appendToBuffer (BufferEntry * be, SendEntry * se)
       GNUNET_free (se);
       return;
     }
-  queueSize = 0;
-  for (i = 0; i < be->sendBufferSize; i++)
-    queueSize += be->sendBuffer[i]->len;
-
-  if (queueSize >= MAX_SEND_BUFFER_SIZE)
+  if (be->sendBufferBytes >= MAX_SEND_BUFFER_SIZE)
     {
       /* first, try to remedy! */
       sendBuffer (be);
       /* did it work? */
-
-      queueSize = 0;
-      for (i = 0; i < be->sendBufferSize; i++)
-        queueSize += be->sendBuffer[i]->len;
-
-      if (queueSize >= MAX_SEND_BUFFER_SIZE)
+      if (be->sendBufferBytes >= MAX_SEND_BUFFER_SIZE)
         {
           /* we need to enforce some hard limit here, otherwise we may take
              FAR too much memory (200 MB easily) */
@@ -2081,27 +2585,7 @@ appendToBuffer (BufferEntry * be, SendEntry * se)
           return;
         }
     }
-  /* grow send buffer, insertion sort! */
-  ne = GNUNET_malloc ((be->sendBufferSize + 1) * sizeof (SendEntry *));
-  GNUNET_GE_ASSERT (ectx, se->len != 0);
-  apri = (float) se->pri / (float) se->len;
-  i = 0;
-  while ((i < be->sendBufferSize) &&
-         (((float) be->sendBuffer[i]->pri /
-           (float) be->sendBuffer[i]->len) >= apri))
-    {
-      ne[i] = be->sendBuffer[i];
-      i++;
-    }
-  ne[i++] = se;
-  while (i < be->sendBufferSize + 1)
-    {
-      ne[i] = be->sendBuffer[i - 1];
-      i++;
-    }
-  GNUNET_free_non_null (be->sendBuffer);
-  be->sendBuffer = ne;
-  be->sendBufferSize++;
+  insertSendEntry (be, se);
   sendBuffer (be);
 }
 
@@ -2135,7 +2619,8 @@ lookForHost (const GNUNET_PeerIdentity * hostId)
  * table, the table entry is returned.  If the connection is down,
  * the session service is asked to try to establish a connection.
  *
- * The connection lock must be held when calling this function.
+ * The connection lock and the lock of the bucket of the
+ * peer must be held when calling this function.
  *
  * @param establishSession should we try to establish a session?
  * @param hostId for which peer should we get/create a connection
@@ -2157,8 +2642,10 @@ addHost (const GNUNET_PeerIdentity * hostId, int establishSession)
       prev = NULL;
       while (NULL != root)
         {
-          /* settle for entry in the linked list that is down */
-          if ((root->status == STAT_DOWN) ||
+          /* settle for entry in the linked list that is down
+             (and not pinned by a concurrent sendBuffer) */
+          if (((root->status == STAT_DOWN) &&
+               (root->inSendBuffer == GNUNET_NO)) ||
               (0 == memcmp (&hostId->hashPubKey,
                             &root->session.sender.hashPubKey,
                             sizeof (GNUNET_HashCode))))
@@ -2186,8 +2673,8 @@ addHost (const GNUNET_PeerIdentity * hostId, int establishSession)
 
 /**
  * Perform an operation for all connected hosts.  The BufferEntry
- * structure is passed to the method.  No synchronization or other
- * checks are performed.
+ * structure is passed to the method.  The connection lock must be
+ * held; the lock of each bucket is acquired while it is traversed.
  *
  * @param method the method to invoke (NULL for couting only)
  * @param arg the second argument to the method
@@ -2202,6 +2689,7 @@ forAllConnectedHosts (BufferEntryCallback method, void *arg)
 
   for (i = 0; i < CONNECTION_MAX_HOSTS_; i++)
     {
+      lockBucket (i);
       be = CONNECTION_buffer_[i];
       while (be != NULL)
         {
@@ -2213,6 +2701,7 @@ forAllConnectedHosts (BufferEntryCallback method, void *arg)
             }
           be = be->overflowChain;
         }
+      unlockBucket (i);
     }
   return count;
 }
@@ -2239,6 +2728,23 @@ fENHCallback (BufferEntry * be, void *arg)
     wrap->method (&be->session.sender, wrap->arg);
 }
 
+/**
+ * Release the cipher contexts of the session keys of
+ * a connection that is about to be freed.
+ *
+ * @param be the connection
+ */
+static void
+releaseSessionKeys (BufferEntry * be)
+{
+  if (be->skey_local_ctx != NULL)
+    GNUNET_AES_context_release (be->skey_local_ctx);
+  be->skey_local_ctx = NULL;
+  if (be->skey_remote_ctx != NULL)
+    GNUNET_AES_context_release (be->skey_remote_ctx);
+  be->skey_remote_ctx = NULL;
+}
+
 /**
  * Shutdown the connection.  Send a HANGUP message to the other side
  * and mark the sessionkey as dead.  Assumes access is already
@@ -2250,7 +2756,6 @@ static void
 shutdownConnection (BufferEntry * be)
 {
   P2P_hangup_MESSAGE hangup;
-  unsigned int i;
   GNUNET_TSession *tsession;
 #if DEBUG_CONNECTION
   GNUNET_EncName enc;
@@ -2314,12 +2819,69 @@ shutdownConnection (BufferEntry * be)
       be->session.tsession = NULL;
       transport->disconnect (tsession, __FILE__);
     }
-  for (i = 0; i < be->sendBufferSize; i++)
+  discardSendBuffer (be);
+}
+
+/**
+ * Change the size of the connection table to CONNECTION_target_hosts_
+ * (and rehash all entries).  The resize is deferred (and retried by
+ * cronDecreaseLiveness) while an entry is pinned by sendBuffer.  The
+ * connection lock must be held.
+ */
+static void
+resizeConnectionTable ()
+{
+  unsigned int olen;
+  unsigned int i;
+  BufferEntry **newBuffer;
+  BufferEntry *be;
+
+  lockAllBuckets ();
+  olen = CONNECTION_MAX_HOSTS_;
+  for (i = 0; i < olen; i++)
+    for (be = CONNECTION_buffer_[i]; be != NULL; be = be->overflowChain)
+      if (be->inSendBuffer == GNUNET_YES)
+        {
+          unlockAllBuckets ();
+          return;               /* try again later */
+        }
+  CONNECTION_MAX_HOSTS_ = CONNECTION_target_hosts_;
+  newBuffer =
+    (BufferEntry **) GNUNET_malloc (sizeof (BufferEntry *) *
+                                    CONNECTION_MAX_HOSTS_);
+  for (i = 0; i < CONNECTION_MAX_HOSTS_; i++)
+    newBuffer[i] = NULL;
+
+  /* rehash! */
+  for (i = 0; i < olen; i++)
     {
-      GNUNET_free_non_null (be->sendBuffer[i]->closure);
-      GNUNET_free (be->sendBuffer[i]);
+      be = CONNECTION_buffer_[i];
+      while (be != NULL)
+        {
+          BufferEntry *next;
+          unsigned int j;
+
+          next = be->overflowChain;
+          j = GNUNET_CORE_connection_compute_index_of_peer (&be->
+                                                            session.sender);
+          be->overflowChain = newBuffer[j];
+          newBuffer[j] = be;
+          be = next;
+        }
     }
-  GNUNET_array_grow (be->sendBuffer, be->sendBufferSize, 0);
+  GNUNET_free_non_null (CONNECTION_buffer_);
+  CONNECTION_buffer_ = newBuffer;
+  unlockAllBuckets ();
+  GNUNET_GE_BREAK (ectx,
+                   0 == GNUNET_GC_set_configuration_value_number (cfg,
+                                                                  ectx,
+                                                                  "gnunetd",
+                                                                  "connection-max-hosts",
+                                                                  CONNECTION_MAX_HOSTS_));
+  GNUNET_GE_LOG (ectx,
+                 GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_USER,
+                 "connection goal is %s%d peers (%llu BPM bandwidth downstream)\n",
+                 (olen == 0) ? "" : "now ", CONNECTION_MAX_HOSTS_, max_bpm);
 }
 
 /* ******** inbound bandwidth scheduling ************* */
@@ -2417,7 +2979,8 @@ scheduleInboundTraffic ()
   GNUNET_EncName enc;
 #endif
 
-  GNUNET_mutex_lock (lock);
+  lockTable ();
+  lockAllBuckets ();
   now = GNUNET_get_time ();
 
   /* if this is the first round, don't bother... */
@@ -2426,12 +2989,14 @@ scheduleInboundTraffic ()
       /* no allocation the first time this function is called! */
       lastRoundStart = now;
       forAllConnectedHosts (&resetRecentlyReceived, NULL);
+      unlockAllBuckets ();
       GNUNET_mutex_unlock (lock);
       return;
     }
   activePeerCount = forAllConnectedHosts (NULL, NULL);
   if (activePeerCount == 0)
     {
+      unlockAllBuckets ();
       GNUNET_mutex_unlock (lock);
       return;                   /* nothing to be done here. */
     }
@@ -2448,6 +3013,7 @@ scheduleInboundTraffic ()
       earlyRun = 1;
       if (activePeerCount > CONNECTION_MAX_HOSTS_ / 8)
         {
+          unlockAllBuckets ();
           GNUNET_mutex_unlock (lock);
           return;               /* don't update too frequently, we need at least some
                                    semi-representative sampling! */
@@ -2849,6 +3415,7 @@ scheduleInboundTraffic ()
     }
 
   GNUNET_free (entries);
+  unlockAllBuckets ();
   GNUNET_mutex_unlock (lock);
 }
 
@@ -2899,9 +3466,12 @@ cronDecreaseLiveness (void *unused)
   total_send_buffer_size = 0;
   connection_count = 0;
   total_connection_lifetime = 0;
-  GNUNET_mutex_lock (lock);
+  lockTable ();
+  if (CONNECTION_target_hosts_ != CONNECTION_MAX_HOSTS_)
+    resizeConnectionTable ();   /* retry deferred resize */
   for (i = 0; i < CONNECTION_MAX_HOSTS_; i++)
     {
+      lockBucket (i);
       root = CONNECTION_buffer_[i];
       prev = NULL;
       while (NULL != root)
@@ -2910,6 +3480,8 @@ cronDecreaseLiveness (void *unused)
           switch (root->status)
             {
             case STAT_DOWN:
+              if (root->inSendBuffer == GNUNET_YES)
+                break;          /* still in use, free later */
               /* just compact linked list */
               if (prev == NULL)
                 CONNECTION_buffer_[i] = root->overflowChain;
@@ -2917,6 +3489,8 @@ cronDecreaseLiveness (void *unused)
                 prev->overflowChain = root->overflowChain;
               tmp = root;
               root = root->overflowChain;
+              releaseSessionKeys (tmp);
+              discardSendBuffer (tmp);
               GNUNET_free (tmp);
               continue;         /* no need to call 'send buffer' */
             case STAT_UP:
@@ -3072,6 +3646,7 @@ cronDecreaseLiveness (void *unused)
           prev = root;
           root = root->overflowChain;
         }                       /* end of while */
+      unlockBucket (i);
     }                           /* for all buckets */
   GNUNET_mutex_unlock (lock);
   if (stats != NULL)
@@ -3091,6 +3666,25 @@ cronDecreaseLiveness (void *unused)
   EXIT ();
 }
 
+/**
+ * Add the given peer to the connection table (if needed) and ask the
+ * session service to establish a session.  Must be called without
+ * holding any bucket lock.
+ *
+ * @param peer the peer to connect to
+ */
+static void
+connectToPeer (const GNUNET_PeerIdentity * peer)
+{
+  unsigned int bucket;
+
+  lockTable ();
+  bucket = lockBucketOfPeer (peer);
+  addHost (peer, GNUNET_YES);
+  unlockBucket (bucket);
+  GNUNET_mutex_unlock (lock);
+}
+
 /**
  * Check the sequence number and timestamp.  Decrypts the
  * message if it was encrypted.  Updates the sequence
@@ -3115,6 +3709,7 @@ GNUNET_CORE_connection_check_header (const GNUNET_PeerIdentity * sender,
   char *tmp;
   GNUNET_HashCode hc;
   GNUNET_EncName enc;
+  unsigned int bucket;
 
   ENTRY ();
   GNUNET_GE_ASSERT (ectx, msg != NULL);
@@ -3144,7 +3739,7 @@ GNUNET_CORE_connection_check_header (const GNUNET_PeerIdentity * sender,
       return GNUNET_NO;         /* plaintext */
     }
 
-  GNUNET_mutex_lock (lock);
+  bucket = lockBucketOfPeer (sender);
   be = lookForHost (sender);
   if ((be == NULL) ||
       (be->status == STAT_DOWN) || (be->status == STAT_SETKEY_SENT))
@@ -3160,15 +3755,20 @@ GNUNET_CORE_connection_check_header (const GNUNET_PeerIdentity * sender,
 #endif
       /* try to establish a connection, that way, we don't keep
          getting bogus messages until the other one times out. */
-      if ((be == NULL) || (be->status == STAT_DOWN))
-        addHost (sender, GNUNET_YES);
-      GNUNET_mutex_unlock (lock);
+      res = ((be == NULL) || (be->status == STAT_DOWN));
+      unlockBucket (bucket);
+      if (res)
+        connectToPeer (sender);
       EXIT ();
       return GNUNET_SYSERR;     /* could not decrypt */
     }
   tmp = GNUNET_malloc (size - sizeof (GNUNET_HashCode));
-  res = GNUNET_AES_decrypt (&be->skey_remote, &msg->sequenceNumber, size - sizeof (GNUNET_HashCode), (const GNUNET_AES_InitializationVector *) &msg->hash,      /* IV */
-                            tmp);
+  if (be->skey_remote_ctx != NULL)
+    res = GNUNET_AES_context_decrypt (be->skey_remote_ctx, &msg->sequenceNumber, size - sizeof (GNUNET_HashCode), (const GNUNET_AES_InitializationVector *) &msg->hash,        /* IV */
+                                      tmp);
+  else
+    res = GNUNET_AES_decrypt (&be->skey_remote, &msg->sequenceNumber, size - sizeof (GNUNET_HashCode), (const GNUNET_AES_InitializationVector *) &msg->hash,    /* IV */
+                              tmp);
   GNUNET_hash (tmp, size - sizeof (GNUNET_HashCode), &hc);
   if (!
       ((res != GNUNET_OK)
@@ -3183,8 +3783,8 @@ GNUNET_CORE_connection_check_header (const GNUNET_PeerIdentity * sender,
                      "Decrypting message from host `%s' failed, wrong sessionkey!\n",
                      &enc);
 #endif
-      addHost (sender, GNUNET_YES);
-      GNUNET_mutex_unlock (lock);
+      unlockBucket (bucket);
+      connectToPeer (sender);
       GNUNET_free (tmp);
       EXIT ();
       return GNUNET_SYSERR;
@@ -3219,7 +3819,7 @@ GNUNET_CORE_connection_check_header (const GNUNET_PeerIdentity * sender,
                            " %u <= %u, dropping message.\n"), sequenceNumber,
                          be->lastSequenceNumberReceived);
 #endif
-          GNUNET_mutex_unlock (lock);
+          unlockBucket (bucket);
           EXIT ();
           return GNUNET_SYSERR;
         }
@@ -3239,7 +3839,7 @@ GNUNET_CORE_connection_check_header (const GNUNET_PeerIdentity * sender,
                      GNUNET_GE_INFO | GNUNET_GE_BULK | GNUNET_GE_USER,
                      _("Message received more than one day old. Dropped.\n"));
 #endif
-      GNUNET_mutex_unlock (lock);
+      unlockBucket (bucket);
       EXIT ();
       return GNUNET_SYSERR;
     }
@@ -3255,7 +3855,7 @@ GNUNET_CORE_connection_check_header (const GNUNET_PeerIdentity * sender,
       be->last_bps_update = GNUNET_get_time ();
     }
   be->recently_received += size;
-  GNUNET_mutex_unlock (lock);
+  unlockBucket (bucket);
   EXIT ();
   return GNUNET_YES;
 }
@@ -3272,6 +3872,7 @@ static int
 handleHANGUP (const GNUNET_PeerIdentity * sender,
               const GNUNET_MessageHeader * msg)
 {
+  unsigned int bucket;
   BufferEntry *be;
 #if DEBUG_CONNECTION
   GNUNET_EncName enc;
@@ -3292,10 +3893,12 @@ handleHANGUP (const GNUNET_PeerIdentity * sender,
                  GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_DEVELOPER,
                  "received HANGUP from `%s'\n", &enc);
 #endif
-  GNUNET_mutex_lock (lock);
+  lockTable ();
+  bucket = lockBucketOfPeer (sender);
   be = lookForHost (sender);
   if (be == NULL)
     {
+      unlockBucket (bucket);
       GNUNET_mutex_unlock (lock);
       return GNUNET_SYSERR;
     }
@@ -3305,6 +3908,7 @@ handleHANGUP (const GNUNET_PeerIdentity * sender,
   if (stats != NULL)
     stats->change (stat_shutdown_hangup_received, 1);
   shutdownConnection (be);
+  unlockBucket (bucket);
   GNUNET_mutex_unlock (lock);
   return GNUNET_OK;
 }
@@ -3327,10 +3931,12 @@ GNUNET_CORE_connection_assign_session_key_to_peer (const GNUNET_AES_SessionKey
                                                    peer, GNUNET_Int32Time age,
                                                    int forSending)
 {
+  unsigned int bucket;
   BufferEntry *be;
 
   ENTRY ();
-  GNUNET_mutex_lock (lock);
+  lockTable ();
+  bucket = lockBucketOfPeer (peer);
   be = lookForHost (peer);
   if (be == NULL)
     be = addHost (peer, GNUNET_NO);
@@ -3339,6 +3945,14 @@ GNUNET_CORE_connection_assign_session_key_to_peer (const GNUNET_AES_SessionKey
       be->isAlive = GNUNET_get_time ();
       if (forSending == GNUNET_YES)
         {
+          if ((be->skey_local_ctx == NULL) ||
+              (0 != memcmp (key, &be->skey_local,
+                            sizeof (GNUNET_AES_SessionKey))))
+            {
+              if (be->skey_local_ctx != NULL)
+                GNUNET_AES_context_release (be->skey_local_ctx);
+              be->skey_local_ctx = GNUNET_AES_context_create (key);
+            }
           be->skey_local = *key;
           be->skey_local_created = age;
           be->status = STAT_SETKEY_SENT | (be->status & STAT_SETKEY_RECEIVED);
@@ -3354,12 +3968,18 @@ GNUNET_CORE_connection_assign_session_key_to_peer (const GNUNET_AES_SessionKey
                 {
                   be->skey_remote = *key;
                   be->lastSequenceNumberReceived = 0;
+                  if (be->skey_remote_ctx != NULL)
+                    GNUNET_AES_context_release (be->skey_remote_ctx);
+                  be->skey_remote_ctx = NULL;
                 }
+              if (be->skey_remote_ctx == NULL)
+                be->skey_remote_ctx = GNUNET_AES_context_create (key);
               be->skey_remote_created = age;
               be->status |= STAT_SETKEY_RECEIVED;
             }
         }
     }
+  unlockBucket (bucket);
   GNUNET_mutex_unlock (lock);
   EXIT ();
 }
@@ -3373,10 +3993,12 @@ void
 GNUNET_CORE_connection_mark_session_as_confirmed (const GNUNET_PeerIdentity *
                                                   peer)
 {
+  unsigned int bucket;
   BufferEntry *be;
 
   ENTRY ();
-  GNUNET_mutex_lock (lock);
+  lockTable ();
+  bucket = lockBucketOfPeer (peer);
   be = lookForHost (peer);
   if (be != NULL)
     {
@@ -3405,6 +4027,7 @@ GNUNET_CORE_connection_mark_session_as_confirmed (const GNUNET_PeerIdentity *
           notify_connect (be);
         }
     }
+  unlockBucket (bucket);
   GNUNET_mutex_unlock (lock);
   EXIT ();
 }
@@ -3433,8 +4056,10 @@ GNUNET_CORE_connection_is_slot_used (int slot)
 
   ENTRY ();
   ret = 0;
-  GNUNET_mutex_lock (lock);
-  if ((slot >= 0) && (slot < CONNECTION_MAX_HOSTS_))
+  if ((slot < 0) || (slot >= CONNECTION_MAX_BUCKETS))
+    return 0;
+  lockBucket (slot);
+  if (slot < CONNECTION_MAX_HOSTS_)
     {
       be = CONNECTION_buffer_[slot];
       while (be != NULL)
@@ -3444,7 +4069,7 @@ GNUNET_CORE_connection_is_slot_used (int slot)
           be = be->overflowChain;
         }
     }
-  GNUNET_mutex_unlock (lock);
+  unlockBucket (slot);
   EXIT ();
   return ret;
 }
@@ -3460,12 +4085,13 @@ GNUNET_CORE_connection_get_last_activity_of_peer (const GNUNET_PeerIdentity *
                                                   peer,
                                                   GNUNET_CronTime * time)
 {
+  unsigned int bucket;
   int ret;
   BufferEntry *be;
 
   ENTRY ();
   ret = 0;
-  GNUNET_mutex_lock (lock);
+  bucket = lockBucketOfPeer (peer);
   be = lookForHost (peer);
   if ((be != NULL) && (be->status == STAT_UP))
     {
@@ -3477,7 +4103,7 @@ GNUNET_CORE_connection_get_last_activity_of_peer (const GNUNET_PeerIdentity *
       *time = 0;
       ret = GNUNET_SYSERR;
     }
-  GNUNET_mutex_unlock (lock);
+  unlockBucket (bucket);
   EXIT ();
   return ret;
 }
@@ -3500,12 +4126,13 @@ GNUNET_CORE_connection_get_session_key_of_peer (const GNUNET_PeerIdentity *
                                                 GNUNET_Int32Time * age,
                                                 int forSending)
 {
+  unsigned int bucket;
   int ret;
   BufferEntry *be;
 
   ENTRY ();
   ret = GNUNET_SYSERR;
-  GNUNET_mutex_lock (lock);
+  bucket = lockBucketOfPeer (peer);
   be = lookForHost (peer);
   if (be != NULL)
     {
@@ -3532,7 +4159,7 @@ GNUNET_CORE_connection_get_session_key_of_peer (const GNUNET_PeerIdentity *
             }
         }
     }
-  GNUNET_mutex_unlock (lock);
+  unlockBucket (bucket);
   EXIT ();
   return ret;
 }
@@ -3555,6 +4182,7 @@ void
 GNUNET_CORE_connection_consider_takeover (const GNUNET_PeerIdentity * sender,
                                           GNUNET_TSession * tsession)
 {
+  unsigned int bucket;
   BufferEntry *be;
   unsigned int cost;
   GNUNET_TSession *ts;
@@ -3567,10 +4195,12 @@ GNUNET_CORE_connection_consider_takeover (const GNUNET_PeerIdentity * sender,
       GNUNET_GE_BREAK (NULL, 0);
       return;
     }
-  GNUNET_mutex_lock (lock);
+  lockTable ();
+  bucket = lockBucketOfPeer (sender);
   be = addHost (sender, GNUNET_NO);
   if (be == NULL)
     {
+      unlockBucket (bucket);
       GNUNET_mutex_unlock (lock);
       EXIT ();
       return;
@@ -3612,6 +4242,7 @@ GNUNET_CORE_connection_consider_takeover (const GNUNET_PeerIdentity * sender,
       fragmentIfNecessary (be);
     }
   EXIT ();
+  unlockBucket (bucket);
   GNUNET_mutex_unlock (lock);
   EXIT ();
 }
@@ -3629,7 +4260,6 @@ connectionConfigChangeCallback (void *ctx,
                                 const char *section, const char *option)
 {
   unsigned long long new_max_bpm;
-  unsigned int i;
 
   if (0 != strcmp (section, "LOAD"))
     return 0;                   /* fast path */
@@ -3639,7 +4269,7 @@ connectionConfigChangeCallback (void *ctx,
   GNUNET_GC_get_configuration_value_number (cfg, "LOAD", "MAXNETUPBPSTOTAL", 0, ((unsigned long long) -1) / 60, 50000,  /* default: 50 kbps */
                                             &max_bpm_up);
   max_bpm_up *= 60;             /* bps -> bpm */
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   new_max_bpm = 60 * new_max_bpm;
   if (max_bpm != new_max_bpm)
     {
@@ -3650,64 +4280,19 @@ connectionConfigChangeCallback (void *ctx,
       /* => for 1000 bps, we get 12 (rounded DOWN to 8) connections! */
       if (newMAXHOSTS < GNUNET_MIN_CONNECTION_TARGET * 2)
         newMAXHOSTS = GNUNET_MIN_CONNECTION_TARGET * 2;
-      if (newMAXHOSTS > 256)
-        newMAXHOSTS = 256;      /* limit, otherwise we run out of sockets! */
+      if (newMAXHOSTS > CONNECTION_MAX_BUCKETS)
+        newMAXHOSTS = CONNECTION_MAX_BUCKETS;   /* limit, otherwise we run out of sockets! */
 
+      CONNECTION_target_hosts_ = newMAXHOSTS;
       if (newMAXHOSTS != CONNECTION_MAX_HOSTS_)
-        {
-          /* change size of connection buffer!!! */
-          unsigned int olen;
-          BufferEntry **newBuffer;
-
-          olen = CONNECTION_MAX_HOSTS_;
-          CONNECTION_MAX_HOSTS_ = newMAXHOSTS;
-          GNUNET_GE_BREAK (ectx,
-                           0 == GNUNET_GC_set_configuration_value_number (cfg,
-                                                                          ectx,
-                                                                          "gnunetd",
-                                                                          "connection-max-hosts",
-                                                                          CONNECTION_MAX_HOSTS_));
-          newBuffer =
-            (BufferEntry **) GNUNET_malloc (sizeof (BufferEntry *) *
-                                            newMAXHOSTS);
-          for (i = 0; i < CONNECTION_MAX_HOSTS_; i++)
-            newBuffer[i] = NULL;
-
-          /* rehash! */
-          for (i = 0; i < olen; i++)
-            {
-              BufferEntry *be;
-
-              be = CONNECTION_buffer_[i];
-              while (be != NULL)
-                {
-                  BufferEntry *next;
-                  unsigned int j;
-
-                  next = be->overflowChain;
-                  j =
-                    GNUNET_CORE_connection_compute_index_of_peer
-                    (&be->session.sender);
-                  be->overflowChain = newBuffer[j];
-                  newBuffer[j] = be;
-                  be = next;
-                }
-            }
-          GNUNET_free_non_null (CONNECTION_buffer_);
-          CONNECTION_buffer_ = newBuffer;
-
-          GNUNET_GE_LOG (ectx,
-                         GNUNET_GE_DEBUG | GNUNET_GE_REQUEST | GNUNET_GE_USER,
-                         "connection goal is %s%d peers (%llu BPM bandwidth downstream)\n",
-                         (olen == 0) ? "" : "now ", CONNECTION_MAX_HOSTS_,
-                         max_bpm);
-
-        }
+        resizeConnectionTable ();
     }
   disable_random_padding = GNUNET_GC_get_configuration_value_yesno (cfg,
                                                                     "GNUNETD-EXPERIMENTAL",
                                                                     "PADDING",
                                                                     GNUNET_NO);
+  GNUNET_GC_get_configuration_value_number (cfg, "GNUNETD-EXPERIMENTAL", "KNAPSACK-MARGIN", 0, 1000, 5,      /* default: 5% */
+                                            &knapsack_margin);
   GNUNET_mutex_unlock (lock);
   return 0;
 }
@@ -3808,6 +4393,18 @@ GNUNET_CORE_connection_init (struct GNUNET_GE_Context *e,
       stat_avg_lifetime =
         stats->create (gettext_noop
                        ("# average connection lifetime (in ms)"));
+      stat_table_lock_contention =
+        stats->create (gettext_noop
+                       ("# connection table lock contentions"));
+      stat_bucket_lock_contention =
+        stats->create (gettext_noop
+                       ("# connection bucket lock contentions"));
+      stat_select_greedy =
+        stats->create (gettext_noop
+                       ("# packets filled by greedy heuristic"));
+      stat_select_knapsack =
+        stats->create (gettext_noop
+                       ("# packets filled by knapsack solver"));
       stat_shutdown_excessive_bandwidth =
         stats->create (gettext_noop
                        ("# conn. shutdown: other peer sent too much"));
@@ -3843,10 +4440,12 @@ GNUNET_CORE_connection_done ()
   GNUNET_GC_detach_change_listener (cfg, &connectionConfigChangeCallback,
                                     NULL);
   GNUNET_cron_del_job (cron, &cronDecreaseLiveness, CDL_FREQUENCY, NULL);
+  lockTable ();
   for (i = 0; i < CONNECTION_MAX_HOSTS_; i++)
     {
       BufferEntry *prev;
 
+      lockBucket (i);
       prev = NULL;
       be = CONNECTION_buffer_[i];
       while (be != NULL)
@@ -3860,12 +4459,17 @@ GNUNET_CORE_connection_done ()
           prev = be;
           be = be->overflowChain;
           CONNECTION_buffer_[i] = be;
+          releaseSessionKeys (prev);
+          discardSendBuffer (prev);
           GNUNET_free (prev);
         }
+      unlockBucket (i);
     }
   GNUNET_free_non_null (CONNECTION_buffer_);
   CONNECTION_buffer_ = NULL;
   CONNECTION_MAX_HOSTS_ = 0;
+  CONNECTION_target_hosts_ = 0;
+  GNUNET_mutex_unlock (lock);
   while (scl_head != NULL)
     {
       scl = scl_head;
@@ -3917,7 +4521,7 @@ GNUNET_CORE_connection_iterate_peers (GNUNET_NodeIteratorCallback method,
   ENTRY ();
   wrap.method = method;
   wrap.arg = arg;
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   ret = forAllConnectedHosts (&fENHCallback, &wrap);
   GNUNET_mutex_unlock (lock);
   EXIT ();
@@ -3937,10 +4541,11 @@ GNUNET_CORE_connection_print_buffer ()
   GNUNET_EncName skey_remote;
   unsigned int ttype;
 
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   ENTRY ();
   for (i = 0; i < CONNECTION_MAX_HOSTS_; i++)
     {
+      lockBucket (i);
       tmp = CONNECTION_buffer_[i];
       while (tmp != NULL)
         {
@@ -3971,6 +4576,7 @@ GNUNET_CORE_connection_print_buffer ()
             }
           tmp = tmp->overflowChain;
         }
+      unlockBucket (i);
     }
   GNUNET_mutex_unlock (lock);
 }
@@ -4016,7 +4622,7 @@ GNUNET_CORE_connection_register_send_callback (unsigned int
   scl->minimumPadding = minimumPadding;
   scl->callback = callback;
   scl->priority = priority;
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   pos = scl_head;
   prev = NULL;
   while ((pos != NULL) && (pos->priority > priority))
@@ -4058,7 +4664,7 @@ GNUNET_CORE_connection_unregister_send_callback (unsigned int
 
   ENTRY ();
   prev = NULL;
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   pos = scl_head;
   while (pos != NULL)
     {
@@ -4151,10 +4757,23 @@ GNUNET_CORE_connection_send_using_callback (const GNUNET_PeerIdentity *
 {
   BufferEntry *be;
   SendEntry *entry;
+  unsigned int bucket;
+  int locked;
 
   ENTRY ();
-  GNUNET_mutex_lock (lock);
-  be = addHost (hostId, GNUNET_YES);
+  /* fast path: only lock the bucket if the connection is up */
+  locked = GNUNET_NO;
+  bucket = lockBucketOfPeer (hostId);
+  be = lookForHost (hostId);
+  if ((be == NULL) ||
+      (be->status != STAT_UP) || (be->session.tsession == NULL))
+    {
+      unlockBucket (bucket);
+      lockTable ();
+      locked = GNUNET_YES;
+      bucket = lockBucketOfPeer (hostId);
+      be = addHost (hostId, GNUNET_YES);
+    }
   if ((be != NULL) && (be->status != STAT_DOWN))
     {
       entry = GNUNET_malloc (sizeof (SendEntry));
@@ -4171,7 +4790,9 @@ GNUNET_CORE_connection_send_using_callback (const GNUNET_PeerIdentity *
     {
       GNUNET_free_non_null (closure);
     }
-  GNUNET_mutex_unlock (lock);
+  unlockBucket (bucket);
+  if (locked == GNUNET_YES)
+    GNUNET_mutex_unlock (lock);
   EXIT ();
 }
 
@@ -4229,11 +4850,15 @@ GNUNET_CORE_connection_compute_index_of_peer (const GNUNET_PeerIdentity *
                                               hostId)
 {
   unsigned int res;
+  unsigned int max;
 
   ENTRY ();
+  /* may be called without holding any lock, so read the table
+     size only once */
+  max = CONNECTION_MAX_HOSTS_;
   res = (((unsigned int) hostId->hashPubKey.bits[0]) &
-         ((unsigned int) (CONNECTION_MAX_HOSTS_ - 1)));
-  GNUNET_GE_ASSERT (ectx, res < CONNECTION_MAX_HOSTS_);
+         ((unsigned int) (max - 1)));
+  GNUNET_GE_ASSERT (ectx, res < max);
   return res;
 }
 
@@ -4257,11 +4882,12 @@ GNUNET_CORE_connection_get_bandwidth_assigned_to_peer (const
                                                        GNUNET_CronTime *
                                                        last_seen)
 {
+  unsigned int bucket;
   BufferEntry *be;
   unsigned int ret;
 
   ENTRY ();
-  GNUNET_mutex_lock (lock);
+  bucket = lockBucketOfPeer (node);
   be = lookForHost (node);
   if ((be != NULL) && (be->status == STAT_UP))
     {
@@ -4275,7 +4901,7 @@ GNUNET_CORE_connection_get_bandwidth_assigned_to_peer (const
     {
       ret = GNUNET_SYSERR;
     }
-  GNUNET_mutex_unlock (lock);
+  unlockBucket (bucket);
   EXIT ();
   return ret;
 }
@@ -4291,14 +4917,15 @@ GNUNET_CORE_connection_update_traffic_preference_for_peer (const
                                                            * node,
                                                            double preference)
 {
+  unsigned int bucket;
   BufferEntry *be;
 
   ENTRY ();
-  GNUNET_mutex_lock (lock);
+  bucket = lockBucketOfPeer (node);
   be = lookForHost (node);
   if (be != NULL)
     be->current_connection_value += preference;
-  GNUNET_mutex_unlock (lock);
+  unlockBucket (bucket);
   EXIT ();
 }
 
@@ -4311,10 +4938,12 @@ GNUNET_CORE_connection_update_traffic_preference_for_peer (const
 void
 GNUNET_CORE_connection_disconnect_from_peer (const GNUNET_PeerIdentity * node)
 {
+  unsigned int bucket;
   BufferEntry *be;
 
   ENTRY ();
-  GNUNET_mutex_lock (lock);
+  lockTable ();
+  bucket = lockBucketOfPeer (node);
   be = lookForHost (node);
   if (be != NULL)
     {
@@ -4336,6 +4965,7 @@ GNUNET_CORE_connection_disconnect_from_peer (const GNUNET_PeerIdentity * node)
                                GNUNET_YES);
       shutdownConnection (be);
     }
+  unlockBucket (bucket);
   GNUNET_mutex_unlock (lock);
   EXIT ();
 }
@@ -4355,7 +4985,7 @@ int
   if (callback == NULL)
     return GNUNET_SYSERR;
   ENTRY ();
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   GNUNET_array_grow (rsns, rsnSize, rsnSize + 1);
   rsns[rsnSize - 1] = callback;
   GNUNET_mutex_unlock (lock);
@@ -4380,7 +5010,7 @@ int
   if (callback == NULL)
     return GNUNET_OK;
   ENTRY ();
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   for (i = 0; i < rsnSize; i++)
     {
       if (rsns[i] == callback)
@@ -4409,21 +5039,24 @@ GNUNET_CORE_connection_assert_tsession_unused (GNUNET_TSession * tsession)
   BufferEntry *root;
 
   ENTRY ();
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   for (i = 0; i < CONNECTION_MAX_HOSTS_; i++)
     {
+      lockBucket (i);
       root = CONNECTION_buffer_[i];
       while (NULL != root)
         {
           if (root->session.tsession == tsession)
             {
               GNUNET_GE_BREAK (ectx, 0);
+              unlockBucket (i);
               GNUNET_mutex_unlock (lock);
               EXIT ();
               return GNUNET_SYSERR;
             }
           root = root->overflowChain;
         }
+      unlockBucket (i);
     }
   GNUNET_mutex_unlock (lock);
   EXIT ();
@@ -4447,7 +5080,7 @@ int
   l = GNUNET_malloc (sizeof (struct DisconnectNotificationList));
   l->callback = callback;
   l->cls = cls;
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   l->next = disconnect_notification_list;
   disconnect_notification_list = l;
   GNUNET_mutex_unlock (lock);
@@ -4469,7 +5102,7 @@ int
   struct DisconnectNotificationList *prev;
 
   prev = NULL;
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   pos = disconnect_notification_list;
   while (pos != NULL)
     {
@@ -4507,7 +5140,7 @@ int
   l = GNUNET_malloc (sizeof (struct ConnectNotificationList));
   l->callback = callback;
   l->cls = cls;
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   l->next = connect_notification_list;
   connect_notification_list = l;
   GNUNET_mutex_unlock (lock);
@@ -4529,7 +5162,7 @@ int
   struct ConnectNotificationList *prev;
 
   prev = NULL;
-  GNUNET_mutex_lock (lock);
+  lockTable ();
   pos = connect_notification_list;
   while (pos != NULL)
     {
@@ -4564,16 +5197,17 @@ int
 GNUNET_CORE_connection_reserve_downstream_bandwidth (const GNUNET_PeerIdentity
                                                      * peer, int amount)
 {
+  unsigned int bucket;
   BufferEntry *be;
   unsigned long long available;
   GNUNET_CronTime now;
   GNUNET_CronTime delta;
 
-  GNUNET_mutex_lock (lock);
+  bucket = lockBucketOfPeer (peer);
   be = lookForHost (peer);
   if ((be == NULL) || (be->status != STAT_UP))
     {
-      GNUNET_mutex_unlock (lock);
+      unlockBucket (bucket);
       return 0;                 /* not connected */
     }
   now = GNUNET_get_time ();
@@ -4591,17 +5225,25 @@ GNUNET_CORE_connection_reserve_downstream_bandwidth (const GNUNET_PeerIdentity
     available -= amount;
   be->last_reservation_update = now;
   be->available_downstream = available;
-  GNUNET_mutex_unlock (lock);
+  unlockBucket (bucket);
   return available;
 }
 
 void __attribute__ ((constructor)) GNUNET_CORE_connection_ltdl_init ()
 {
+  unsigned int i;
+
   lock = GNUNET_mutex_create (GNUNET_YES);
+  for (i = 0; i < CONNECTION_MAX_BUCKETS; i++)
+    bucket_locks[i].lock = GNUNET_mutex_create (GNUNET_YES);
 }
 
 void __attribute__ ((destructor)) GNUNET_CORE_connection_ltdl_fini ()
 {
+  unsigned int i;
+
+  for (i = 0; i < CONNECTION_MAX_BUCKETS; i++)
+    GNUNET_mutex_destroy (bucket_locks[i].lock);
   GNUNET_mutex_destroy (lock);
 }
 
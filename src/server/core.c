@@ -577,6 +577,7 @@ GNUNET_CORE_init (struct GNUNET_GE_Context *ectx,
   applicationCore.p2p_plaintext_handler_register = &GNUNET_CORE_plaintext_register_handler;     /* handler.c */
   applicationCore.p2p_plaintext_handler_unregister = &GNUNET_CORE_plaintext_unregister_handler; /* handler.c */
   applicationCore.p2p_message_handler_registered_test = &GNUNET_CORE_p2p_test_handler_registered;       /* handler.c */
+  applicationCore.p2p_handler_statistics_get = &GNUNET_CORE_p2p_get_handler_statistics; /* handler.c */
 
   applicationCore.p2p_transport_session_offer = &GNUNET_CORE_connection_consider_takeover;      /* connection.c */
   applicationCore.p2p_session_key_set = &GNUNET_CORE_connection_assign_session_key_to_peer;     /* connection.c */
@@ -616,7 +617,7 @@ GNUNET_CORE_init (struct GNUNET_GE_Context *ectx,
       GNUNET_CORE_release_service (identity);
       return GNUNET_SYSERR;
     }
-  GNUNET_CORE_p2p_init (ectx);
+  GNUNET_CORE_p2p_init (ectx, cfg);
   return GNUNET_OK;
 }
 
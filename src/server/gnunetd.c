@@ -272,6 +272,11 @@ main (int argc, char *const *argv)
       GNUNET_free (user_log_level);
     }
   GNUNET_CORE_startup_set_fd_limit (ectx, cfg);
+  if (GNUNET_YES == GNUNET_GC_get_configuration_value_yesno (cfg,
+                                                             "GNUNETD",
+                                                             "DISABLE-EPOLL",
+                                                             GNUNET_NO))
+    GNUNET_select_set_epoll (GNUNET_NO);
   if (GNUNET_OK != GNUNET_CORE_version_check_up_to_date (ectx, cfg))
     {
       GNUNET_GE_LOG (ectx,
@@ -28,6 +28,7 @@
 #include "gnunet_protocols.h"
 #include "gnunet_transport_service.h"
 #include "gnunet_identity_service.h"
+#include "gnunet_stats_service.h"
 
 #include "core.h"
 #include "handler.h"
@@ -41,12 +42,6 @@
  */
 #define TRACK_DISCARD GNUNET_NO
 
-/**
- * Track how much time was spent on each
- * type of message?
- */
-#define MEASURE_TIME GNUNET_NO
-
 /**
  * Should we validate that handlers do not
  * modify the messages that they are given?
@@ -55,15 +50,29 @@
 #define VALIDATE_CLIENT GNUNET_NO
 
 /**
- * How many incoming packages do we have in the buffer
- * (max.). Must be >= THREAD_COUNT to make sense.
+ * Default number of incoming packages that we buffer (max);
+ * can be changed with the INBOUND-QUEUE-SIZE option (and
+ * is always rounded up to a power of two).
+ */
+#define QUEUE_LENGTH 256
+
+/**
+ * Minimum number of threads that we start (handlers may
+ * block, so we want at least two even on single-CPU hosts).
  */
-#define QUEUE_LENGTH 64
+#define MIN_THREAD_COUNT 2
 
 /**
- * How many threads do we start?
+ * A single peer may use at most 1/FAIR_SHARE_DIVISOR of the
+ * queue; messages beyond that are dropped.
  */
-#define THREAD_COUNT 2
+#define FAIR_SHARE_DIVISOR 4
+
+/**
+ * Number of counters used to track the per-peer queue usage
+ * (peers are mapped to counters by their hash).
+ */
+#define FAIRNESS_BUCKETS 256
 
 /**
  * Transport service
@@ -75,26 +84,99 @@ static GNUNET_Transport_ServiceAPI *transport;
  */
 static GNUNET_Identity_ServiceAPI *identity;
 
+/**
+ * Statistics service (may be NULL).
+ */
+static GNUNET_Stats_ServiceAPI *stats;
+
+/**
+ * Slot in the inbound packet queue.
+ */
+struct QueueSlot
+{
+  /**
+   * Sequence number of the slot; tells producers and
+   * consumers whether the slot is free or full for the
+   * current lap around the ring.
+   */
+  volatile unsigned int seq;
+
+  /**
+   * The queued message.
+   */
+  GNUNET_TransportPacket *mp;
+};
+
+/**
+ * Information about a worker thread.
+ */
+struct HandlerWorker
+{
+  struct GNUNET_ThreadHandle *thread;
+
+  /**
+   * Statistics handle for the time this worker spent
+   * processing messages.
+   */
+  int stat_busy;
+};
+
+/**
+ * Bounded lock-free multi-producer/multi-consumer
+ * ring buffer of inbound messages.
+ */
+static struct QueueSlot *bufferQueue_;
 
-static GNUNET_TransportPacket *bufferQueue_[QUEUE_LENGTH];
+/**
+ * Size of bufferQueue_ (a power of two).
+ */
+static unsigned int queue_length;
 
-static int bq_firstFree_;
+/**
+ * Next position at which a message will be queued.
+ */
+static volatile unsigned int bq_head_;
+
+/**
+ * Next position from which a message will be taken.
+ */
+static volatile unsigned int bq_tail_;
+
+/**
+ * Number of messages per peer (bucket) in the queue.
+ */
+static volatile unsigned int sender_load_[FAIRNESS_BUCKETS];
 
-static int bq_firstFull_;
+/**
+ * Highest number of messages that were in the queue.
+ */
+static volatile unsigned int queue_high_water_;
 
 static volatile int threads_running = GNUNET_NO;
 
+/**
+ * Counts the messages in the queue; workers sleep on it.
+ */
 static struct GNUNET_Semaphore *bufferQueueRead_;
 
-static struct GNUNET_Semaphore *bufferQueueWrite_;
+static struct GNUNET_Semaphore *mainShutdownSignal;
 
-static struct GNUNET_Mutex *globalLock_;
+static struct HandlerWorker *workers_;
 
-static struct GNUNET_Semaphore *mainShutdownSignal;
+static unsigned int worker_count;
+
+static int stat_dropped_full;
+
+static int stat_dropped_unfair;
 
-static struct GNUNET_ThreadHandle *threads_[THREAD_COUNT];
+static int stat_queue_high_water;
+
+static struct GNUNET_GE_Context *ectx;
+
+static struct GNUNET_GC_Configuration *cfg;
 
 #if TRACK_DISCARD
+static struct GNUNET_Mutex *discardLock;
 static unsigned int discarded;
 static unsigned int blacklisted;
 static unsigned int accepted;
@@ -127,12 +209,106 @@ static unsigned int plaintextmax_registeredType = 0;
  */
 static struct GNUNET_Mutex *handlerLock;
 
-static struct GNUNET_GE_Context *ectx;
+/**
+ * Statistics about the handlers for each p2p message type.
+ * Updated with atomic operations only (no lock) since
+ * several worker threads may process messages of the same
+ * type at the same time.
+ */
+static struct GNUNET_CORE_HandlerStatistics
+  handler_stats[GNUNET_P2P_PROTO_MAX_USED];
 
-#if MEASURE_TIME
-static GNUNET_CronTime time_by_type[GNUNET_P2P_PROTO_MAX_USED];
-static unsigned int count_by_type[GNUNET_P2P_PROTO_MAX_USED];
-#endif
+/**
+ * Get the current time in microseconds.  Only used for
+ * measuring differences, hence the epoch does not matter.
+ */
+static unsigned long long
+get_time_us ()
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (unsigned long long) tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/**
+ * Get the histogram bucket for the given handler time.
+ *
+ * @param t time spent in the handlers (in microseconds)
+ */
+static unsigned int
+get_histogram_bucket (unsigned long long t)
+{
+  unsigned int e;
+  unsigned int b;
+
+  if (t < 4)
+    return (unsigned int) t;
+  e = 2;
+  while ((e < 63) && ((t >> (e + 1)) != 0))
+    e++;
+  b = 4 * (e - 1) + ((t >> (e - 2)) & 3);
+  if (b >= GNUNET_CORE_HANDLER_HISTOGRAM_BUCKETS)
+    b = GNUNET_CORE_HANDLER_HISTOGRAM_BUCKETS - 1;
+  return b;
+}
+
+/**
+ * Record that the handlers for a message took the time since
+ * start to process it.
+ *
+ * @param ptyp type of the message
+ * @param plen size of the message
+ * @param start time (in microseconds) when processing started
+ */
+static void
+record_handler_time (unsigned short ptyp,
+                     unsigned short plen, unsigned long long start)
+{
+  struct GNUNET_CORE_HandlerStatistics *hs;
+  unsigned long long now;
+  unsigned long long delta;
+
+  if (ptyp >= GNUNET_P2P_PROTO_MAX_USED)
+    return;
+  now = get_time_us ();
+  delta = (now > start) ? now - start : 0;      /* clock may jump */
+  hs = &handler_stats[ptyp];
+  __sync_fetch_and_add (&hs->count, 1);
+  __sync_fetch_and_add (&hs->bytes, plen);
+  __sync_fetch_and_add (&hs->time, delta);
+  __sync_fetch_and_add (&hs->histogram[get_histogram_bucket (delta)], 1);
+}
+
+/**
+ * Get statistics about the handlers for messages of the given
+ * p2p type (since gnunetd was started).
+ *
+ * @param type the message type
+ * @param stats set to the statistics for the type
+ * @return GNUNET_OK on success, GNUNET_SYSERR if no
+ *         statistics are kept for the type
+ */
+int
+GNUNET_CORE_p2p_get_handler_statistics (unsigned short type,
+                                        struct GNUNET_CORE_HandlerStatistics
+                                        *stats)
+{
+  struct GNUNET_CORE_HandlerStatistics *hs;
+  unsigned int i;
+
+  if (type >= GNUNET_P2P_PROTO_MAX_USED)
+    return GNUNET_SYSERR;
+  hs = &handler_stats[type];
+  /* atomic reads; the fields may be slightly out of sync
+     with each other if messages are processed concurrently */
+  stats->count = __sync_fetch_and_add (&hs->count, 0);
+  stats->bytes = __sync_fetch_and_add (&hs->bytes, 0);
+  stats->time = __sync_fetch_and_add (&hs->time, 0);
+  for (i = 0; i < GNUNET_CORE_HANDLER_HISTOGRAM_BUCKETS; i++)
+    stats->histogram[i] = hs->histogram[i];
+  return GNUNET_OK;
+}
 
 
 /**
@@ -410,9 +586,7 @@ GNUNET_CORE_p2p_inject_message (const GNUNET_PeerIdentity * sender,
   GNUNET_MessageHeader *copy;
   int last;
   GNUNET_EncName enc;
-#if MEASURE_TIME
-  GNUNET_CronTime now;
-#endif
+  unsigned long long start;
 #if VALIDATE_CLIENT
   void *old_value;
 #endif
@@ -492,9 +666,7 @@ GNUNET_CORE_p2p_inject_message (const GNUNET_PeerIdentity * sender,
                              ptyp);
               continue;         /* no handler registered, go to next part */
             }
-#if MEASURE_TIME
-          now = GNUNET_get_time ();
-#endif
+          start = get_time_us ();
           last = 0;
           while (NULL != (callback = handlers[ptyp][last]))
             {
@@ -511,6 +683,7 @@ GNUNET_CORE_p2p_inject_message (const GNUNET_PeerIdentity * sender,
                                  "Handler aborted message processing after receiving message of type '%d'.\n",
                                  ptyp);
 #endif
+                  record_handler_time (ptyp, plen, start);
                   GNUNET_free_non_null (copy);
                   copy = NULL;
 #if VALIDATE_CLIENT
@@ -530,13 +703,7 @@ GNUNET_CORE_p2p_inject_message (const GNUNET_PeerIdentity * sender,
 
               last++;
             }
-#if MEASURE_TIME
-          if (ptyp < GNUNET_P2P_PROTO_MAX_USED)
-            {
-              time_by_type[ptyp] += GNUNET_get_time () - now;
-              count_by_type[ptyp]++;
-            }
-#endif
+          record_handler_time (ptyp, plen, start);
         }
       else
         {                       /* isEncrypted == GNUNET_NO */
@@ -552,9 +719,7 @@ GNUNET_CORE_p2p_inject_message (const GNUNET_PeerIdentity * sender,
                              ptyp);
               continue;         /* no handler registered, go to next part */
             }
-#if MEASURE_TIME
-          now = GNUNET_get_time ();
-#endif
+          start = get_time_us ();
           last = 0;
           while (NULL != (callback = plaintextHandlers[ptyp][last]))
             {
@@ -567,19 +732,14 @@ GNUNET_CORE_p2p_inject_message (const GNUNET_PeerIdentity * sender,
                                  "Handler aborted message processing after receiving message of type '%d'.\n",
                                  ptyp);
 #endif
+                  record_handler_time (ptyp, plen, start);
                   GNUNET_free_non_null (copy);
                   copy = NULL;
                   return;       /* handler says: do not process the rest of the message */
                 }
               last++;
             }
-#if MEASURE_TIME
-          if (ptyp < GNUNET_P2P_PROTO_MAX_USED)
-            {
-              time_by_type[ptyp] += GNUNET_get_time () - now;
-              count_by_type[ptyp]++;
-            }
-#endif
+          record_handler_time (ptyp, plen, start);
 
         }                       /* if plaintext */
     }                           /* while loop */
@@ -625,6 +785,102 @@ handleMessage (GNUNET_TSession * tsession,
                                   tsession);
 }
 
+/**
+ * Compute the fairness bucket of a peer.
+ */
+static unsigned int
+senderBucket (const GNUNET_PeerIdentity * sender)
+{
+  return ((unsigned int) sender->hashPubKey.bits[1]) % FAIRNESS_BUCKETS;
+}
+
+/**
+ * Append a message to the inbound queue.
+ *
+ * @return GNUNET_OK on success, GNUNET_SYSERR if the queue is full
+ */
+static int
+queuePush (GNUNET_TransportPacket * mp)
+{
+  struct QueueSlot *slot;
+  unsigned int pos;
+  unsigned int used;
+  int dif;
+
+  pos = bq_head_;
+  while (1)
+    {
+      slot = &bufferQueue_[pos & (queue_length - 1)];
+      dif = (int) (slot->seq - pos);
+      if (dif == 0)
+        {
+          if (__sync_bool_compare_and_swap (&bq_head_, pos, pos + 1))
+            break;
+        }
+      else if (dif < 0)
+        return GNUNET_SYSERR;   /* full */
+      pos = bq_head_;
+    }
+  slot->mp = mp;
+  __sync_synchronize ();
+  slot->seq = pos + 1;
+  used = pos + 1 - bq_tail_;
+  if ((used <= queue_length) && (used > queue_high_water_))
+    {
+      queue_high_water_ = used;
+      if (stats != NULL)
+        stats->set (stat_queue_high_water, used);
+    }
+  return GNUNET_OK;
+}
+
+/**
+ * Take a message from the inbound queue.
+ *
+ * @return NULL if no message is available right now
+ */
+static GNUNET_TransportPacket *
+queuePop ()
+{
+  struct QueueSlot *slot;
+  GNUNET_TransportPacket *mp;
+  unsigned int pos;
+  int dif;
+
+  pos = bq_tail_;
+  while (1)
+    {
+      slot = &bufferQueue_[pos & (queue_length - 1)];
+      dif = (int) (slot->seq - (pos + 1));
+      if (dif == 0)
+        {
+          if (__sync_bool_compare_and_swap (&bq_tail_, pos, pos + 1))
+            break;
+        }
+      else if (dif < 0)
+        return NULL;            /* empty (or not yet published) */
+      pos = bq_tail_;
+    }
+  mp = slot->mp;
+  slot->mp = NULL;
+  __sync_synchronize ();
+  slot->seq = pos + queue_length;
+  return mp;
+}
+
+/**
+ * Free a message from the transport layer.
+ */
+static void
+freePacket (GNUNET_TransportPacket * mp)
+{
+  if (mp->buffer != NULL)
+    GNUNET_buffer_release (mp->buffer);
+  else
+    GNUNET_free_non_null (mp->msg);
+  GNUNET_free (mp);
+}
+
 /**
  * This is the main loop of each thread.  It loops *forever* waiting
  * for incomming packets in the packet queue. Then it calls "handle"
@@ -633,29 +889,32 @@ handleMessage (GNUNET_TSession * tsession,
 static void *
 threadMain (void *cls)
 {
+  struct HandlerWorker *worker = cls;
   GNUNET_TransportPacket *mp;
+  GNUNET_CronTime start;
 
   while (mainShutdownSignal == NULL)
     {
       GNUNET_semaphore_down (bufferQueueRead_, GNUNET_YES);
-      /* handle buffer entry */
-      /* sync with other handlers to get buffer */
       if (mainShutdownSignal != NULL)
         break;
-      GNUNET_mutex_lock (globalLock_);
-      mp = bufferQueue_[bq_firstFull_];
-      bufferQueue_[bq_firstFull_++] = NULL;
-      if (bq_firstFull_ == QUEUE_LENGTH)
-        bq_firstFull_ = 0;
-      GNUNET_mutex_unlock (globalLock_);
-      /* end of sync */
-      GNUNET_semaphore_up (bufferQueueWrite_);
-      /* handle buffer - now out of sync */
+      /* the semaphore guarantees that a message is in the queue
+         (idle workers block above, they never poll).  If the slot
+         at the tail was claimed by a producer that has not yet
+         stored its message (while a later one already counted
+         its message on the semaphore), that producer is a few
+         instructions away from finishing: just give up the CPU
+         until it does, sleeping here would delay the message */
+      while (NULL == (mp = queuePop ()))
+        GNUNET_thread_sleep (0);
+      start = GNUNET_get_time ();
       handleMessage (mp->tsession, &mp->sender, mp->msg, mp->size);
       if (mp->tsession != NULL)
         transport->disconnect (mp->tsession, __FILE__);
-      GNUNET_free (mp->msg);
-      GNUNET_free (mp);
+      __sync_fetch_and_sub (&sender_load_[senderBucket (&mp->sender)], 1);
+      freePacket (mp);
+      if (stats != NULL)
+        stats->change (worker->stat_busy, GNUNET_get_time () - start);
     }
   GNUNET_semaphore_up (mainShutdownSignal);
   return NULL;
@@ -668,10 +927,11 @@ threadMain (void *cls)
 void
 GNUNET_CORE_p2p_receive (GNUNET_TransportPacket * mp)
 {
+  unsigned int bucket;
+
   if (threads_running != GNUNET_YES)
     {
-      GNUNET_free (mp->msg);
-      GNUNET_free (mp);
+      freePacket (mp);
       return;
     }
   if ((mp->tsession != NULL) &&
@@ -680,14 +940,13 @@ GNUNET_CORE_p2p_receive (GNUNET_TransportPacket * mp)
                sizeof (GNUNET_PeerIdentity))))
     {
       GNUNET_GE_BREAK (NULL, 0);
-      GNUNET_free (mp->msg);
-      GNUNET_free (mp);
+      freePacket (mp);
       return;
     }
   if ((threads_running == GNUNET_NO) || (mainShutdownSignal != NULL))
     {
 #if TRACK_DISCARD
-      GNUNET_mutex_lock (globalLock_);
+      GNUNET_mutex_lock (discardLock);
       discarded++;
       if (0 == discarded % 64)
         GNUNET_GE_LOG (ectx,
@@ -696,7 +955,7 @@ GNUNET_CORE_p2p_receive (GNUNET_TransportPacket * mp)
                        "Accepted: %u discarded: %u blacklisted: %u, ratio: %f\n",
                        accepted, discarded, blacklisted,
                        1.0 * accepted / (blacklisted + discarded + 1));
-      GNUNET_mutex_unlock (globalLock_);
+      GNUNET_mutex_unlock (discardLock);
 #endif
     }
   /* check for blacklisting */
@@ -714,7 +973,7 @@ GNUNET_CORE_p2p_receive (GNUNET_TransportPacket * mp)
                      (char *) &enc);
 #endif
 #if TRACK_DISCARD
-      GNUNET_mutex_lock (globalLock_);
+      GNUNET_mutex_lock (discardLock);
       blacklisted++;
       if (0 == blacklisted % 64)
         GNUNET_GE_LOG (ectx,
@@ -723,15 +982,28 @@ GNUNET_CORE_p2p_receive (GNUNET_TransportPacket * mp)
                        "Accepted: %u discarded: %u blacklisted: %u, ratio: %f\n",
                        accepted, discarded, blacklisted,
                        1.0 * accepted / (blacklisted + discarded + 1));
-      GNUNET_mutex_unlock (globalLock_);
+      GNUNET_mutex_unlock (discardLock);
 #endif
-      GNUNET_free (mp->msg);
-      GNUNET_free (mp);
+      freePacket (mp);
       return;
     }
+  /* make sure a single peer can not fill the entire queue */
+  bucket = senderBucket (&mp->sender);
+  if (__sync_add_and_fetch (&sender_load_[bucket], 1) >
+      queue_length / FAIR_SHARE_DIVISOR)
+    {
+      __sync_fetch_and_sub (&sender_load_[bucket], 1);
+      if (stats != NULL)
+        stats->change (stat_dropped_unfair, 1);
+      freePacket (mp);
+      return;
+    }
+  /* try to increment session reference count */
+  if ((mp->tsession != NULL) &&
+      (GNUNET_SYSERR == transport->associate (mp->tsession, __FILE__)))
+    mp->tsession = NULL;
   if ((threads_running == GNUNET_NO) ||
-      (mainShutdownSignal != NULL) ||
-      (GNUNET_SYSERR == GNUNET_semaphore_down (bufferQueueWrite_, GNUNET_NO)))
+      (mainShutdownSignal != NULL) || (GNUNET_SYSERR == queuePush (mp)))
     {
       /* discard message, buffer is full or
          we're shut down! */
@@ -742,10 +1014,14 @@ GNUNET_CORE_p2p_receive (GNUNET_TransportPacket * mp)
                      "Discarding message of size %u -- buffer full!\n",
                      mp->size);
 #endif
-      GNUNET_free (mp->msg);
-      GNUNET_free (mp);
+      __sync_fetch_and_sub (&sender_load_[bucket], 1);
+      if (mp->tsession != NULL)
+        transport->disconnect (mp->tsession, __FILE__);
+      freePacket (mp);
+      if (stats != NULL)
+        stats->change (stat_dropped_full, 1);
 #if TRACK_DISCARD
-      GNUNET_mutex_lock (globalLock_);
+      GNUNET_mutex_lock (discardLock);
       discarded++;
       if (0 == discarded % 64)
         GNUNET_GE_LOG (ectx,
@@ -754,20 +1030,12 @@ GNUNET_CORE_p2p_receive (GNUNET_TransportPacket * mp)
                        "Accepted: %u discarded: %u blacklisted: %u, ratio: %f\n",
                        accepted, discarded, blacklisted,
                        1.0 * accepted / (blacklisted + discarded + 1));
-      GNUNET_mutex_unlock (globalLock_);
+      GNUNET_mutex_unlock (discardLock);
 #endif
       return;
     }
-  /* try to increment session reference count */
-  if ((mp->tsession != NULL) &&
-      (GNUNET_SYSERR == transport->associate (mp->tsession, __FILE__)))
-    mp->tsession = NULL;
-
-  GNUNET_mutex_lock (globalLock_);
-  if (bq_firstFree_ == QUEUE_LENGTH)
-    bq_firstFree_ = 0;
-  bufferQueue_[bq_firstFree_++] = mp;
 #if TRACK_DISCARD
+  GNUNET_mutex_lock (discardLock);
   accepted++;
   if (0 == accepted % 64)
     GNUNET_GE_LOG (ectx,
@@ -777,8 +1045,8 @@ GNUNET_CORE_p2p_receive (GNUNET_TransportPacket * mp)
                    discarded,
                    blacklisted,
                    1.0 * accepted / (blacklisted + discarded + 1));
+  GNUNET_mutex_unlock (discardLock);
 #endif
-  GNUNET_mutex_unlock (globalLock_);
   GNUNET_semaphore_up (bufferQueueRead_);
 }
 
@@ -788,14 +1056,36 @@ GNUNET_CORE_p2p_receive (GNUNET_TransportPacket * mp)
 void
 GNUNET_CORE_p2p_enable_processing ()
 {
-  int i;
+  unsigned int i;
+  char *name;
 
+  stats = GNUNET_CORE_request_service ("stats");
+  if (stats != NULL)
+    {
+      stat_dropped_full =
+        stats->create (gettext_noop
+                       ("# p2p messages dropped (inbound queue full)"));
+      stat_dropped_unfair =
+        stats->create (gettext_noop
+                       ("# p2p messages dropped (sender exceeded fair share)"));
+      stat_queue_high_water =
+        stats->create (gettext_noop
+                       ("# p2p inbound queue high-water mark"));
+      for (i = 0; i < worker_count; i++)
+        {
+          name = GNUNET_malloc (64);
+          GNUNET_snprintf (name, 64, "# p2p worker %u busy time (ms)", i);
+          workers_[i].stat_busy = stats->create (name);
+          GNUNET_free (name);
+        }
+    }
   /* create message handling threads */
   threads_running = GNUNET_YES;
-  for (i = 0; i < THREAD_COUNT; i++)
+  for (i = 0; i < worker_count; i++)
     {
-      threads_[i] = GNUNET_thread_create (&threadMain, &i, 128 * 1024);
-      if (threads_[i] == NULL)
+      workers_[i].thread =
+        GNUNET_thread_create (&threadMain, &workers_[i], 128 * 1024);
+      if (workers_[i].thread == NULL)
         GNUNET_GE_LOG_STRERROR (ectx, GNUNET_GE_ERROR, "pthread_create");
     }
 }
@@ -806,48 +1096,114 @@ GNUNET_CORE_p2p_enable_processing ()
 void
 GNUNET_CORE_p2p_disable_processing ()
 {
-  int i;
+  unsigned int i;
   void *unused;
 
   /* shutdown processing of inbound messages... */
   threads_running = GNUNET_NO;
   mainShutdownSignal = GNUNET_semaphore_create (0);
-  for (i = 0; i < THREAD_COUNT; i++)
+  for (i = 0; i < worker_count; i++)
     {
+      if (workers_[i].thread == NULL)
+        continue;
       GNUNET_semaphore_up (bufferQueueRead_);
       GNUNET_semaphore_down (mainShutdownSignal, GNUNET_YES);
     }
-  for (i = 0; i < THREAD_COUNT; i++)
+  for (i = 0; i < worker_count; i++)
     {
-      GNUNET_thread_join (threads_[i], &unused);
-      threads_[i] = NULL;
+      if (workers_[i].thread == NULL)
+        continue;
+      GNUNET_thread_join (workers_[i].thread, &unused);
+      workers_[i].thread = NULL;
     }
   GNUNET_semaphore_destroy (mainShutdownSignal);
   mainShutdownSignal = NULL;
+  if (stats != NULL)
+    {
+      GNUNET_CORE_release_service (stats);
+      stats = NULL;
+    }
+}
+
+/**
+ * Determine the number of CPUs of this host.
+ *
+ * @return number of CPUs, 1 if unknown
+ */
+static unsigned int
+getCPUCount ()
+{
+  long ret;
+
+  ret = -1;
+#ifdef _SC_NPROCESSORS_ONLN
+  ret = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  if (ret < 1)
+    return 1;
+  return (unsigned int) ret;
 }
 
 /**
  * Initialize message handling module.
  */
 void
-GNUNET_CORE_p2p_init (struct GNUNET_GE_Context *e)
+GNUNET_CORE_p2p_init (struct GNUNET_GE_Context *e,
+                      struct GNUNET_GC_Configuration *c)
 {
-  int i;
+  unsigned long long len;
+  unsigned long long threads;
+  unsigned int i;
 
   ectx = e;
+  cfg = c;
   handlerLock = GNUNET_mutex_create (GNUNET_NO);
   transport = GNUNET_CORE_request_service ("transport");
   GNUNET_GE_ASSERT (ectx, transport != NULL);
   identity = GNUNET_CORE_request_service ("identity");
   GNUNET_GE_ASSERT (ectx, identity != NULL);
+  len = QUEUE_LENGTH;
+  threads = 0;
+  if (cfg != NULL)
+    {
+      GNUNET_GC_get_configuration_value_number (cfg,
+                                                "GNUNETD",
+                                                "INBOUND-QUEUE-SIZE",
+                                                8, 65536, QUEUE_LENGTH, &len);
+      GNUNET_GC_get_configuration_value_number (cfg,
+                                                "GNUNETD",
+                                                "INBOUND-THREADS",
+                                                0, 1024, 0, &threads);
+    }
+  if (threads == 0)
+    {
+      threads = getCPUCount ();
+      if (threads < MIN_THREAD_COUNT)
+        threads = MIN_THREAD_COUNT;
+    }
+  worker_count = (unsigned int) threads;
+  /* round queue length up to a power of two (needed for
+     the ring buffer) that is large enough for all threads */
+  queue_length = 8;
+  while ((queue_length < len) || (queue_length < worker_count))
+    queue_length *= 2;
   /* initialize sync mechanisms for message handling threads */
   bufferQueueRead_ = GNUNET_semaphore_create (0);
-  bufferQueueWrite_ = GNUNET_semaphore_create (QUEUE_LENGTH);
-  globalLock_ = GNUNET_mutex_create (GNUNET_NO);
-  for (i = 0; i < QUEUE_LENGTH; i++)
-    bufferQueue_[i] = NULL;
-  bq_firstFree_ = 0;
-  bq_firstFull_ = 0;
+#if TRACK_DISCARD
+  discardLock = GNUNET_mutex_create (GNUNET_NO);
+#endif
+  bufferQueue_ = GNUNET_malloc (queue_length * sizeof (struct QueueSlot));
+  for (i = 0; i < queue_length; i++)
+    {
+      bufferQueue_[i].seq = i;
+      bufferQueue_[i].mp = NULL;
+    }
+  bq_head_ = 0;
+  bq_tail_ = 0;
+  queue_high_water_ = 0;
+  memset ((void *) sender_load_, 0, sizeof (sender_load_));
+  workers_ = GNUNET_malloc (worker_count * sizeof (struct HandlerWorker));
+  memset (workers_, 0, worker_count * sizeof (struct HandlerWorker));
 }
 
 /**
@@ -857,20 +1213,26 @@ void
 GNUNET_CORE_p2p_done ()
 {
   unsigned int i;
+  GNUNET_TransportPacket *mp;
 
-  GNUNET_mutex_destroy (globalLock_);
-  globalLock_ = NULL;
+#if TRACK_DISCARD
+  GNUNET_mutex_destroy (discardLock);
+  discardLock = NULL;
+#endif
   /* free datastructures */
   GNUNET_semaphore_destroy (bufferQueueRead_);
   bufferQueueRead_ = NULL;
-  GNUNET_semaphore_destroy (bufferQueueWrite_);
-  bufferQueueWrite_ = NULL;
-  for (i = 0; i < QUEUE_LENGTH; i++)
+  while (NULL != (mp = queuePop ()))
     {
-      if (bufferQueue_[i] != NULL)
-        GNUNET_free_non_null (bufferQueue_[i]->msg);
-      GNUNET_free_non_null (bufferQueue_[i]);
+      if (mp->tsession != NULL)
+        transport->disconnect (mp->tsession, __FILE__);
+      freePacket (mp);
     }
+  GNUNET_free (bufferQueue_);
+  bufferQueue_ = NULL;
+  GNUNET_free (workers_);
+  workers_ = NULL;
+  worker_count = 0;
 
   GNUNET_mutex_destroy (handlerLock);
   handlerLock = NULL;
@@ -895,19 +1257,17 @@ GNUNET_CORE_p2p_done ()
   transport = NULL;
   GNUNET_CORE_release_service (identity);
   identity = NULL;
-#if MEASURE_TIME
   for (i = 0; i < GNUNET_P2P_PROTO_MAX_USED; i++)
     {
-      if (count_by_type[i] == 0)
+      if (handler_stats[i].count == 0)
         continue;
       GNUNET_GE_LOG (ectx,
                      GNUNET_GE_DEBUG | GNUNET_GE_DEVELOPER |
                      GNUNET_GE_REQUEST,
-                     "%10u msgs of type %2u took %16llu ms (%llu on average)\n",
-                     count_by_type[i], i, time_by_type[i],
-                     time_by_type[i] / count_by_type[i]);
+                     "%10llu msgs of type %2u took %16llu us (%llu on average)\n",
+                     handler_stats[i].count, i, handler_stats[i].time,
+                     handler_stats[i].time / handler_stats[i].count);
     }
-#endif
 }
 
 
@@ -32,8 +32,12 @@
 /**
  * Initialize message handling module (make ready to register
  * handlers).
+ *
+ * @param c configuration (size of the inbound queue and
+ *        number of worker threads), may be NULL
  */
-void GNUNET_CORE_p2p_init (struct GNUNET_GE_Context *e);
+void GNUNET_CORE_p2p_init (struct GNUNET_GE_Context *e,
+                           struct GNUNET_GC_Configuration *c);
 
 /**
  * Shutdown message handling module.
@@ -144,6 +148,20 @@ int GNUNET_CORE_plaintext_unregister_handler (const unsigned short type,
 int GNUNET_CORE_p2p_test_handler_registered (unsigned short type,
                                              unsigned short handlerType);
 
+/**
+ * Get statistics about the handlers for messages of the given
+ * p2p type (since gnunetd was started).
+ *
+ * @param type the message type
+ * @param stats set to the statistics for the type
+ * @return GNUNET_OK on success, GNUNET_SYSERR if no
+ *         statistics are kept for the type
+ */
+int GNUNET_CORE_p2p_get_handler_statistics (unsigned short type,
+                                            struct
+                                            GNUNET_CORE_HandlerStatistics *
+                                            stats);
+
 
 #endif
 /* end of handler.h */
@@ -293,9 +293,11 @@ select_message_handler (void *mh_cls,
           tcp_disconnect (tsession);
           return GNUNET_SYSERR;
         }
+      /* pass the message to the core without copying it */
       mp = GNUNET_malloc (sizeof (GNUNET_TransportPacket));
-      mp->msg = GNUNET_malloc (len - sizeof (GNUNET_MessageHeader));
-      memcpy (mp->msg, &msg[1], len - sizeof (GNUNET_MessageHeader));
+      mp->buffer = GNUNET_select_get_message_buffer (sh);
+      GNUNET_buffer_retain (mp->buffer);
+      mp->msg = (char *) &msg[1];
       mp->sender = tcpSession->sender;
       mp->size = len - sizeof (GNUNET_MessageHeader);
       mp->tsession = tsession;
@@ -380,7 +382,8 @@ tcp_send (GNUNET_TSession * tsession,
           const void *msg, unsigned int size, int important)
 {
   TCPSession *tcpSession;
-  GNUNET_MessageHeader *mp;
+  GNUNET_MessageHeader hdr;
+  struct GNUNET_IOVec iov[2];
   int ok;
 
   tcpSession = tsession->internal;
@@ -408,17 +411,17 @@ tcp_send (GNUNET_TSession * tsession,
         stats->change (stat_bytesDropped, size);
       return GNUNET_SYSERR;     /* other side closed connection */
     }
-  mp = GNUNET_malloc (sizeof (GNUNET_MessageHeader) + size);
-  mp->size = htons (size + sizeof (GNUNET_MessageHeader));
-  mp->type = 0;
-  memcpy (&mp[1], msg, size);
+  hdr.size = htons (size + sizeof (GNUNET_MessageHeader));
+  hdr.type = 0;
+  iov[0].base = &hdr;
+  iov[0].size = sizeof (GNUNET_MessageHeader);
+  iov[1].base = msg;
+  iov[1].size = size;
   ok =
-    GNUNET_select_write (selector, tcpSession->sock, mp, GNUNET_NO,
-                         important);
+    GNUNET_select_writev (selector, tcpSession->sock, iov, 2, GNUNET_NO,
+                          important);
   if ((GNUNET_OK == ok) && (stats != NULL))
     stats->change (stat_bytesSent, size + sizeof (GNUNET_MessageHeader));
-
-  GNUNET_free (mp);
   return ok;
 }
 
@@ -0,0 +1,231 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file transports/tcpperf.c
+ * @brief Throughput of tcp_send over loopback (the transport
+ *        connects to itself) and the number of buffer allocations
+ *        made by its select per MB sent and received.  The messages
+ *        are not important, so they go through the memory quota of
+ *        the select like normal traffic does.
+ * @author Christian Grothoff
+ */
+
+#include "tcp.c"
+
+#define PORT 4468
+
+/**
+ * Size of the payload of each message.
+ */
+#define PAYLOAD_SIZE 1024
+
+/**
+ * How many MB should we send?
+ */
+#define MEGABYTES 64
+
+#define MESSAGES (MEGABYTES * 1024 * 1024 / (PAYLOAD_SIZE + sizeof (GNUNET_MessageHeader)))
+
+/**
+ * Name of the configuration file.
+ */
+static char *cfgFilename = "test.conf";
+
+/**
+ * No options.
+ */
+static struct GNUNET_CommandLineOption testOptions[] = {
+  GNUNET_COMMAND_LINE_OPTION_END,
+};
+
+static unsigned int received;
+
+static unsigned int corrupt;
+
+static unsigned char expectValue;
+
+static void *
+request_service (const char *name)
+{
+  return NULL;
+}
+
+static int
+connection_assert_tsession_unused (GNUNET_TSession * tsession)
+{
+  return GNUNET_OK;
+}
+
+static void
+receive (GNUNET_TransportPacket * mp)
+{
+  if ((mp->size != PAYLOAD_SIZE) ||
+      (mp->msg[0] != (char) expectValue) ||
+      (mp->msg[PAYLOAD_SIZE - 1] != (char) expectValue))
+    corrupt++;
+  expectValue++;
+  received++;
+  if (mp->buffer != NULL)
+    GNUNET_buffer_release (mp->buffer);
+  else
+    GNUNET_free (mp->msg);
+  GNUNET_free (mp);
+}
+
+/**
+ * Send MESSAGES messages to ourselves with tcp_send.
+ */
+static int
+perfSend (GNUNET_TransportAPI * transport)
+{
+  GNUNET_MessageHello *hello;
+  GNUNET_TSession *tsession;
+  GNUNET_CronTime start;
+  GNUNET_CronTime end;
+  GNUNET_CronTime delta;
+  unsigned long long allocations;
+  char payload[PAYLOAD_SIZE];
+  unsigned int refused;
+  unsigned int i;
+  int ret;
+
+  hello = transport->hello_create ();
+  if (hello == NULL)
+    return GNUNET_SYSERR;
+  if (GNUNET_OK != transport->connect (hello, &tsession, GNUNET_NO))
+    {
+      GNUNET_free (hello);
+      return GNUNET_SYSERR;
+    }
+  GNUNET_free (hello);
+  refused = 0;
+  allocations = GNUNET_select_get_allocations (selector);
+  start = GNUNET_get_time ();
+  for (i = 0; i < MESSAGES; i++)
+    {
+      memset (payload, (char) i, PAYLOAD_SIZE);
+      /* wait for the select to drain its queue if the
+         memory quota does not permit queueing more */
+      while (GNUNET_OK !=
+             (ret = transport->send (tsession, payload, PAYLOAD_SIZE,
+                                     GNUNET_NO)))
+        {
+          if (ret == GNUNET_SYSERR)
+            {
+              transport->disconnect (tsession);
+              return GNUNET_SYSERR;
+            }
+          refused++;
+          GNUNET_thread_sleep (GNUNET_CRON_MILLISECONDS);
+        }
+    }
+  end = GNUNET_get_time () + 60 * GNUNET_CRON_SECONDS;
+  while ((received < MESSAGES) && (GNUNET_get_time () < end))
+    GNUNET_thread_sleep (5 * GNUNET_CRON_MILLISECONDS);
+  delta = GNUNET_get_time () - start;
+  allocations = GNUNET_select_get_allocations (selector) - allocations;
+  transport->disconnect (tsession);
+  if (received < MESSAGES)
+    {
+      fprintf (stderr, "Only %u of %u messages received\n",
+               received, (unsigned int) MESSAGES);
+      return GNUNET_SYSERR;
+    }
+  if (delta == 0)
+    delta = 1;
+  printf ("tcp_send: %llu MB/s, %llu select allocations per MB, "
+          "%u sends refused by the quota\n",
+          (unsigned long long) MEGABYTES * GNUNET_CRON_SECONDS / delta,
+          allocations / MEGABYTES, refused);
+  if (corrupt != 0)
+    {
+      fprintf (stderr, "%u messages corrupt\n", corrupt);
+      return GNUNET_SYSERR;
+    }
+  return GNUNET_OK;
+}
+
+int
+main (int argc, char *const *argv)
+{
+  GNUNET_CoreAPIForTransport api;
+  GNUNET_TransportAPI *transport;
+  GNUNET_PeerIdentity me;
+  GNUNET_HashCode hc;
+  int res;
+
+  memset (&api, 0, sizeof (GNUNET_CoreAPIForTransport));
+  res = GNUNET_init (argc,
+                     argv,
+                     "tcpperf", &cfgFilename, testOptions, &api.ectx,
+                     &api.cfg);
+  if (res == -1)
+    {
+      GNUNET_fini (api.ectx, api.cfg);
+      return 1;
+    }
+  /* disable blacklists (loopback is often blacklisted)... */
+  GNUNET_GC_set_configuration_value_string (api.cfg, api.ectx, "TCP",
+                                            "BLACKLISTV4", "");
+  GNUNET_GC_set_configuration_value_string (api.cfg, api.ectx, "TCP",
+                                            "BLACKLISTV6", "");
+  GNUNET_GC_set_configuration_value_string (api.cfg, api.ectx, "TCP", "UPNP",
+                                            "NO");
+  GNUNET_GC_set_configuration_value_number (api.cfg, api.ectx, "TCP", "PORT",
+                                            PORT);
+  GNUNET_create_random_hash (&hc);
+  me.hashPubKey = hc;
+  api.cron = GNUNET_cron_create (api.ectx);
+  api.my_identity = &me;
+  api.receive = &receive;
+  api.service_request = &request_service;
+  api.service_release = NULL;   /* not needed */
+  api.tsession_assert_unused = &connection_assert_tsession_unused;
+  GNUNET_cron_start (api.cron);
+  transport = inittransport_tcp (&api);
+  if (transport == NULL)
+    {
+      fprintf (stderr, "Error initializing transport...\n");
+      res = GNUNET_SYSERR;
+    }
+  else
+    {
+      if (GNUNET_OK != transport->server_start ())
+        res = GNUNET_SYSERR;
+      else
+        {
+          res = perfSend (transport);
+          transport->server_stop ();
+        }
+      donetransport_tcp ();
+    }
+  GNUNET_cron_stop (api.cron);
+  GNUNET_cron_destroy (api.cron);
+  GNUNET_fini (api.ectx, api.cfg);
+  if (res != GNUNET_OK)
+    {
+      fprintf (stderr, "TCP performance test failed\n");
+      return 2;
+    }
+  return 0;
+}
+
+/* end of tcpperf.c */
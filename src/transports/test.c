@@ -121,7 +121,10 @@ receive (GNUNET_TransportPacket * mp)
           if (GNUNET_OK != transport->connect (hello, &tsession, GNUNET_NO))
             {
               GNUNET_free (hello);
-              GNUNET_free (mp->msg);
+              if (mp->buffer != NULL)
+                GNUNET_buffer_release (mp->buffer);
+              else
+                GNUNET_free (mp->msg);
               GNUNET_free (mp);
               error_count++;
               return;
@@ -157,7 +160,10 @@ receive (GNUNET_TransportPacket * mp)
       else
         msg_count++;
     }
-  GNUNET_free (mp->msg);
+  if (mp->buffer != NULL)
+    GNUNET_buffer_release (mp->buffer);
+  else
+    GNUNET_free (mp->msg);
   GNUNET_free (mp);
 }
 
@@ -40,6 +40,12 @@
  */
 #define MESSAGE_SIZE 1472
 
+/**
+ * How many datagrams may wait in the send queue?  Messages
+ * that do not fit are dropped.
+ */
+#define SEND_QUEUE_SIZE 128
+
 /**
  * Message-Packet header.
  */
@@ -82,6 +88,45 @@ static struct GNUNET_SocketHandle *udp_sock;
 
 static struct GNUNET_LoadMonitor *load_monitor;
 
+/**
+ * Datagrams waiting to be sent (ring buffer); their data
+ * and addresses point into send_data and send_addr.
+ */
+static struct GNUNET_Datagram send_queue[SEND_QUEUE_SIZE];
+
+static char *send_data;
+
+static struct sockaddr_in6 *send_addr;
+
+/**
+ * Position of the first datagram in the send queue.
+ */
+static unsigned int send_head;
+
+/**
+ * Number of datagrams in the send queue (including
+ * those that the sender thread is sending right now).
+ */
+static unsigned int send_count;
+
+/**
+ * Lock for the send queue.
+ */
+static struct GNUNET_Mutex *send_lock;
+
+/**
+ * Signaled whenever the send queue becomes non-empty.
+ */
+static struct GNUNET_Semaphore *send_signal;
+
+/**
+ * Thread that sends the queued datagrams; NULL if
+ * the server is not running.
+ */
+static struct GNUNET_ThreadHandle *sender;
+
+static int sender_shutdown;
+
 
 /**
  * The socket of session has data waiting, process!
@@ -109,9 +154,11 @@ select_message_handler (void *mh_cls,
       return GNUNET_SYSERR;
     }
   um = (const UDPMessage *) msg;
+  /* pass the message to the core without copying it */
   mp = GNUNET_malloc (sizeof (GNUNET_TransportPacket));
-  mp->msg = GNUNET_malloc (len - sizeof (UDPMessage));
-  memcpy (mp->msg, &um[1], len - sizeof (UDPMessage));
+  mp->buffer = GNUNET_select_get_message_buffer (sh);
+  GNUNET_buffer_retain (mp->buffer);
+  mp->msg = (char *) &um[1];
   mp->sender = um->sender;
   mp->size = len - sizeof (UDPMessage);
   mp->tsession = NULL;
@@ -215,12 +262,28 @@ udp_disconnect (GNUNET_TSession * tsession)
 static int
 udp_transport_server_stop ()
 {
+  struct GNUNET_ThreadHandle *thread;
+  void *unused;
+
   GNUNET_GE_ASSERT (coreAPI->ectx, udp_sock != NULL);
   if (selector != NULL)
     {
       GNUNET_select_destroy (selector);
       selector = NULL;
     }
+  GNUNET_mutex_lock (send_lock);
+  thread = sender;
+  sender = NULL;
+  sender_shutdown = GNUNET_YES;
+  GNUNET_mutex_unlock (send_lock);
+  GNUNET_semaphore_up (send_signal);
+  GNUNET_thread_join (thread, &unused);
+  GNUNET_semaphore_destroy (send_signal);
+  send_signal = NULL;
+  GNUNET_free (send_data);
+  send_data = NULL;
+  GNUNET_free (send_addr);
+  send_addr = NULL;
   GNUNET_socket_destroy (udp_sock);
   udp_sock = NULL;
   return GNUNET_OK;
@@ -260,6 +323,8 @@ udp_test_would_try (GNUNET_TSession * tsession, unsigned int size,
   hello = (const GNUNET_MessageHello *) tsession->internal;
   if (hello == NULL)
     return GNUNET_SYSERR;
+  if (send_count == SEND_QUEUE_SIZE)
+    return GNUNET_NO;           /* queue full, would drop */
   return GNUNET_YES;
 }
 
@@ -308,7 +373,95 @@ udp_create_socket ()
 }
 
 /**
- * Send a message to the specified remote node.
+ * Send a batch of datagrams from the send queue.  Datagrams
+ * that can not be sent are dropped.  Called by the sender
+ * thread without holding send_lock.
+ */
+static void
+send_datagrams (struct GNUNET_Datagram *batch, unsigned int count)
+{
+  unsigned long long bytes;
+  unsigned int pos;
+  unsigned int sent;
+  unsigned int i;
+  int ret;
+
+  pos = 0;
+  while (pos < count)
+    {
+#ifndef MINGW
+      ret = GNUNET_socket_send_to_multiple (udp_sock,
+                                            GNUNET_NC_BLOCKING |
+                                            GNUNET_NC_IGNORE_INT,
+                                            &batch[pos], count - pos, &sent);
+#else
+      sent = 0;
+      ret = GNUNET_YES;
+      if (SOCKET_ERROR == win_ols_sendto (udp_sock,
+                                          batch[pos].data,
+                                          batch[pos].size,
+                                          batch[pos].addr,
+                                          batch[pos].addr_len))
+        ret = GNUNET_SYSERR;
+      else
+        sent = 1;
+#endif
+      bytes = 0;
+      for (i = pos; i < pos + sent; i++)
+        bytes += batch[i].size;
+      pos += sent;
+      if ((stats != NULL) && (bytes > 0))
+        stats->change (stat_bytesSent, bytes);
+      if (ret != GNUNET_SYSERR)
+        continue;
+      /* skip the datagram that failed */
+      if (stats != NULL)
+        stats->change (stat_bytesDropped, batch[pos].size);
+      pos++;
+    }
+}
+
+/**
+ * Main method of the sender thread: whenever the send queue
+ * becomes non-empty, send everything that was queued (in
+ * batches of as many datagrams as queued meanwhile).
+ */
+static void *
+sender_main (void *unused)
+{
+  struct GNUNET_Datagram *batch;
+  unsigned int count;
+  int shutdown;
+
+  while (1)
+    {
+      GNUNET_semaphore_down (send_signal, GNUNET_YES);
+      GNUNET_mutex_lock (send_lock);
+      while (send_count > 0)
+        {
+          count = send_count;
+          if (send_head + count > SEND_QUEUE_SIZE)
+            count = SEND_QUEUE_SIZE - send_head;
+          batch = &send_queue[send_head];
+          /* producers only write behind the queued datagrams,
+             so we can send these without holding the lock */
+          GNUNET_mutex_unlock (send_lock);
+          send_datagrams (batch, count);
+          GNUNET_mutex_lock (send_lock);
+          send_head = (send_head + count) % SEND_QUEUE_SIZE;
+          send_count -= count;
+        }
+      shutdown = sender_shutdown;
+      GNUNET_mutex_unlock (send_lock);
+      if (shutdown == GNUNET_YES)
+        break;
+    }
+  return NULL;
+}
+
+/**
+ * Send a message to the specified remote node.  The message
+ * is copied into the send queue and sent by the sender thread.
  *
  * @param tsession the GNUNET_MessageHello identifying the remote node
  * @param message what to send
@@ -321,15 +474,12 @@ udp_send (GNUNET_TSession * tsession,
 {
   const GNUNET_MessageHello *hello;
   const HostAddress *haddr;
+  struct GNUNET_Datagram *dgram;
   UDPMessage *mp;
-  struct sockaddr_in serverAddrv4;
-  struct sockaddr_in6 serverAddrv6;
-  struct sockaddr *serverAddr;
-  socklen_t addrlen;
+  struct sockaddr_in *serverAddrv4;
+  struct sockaddr_in6 *serverAddrv6;
   unsigned short available;
-  int ok;
   int ssize;
-  size_t sent;
 
   GNUNET_GE_ASSERT (NULL, tsession != NULL);
   if (udp_sock == NULL)
@@ -360,56 +510,45 @@ udp_send (GNUNET_TSession * tsession,
         available = VERSION_AVAILABLE_IPV6;
     }
   ssize = size + sizeof (UDPMessage);
-  mp = GNUNET_malloc (ssize);
+  GNUNET_mutex_lock (send_lock);
+  if ((sender == NULL) || (send_count == SEND_QUEUE_SIZE))
+    {
+      GNUNET_mutex_unlock (send_lock);
+      if (stats != NULL)
+        stats->change (stat_bytesDropped, ssize);
+      return GNUNET_SYSERR;
+    }
+  dgram = &send_queue[(send_head + send_count) % SEND_QUEUE_SIZE];
+  mp = (UDPMessage *) dgram->data;
   mp->header.size = htons (ssize);
   mp->header.type = 0;
   mp->sender = *(coreAPI->my_identity);
   memcpy (&mp[1], message, size);
-  ok = GNUNET_SYSERR;
-
+  dgram->size = ssize;
   if ((available & VERSION_AVAILABLE_IPV4) > 0)
     {
-      memset (&serverAddrv4, 0, sizeof (serverAddrv4));
-      serverAddrv4.sin_family = AF_INET;
-      serverAddrv4.sin_port = haddr->port;
-      memcpy (&serverAddrv4.sin_addr, &haddr->ipv4, sizeof (struct in_addr));
-      addrlen = sizeof (serverAddrv4);
-      serverAddr = (struct sockaddr *) &serverAddrv4;
+      serverAddrv4 = (struct sockaddr_in *) dgram->addr;
+      memset (serverAddrv4, 0, sizeof (struct sockaddr_in));
+      serverAddrv4->sin_family = AF_INET;
+      serverAddrv4->sin_port = haddr->port;
+      memcpy (&serverAddrv4->sin_addr, &haddr->ipv4, sizeof (struct in_addr));
+      dgram->addr_len = sizeof (struct sockaddr_in);
     }
   else
     {
-      memset (&serverAddrv6, 0, sizeof (serverAddrv6));
-      serverAddrv6.sin6_family = AF_INET;
-      serverAddrv6.sin6_port = haddr->port;
-      memcpy (&serverAddrv6.sin6_addr, &haddr->ipv6,
+      serverAddrv6 = (struct sockaddr_in6 *) dgram->addr;
+      memset (serverAddrv6, 0, sizeof (struct sockaddr_in6));
+      serverAddrv6->sin6_family = AF_INET6;
+      serverAddrv6->sin6_port = haddr->port;
+      memcpy (&serverAddrv6->sin6_addr, &haddr->ipv6,
               sizeof (struct in6_addr));
-      addrlen = sizeof (serverAddrv6);
-      serverAddr = (struct sockaddr *) &serverAddrv6;
+      dgram->addr_len = sizeof (struct sockaddr_in6);
     }
-#ifndef MINGW
-  if (GNUNET_YES == GNUNET_socket_send_to (udp_sock,
-                                           GNUNET_NC_NONBLOCKING,
-                                           mp,
-                                           ssize, &sent,
-                                           (const char *) serverAddr,
-                                           addrlen))
-#else
-  sent =
-    win_ols_sendto (udp_sock, mp, ssize, (const char *) serverAddr, addrlen);
-  if (sent != SOCKET_ERROR)
-#endif
-    {
-      ok = GNUNET_OK;
-      if (stats != NULL)
-        stats->change (stat_bytesSent, sent);
-    }
-  else
-    {
-      if (stats != NULL)
-        stats->change (stat_bytesDropped, ssize);
-    }
-  GNUNET_free (mp);
-  return ok;
+  send_count++;
+  if (send_count == 1)
+    GNUNET_semaphore_up (send_signal);
+  GNUNET_mutex_unlock (send_lock);
+  return GNUNET_OK;
 }
 
 /**
@@ -423,7 +562,9 @@ udp_transport_server_start ()
   struct sockaddr_in serverAddrv4;
   struct sockaddr_in6 serverAddrv6;
   struct sockaddr *serverAddr;
+  struct GNUNET_ThreadHandle *thread;
   socklen_t addrlen;
+  unsigned int i;
   int sock;
   const int on = 1;
   unsigned short port;
@@ -501,6 +642,47 @@ udp_transport_server_start ()
     }
   udp_sock = GNUNET_socket_create (coreAPI->ectx, load_monitor, sock);
   GNUNET_GE_ASSERT (coreAPI->ectx, udp_sock != NULL);
+#ifndef MINGW
+  /* set once; the sender thread waits for the socket
+     with poll if the kernel can not take more datagrams */
+  GNUNET_socket_set_blocking (udp_sock, GNUNET_NO);
+#endif
+  send_data = GNUNET_malloc (SEND_QUEUE_SIZE *
+                             (myAPI.mtu + sizeof (UDPMessage)));
+  send_addr = GNUNET_malloc (SEND_QUEUE_SIZE * sizeof (struct sockaddr_in6));
+  for (i = 0; i < SEND_QUEUE_SIZE; i++)
+    {
+      send_queue[i].data = &send_data[i * (myAPI.mtu + sizeof (UDPMessage))];
+      send_queue[i].addr = (char *) &send_addr[i];
+    }
+  send_head = 0;
+  send_count = 0;
+  sender_shutdown = GNUNET_NO;
+  send_signal = GNUNET_semaphore_create (0);
+  thread = GNUNET_thread_create (&sender_main, NULL, 128 * 1024);
+  if (thread == NULL)
+    {
+      GNUNET_GE_LOG_STRERROR (coreAPI->ectx,
+                              GNUNET_GE_ERROR | GNUNET_GE_ADMIN |
+                              GNUNET_GE_IMMEDIATE, "pthread_create");
+      GNUNET_semaphore_destroy (send_signal);
+      send_signal = NULL;
+      GNUNET_free (send_data);
+      send_data = NULL;
+      GNUNET_free (send_addr);
+      send_addr = NULL;
+      GNUNET_socket_destroy (udp_sock);
+      udp_sock = NULL;
+      if (selector != NULL)
+        {
+          GNUNET_select_destroy (selector);
+          selector = NULL;
+        }
+      return GNUNET_SYSERR;
+    }
+  GNUNET_mutex_lock (send_lock);
+  sender = thread;
+  GNUNET_mutex_unlock (send_lock);
   return GNUNET_OK;
 }
 
@@ -544,6 +726,7 @@ inittransport_udp (GNUNET_CoreAPIForTransport * core)
       lock = NULL;
       return NULL;
     }
+  send_lock = GNUNET_mutex_create (GNUNET_NO);
   if (GNUNET_GC_get_configuration_value_yesno (cfg, "UDP", "UPNP", GNUNET_YES)
       == GNUNET_YES)
     {
@@ -587,6 +770,8 @@ void
 donetransport_udp ()
 {
   do_shutdown ();
+  GNUNET_mutex_destroy (send_lock);
+  send_lock = NULL;
 }
 
 /* end of udp.c */
@@ -0,0 +1,242 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file transports/udpperf.c
+ * @brief Packets per second sent and received by the UDP
+ *        transport over loopback (the transport sends to itself)
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "gnunet_util.h"
+#include "gnunet_directories.h"
+#include "gnunet_protocols.h"
+#include "gnunet_transport.h"
+#include "common.h"
+
+#define PORT 4466
+
+/**
+ * How many packets should we send?
+ */
+#define PACKETS (128 * 1024)
+
+/**
+ * Size of each packet (pick a value smaller than the MTU).
+ */
+#define PACKET_SIZE 1200
+
+/**
+ * Name of the configuration file.
+ */
+static char *cfgFilename = "test.conf";
+
+/**
+ * No options.
+ */
+static struct GNUNET_CommandLineOption testOptions[] = {
+  GNUNET_COMMAND_LINE_OPTION_END,
+};
+
+static unsigned int received;
+
+static unsigned int corrupt;
+
+static void *
+request_service (const char *name)
+{
+  return NULL;
+}
+
+static int
+connection_assert_tsession_unused (GNUNET_TSession * tsession)
+{
+  return GNUNET_OK;
+}
+
+static void
+receive (GNUNET_TransportPacket * mp)
+{
+  if ((mp->size != PACKET_SIZE) ||
+      (mp->msg[0] != mp->msg[PACKET_SIZE - 1]))
+    corrupt++;
+  received++;
+  if (mp->buffer != NULL)
+    GNUNET_buffer_release (mp->buffer);
+  else
+    GNUNET_free (mp->msg);
+  GNUNET_free (mp);
+}
+
+/**
+ * Send PACKETS packets to ourselves and report how many
+ * packets per second were sent and received.
+ */
+static int
+perfSend (GNUNET_TransportAPI * transport)
+{
+  GNUNET_MessageHello *hello;
+  GNUNET_TSession *tsession;
+  GNUNET_CronTime start;
+  GNUNET_CronTime sent;
+  GNUNET_CronTime last;
+  char payload[PACKET_SIZE];
+  unsigned int seen;
+  unsigned int i;
+
+  hello = transport->hello_create ();
+  if (hello == NULL)
+    return GNUNET_SYSERR;
+  if (GNUNET_OK != transport->connect (hello, &tsession, GNUNET_NO))
+    {
+      GNUNET_free (hello);
+      return GNUNET_SYSERR;
+    }
+  GNUNET_free (hello);
+  start = GNUNET_get_time ();
+  for (i = 0; i < PACKETS; i++)
+    {
+      memset (payload, (char) i, PACKET_SIZE);
+      /* give the transport time to catch up if it has to drop */
+      while (GNUNET_OK !=
+             transport->send (tsession, payload, PACKET_SIZE, GNUNET_NO))
+        GNUNET_thread_sleep (GNUNET_CRON_MILLISECONDS);
+    }
+  sent = GNUNET_get_time ();
+  /* wait until everything arrived or nothing arrives anymore
+     (loopback may drop packets if we send faster than we read) */
+  seen = 0;
+  last = sent;
+  while ((received < PACKETS) &&
+         (GNUNET_get_time () - last < 500 * GNUNET_CRON_MILLISECONDS))
+    {
+      if (received != seen)
+        {
+          seen = received;
+          last = GNUNET_get_time ();
+        }
+      GNUNET_thread_sleep (5 * GNUNET_CRON_MILLISECONDS);
+    }
+  transport->disconnect (tsession);
+  if (sent == start)
+    sent++;
+  if (last <= start)
+    last = start + 1;
+  printf ("Sent %u packets: %llu packets/s\n",
+          PACKETS,
+          (unsigned long long) PACKETS * GNUNET_CRON_SECONDS / (sent - start));
+  printf ("Received %u packets: %llu packets/s\n",
+          received,
+          (unsigned long long) received * GNUNET_CRON_SECONDS / (last -
+                                                                 start));
+  if ((received == 0) || (corrupt != 0))
+    return GNUNET_SYSERR;
+  return GNUNET_OK;
+}
+
+int
+main (int argc, char *const *argv)
+{
+  GNUNET_CoreAPIForTransport api;
+  struct GNUNET_PluginHandle *plugin;
+  GNUNET_TransportMainMethod init;
+  GNUNET_TransportAPI *transport;
+  void (*done) ();
+  GNUNET_PeerIdentity me;
+  int res;
+
+  memset (&api, 0, sizeof (GNUNET_CoreAPIForTransport));
+  res = GNUNET_init (argc,
+                     argv,
+                     "udpperf", &cfgFilename, testOptions, &api.ectx,
+                     &api.cfg);
+  if (res == -1)
+    {
+      GNUNET_fini (api.ectx, api.cfg);
+      return 1;
+    }
+  /* disable blacklists (loopback is often blacklisted)... */
+  GNUNET_GC_set_configuration_value_string (api.cfg, api.ectx, "UDP",
+                                            "BLACKLISTV4", "");
+  GNUNET_GC_set_configuration_value_string (api.cfg, api.ectx, "UDP",
+                                            "BLACKLISTV6", "");
+  GNUNET_GC_set_configuration_value_string (api.cfg, api.ectx, "UDP", "UPNP",
+                                            "NO");
+  GNUNET_GC_set_configuration_value_number (api.cfg, api.ectx, "UDP", "PORT",
+                                            PORT);
+  GNUNET_create_random_hash (&me.hashPubKey);
+  plugin = GNUNET_plugin_load (api.ectx, "libgnunettransport_", "udp");
+  if (plugin == NULL)
+    {
+      fprintf (stderr, "Error loading plugin...\n");
+      GNUNET_fini (api.ectx, api.cfg);
+      return 1;
+    }
+  init =
+    GNUNET_plugin_resolve_function (plugin, "inittransport_", GNUNET_YES);
+  if (init == NULL)
+    {
+      fprintf (stderr, "Error resolving init method...\n");
+      GNUNET_plugin_unload (plugin);
+      GNUNET_fini (api.ectx, api.cfg);
+      return 1;
+    }
+  api.cron = GNUNET_cron_create (api.ectx);
+  api.my_identity = &me;
+  api.receive = &receive;
+  api.service_request = &request_service;
+  api.service_release = NULL;   /* not needed */
+  api.tsession_assert_unused = &connection_assert_tsession_unused;
+  GNUNET_cron_start (api.cron);
+  transport = init (&api);
+  if (transport == NULL)
+    {
+      fprintf (stderr, "Error initializing plugin...\n");
+      res = GNUNET_SYSERR;
+    }
+  else
+    {
+      if (GNUNET_OK != transport->server_start ())
+        res = GNUNET_SYSERR;
+      else
+        {
+          res = perfSend (transport);
+          transport->server_stop ();
+        }
+      done =
+        GNUNET_plugin_resolve_function (plugin, "donetransport_", GNUNET_NO);
+      if (done != NULL)
+        done ();
+    }
+  GNUNET_plugin_unload (plugin);
+  GNUNET_cron_stop (api.cron);
+  GNUNET_cron_destroy (api.cron);
+  GNUNET_fini (api.ectx, api.cfg);
+  if (res != GNUNET_OK)
+    {
+      fprintf (stderr, "UDP performance test failed (%u/%u packets)\n",
+               received, PACKETS);
+      return 2;
+    }
+  return 0;
+}
+
+/* end of udpperf.c */
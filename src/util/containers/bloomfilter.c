@@ -33,7 +33,12 @@
  *
  * To be able to delete entries from the bloom filter, we maintain
  * a 4 bit counter in the file on the drive (we still use only one
- * bit in memory).
+ * bit in memory).  The counter file is mapped into memory if
+ * possible, so updating a counter does not require any system
+ * calls.  The kernel writes the dirty pages back to the file
+ * (also if gnunetd crashes); we additionally ask for write-back
+ * every FLUSH_INTERVAL updates and wait for it when the filter
+ * is freed.
  *
  * @author Igor Wronsky
  * @author Christian Grothoff
@@ -43,6 +48,12 @@
 #include "gnunet_util.h"
 #include "gnunet_util_containers.h"
 
+/**
+ * After how many counter updates should we ask the
+ * kernel to write the counter file back to disk?
+ */
+#define FLUSH_INTERVAL (16 * 1024)
+
 typedef struct GNUNET_BloomFilter
 {
 
@@ -71,6 +82,18 @@ typedef struct GNUNET_BloomFilter
    */
   int fd;
 
+  /**
+   * The bit counter file mapped into memory (NULL if
+   * the file is not mapped, in which case we use fd)
+   */
+  unsigned char *counters;
+
+  /**
+   * Number of counter updates since we last asked
+   * for the mapping to be written back.
+   */
+  unsigned int dirty;
+
   /**
    * How many bits we set for each stored element
    */
@@ -141,17 +164,73 @@ testBit (char *bitArray, unsigned int bitIdx)
     return GNUNET_NO;
 }
 
+/**
+ * Read the byte holding the counter for the given bit.
+ *
+ * @param bf the filter
+ * @param fileSlot offset of the byte in the counter file
+ * @return the byte (two 4 bit counters)
+ */
+static unsigned char
+readCounters (Bloomfilter * bf, unsigned int fileSlot)
+{
+  unsigned char value;
+
+  if (bf->counters != NULL)
+    return bf->counters[fileSlot];
+  if (fileSlot != (unsigned int) LSEEK (bf->fd, fileSlot, SEEK_SET))
+    GNUNET_GE_DIE_STRERROR (NULL,
+                            GNUNET_GE_ADMIN | GNUNET_GE_USER | GNUNET_GE_FATAL
+                            | GNUNET_GE_IMMEDIATE, "lseek");
+  value = 0;
+  READ (bf->fd, &value, 1);
+  return value;
+}
+
+/**
+ * Write the byte holding the counter for the given bit.
+ *
+ * @param bf the filter
+ * @param fileSlot offset of the byte in the counter file
+ * @param value the new byte (two 4 bit counters)
+ */
+static void
+writeCounters (Bloomfilter * bf, unsigned int fileSlot, unsigned char value)
+{
+  if (bf->counters != NULL)
+    {
+      bf->counters[fileSlot] = value;
+      if (++bf->dirty < FLUSH_INTERVAL)
+        return;
+      bf->dirty = 0;
+#ifndef MINGW
+      if (0 != msync (bf->counters, bf->bitArraySize * 4, MS_ASYNC))
+        GNUNET_GE_LOG_STRERROR_FILE (bf->ectx,
+                                     GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
+                                     GNUNET_GE_BULK, "msync", bf->filename);
+#endif
+      return;
+    }
+  if (fileSlot != (unsigned int) LSEEK (bf->fd, fileSlot, SEEK_SET))
+    GNUNET_GE_DIE_STRERROR (NULL,
+                            GNUNET_GE_ADMIN | GNUNET_GE_USER | GNUNET_GE_FATAL
+                            | GNUNET_GE_IMMEDIATE, "lseek");
+  if (1 != WRITE (bf->fd, &value, 1))
+    GNUNET_GE_DIE_STRERROR (NULL,
+                            GNUNET_GE_ADMIN | GNUNET_GE_USER | GNUNET_GE_FATAL
+                            | GNUNET_GE_IMMEDIATE, "write");
+}
+
 /**
  * Sets a bit active in the bitArray and increments
  * bit-specific usage counter on disk (but only if
  * the counter was below 4 bit max (==15)).
  *
- * @param bitArray memory area to set the bit in
+ * @param bf the filter
  * @param bitIdx which bit to test
- * @param fd A file to keep the 4 bit address usage counters in
  */
 static void
-incrementBit (char *bitArray, unsigned int bitIdx, int fd)
+incrementBit (Bloomfilter * bf, unsigned int bitIdx)
 {
   unsigned int fileSlot;
   unsigned char value;
@@ -159,19 +238,14 @@ incrementBit (char *bitArray, unsigned int bitIdx, int fd)
   unsigned int low;
   unsigned int targetLoc;
 
-  setBit (bitArray, bitIdx);
-  if (fd == -1)
+  setBit (bf->bitArray, bitIdx);
+  if (bf->fd == -1)
     return;
   /* Update the counter file on disk */
   fileSlot = bitIdx / 2;
   targetLoc = bitIdx % 2;
 
-  if (fileSlot != (unsigned int) LSEEK (fd, fileSlot, SEEK_SET))
-    GNUNET_GE_DIE_STRERROR (NULL,
-                            GNUNET_GE_ADMIN | GNUNET_GE_USER | GNUNET_GE_FATAL
-                            | GNUNET_GE_IMMEDIATE, "lseek");
-  value = 0;
-  READ (fd, &value, 1);
+  value = readCounters (bf, fileSlot);
 
   low = value & 0xF;
   high = (value & (~0xF)) >> 4;
@@ -187,27 +261,18 @@ incrementBit (char *bitArray, unsigned int bitIdx, int fd)
         high++;
     }
   value = ((high << 4) | low);
-  if (fileSlot != (unsigned int) LSEEK (fd, fileSlot, SEEK_SET))
-    GNUNET_GE_DIE_STRERROR (NULL,
-                            GNUNET_GE_ADMIN | GNUNET_GE_USER | GNUNET_GE_FATAL
-                            | GNUNET_GE_IMMEDIATE, "lseek");
-  if (1 != WRITE (fd, &value, 1))
-    GNUNET_GE_DIE_STRERROR (NULL,
-                            GNUNET_GE_ADMIN | GNUNET_GE_USER | GNUNET_GE_FATAL
-                            | GNUNET_GE_IMMEDIATE, "write");
-
+  writeCounters (bf, fileSlot, value);
 }
 
 /**
  * Clears a bit from bitArray if the respective usage
  * counter on the disk hits/is zero.
  *
- * @param bitArray memory area to set the bit in
+ * @param bf the filter
  * @param bitIdx which bit to test
- * @param fd A file to keep the 4bit address usage counters in
  */
 static void
-decrementBit (char *bitArray, unsigned int bitIdx, int fd)
+decrementBit (Bloomfilter * bf, unsigned int bitIdx)
 {
   unsigned int fileSlot;
   unsigned char value;
@@ -215,15 +280,12 @@ decrementBit (char *bitArray, unsigned int bitIdx, int fd)
   unsigned int low;
   unsigned int targetLoc;
 
-  if (fd == -1)
+  if (bf->fd == -1)
     return;                     /* cannot decrement! */
-  GNUNET_GE_ASSERT (NULL, fd != -1);
   /* Each char slot in the counter file holds two 4 bit counters */
   fileSlot = bitIdx / 2;
   targetLoc = bitIdx % 2;
-  LSEEK (fd, fileSlot, SEEK_SET);
-  value = 0;
-  READ (fd, &value, 1);
+  value = readCounters (bf, fileSlot);
 
   low = value & 0xF;
   high = (value & 0xF0) >> 4;
@@ -235,7 +297,7 @@ decrementBit (char *bitArray, unsigned int bitIdx, int fd)
         low--;
       if (low == 0)
         {
-          clearBit (bitArray, bitIdx);
+          clearBit (bf->bitArray, bitIdx);
         }
     }
   else
@@ -244,15 +306,11 @@ decrementBit (char *bitArray, unsigned int bitIdx, int fd)
         high--;
       if (high == 0)
         {
-          clearBit (bitArray, bitIdx);
+          clearBit (bf->bitArray, bitIdx);
         }
     }
   value = ((high << 4) | low);
-  LSEEK (fd, fileSlot, SEEK_SET);
-  if (1 != WRITE (fd, &value, 1))
-    GNUNET_GE_DIE_STRERROR (NULL,
-                            GNUNET_GE_ADMIN | GNUNET_GE_USER | GNUNET_GE_FATAL
-                            | GNUNET_GE_IMMEDIATE, "write");
+  writeCounters (bf, fileSlot, value);
 }
 
 #define BUFFSIZE 65536
@@ -303,6 +361,68 @@ makeEmptyFile (int fd, unsigned int size)
   return GNUNET_OK;
 }
 
+/**
+ * Map the counter file into memory.  Extends the file to
+ * the size required for the filter if needed.  If mapping
+ * fails, the counters are updated with system calls.
+ *
+ * @param bf the filter
+ */
+static void
+mapCounters (Bloomfilter * bf)
+{
+  struct stat sbuf;
+  void *map;
+  size_t size;
+
+  size = (size_t) bf->bitArraySize * 4;
+  if (0 != FSTAT (bf->fd, &sbuf))
+    {
+      GNUNET_GE_LOG_STRERROR_FILE (bf->ectx,
+                                   GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
+                                   GNUNET_GE_BULK, "fstat", bf->filename);
+      return;
+    }
+  if ((sbuf.st_size < (off_t) size) && (0 != FTRUNCATE (bf->fd, size)))
+    {
+      GNUNET_GE_LOG_STRERROR_FILE (bf->ectx,
+                                   GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
+                                   GNUNET_GE_BULK, "ftruncate",
+                                   bf->filename);
+      return;
+    }
+  map = MMAP (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, bf->fd, 0);
+  if (map == MAP_FAILED)
+    {
+      GNUNET_GE_LOG_STRERROR_FILE (bf->ectx,
+                                   GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
+                                   GNUNET_GE_BULK, "mmap", bf->filename);
+      return;
+    }
+  bf->counters = map;
+  bf->dirty = 0;
+}
+
+/**
+ * Write the mapped counter file back to disk and unmap it.
+ *
+ * @param bf the filter
+ */
+static void
+unmapCounters (Bloomfilter * bf)
+{
+  if (bf->counters == NULL)
+    return;
+#ifndef MINGW
+  if (0 != msync (bf->counters, bf->bitArraySize * 4, MS_SYNC))
+    GNUNET_GE_LOG_STRERROR_FILE (bf->ectx,
+                                 GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
+                                 GNUNET_GE_BULK, "msync", bf->filename);
+#endif
+  MUNMAP (bf->counters, bf->bitArraySize * 4);
+  bf->counters = NULL;
+}
+
 /* ************** GNUNET_BloomFilter GNUNET_hash iterator ********* */
 
 /**
@@ -369,7 +489,7 @@ iterateBits (Bloomfilter * bf,
 static void
 incrementBitCallback (Bloomfilter * bf, unsigned int bit, void *arg)
 {
-  incrementBit (bf->bitArray, bit, bf->fd);
+  incrementBit (bf, bit);
 }
 
 /**
@@ -382,7 +502,7 @@ incrementBitCallback (Bloomfilter * bf, unsigned int bit, void *arg)
 static void
 decrementBitCallback (Bloomfilter * bf, unsigned int bit, void *arg)
 {
-  decrementBit (bf->bitArray, bit, bf->fd);
+  decrementBit (bf, bit);
 }
 
 /**
@@ -466,6 +586,18 @@ GNUNET_bloomfilter_load (struct GNUNET_GE_Context *ectx,
   memset (bf->bitArray, 0, bf->bitArraySize);
 
   if (bf->fd != -1)
+    mapCounters (bf);
+  if (bf->counters != NULL)
+    {
+      for (pos = 0; pos < size * 4; pos++)
+        {
+          if ((bf->counters[pos] & 0x0F) != 0)
+            setBit (bf->bitArray, pos * 2);
+          if ((bf->counters[pos] & 0xF0) != 0)
+            setBit (bf->bitArray, pos * 2 + 1);
+        }
+    }
+  else if (bf->fd != -1)
     {
       /* Read from the file what bits we can */
       rbuff = GNUNET_malloc (BUFFSIZE);
@@ -574,6 +706,7 @@ GNUNET_bloomfilter_free (Bloomfilter * bf)
   if (NULL == bf)
     return;
   GNUNET_mutex_destroy (bf->lock);
+  unmapCounters (bf);
   if (bf->fd != -1)
     GNUNET_disk_file_close (bf->ectx, bf->filename, bf->fd);
   GNUNET_free_non_null (bf->filename);
@@ -594,7 +727,9 @@ GNUNET_bloomfilter_clear (Bloomfilter * bf)
 
   GNUNET_mutex_lock (bf->lock);
   memset (bf->bitArray, 0, bf->bitArraySize);
-  if (bf->fd != -1)
+  if (bf->counters != NULL)
+    memset (bf->counters, 0, bf->bitArraySize * 4);
+  else if (bf->fd != -1)
     makeEmptyFile (bf->fd, bf->bitArraySize * 4);
   GNUNET_mutex_unlock (bf->lock);
 }
@@ -705,6 +840,7 @@ GNUNET_bloomfilter_resize (Bloomfilter * bf,
   unsigned int i;
 
   GNUNET_mutex_lock (bf->lock);
+  unmapCounters (bf);
   GNUNET_free (bf->bitArray);
   i = 1;
   while (i < size)
@@ -715,7 +851,10 @@ GNUNET_bloomfilter_resize (Bloomfilter * bf,
   bf->bitArray = GNUNET_malloc (size);
   memset (bf->bitArray, 0, bf->bitArraySize);
   if (bf->fd != -1)
-    makeEmptyFile (bf->fd, bf->bitArraySize * 4);
+    {
+      makeEmptyFile (bf->fd, bf->bitArraySize * 4);
+      mapCounters (bf);
+    }
   while (GNUNET_YES == iterator (&hc, iterator_arg))
     GNUNET_bloomfilter_add (bf, &hc);
   GNUNET_mutex_unlock (bf->lock);
@@ -0,0 +1,100 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+/**
+ * @file util/containers/bloomperf.c
+ * @brief Throughput of a bloomfilter with a counter file, sized
+ *        (like the datastore filter) for a 100 GB quota
+ * @author Christian Grothoff
+ */
+
+#include "gnunet_util.h"
+#include "gnunet_util_containers.h"
+#include "gnunet_util_crypto.h"
+#include "platform.h"
+
+#define FILENAME "/tmp/bloomperf.dat"
+
+/**
+ * Quota in kb (datastore/filter.c uses 1 bit per 32 kb)
+ */
+#define QUOTA (100LL * 1024 * 1024)
+
+#define K 5
+
+#define ELEMENTS (128 * 1024)
+
+static void
+report (const char *what, GNUNET_CronTime start)
+{
+  GNUNET_CronTime delta;
+
+  delta = GNUNET_get_time () - start;
+  if (delta == 0)
+    delta = 1;
+  printf ("Bloomfilter %s: %llu ops/s\n",
+          what, (unsigned long long) ELEMENTS * 1000 / delta);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct GNUNET_BloomFilter *bf;
+  GNUNET_HashCode *keys;
+  GNUNET_CronTime start;
+  int i;
+  int ok;
+
+  keys = GNUNET_malloc_large (ELEMENTS * sizeof (GNUNET_HashCode));
+  for (i = 0; i < ELEMENTS; i++)
+    GNUNET_create_random_hash (&keys[i]);
+  UNLINK (FILENAME);
+  start = GNUNET_get_time ();
+  bf = GNUNET_bloomfilter_load (NULL, FILENAME, QUOTA / 32, K);
+  if (bf == NULL)
+    return 1;
+  printf ("Bloomfilter load took %llu ms\n", GNUNET_get_time () - start);
+  start = GNUNET_get_time ();
+  for (i = 0; i < ELEMENTS; i++)
+    GNUNET_bloomfilter_add (bf, &keys[i]);
+  report ("add", start);
+  ok = 0;
+  start = GNUNET_get_time ();
+  for (i = 0; i < ELEMENTS; i++)
+    if (GNUNET_YES == GNUNET_bloomfilter_test (bf, &keys[i]))
+      ok++;
+  report ("test", start);
+  start = GNUNET_get_time ();
+  for (i = 0; i < ELEMENTS; i++)
+    GNUNET_bloomfilter_remove (bf, &keys[i]);
+  report ("remove", start);
+  start = GNUNET_get_time ();
+  GNUNET_bloomfilter_free (bf);
+  printf ("Bloomfilter free took %llu ms\n", GNUNET_get_time () - start);
+  UNLINK (FILENAME);
+  GNUNET_free (keys);
+  if (ok != ELEMENTS)
+    {
+      printf ("Bloomfilter lost %d elements\n", ELEMENTS - ok);
+      return 1;
+    }
+  return 0;
+}
+
+/* end of bloomperf.c */
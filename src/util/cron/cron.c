@@ -23,15 +23,20 @@
  * @author Christian Grothoff
  * @brief Module for periodic background (cron) jobs.
  *
- * The module only uses one thread, thus every cron-job must be
- * short-lived, should never block for an indefinite amount of
- * time. Specified deadlines are only a guide-line, the 10ms
+ * Jobs are kept in a binary heap ordered by their deadline; an
+ * additional hash table indexed by (method, data, repeat) is used to
+ * find jobs for GNUNET_cron_del_job and GNUNET_cron_advance_job.
+ * Thus adding, deleting and advancing jobs is O(log n).
+ *
+ * Regular jobs are run by a single thread, thus every such cron-job
+ * must be short-lived, should never block for an indefinite amount
+ * of time. Specified deadlines are only a guide-line, the 10ms
  * timer-resolution is only an upper-bound on the possible precision,
  * in practice it will be worse (depending on the other cron-jobs).
  *
- * If you need to schedule a long-running or blocking cron-job,
- * run a function that will start another thread that will
- * then run the actual job.
+ * If you need to schedule a long-running or blocking cron-job, use
+ * GNUNET_cron_add_long_job; such jobs are handed to a small pool of
+ * worker threads and thus do not delay the other jobs.
  */
 
 #include "gnunet_util.h"
@@ -51,6 +56,12 @@
  */
 #define INIT_CRON_JOBS 16
 
+/**
+ * Maximum number of worker threads (per cron manager)
+ * for long-running jobs.
+ */
+#define MAX_CRON_WORKERS 4
+
 /**
  * how long do we sleep at most? In some systems, the
  * signal-interrupted sleep does not work nicely, so to ensure
@@ -80,7 +91,7 @@
 
 
 /**
- * @brief The Delta-list for the cron jobs.
+ * @brief An entry in the cron-job table.
  */
 typedef struct
 {
@@ -100,6 +111,12 @@ typedef struct
    */
   GNUNET_CronTime delta;
 
+  /**
+   * Order in which the jobs were added; jobs with
+   * the same start-time are run in this order.
+   */
+  unsigned long long seq;
+
   /**
    * for cron-jobs: when this should be repeated
    * automatically, 0 if this was a once-only job
@@ -107,26 +124,70 @@ typedef struct
   unsigned int deltaRepeat;
 
   /**
-   * The index of the next entry in the delta list
-   * after this one (-1 for none)
+   * Should this job be run by a worker thread?
+   */
+  int longRunning;
+
+  /**
+   * Position of this entry in the heap, -1 if the
+   * entry is unused.
+   */
+  int heapPos;
+
+  /**
+   * The index of the next entry in the same hash
+   * bucket (or in the free list); -1 for none.
    */
   int next;
 
 } UTIL_cron_DeltaListEntry;
 
+/**
+ * @brief A long-running job that was handed to the workers.
+ */
+typedef struct UTIL_cron_WorkerJob
+{
+
+  struct UTIL_cron_WorkerJob *next;
+
+  GNUNET_CronJob method;
+
+  void *data;
+
+  unsigned int deltaRepeat;
+
+  /**
+   * Has a worker started running this job?
+   */
+  int running;
+
+} UTIL_cron_WorkerJob;
+
 typedef struct GNUNET_CronManager
 {
 
   /**
-   * The lock for the delta-list.
+   * The lock for the job table.
    */
   struct GNUNET_Mutex *deltaListLock_;
 
   /**
-   * The delta-list of waiting tasks.
+   * The table of waiting jobs.
    */
   UTIL_cron_DeltaListEntry *deltaList_;
 
+  /**
+   * Binary min-heap of indices into deltaList_,
+   * ordered by (delta, seq).
+   */
+  int *heap_;
+
+  /**
+   * Hash table (by method, data and repeat) of indices into
+   * deltaList_; has deltaListSize_ buckets.
+   */
+  int *buckets_;
+
   /**
    * The currently running job.
    */
@@ -147,28 +208,70 @@ typedef struct GNUNET_CronManager
 
   struct GNUNET_Mutex *inBlockLock_;
 
+  /**
+   * Long-running jobs that are queued or running
+   * in a worker thread (protected by deltaListLock_).
+   */
+  UTIL_cron_WorkerJob *workerJobs_;
+
+  /**
+   * Worker threads.
+   */
+  struct GNUNET_ThreadHandle *workers_[MAX_CRON_WORKERS];
+
+  /**
+   * Signaled whenever a job was added to workerJobs_
+   * (and for each worker on shutdown).
+   */
+  struct GNUNET_Semaphore *worker_signal;
+
+  /**
+   * Signaled whenever a worker finished a job.
+   */
+  struct GNUNET_Semaphore *worker_done;
+
+  /**
+   * Sequence number for the next job.
+   */
+  unsigned long long nextSeq_;
+
   unsigned int runningRepeat_;
 
   /**
-   * The current size of the DeltaList.
+   * The current size of the job table.
    */
   unsigned int deltaListSize_;
 
   /**
-   * The first empty slot in the delta-list.
+   * Number of jobs in the heap.
    */
-  int firstFree_;
+  unsigned int heapSize_;
+
+  /**
+   * Number of worker threads.
+   */
+  unsigned int workerCount_;
 
   /**
-   * The first empty slot in the delta-list.
+   * Number of worker threads that are running a job.
    */
-  int firstUsed_;
+  unsigned int workersBusy_;
+
+  /**
+   * The first empty slot in the job table.
+   */
+  int firstFree_;
 
   /**
    * Set to yes if we are shutting down or shut down.
    */
   int cron_shutdown;
 
+  /**
+   * Set to yes if the workers should terminate.
+   */
+  int worker_shutdown;
+
   /**
    * Are we in block?
    */
@@ -179,6 +282,202 @@ typedef struct GNUNET_CronManager
 } CronManager;
 
 
+/**
+ * Compute the hash bucket for the given job.
+ */
+static unsigned int
+bucketOf (struct GNUNET_CronManager *cron,
+          GNUNET_CronJob method, unsigned int repeat, void *data)
+{
+  unsigned long h;
+
+  h = (unsigned long) method;
+  h = h * 31 + (unsigned long) data;
+  h = h * 31 + repeat;
+  h ^= h >> 16;
+  return (unsigned int) (h % cron->deltaListSize_);
+}
+
+static void
+hashInsert (struct GNUNET_CronManager *cron, int jobId)
+{
+  UTIL_cron_DeltaListEntry *job;
+  unsigned int b;
+
+  job = &cron->deltaList_[jobId];
+  b = bucketOf (cron, job->method, job->deltaRepeat, job->data);
+  job->next = cron->buckets_[b];
+  cron->buckets_[b] = jobId;
+}
+
+static void
+hashRemove (struct GNUNET_CronManager *cron, int jobId)
+{
+  UTIL_cron_DeltaListEntry *job;
+  unsigned int b;
+  int pos;
+
+  job = &cron->deltaList_[jobId];
+  b = bucketOf (cron, job->method, job->deltaRepeat, job->data);
+  if (cron->buckets_[b] == jobId)
+    {
+      cron->buckets_[b] = job->next;
+      return;
+    }
+  pos = cron->buckets_[b];
+  while (cron->deltaList_[pos].next != jobId)
+    pos = cron->deltaList_[pos].next;
+  cron->deltaList_[pos].next = job->next;
+}
+
+/**
+ * Is job a due before job b?
+ */
+static int
+jobBefore (struct GNUNET_CronManager *cron, int a, int b)
+{
+  UTIL_cron_DeltaListEntry *ja;
+  UTIL_cron_DeltaListEntry *jb;
+
+  ja = &cron->deltaList_[a];
+  jb = &cron->deltaList_[b];
+  if (ja->delta != jb->delta)
+    return ja->delta < jb->delta;
+  return ja->seq < jb->seq;
+}
+
+static void
+heapSet (struct GNUNET_CronManager *cron, unsigned int pos, int jobId)
+{
+  cron->heap_[pos] = jobId;
+  cron->deltaList_[jobId].heapPos = pos;
+}
+
+static void
+heapUp (struct GNUNET_CronManager *cron, unsigned int pos)
+{
+  int jobId;
+  unsigned int parent;
+
+  jobId = cron->heap_[pos];
+  while (pos > 0)
+    {
+      parent = (pos - 1) / 2;
+      if (!jobBefore (cron, jobId, cron->heap_[parent]))
+        break;
+      heapSet (cron, pos, cron->heap_[parent]);
+      pos = parent;
+    }
+  heapSet (cron, pos, jobId);
+}
+
+static void
+heapDown (struct GNUNET_CronManager *cron, unsigned int pos)
+{
+  int jobId;
+  unsigned int child;
+
+  jobId = cron->heap_[pos];
+  while ((child = 2 * pos + 1) < cron->heapSize_)
+    {
+      if ((child + 1 < cron->heapSize_) &&
+          jobBefore (cron, cron->heap_[child + 1], cron->heap_[child]))
+        child++;
+      if (!jobBefore (cron, cron->heap_[child], jobId))
+        break;
+      heapSet (cron, pos, cron->heap_[child]);
+      pos = child;
+    }
+  heapSet (cron, pos, jobId);
+}
+
+/**
+ * Remove the job with the given index from the heap and the hash
+ * table and put its slot back on the free list.  The caller must
+ * hold the deltaListLock_.
+ */
+static void
+removeJob (struct GNUNET_CronManager *cron, int jobId)
+{
+  UTIL_cron_DeltaListEntry *job;
+  unsigned int pos;
+
+  job = &cron->deltaList_[jobId];
+  pos = job->heapPos;
+  cron->heapSize_--;
+  if (pos != cron->heapSize_)
+    {
+      heapSet (cron, pos, cron->heap_[cron->heapSize_]);
+      heapDown (cron, pos);
+      heapUp (cron, pos);
+    }
+  hashRemove (cron, jobId);
+  job->heapPos = -1;
+  job->method = NULL;
+  job->data = NULL;
+  job->deltaRepeat = 0;
+  job->next = cron->firstFree_;
+  cron->firstFree_ = jobId;
+}
+
+/**
+ * Find the matching job that is due first.  The caller must
+ * hold the deltaListLock_.
+ *
+ * @return index of the job, -1 if no such job is queued
+ */
+static int
+findJob (struct GNUNET_CronManager *cron,
+         GNUNET_CronJob method, unsigned int repeat, void *data)
+{
+  UTIL_cron_DeltaListEntry *job;
+  int pos;
+  int ret;
+
+  ret = -1;
+  pos = cron->buckets_[bucketOf (cron, method, repeat, data)];
+  while (pos != -1)
+    {
+      job = &cron->deltaList_[pos];
+      if ((job->method == method) &&
+          (job->data == data) && (job->deltaRepeat == repeat) &&
+          ((ret == -1) || (jobBefore (cron, pos, ret))))
+        ret = pos;
+      pos = job->next;
+    }
+  return ret;
+}
+
+/**
+ * Double the size of the job table (and rebuild the
+ * hash table).  The caller must hold the deltaListLock_.
+ */
+static void
+growTable (struct GNUNET_CronManager *cron)
+{
+  unsigned int oldSize;
+  unsigned int i;
+
+  oldSize = cron->deltaListSize_;
+  GNUNET_array_grow (cron->deltaList_, cron->deltaListSize_, oldSize * 2);
+  cron->heap_ = GNUNET_realloc (cron->heap_,
+                                sizeof (int) * cron->deltaListSize_);
+  GNUNET_free (cron->buckets_);
+  cron->buckets_ = GNUNET_malloc (sizeof (int) * cron->deltaListSize_);
+  for (i = 0; i < cron->deltaListSize_; i++)
+    cron->buckets_[i] = -1;
+  for (i = 0; i < oldSize; i++)
+    if (cron->deltaList_[i].heapPos != -1)
+      hashInsert (cron, i);
+  for (i = oldSize; i < cron->deltaListSize_; i++)
+    {
+      cron->deltaList_[i].heapPos = -1;
+      cron->deltaList_[i].next = i - 1;
+    }
+  cron->deltaList_[oldSize].next = -1;
+  cron->firstFree_ = cron->deltaListSize_ - 1;
+}
+
 struct GNUNET_CronManager *
 GNUNET_cron_create (struct GNUNET_GE_Context *ectx)
 {
@@ -191,14 +490,22 @@ GNUNET_cron_create (struct GNUNET_GE_Context *ectx)
   cron->deltaList_
     =
     GNUNET_malloc (sizeof (UTIL_cron_DeltaListEntry) * cron->deltaListSize_);
+  cron->heap_ = GNUNET_malloc (sizeof (int) * cron->deltaListSize_);
+  cron->buckets_ = GNUNET_malloc (sizeof (int) * cron->deltaListSize_);
   for (i = 0; i < cron->deltaListSize_; i++)
-    cron->deltaList_[i].next = i - 1;
+    {
+      cron->deltaList_[i].next = i - 1;
+      cron->deltaList_[i].heapPos = -1;
+      cron->buckets_[i] = -1;
+    }
   cron->firstFree_ = cron->deltaListSize_ - 1;
+  cron->heapSize_ = 0;
   cron->deltaListLock_ = GNUNET_mutex_create (GNUNET_YES);
   cron->inBlockLock_ = GNUNET_mutex_create (GNUNET_NO);
   cron->runningJob_ = NULL;
-  cron->firstUsed_ = -1;
   cron->cron_signal_up = GNUNET_semaphore_create (0);
+  cron->worker_signal = GNUNET_semaphore_create (0);
+  cron->worker_done = GNUNET_semaphore_create (0);
   cron->ectx = ectx;
   cron->cron_shutdown = GNUNET_YES;
   cron->sig = NULL;
@@ -220,6 +527,8 @@ void
 GNUNET_cron_stop (struct GNUNET_CronManager *cron)
 {
   void *unused;
+  unsigned int i;
+  unsigned int workers;
 
 #if DEBUG_CRON
   GNUNET_GE_LOG (cron->ectx,
@@ -232,6 +541,16 @@ GNUNET_cron_stop (struct GNUNET_CronManager *cron)
   GNUNET_semaphore_destroy (cron->cron_signal);
   cron->cron_signal = NULL;
   GNUNET_thread_join (cron->cron_handle, &unused);
+  /* let the workers finish the jobs that were handed to them */
+  GNUNET_mutex_lock (cron->deltaListLock_);
+  cron->worker_shutdown = GNUNET_YES;
+  workers = cron->workerCount_;
+  GNUNET_mutex_unlock (cron->deltaListLock_);
+  for (i = 0; i < workers; i++)
+    GNUNET_semaphore_up (cron->worker_signal);
+  for (i = 0; i < workers; i++)
+    GNUNET_thread_join (cron->workers_[i], &unused);
+  cron->workerCount_ = 0;
 #if DEBUG_CRON
   GNUNET_GE_LOG (NULL,
                  GNUNET_GE_STATUS | GNUNET_GE_DEVELOPER | GNUNET_GE_BULK,
@@ -241,7 +560,8 @@ GNUNET_cron_stop (struct GNUNET_CronManager *cron)
 
 /**
  * GNUNET_CronJob to suspend the cron thread
- * until it is resumed.
+ * until it is resumed.  Also waits for the
+ * workers to finish their jobs.
  */
 static void
 block (void *cls)
@@ -249,6 +569,14 @@ block (void *cls)
   struct GNUNET_CronManager *cron = cls;
   int ok = GNUNET_SYSERR;
 
+  GNUNET_mutex_lock (cron->deltaListLock_);
+  while (cron->workerJobs_ != NULL)
+    {
+      GNUNET_mutex_unlock (cron->deltaListLock_);
+      GNUNET_semaphore_down (cron->worker_done, GNUNET_YES);
+      GNUNET_mutex_lock (cron->deltaListLock_);
+    }
+  GNUNET_mutex_unlock (cron->deltaListLock_);
   if (cron->sig != NULL)
     GNUNET_semaphore_up (cron->sig);
   while (ok == GNUNET_SYSERR)
@@ -315,41 +643,101 @@ abortSleep (struct GNUNET_CronManager *cron)
 
 #if HAVE_PRINT_CRON_TAB
 /**
- * Print the cron-tab.
+ * Print the cron-tab (in heap order).
  */
 void
 printCronTab (struct GNUNET_CronManager *cron)
 {
   int jobId;
+  unsigned int i;
   UTIL_cron_DeltaListEntry *tab;
   GNUNET_CronTime now;
 
   now = GNUNET_get_time ();
   GNUNET_mutex_lock (cron->deltaListLock_);
-
-  jobId = cron->firstUsed_;
-  while (jobId != -1)
+  for (i = 0; i < cron->heapSize_; i++)
     {
+      jobId = cron->heap_[i];
       tab = &cron->deltaList_[jobId];
       GNUNET_GE_LOG (NULL,
                      GNUNET_GE_STATUS | GNUNET_GE_DEVELOPER | GNUNET_GE_BULK,
                      "%3u: delta %8lld CU --- method %p --- repeat %8u CU\n",
-                     jobId, tab->delta - now, (int) tab->method,
-                     tab->deltaRepeat);
-      jobId = tab->next;
+                     jobId, tab->delta - now, tab->method, tab->deltaRepeat);
     }
   GNUNET_mutex_unlock (cron->deltaListLock_);
 }
 #endif
 
+/**
+ * Is the given long-running job queued for or running
+ * in a worker?  The caller must hold the deltaListLock_.
+ */
+static int
+workerHasJob (struct GNUNET_CronManager *cron,
+              GNUNET_CronJob method, unsigned int repeat, void *data)
+{
+  UTIL_cron_WorkerJob *pos;
+
+  pos = cron->workerJobs_;
+  while (pos != NULL)
+    {
+      if ((pos->method == method) &&
+          (pos->data == data) && (pos->deltaRepeat == repeat))
+        return GNUNET_YES;
+      pos = pos->next;
+    }
+  return GNUNET_NO;
+}
+
+static void
+addJob (struct GNUNET_CronManager *cron,
+        GNUNET_CronJob method,
+        unsigned int delta,
+        unsigned int deltaRepeat, void *data, int longRunning)
+{
+  UTIL_cron_DeltaListEntry *entry;
+  int jobId;
+
+#if DEBUG_CRON
+  GNUNET_GE_LOG (cron->ectx,
+                 GNUNET_GE_STATUS | GNUNET_GE_DEVELOPER | GNUNET_GE_BULK,
+                 "Adding job %p-%p to fire in %d CU\n", method, data, delta);
+#endif
+
+  GNUNET_mutex_lock (cron->deltaListLock_);
+  if (cron->firstFree_ == -1)
+    growTable (cron);
+  jobId = cron->firstFree_;
+  entry = &cron->deltaList_[jobId];
+  cron->firstFree_ = entry->next;
+  entry->method = method;
+  entry->data = data;
+  entry->deltaRepeat = deltaRepeat;
+  entry->longRunning = longRunning;
+  entry->delta = GNUNET_get_time () + delta;
+  entry->seq = cron->nextSeq_++;
+  hashInsert (cron, jobId);
+  heapSet (cron, cron->heapSize_, jobId);
+  cron->heapSize_++;
+  heapUp (cron, cron->heapSize_ - 1);
+  if (cron->heap_[0] == jobId)
+    {
+      /* new first job, interrupt sleeping cron-thread! */
+      abortSleep (cron);
+    }
+  GNUNET_mutex_unlock (cron->deltaListLock_);
+#if HAVE_PRINT_CRON_TAB
+  printCronTab (cron);
+#endif
+}
+
 void
 GNUNET_cron_advance_job (struct GNUNET_CronManager *cron,
                          GNUNET_CronJob method, unsigned int deltaRepeat,
                          void *data)
 {
-  UTIL_cron_DeltaListEntry *job;
-  UTIL_cron_DeltaListEntry *last;
   int jobId;
+  int longRunning;
 
 #if DEBUG_CRON
   GNUNET_GE_LOG (NULL,
@@ -357,37 +745,22 @@ GNUNET_cron_advance_job (struct GNUNET_CronManager *cron,
                  "Advancing job %p-%p\n", method, data);
 #endif
   GNUNET_mutex_lock (cron->deltaListLock_);
-  jobId = cron->firstUsed_;
+  jobId = findJob (cron, method, deltaRepeat, data);
   if (jobId == -1)
     {
-      /* not in queue - do nothing! */
+      /* not in queue; add if not running */
+      if (((method != cron->runningJob_) ||
+           (data != cron->runningData_) ||
+           (deltaRepeat != cron->runningRepeat_)) &&
+          (GNUNET_NO == workerHasJob (cron, method, deltaRepeat, data)))
+        addJob (cron, method, 0, deltaRepeat, data, GNUNET_NO);
       GNUNET_mutex_unlock (cron->deltaListLock_);
       return;
     }
-  last = NULL;
-  job = &cron->deltaList_[jobId];
-  while ((job->method != method) ||
-         (job->data != data) || (job->deltaRepeat != deltaRepeat))
-    {
-      last = job;
-      if (job->next == -1)
-        {
-          /* not in queue; add if not running */
-          if ((method != cron->runningJob_) ||
-              (data != cron->runningData_) ||
-              (deltaRepeat != cron->runningRepeat_))
-            {
-              GNUNET_cron_add_job (cron, method, 0, deltaRepeat, data);
-            }
-          GNUNET_mutex_unlock (cron->deltaListLock_);
-          return;
-        }
-      jobId = job->next;
-      job = &cron->deltaList_[jobId];
-    }
   /* ok, found it; remove, re-add with time 0 */
-  GNUNET_cron_del_job (cron, method, deltaRepeat, data);
-  GNUNET_cron_add_job (cron, method, 0, deltaRepeat, data);
+  longRunning = cron->deltaList_[jobId].longRunning;
+  removeJob (cron, jobId);
+  addJob (cron, method, 0, deltaRepeat, data, longRunning);
   GNUNET_mutex_unlock (cron->deltaListLock_);
 }
 
@@ -396,85 +769,141 @@ GNUNET_cron_add_job (struct GNUNET_CronManager *cron,
                      GNUNET_CronJob method,
                      unsigned int delta, unsigned int deltaRepeat, void *data)
 {
-  UTIL_cron_DeltaListEntry *entry;
-  UTIL_cron_DeltaListEntry *pos;
-  int last;
-  int current;
+  addJob (cron, method, delta, deltaRepeat, data, GNUNET_NO);
+}
+
+void
+GNUNET_cron_add_long_job (struct GNUNET_CronManager *cron,
+                          GNUNET_CronJob method,
+                          unsigned int delta, unsigned int deltaRepeat,
+                          void *data)
+{
+  addJob (cron, method, delta, deltaRepeat, data, GNUNET_YES);
+}
 
+/**
+ * Main method of the worker threads: run the
+ * long-running jobs from the worker queue.
+ */
+static void *
+worker_main_method (void *ctx)
+{
+  struct GNUNET_CronManager *cron = ctx;
+  UTIL_cron_WorkerJob *job;
+  UTIL_cron_WorkerJob *prev;
+
+  while (1)
+    {
+      GNUNET_semaphore_down (cron->worker_signal, GNUNET_YES);
+      GNUNET_mutex_lock (cron->deltaListLock_);
+      job = cron->workerJobs_;
+      while ((job != NULL) && (job->running == GNUNET_YES))
+        job = job->next;
+      if (job == NULL)
+        {
+          if (cron->worker_shutdown == GNUNET_YES)
+            {
+              GNUNET_mutex_unlock (cron->deltaListLock_);
+              break;
+            }
+          GNUNET_mutex_unlock (cron->deltaListLock_);
+          continue;
+        }
+      job->running = GNUNET_YES;
+      cron->workersBusy_++;
+      GNUNET_mutex_unlock (cron->deltaListLock_);
 #if DEBUG_CRON
-  GNUNET_GE_LOG (cron->ectx,
-                 GNUNET_GE_STATUS | GNUNET_GE_DEVELOPER | GNUNET_GE_BULK,
-                 "Adding job %p-%p to fire in %d CU\n", method, data, delta);
+      GNUNET_GE_LOG (cron->ectx,
+                     GNUNET_GE_STATUS | GNUNET_GE_DEVELOPER | GNUNET_GE_BULK,
+                     "worker running job %p-%p\n", job->method, job->data);
 #endif
-
-  GNUNET_mutex_lock (cron->deltaListLock_);
-  if (cron->firstFree_ == -1)
-    {                           /* need to grow */
-      unsigned int i;
-
-      GNUNET_array_grow (cron->deltaList_, cron->deltaListSize_,
-                         cron->deltaListSize_ * 2);
-      for (i = cron->deltaListSize_ / 2; i < cron->deltaListSize_; i++)
-        cron->deltaList_[i].next = i - 1;
-      cron->deltaList_[cron->deltaListSize_ / 2].next = -1;
-      cron->firstFree_ = cron->deltaListSize_ - 1;
+      job->method (job->data);
+      GNUNET_mutex_lock (cron->deltaListLock_);
+      cron->workersBusy_--;
+      if (cron->workerJobs_ == job)
+        {
+          cron->workerJobs_ = job->next;
+        }
+      else
+        {
+          prev = cron->workerJobs_;
+          while (prev->next != job)
+            prev = prev->next;
+          prev->next = job->next;
+        }
+      GNUNET_mutex_unlock (cron->deltaListLock_);
+      GNUNET_free (job);
+      GNUNET_semaphore_up (cron->worker_done);
     }
-  entry = &cron->deltaList_[cron->firstFree_];
-  entry->method = method;
-  entry->data = data;
-  entry->deltaRepeat = deltaRepeat;
-  entry->delta = GNUNET_get_time () + delta;
-  if (cron->firstUsed_ == -1)
+  return NULL;
+}
+
+/**
+ * Hand a long-running job to the workers, starting another
+ * worker if all of them are busy.  The caller must hold the
+ * deltaListLock_.
+ */
+static void
+dispatchJob (struct GNUNET_CronManager *cron,
+             GNUNET_CronJob method, unsigned int repeat, void *data)
+{
+  UTIL_cron_WorkerJob *job;
+  UTIL_cron_WorkerJob *pos;
+  unsigned int pending;
+
+  if (GNUNET_YES == workerHasJob (cron, method, repeat, data))
     {
-      cron->firstUsed_ = cron->firstFree_;
-      cron->firstFree_ = entry->next;
-      entry->next = -1;         /* end of list */
-      GNUNET_mutex_unlock (cron->deltaListLock_);
-      /* interrupt sleeping cron-thread! */
-      abortSleep (cron);
+      /* previous run has not finished yet, skip this one */
       return;
     }
-  /* no, there are jobs waiting */
-  last = -1;
-  current = cron->firstUsed_;
-  pos = &cron->deltaList_[current];
-
-  while (entry->delta > pos->delta)
+  job = GNUNET_malloc (sizeof (UTIL_cron_WorkerJob));
+  job->next = NULL;
+  job->method = method;
+  job->data = data;
+  job->deltaRepeat = repeat;
+  job->running = GNUNET_NO;
+  pending = 1;
+  if (cron->workerJobs_ == NULL)
     {
-      if (pos->next != -1)
+      cron->workerJobs_ = job;
+    }
+  else
+    {
+      pos = cron->workerJobs_;
+      while (pos->next != NULL)
         {
-          last = current;
-          current = pos->next;
-          pos = &cron->deltaList_[current];
-        }
-      else
-        {                       /* append */
-          pos->next = cron->firstFree_;
-          cron->firstFree_ = entry->next;
-          entry->next = -1;
-          GNUNET_mutex_unlock (cron->deltaListLock_);
-#if HAVE_PRINT_CRON_TAB
-          printCronTab ();
-#endif
-          return;
+          if (pos->running == GNUNET_NO)
+            pending++;
+          pos = pos->next;
         }
+      if (pos->running == GNUNET_NO)
+        pending++;
+      pos->next = job;
     }
-  /* insert before pos */
-  if (last == -1)
+  if ((pending > cron->workerCount_ - cron->workersBusy_) &&
+      (cron->workerCount_ < MAX_CRON_WORKERS))
     {
-      cron->firstUsed_ = cron->firstFree_;
-      abortSleep (cron);
+      cron->workers_[cron->workerCount_] =
+        GNUNET_thread_create (&worker_main_method, cron, 256 * 1024);
+      if (cron->workers_[cron->workerCount_] == NULL)
+        GNUNET_GE_LOG_STRERROR (cron->ectx,
+                                GNUNET_GE_ERROR | GNUNET_GE_ADMIN |
+                                GNUNET_GE_USER | GNUNET_GE_BULK,
+                                "pthread_create");
+      else
+        cron->workerCount_++;
     }
-  else
+  if (cron->workerCount_ == 0)
     {
-      cron->deltaList_[last].next = cron->firstFree_;
-#if HAVE_PRINT_CRON_TAB
-      printCronTab ();
-#endif
+      /* no worker, run it ourselves */
+      cron->workerJobs_ = NULL;
+      GNUNET_free (job);
+      GNUNET_mutex_unlock (cron->deltaListLock_);
+      method (data);
+      GNUNET_mutex_lock (cron->deltaListLock_);
+      return;
     }
-  cron->firstFree_ = entry->next;
-  entry->next = current;
-  GNUNET_mutex_unlock (cron->deltaListLock_);
+  GNUNET_semaphore_up (cron->worker_signal);
 }
 
 /**
@@ -490,25 +919,21 @@ runJob (struct GNUNET_CronManager *cron)
 {
   UTIL_cron_DeltaListEntry *job;
   int jobId;
+  int longRunning;
   GNUNET_CronJob method;
   void *data;
   unsigned int repeat;
 
-  jobId = cron->firstUsed_;
-  if (jobId == -1)
+  if (cron->heapSize_ == 0)
     return;                     /* no job to be done */
+  jobId = cron->heap_[0];
   job = &cron->deltaList_[jobId];
   method = job->method;
-  cron->runningJob_ = method;
   data = job->data;
-  cron->runningData_ = data;
   repeat = job->deltaRepeat;
-  cron->runningRepeat_ = repeat;
+  longRunning = job->longRunning;
   /* remove from queue */
-  cron->firstUsed_ = job->next;
-  job->next = cron->firstFree_;
-  cron->firstFree_ = jobId;
-  GNUNET_mutex_unlock (cron->deltaListLock_);
+  removeJob (cron, jobId);
   /* re-insert */
   if (repeat > 0)
     {
@@ -518,8 +943,17 @@ runJob (struct GNUNET_CronManager *cron)
                      "adding periodic job %p-%p to run again in %u\n",
                      method, data, repeat);
 #endif
-      GNUNET_cron_add_job (cron, method, repeat, repeat, data);
+      addJob (cron, method, repeat, repeat, data, longRunning);
+    }
+  if (longRunning == GNUNET_YES)
+    {
+      dispatchJob (cron, method, repeat, data);
+      return;
     }
+  cron->runningJob_ = method;
+  cron->runningData_ = data;
+  cron->runningRepeat_ = repeat;
+  GNUNET_mutex_unlock (cron->deltaListLock_);
   /* run */
 #if DEBUG_CRON
   GNUNET_GE_LOG (cron->ectx,
@@ -554,10 +988,10 @@ cron_main_method (void *ctx)
       now = GNUNET_get_time ();
       next = now + 0xFFFFFFFF;
       GNUNET_mutex_lock (cron->deltaListLock_);
-      while ((cron->cron_shutdown == GNUNET_NO) && (cron->firstUsed_ != -1))
+      while ((cron->cron_shutdown == GNUNET_NO) && (cron->heapSize_ > 0))
         {
           now = GNUNET_get_time ();
-          next = cron->deltaList_[cron->firstUsed_].delta;
+          next = cron->deltaList_[cron->heap_[0]].delta;
           if (next <= now)
             {
 #if DEBUG_CRON
@@ -613,19 +1047,20 @@ cron_main_method (void *ctx)
 void
 GNUNET_cron_destroy (struct GNUNET_CronManager *cron)
 {
-  int i;
+  unsigned int i;
 
   GNUNET_GE_ASSERT (cron->ectx, cron->cron_signal == NULL);
-  i = cron->firstUsed_;
-  while (i != -1)
-    {
-      GNUNET_free_non_null (cron->deltaList_[i].data);
-      i = cron->deltaList_[i].next;
-    }
+  GNUNET_GE_ASSERT (cron->ectx, cron->workerJobs_ == NULL);
+  for (i = 0; i < cron->heapSize_; i++)
+    GNUNET_free_non_null (cron->deltaList_[cron->heap_[i]].data);
   GNUNET_mutex_destroy (cron->deltaListLock_);
   GNUNET_mutex_destroy (cron->inBlockLock_);
   GNUNET_free (cron->deltaList_);
+  GNUNET_free (cron->heap_);
+  GNUNET_free (cron->buckets_);
   GNUNET_semaphore_destroy (cron->cron_signal_up);
+  GNUNET_semaphore_destroy (cron->worker_signal);
+  GNUNET_semaphore_destroy (cron->worker_done);
   GNUNET_free (cron);
 }
 
@@ -637,6 +1072,7 @@ GNUNET_cron_start (struct GNUNET_CronManager *cron)
 {
   GNUNET_GE_ASSERT (cron->ectx, cron->cron_signal == NULL);
   cron->cron_shutdown = GNUNET_NO;
+  cron->worker_shutdown = GNUNET_NO;
   cron->cron_signal = GNUNET_semaphore_create (0);
   /* large stack, we don't know for sure
      what the cron jobs may be doing */
@@ -652,8 +1088,6 @@ int
 GNUNET_cron_del_job (struct GNUNET_CronManager *cron,
                      GNUNET_CronJob method, unsigned int repeat, void *data)
 {
-  UTIL_cron_DeltaListEntry *job;
-  UTIL_cron_DeltaListEntry *last;
   int jobId;
 
 #if DEBUG_CRON
@@ -662,41 +1096,17 @@ GNUNET_cron_del_job (struct GNUNET_CronManager *cron,
                  "deleting job %p-%p\n", method, data);
 #endif
   GNUNET_mutex_lock (cron->deltaListLock_);
-  jobId = cron->firstUsed_;
+  jobId = findJob (cron, method, repeat, data);
   if (jobId == -1)
     {
       GNUNET_mutex_unlock (cron->deltaListLock_);
       return 0;
     }
-  last = NULL;
-  job = &cron->deltaList_[jobId];
-  while ((job->method != method) ||
-         (job->data != data) || (job->deltaRepeat != repeat))
-    {
-      last = job;
-      if (job->next == -1)
-        {
-          GNUNET_mutex_unlock (cron->deltaListLock_);
-          return 0;
-        }
-      jobId = job->next;
-      job = &cron->deltaList_[jobId];
-    }
-  if (last != NULL)
-    last->next = job->next;
-  else
-    cron->firstUsed_ = job->next;
-  job->next = cron->firstFree_;
-  cron->firstFree_ = jobId;
-  job->method = NULL;
-  job->data = NULL;
-  job->deltaRepeat = 0;
+  removeJob (cron, jobId);
   GNUNET_mutex_unlock (cron->deltaListLock_);
   return 1;
 }
 
 
 
-
-
 /* end of cron.c */
@@ -114,6 +114,146 @@ testDelCron ()
   return 0;
 }
 
+static GNUNET_CronTime longDone;
+
+static void
+longJob (void *unused)
+{
+  GNUNET_thread_sleep (2 * GNUNET_CRON_SECONDS);
+  longDone = GNUNET_get_time ();
+}
+
+static GNUNET_CronTime shortDone;
+
+static void
+shortJob (void *unused)
+{
+  shortDone = GNUNET_get_time ();
+}
+
+/**
+ * Check that a long-running job does not delay other jobs.
+ */
+static int
+testLongJob ()
+{
+  GNUNET_CronTime start;
+
+  longDone = 0;
+  shortDone = 0;
+  start = GNUNET_get_time ();
+  GNUNET_cron_add_long_job (cron, &longJob, 0, 0, NULL);
+  GNUNET_cron_add_job (cron, &shortJob, 100 * GNUNET_CRON_MILLISECONDS, 0,
+                       NULL);
+  GNUNET_thread_sleep (500 * GNUNET_CRON_MILLISECONDS);
+  if ((shortDone == 0) || (shortDone - start > 400 * GNUNET_CRON_MILLISECONDS))
+    {
+      fprintf (stderr, "short job was delayed by long-running job!\n");
+      return 1;
+    }
+  /* suspending must wait for the long job */
+  GNUNET_cron_suspend_jobs (cron, GNUNET_NO);
+  GNUNET_cron_resume_jobs (cron, GNUNET_NO);
+  if (longDone == 0)
+    {
+      fprintf (stderr, "suspend did not wait for long-running job!\n");
+      return 1;
+    }
+  return 0;
+}
+
+#define JITTER_PERIOD (20 * GNUNET_CRON_MILLISECONDS)
+
+#define JITTER_RUNS 50
+
+static GNUNET_CronTime jitterNext;
+
+static GNUNET_CronTime jitterMax;
+
+static unsigned long long jitterSum;
+
+static unsigned int jitterCount;
+
+static void
+jitterJob (void *unused)
+{
+  GNUNET_CronTime now;
+  GNUNET_CronTime late;
+
+  now = GNUNET_get_time ();
+  late = (now > jitterNext) ? now - jitterNext : 0;
+  jitterNext = now + JITTER_PERIOD;
+  if (late > jitterMax)
+    jitterMax = late;
+  jitterSum += late;
+  jitterCount++;
+}
+
+/**
+ * Measure how late a periodic job runs while the
+ * table holds many other (idle) jobs.
+ */
+static int
+testJitter ()
+{
+  unsigned int i;
+
+  for (i = 0; i < 1000; i++)
+    GNUNET_cron_add_job (cron, &cronJob3,
+                         GNUNET_CRON_HOURS + i, 0, NULL);
+  jitterMax = 0;
+  jitterSum = 0;
+  jitterCount = 0;
+  jitterNext = GNUNET_get_time () + JITTER_PERIOD;
+  GNUNET_cron_add_job (cron, &jitterJob, JITTER_PERIOD, JITTER_PERIOD, NULL);
+  GNUNET_thread_sleep (JITTER_PERIOD * JITTER_RUNS);
+  GNUNET_cron_del_job (cron, &jitterJob, JITTER_PERIOD, NULL);
+  for (i = 0; i < 1000; i++)
+    GNUNET_cron_del_job (cron, &cronJob3, 0, NULL);
+  if (jitterCount == 0)
+    {
+      fprintf (stderr, "periodic job did not run!\n");
+      return 1;
+    }
+  fprintf (stdout,
+           "Jitter: %llu ms average, %llu ms maximum over %u runs.\n",
+           jitterSum / jitterCount, jitterMax, jitterCount);
+  return 0;
+}
+
+#define THROUGHPUT_JOBS 100000
+
+/**
+ * Measure how fast jobs can be added and removed.
+ */
+static int
+testThroughput ()
+{
+  GNUNET_CronTime start;
+  GNUNET_CronTime delay;
+  unsigned int i;
+  int ret;
+
+  ret = 0;
+  GNUNET_cron_suspend_jobs (cron, GNUNET_NO);
+  start = GNUNET_get_time ();
+  for (i = 0; i < THROUGHPUT_JOBS; i++)
+    GNUNET_cron_add_job (cron, &cronJob3,
+                         GNUNET_CRON_HOURS + (i * 7919) % THROUGHPUT_JOBS,
+                         0, (void *) (long) i);
+  for (i = 0; i < THROUGHPUT_JOBS; i++)
+    if (1 != GNUNET_cron_del_job (cron, &cronJob3, 0, (void *) (long) i))
+      ret = 1;
+  delay = GNUNET_get_time () - start;
+  GNUNET_cron_resume_jobs (cron, GNUNET_NO);
+  if (ret != 0)
+    fprintf (stderr, "failed to delete job!\n");
+  fprintf (stdout,
+           "Throughput: %u jobs added and removed in %llu ms.\n",
+           THROUGHPUT_JOBS, delay);
+  return ret;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -123,6 +263,9 @@ main (int argc, char *argv[])
   GNUNET_cron_start (cron);
   failureCount += testCron ();
   failureCount += testDelCron ();
+  failureCount += testLongJob ();
+  failureCount += testJitter ();
+  failureCount += testThroughput ();
   GNUNET_cron_stop (cron);
   GNUNET_cron_destroy (cron);
   if (failureCount != 0)
@@ -84,6 +84,65 @@ check ()
   return 0;
 }
 
+#define MANY_JOBS 2000
+
+static GNUNET_CronTime deadlines[MANY_JOBS];
+
+static unsigned long long manyDelta;
+
+static GNUNET_CronTime manyMax;
+
+static unsigned int manyCount;
+
+static void
+manyJob (void *ctx)
+{
+  GNUNET_CronTime *deadline = ctx;
+  GNUNET_CronTime now;
+
+  now = GNUNET_get_time ();
+  if (now > *deadline)
+    {
+      manyDelta += now - *deadline;
+      if (now - *deadline > manyMax)
+        manyMax = now - *deadline;
+    }
+  manyCount++;
+}
+
+/**
+ * Measure the precision when many timers are pending.
+ */
+static int
+checkMany ()
+{
+  GNUNET_CronTime start;
+  unsigned int i;
+  unsigned int delay;
+
+  manyDelta = 0;
+  manyMax = 0;
+  manyCount = 0;
+  start = GNUNET_get_time ();
+  for (i = 0; i < MANY_JOBS; i++)
+    {
+      delay = 50 + (i * 7919) % 1000;
+      deadlines[i] = start + delay;
+      GNUNET_cron_add_job (cron, &manyJob, delay * GNUNET_CRON_MILLISECONDS,
+                           0, &deadlines[i]);
+    }
+  GNUNET_thread_sleep (1500 * GNUNET_CRON_MILLISECONDS);
+  if (manyCount != MANY_JOBS)
+    {
+      fprintf (stderr, "Only %u of %u jobs ran.\n", manyCount, MANY_JOBS);
+      return 1;
+    }
+  FPRINTF (stdout,
+           "With %u pending timers, jobs ran %llums late on average (%llums max).\n",
+           MANY_JOBS, manyDelta / MANY_JOBS, manyMax);
+  return 0;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -92,6 +151,7 @@ main (int argc, char *argv[])
   cron = GNUNET_cron_create (NULL);
   GNUNET_cron_start (cron);
   failureCount += check ();
+  failureCount += checkMany ();
   GNUNET_cron_stop (cron);
   GNUNET_cron_destroy (cron);
   if (failureCount != 0)
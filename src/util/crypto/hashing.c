@@ -32,6 +32,7 @@
 
 #include "platform.h"
 #include "gnunet_util.h"
+#include "hashing_x86.h"
 
 #define SHA512_DIGEST_SIZE 64
 #define SHA512_HMAC_BLOCK_SIZE 128
@@ -354,6 +355,222 @@ sha512_final (struct sha512_ctx *sctx, unsigned char *hash)
   memset (sctx, 0, sizeof (struct sha512_ctx));
 }
 
+/**
+ * One message being hashed by hash_lanes.  The full blocks are
+ * compressed straight from the caller's buffer, the remaining
+ * bytes plus padding and length from 'tail'.
+ */
+struct sha512_lane
+{
+  /**
+   * Next block to compress.
+   */
+  const unsigned char *data;
+
+  /**
+   * Blocks left at data.
+   */
+  unsigned int left;
+
+  /**
+   * Blocks in tail that have not been started on (1 or 2,
+   * 0 once data points into tail).
+   */
+  unsigned int tail_left;
+
+  /**
+   * Which message is this (index into the result array)?
+   */
+  unsigned int msg;
+
+  /**
+   * Is this lane hashing a message at all?
+   */
+  int busy;
+
+  /**
+   * Final one or two blocks of the message, padded.
+   */
+  unsigned char tail[2 * SHA512_HMAC_BLOCK_SIZE];
+};
+
+/**
+ * Start hashing a message in the given lane.
+ */
+static void
+lane_start (struct sha512_lane *lane,
+            unsigned long long *state, unsigned int lanes, unsigned int l,
+            const unsigned char *block, unsigned int size, unsigned int msg)
+{
+  static const unsigned long long H[8] = { H0, H1, H2, H3, H4, H5, H6, H7 };
+  unsigned long long bits;
+  unsigned int rest;
+  unsigned int i;
+
+  for (i = 0; i < 8; i++)
+    state[i * lanes + l] = H[i];
+  rest = size % SHA512_HMAC_BLOCK_SIZE;
+  lane->data = block;
+  lane->left = size / SHA512_HMAC_BLOCK_SIZE;
+  lane->tail_left = (rest < 112) ? 1 : 2;
+  lane->msg = msg;
+  lane->busy = GNUNET_YES;
+  memset (lane->tail, 0, sizeof (lane->tail));
+  memcpy (lane->tail, &block[size - rest], rest);
+  lane->tail[rest] = 0x80;
+  /* the upper 64 bits of the 128-bit length are always zero */
+  bits = ((unsigned long long) size) << 3;
+  for (i = 1; i <= 8; i++)
+    {
+      lane->tail[lane->tail_left * SHA512_HMAC_BLOCK_SIZE - i] =
+        (unsigned char) bits;
+      bits >>= 8;
+    }
+}
+
+/**
+ * Hash 'count' messages using a transform that compresses one
+ * block of each of 'lanes' messages per call.  Whenever a message
+ * is done its lane takes the next one, so lanes stay busy even if
+ * the sizes differ; lanes without a message left chew on a dummy
+ * block and their result is ignored.
+ */
+static void
+hash_lanes (GNUNET_SHA512_MultiTransform transform, unsigned int lanes,
+            const void *const *blocks, const unsigned int *sizes,
+            unsigned int count, GNUNET_HashCode * ret)
+{
+  static const unsigned char idle[SHA512_HMAC_BLOCK_SIZE];
+  struct sha512_lane lane[SHA512_MAX_LANES];
+  unsigned long long state[8 * SHA512_MAX_LANES];
+  const unsigned char *in[SHA512_MAX_LANES];
+  unsigned long long t;
+  unsigned char *hash;
+  unsigned int next;
+  unsigned int active;
+  unsigned int l;
+  unsigned int i;
+  unsigned int j;
+
+  next = 0;
+  active = 0;
+  for (l = 0; l < lanes; l++)
+    {
+      lane[l].busy = GNUNET_NO;
+      if (next == count)
+        continue;
+      lane_start (&lane[l], state, lanes, l, blocks[next], sizes[next], next);
+      next++;
+      active++;
+    }
+  while (active > 0)
+    {
+      for (l = 0; l < lanes; l++)
+        {
+          if (lane[l].busy != GNUNET_YES)
+            {
+              in[l] = idle;
+              continue;
+            }
+          if (lane[l].left == 0)
+            {
+              lane[l].data = lane[l].tail;
+              lane[l].left = lane[l].tail_left;
+              lane[l].tail_left = 0;
+            }
+          in[l] = lane[l].data;
+          lane[l].data += SHA512_HMAC_BLOCK_SIZE;
+          lane[l].left--;
+        }
+      transform (state, in);
+      for (l = 0; l < lanes; l++)
+        {
+          if ((lane[l].busy != GNUNET_YES) ||
+              (lane[l].left > 0) || (lane[l].tail_left > 0))
+            continue;
+          hash = (unsigned char *) &ret[lane[l].msg];
+          for (i = 0; i < 8; i++)
+            {
+              t = state[i * lanes + l];
+              for (j = 8; j > 0; j--)
+                {
+                  hash[8 * i + j - 1] = (unsigned char) t;
+                  t >>= 8;
+                }
+            }
+          if (next < count)
+            {
+              lane_start (&lane[l], state, lanes, l,
+                          blocks[next], sizes[next], next);
+              next++;
+            }
+          else
+            {
+              lane[l].busy = GNUNET_NO;
+              active--;
+            }
+        }
+    }
+  /* Zeroize sensitive information. */
+  memset (lane, 0, sizeof (lane));
+  memset (state, 0, sizeof (state));
+}
+
+/**
+ * Multi-message transform picked for this CPU (NULL if none).
+ */
+static GNUNET_SHA512_MultiTransform multi_transform;
+
+/**
+ * Number of lanes of multi_transform.
+ */
+static unsigned int multi_lanes;
+
+/**
+ * Make GNUNET_hash_multiple use the transform with the given
+ * number of lanes (1 for plain GNUNET_hash).  Only for testing,
+ * normally the widest transform the CPU supports is used.
+ *
+ * @return GNUNET_OK on success, GNUNET_NO if the CPU (or the
+ *         compiler) does not support such a transform
+ */
+int
+GNUNET_hash_set_lanes_ (unsigned int lanes)
+{
+  switch (lanes)
+    {
+    case 1:
+      multi_transform = NULL;
+      multi_lanes = 1;
+      return GNUNET_OK;
+#if HAVE_SHA512_X86
+    case 4:
+      __builtin_cpu_init ();
+      if (!__builtin_cpu_supports ("avx2"))
+        return GNUNET_NO;
+      multi_transform = &GNUNET_sha512_transform_avx2_;
+      multi_lanes = 4;
+      return GNUNET_OK;
+    case 8:
+      __builtin_cpu_init ();
+      if (!__builtin_cpu_supports ("avx512f"))
+        return GNUNET_NO;
+      multi_transform = &GNUNET_sha512_transform_avx512_;
+      multi_lanes = 8;
+      return GNUNET_OK;
+#endif
+    default:
+      return GNUNET_NO;
+    }
+}
+
+void __attribute__ ((constructor)) GNUNET_hash_cpu_init ()
+{
+  if ((GNUNET_OK != GNUNET_hash_set_lanes_ (8)) &&
+      (GNUNET_OK != GNUNET_hash_set_lanes_ (4)))
+    GNUNET_hash_set_lanes_ (1);
+}
+
 /**
  * Hash block of given size.
  *
@@ -371,6 +588,33 @@ GNUNET_hash (const void *block, unsigned int size, GNUNET_HashCode * ret)
   sha512_final (&ctx, (unsigned char *) ret);
 }
 
+/**
+ * Hash several independent blocks at once.  Gives the same
+ * results as calling GNUNET_hash on each block, but is
+ * considerably faster if the CPU has wide enough vector
+ * registers to process several blocks side by side.
+ *
+ * @param blocks the blocks to hash
+ * @param sizes the length of each block
+ * @param count number of blocks
+ * @param ret array of count hashcodes to write the results to
+ */
+void
+GNUNET_hash_multiple (const void *const *blocks,
+                      const unsigned int *sizes,
+                      unsigned int count, GNUNET_HashCode * ret)
+{
+  unsigned int i;
+
+  if ((multi_transform != NULL) && (count > 1))
+    {
+      hash_lanes (multi_transform, multi_lanes, blocks, sizes, count, ret);
+      return;
+    }
+  for (i = 0; i < count; i++)
+    GNUNET_hash (blocks[i], sizes[i], &ret[i]);
+}
+
 /**
  * Compute the GNUNET_hash of an entire file.  Does NOT load the entire file
  * into memory but instead processes it in blocks.  Very important for
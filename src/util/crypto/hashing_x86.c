@@ -0,0 +1,225 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file util/crypto/hashing_x86.c
+ * @brief SHA-512 compression of several independent messages at
+ *        once, one message per 64-bit lane of an AVX2 or AVX-512
+ *        register.  SHA-512 itself has no data parallelism to
+ *        exploit within one message, so this only pays off when
+ *        there are several messages to hash.  The caller
+ *        (hashing.c) checks the CPU before using these.
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "hashing_x86.h"
+
+#if HAVE_SHA512_X86
+
+#include <immintrin.h>
+
+/**
+ * Load word j of a block (big-endian).
+ */
+static inline unsigned long long
+load64 (const unsigned char *block, unsigned int j)
+{
+  unsigned long long w;
+
+  memcpy (&w, &block[8 * j], sizeof (w));
+  return __builtin_bswap64 (w);
+}
+
+/* ******************** AVX2, 4 lanes ******************* */
+
+#define V4_ADD(x, y) _mm256_add_epi64 (x, y)
+#define V4_XOR3(x, y, z) _mm256_xor_si256 (_mm256_xor_si256 (x, y), z)
+#define V4_ROR(x, n) \
+  _mm256_or_si256 (_mm256_srli_epi64 (x, n), _mm256_slli_epi64 (x, 64 - (n)))
+#define V4_CH(x, y, z) \
+  _mm256_xor_si256 (z, _mm256_and_si256 (x, _mm256_xor_si256 (y, z)))
+#define V4_MAJ(x, y, z) \
+  _mm256_or_si256 (_mm256_and_si256 (x, y), \
+                   _mm256_and_si256 (z, _mm256_or_si256 (x, y)))
+#define V4_E0(x) V4_XOR3 (V4_ROR (x, 28), V4_ROR (x, 34), V4_ROR (x, 39))
+#define V4_E1(x) V4_XOR3 (V4_ROR (x, 14), V4_ROR (x, 18), V4_ROR (x, 41))
+#define V4_S0(x) V4_XOR3 (V4_ROR (x, 1), V4_ROR (x, 8), _mm256_srli_epi64 (x, 7))
+#define V4_S1(x) V4_XOR3 (V4_ROR (x, 19), V4_ROR (x, 61), _mm256_srli_epi64 (x, 6))
+
+#define V4_BLEND(I) \
+  W[(I) & 15] = V4_ADD (V4_ADD (W[(I) & 15], V4_S1 (W[((I) - 2) & 15])), \
+                        V4_ADD (W[((I) - 7) & 15], V4_S0 (W[((I) - 15) & 15])));
+
+#define V4_ROUND(a, b, c, d, e, f, g, h, I) \
+  t1 = V4_ADD (V4_ADD (h, V4_E1 (e)), \
+               V4_ADD (V4_CH (e, f, g), \
+                       V4_ADD (_mm256_set1_epi64x (sha512_K[I]), \
+                               W[(I) & 15]))); \
+  t2 = V4_ADD (V4_E0 (a), V4_MAJ (a, b, c)); \
+  d = V4_ADD (d, t1); \
+  h = V4_ADD (t1, t2);
+
+void __attribute__ ((target ("avx2")))
+GNUNET_sha512_transform_avx2_ (unsigned long long *state,
+                               const unsigned char *const *blocks)
+{
+  __m256i a, b, c, d, e, f, g, h, t1, t2;
+  __m256i W[16];
+  int i;
+
+  for (i = 0; i < 16; i++)
+    W[i] = _mm256_set_epi64x (load64 (blocks[3], i),
+                              load64 (blocks[2], i),
+                              load64 (blocks[1], i), load64 (blocks[0], i));
+  a = _mm256_loadu_si256 ((const __m256i *) &state[0]);
+  b = _mm256_loadu_si256 ((const __m256i *) &state[4]);
+  c = _mm256_loadu_si256 ((const __m256i *) &state[8]);
+  d = _mm256_loadu_si256 ((const __m256i *) &state[12]);
+  e = _mm256_loadu_si256 ((const __m256i *) &state[16]);
+  f = _mm256_loadu_si256 ((const __m256i *) &state[20]);
+  g = _mm256_loadu_si256 ((const __m256i *) &state[24]);
+  h = _mm256_loadu_si256 ((const __m256i *) &state[28]);
+  for (i = 0; i < 80; i += 8)
+    {
+      if (i >= 16)
+        {
+          V4_BLEND (i);
+          V4_BLEND (i + 1);
+          V4_BLEND (i + 2);
+          V4_BLEND (i + 3);
+          V4_BLEND (i + 4);
+          V4_BLEND (i + 5);
+          V4_BLEND (i + 6);
+          V4_BLEND (i + 7);
+        }
+      V4_ROUND (a, b, c, d, e, f, g, h, i);
+      V4_ROUND (h, a, b, c, d, e, f, g, i + 1);
+      V4_ROUND (g, h, a, b, c, d, e, f, i + 2);
+      V4_ROUND (f, g, h, a, b, c, d, e, i + 3);
+      V4_ROUND (e, f, g, h, a, b, c, d, i + 4);
+      V4_ROUND (d, e, f, g, h, a, b, c, i + 5);
+      V4_ROUND (c, d, e, f, g, h, a, b, i + 6);
+      V4_ROUND (b, c, d, e, f, g, h, a, i + 7);
+    }
+#define V4_STORE(I, x) \
+  _mm256_storeu_si256 ((__m256i *) &state[I], \
+                       V4_ADD (x, _mm256_loadu_si256 ((const __m256i *) &state[I])));
+  V4_STORE (0, a);
+  V4_STORE (4, b);
+  V4_STORE (8, c);
+  V4_STORE (12, d);
+  V4_STORE (16, e);
+  V4_STORE (20, f);
+  V4_STORE (24, g);
+  V4_STORE (28, h);
+  /* erase our data */
+  memset (W, 0, sizeof (W));
+}
+
+/* ******************** AVX-512, 8 lanes ******************* */
+
+/* ternary logic: 0x96 is x ^ y ^ z, 0xCA is Ch, 0xE8 is Maj */
+#define V8_ADD(x, y) _mm512_add_epi64 (x, y)
+#define V8_XOR3(x, y, z) _mm512_ternarylogic_epi64 (x, y, z, 0x96)
+#define V8_ROR(x, n) _mm512_ror_epi64 (x, n)
+#define V8_CH(x, y, z) _mm512_ternarylogic_epi64 (x, y, z, 0xCA)
+#define V8_MAJ(x, y, z) _mm512_ternarylogic_epi64 (x, y, z, 0xE8)
+#define V8_E0(x) V8_XOR3 (V8_ROR (x, 28), V8_ROR (x, 34), V8_ROR (x, 39))
+#define V8_E1(x) V8_XOR3 (V8_ROR (x, 14), V8_ROR (x, 18), V8_ROR (x, 41))
+#define V8_S0(x) V8_XOR3 (V8_ROR (x, 1), V8_ROR (x, 8), _mm512_srli_epi64 (x, 7))
+#define V8_S1(x) V8_XOR3 (V8_ROR (x, 19), V8_ROR (x, 61), _mm512_srli_epi64 (x, 6))
+
+#define V8_BLEND(I) \
+  W[(I) & 15] = V8_ADD (V8_ADD (W[(I) & 15], V8_S1 (W[((I) - 2) & 15])), \
+                        V8_ADD (W[((I) - 7) & 15], V8_S0 (W[((I) - 15) & 15])));
+
+#define V8_ROUND(a, b, c, d, e, f, g, h, I) \
+  t1 = V8_ADD (V8_ADD (h, V8_E1 (e)), \
+               V8_ADD (V8_CH (e, f, g), \
+                       V8_ADD (_mm512_set1_epi64 (sha512_K[I]), \
+                               W[(I) & 15]))); \
+  t2 = V8_ADD (V8_E0 (a), V8_MAJ (a, b, c)); \
+  d = V8_ADD (d, t1); \
+  h = V8_ADD (t1, t2);
+
+void __attribute__ ((target ("avx512f")))
+GNUNET_sha512_transform_avx512_ (unsigned long long *state,
+                                 const unsigned char *const *blocks)
+{
+  __m512i a, b, c, d, e, f, g, h, t1, t2;
+  __m512i W[16];
+  int i;
+
+  for (i = 0; i < 16; i++)
+    W[i] = _mm512_set_epi64 (load64 (blocks[7], i),
+                             load64 (blocks[6], i),
+                             load64 (blocks[5], i),
+                             load64 (blocks[4], i),
+                             load64 (blocks[3], i),
+                             load64 (blocks[2], i),
+                             load64 (blocks[1], i), load64 (blocks[0], i));
+  a = _mm512_loadu_si512 (&state[0]);
+  b = _mm512_loadu_si512 (&state[8]);
+  c = _mm512_loadu_si512 (&state[16]);
+  d = _mm512_loadu_si512 (&state[24]);
+  e = _mm512_loadu_si512 (&state[32]);
+  f = _mm512_loadu_si512 (&state[40]);
+  g = _mm512_loadu_si512 (&state[48]);
+  h = _mm512_loadu_si512 (&state[56]);
+  for (i = 0; i < 80; i += 8)
+    {
+      if (i >= 16)
+        {
+          V8_BLEND (i);
+          V8_BLEND (i + 1);
+          V8_BLEND (i + 2);
+          V8_BLEND (i + 3);
+          V8_BLEND (i + 4);
+          V8_BLEND (i + 5);
+          V8_BLEND (i + 6);
+          V8_BLEND (i + 7);
+        }
+      V8_ROUND (a, b, c, d, e, f, g, h, i);
+      V8_ROUND (h, a, b, c, d, e, f, g, i + 1);
+      V8_ROUND (g, h, a, b, c, d, e, f, i + 2);
+      V8_ROUND (f, g, h, a, b, c, d, e, i + 3);
+      V8_ROUND (e, f, g, h, a, b, c, d, i + 4);
+      V8_ROUND (d, e, f, g, h, a, b, c, i + 5);
+      V8_ROUND (c, d, e, f, g, h, a, b, i + 6);
+      V8_ROUND (b, c, d, e, f, g, h, a, i + 7);
+    }
+#define V8_STORE(I, x) \
+  _mm512_storeu_si512 (&state[I], V8_ADD (x, _mm512_loadu_si512 (&state[I])));
+  V8_STORE (0, a);
+  V8_STORE (8, b);
+  V8_STORE (16, c);
+  V8_STORE (24, d);
+  V8_STORE (32, e);
+  V8_STORE (40, f);
+  V8_STORE (48, g);
+  V8_STORE (56, h);
+  /* erase our data */
+  memset (W, 0, sizeof (W));
+}
+
+#endif
+
+/* end of hashing_x86.c */
@@ -0,0 +1,78 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file util/crypto/hashing_x86.h
+ * @brief SIMD SHA-512 transforms for hashing several messages at once
+ * @author Christian Grothoff
+ */
+
+#ifndef HASHING_X86_H
+#define HASHING_X86_H
+
+/**
+ * Can we build the x86 transforms?  They need a compiler that
+ * supports per-function target attributes (the rest of the code
+ * is still built for the baseline CPU) and the AVX-512 intrinsics.
+ */
+#if defined(__x86_64__) && (defined(__clang__) || (__GNUC__ >= 5))
+#define HAVE_SHA512_X86 1
+#endif
+
+/**
+ * Largest number of lanes of any transform.
+ */
+#define SHA512_MAX_LANES 8
+
+/**
+ * Process one 128-byte block for each of 'lanes' messages.  The
+ * state is interleaved: word i of lane l is state[i * lanes + l].
+ */
+typedef void (*GNUNET_SHA512_MultiTransform) (unsigned long long *state,
+                                              const unsigned char *const
+                                              *blocks);
+
+extern const unsigned long long sha512_K[80];
+
+/**
+ * Make GNUNET_hash_multiple use the transform with the given
+ * number of lanes (1, 4 or 8).  For testing.
+ *
+ * @return GNUNET_OK on success, GNUNET_NO if not supported here
+ */
+int GNUNET_hash_set_lanes_ (unsigned int lanes);
+
+#if HAVE_SHA512_X86
+
+/**
+ * Four lanes, needs AVX2.
+ */
+void GNUNET_sha512_transform_avx2_ (unsigned long long *state,
+                                    const unsigned char *const *blocks);
+
+/**
+ * Eight lanes, needs AVX-512F.
+ */
+void GNUNET_sha512_transform_avx512_ (unsigned long long *state,
+                                      const unsigned char *const *blocks);
+
+#endif
+
+#endif
@@ -27,6 +27,7 @@
 #include "gnunet_util.h"
 #include "gnunet_util_crypto.h"
 #include "platform.h"
+#include "hashing_x86.h"
 
 static int
 test (int number)
@@ -57,14 +58,58 @@ testEncoding ()
   return 0;
 }
 
+/**
+ * Hash blocks of all sizes up to 300 bytes (covering every
+ * padding case) plus a few large ones with GNUNET_hash_multiple
+ * and compare with GNUNET_hash.
+ */
+static int
+testMultiple (unsigned int lanes)
+{
+  GNUNET_HashCode single;
+  GNUNET_HashCode multi[304];
+  const void *blocks[304];
+  unsigned int sizes[304];
+  char *buf;
+  unsigned int i;
+
+  buf = GNUNET_malloc (65536);
+  for (i = 0; i < 65536; i++)
+    buf[i] = (char) i;
+  for (i = 0; i < 304; i++)
+    {
+      blocks[i] = &buf[i];
+      sizes[i] = (i < 300) ? i : 32768 + i;
+    }
+  GNUNET_hash_multiple (blocks, sizes, 304, multi);
+  for (i = 0; i < 304; i++)
+    {
+      GNUNET_hash (blocks[i], sizes[i], &single);
+      if (0 != memcmp (&single, &multi[i], sizeof (GNUNET_HashCode)))
+        {
+          printf ("GNUNET_hash_multiple (%u lanes) differs for %u bytes!\n",
+                  lanes, sizes[i]);
+          GNUNET_free (buf);
+          return 1;
+        }
+    }
+  GNUNET_free (buf);
+  return 0;
+}
+
 int
 main (int argc, char *argv[])
 {
+  static const unsigned int lanes[] = { 1, 4, 8 };
   int failureCount = 0;
   int i;
 
   for (i = 0; i < 10; i++)
     failureCount += testEncoding ();
+  /* check every transform this CPU supports */
+  for (i = 0; i < sizeof (lanes) / sizeof (lanes[0]); i++)
+    if (GNUNET_OK == GNUNET_hash_set_lanes_ (lanes[i]))
+      failureCount += testMultiple (lanes[i]);
   if (failureCount != 0)
     return 1;
   return 0;
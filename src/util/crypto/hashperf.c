@@ -19,7 +19,8 @@
 */
 
 /**
- * Test for hashing.c
+ * Throughput of GNUNET_hash and GNUNET_hash_multiple on one core
+ * for small (hashcode-sized) and DBlock-sized inputs
  * @author Christian Grothoff
  * @file util/crypto/hashperf.c
  */
@@ -27,36 +28,90 @@
 #include "gnunet_util.h"
 #include "gnunet_util_crypto.h"
 #include "platform.h"
+#include "hashing_x86.h"
 
-static void
-perfHash ()
+/**
+ * How many MB to hash per run.
+ */
+#define MEGABYTES 64
+
+/**
+ * How many blocks to pass to GNUNET_hash_multiple at once.
+ */
+#define BATCH 64
+
+/**
+ * Hash MEGABYTES of blocks of the given size, either one at a
+ * time or BATCH at a time (with the transform of the given
+ * number of lanes), and report GB/s.
+ *
+ * @return GNUNET_OK if both ways give the same hashes
+ */
+static int
+perfHash (unsigned int size, unsigned int lanes)
 {
-  GNUNET_HashCode hc1;
-  GNUNET_HashCode hc2;
-  GNUNET_HashCode hc3;
-  int i;
+  GNUNET_HashCode single[BATCH];
+  GNUNET_HashCode multi[BATCH];
+  const void *blocks[BATCH];
+  unsigned int sizes[BATCH];
+  GNUNET_CronTime start;
+  GNUNET_CronTime delta[2];
+  unsigned long long total;
   char *buf;
+  unsigned int rounds;
+  unsigned int i;
+  unsigned int j;
 
-  buf = GNUNET_malloc (1024 * 64);
-  memset (buf, 1, 1024 * 64);
-  GNUNET_hash ("foo", 3, &hc1);
-  for (i = 0; i < 1024; i++)
+  buf = GNUNET_malloc (size * BATCH);
+  for (i = 0; i < size * BATCH; i++)
+    buf[i] = (char) GNUNET_random_u32 (GNUNET_RANDOM_QUALITY_WEAK, 256);
+  for (i = 0; i < BATCH; i++)
     {
-      GNUNET_hash (&hc1, sizeof (GNUNET_HashCode), &hc2);
-      GNUNET_hash (&hc2, sizeof (GNUNET_HashCode), &hc1);
-      GNUNET_hash (buf, 1024 * 64, &hc3);
+      blocks[i] = &buf[i * size];
+      sizes[i] = size;
     }
+  total = 1024LL * 1024 * MEGABYTES;
+  rounds = total / size / BATCH;
+  start = GNUNET_get_time ();
+  for (j = 0; j < rounds; j++)
+    for (i = 0; i < BATCH; i++)
+      GNUNET_hash (blocks[i], size, &single[i]);
+  delta[0] = GNUNET_get_time () - start;
+  start = GNUNET_get_time ();
+  for (j = 0; j < rounds; j++)
+    GNUNET_hash_multiple (blocks, sizes, BATCH, multi);
+  delta[1] = GNUNET_get_time () - start;
   GNUNET_free (buf);
+  for (i = 0; i < 2; i++)
+    if (delta[i] == 0)
+      delta[i] = 1;
+  printf ("%5u byte blocks: GNUNET_hash %.3f GB/s, "
+          "GNUNET_hash_multiple (%u lanes) %.3f GB/s (per core)\n",
+          size,
+          (double) total / delta[0] / 1000 / 1000,
+          lanes, (double) total / delta[1] / 1000 / 1000);
+  if (0 != memcmp (single, multi, sizeof (single)))
+    {
+      fprintf (stderr, "GNUNET_hash_multiple result differs!\n");
+      return GNUNET_SYSERR;
+    }
+  return GNUNET_OK;
 }
 
 int
 main (int argc, char *argv[])
 {
-  GNUNET_CronTime start;
+  static const unsigned int lanes[] = { 1, 4, 8 };
+  int i;
 
-  start = GNUNET_get_time ();
-  perfHash ();
-  printf ("Hash perf took %llu ms\n", GNUNET_get_time () - start);
+  for (i = 0; i < sizeof (lanes) / sizeof (lanes[0]); i++)
+    {
+      if (GNUNET_OK != GNUNET_hash_set_lanes_ (lanes[i]))
+        continue;
+      if ((GNUNET_OK != perfHash (sizeof (GNUNET_HashCode), lanes[i])) ||
+          (GNUNET_OK != perfHash (32 * 1024, lanes[i])))
+        return 1;
+    }
   return 0;
 }
 
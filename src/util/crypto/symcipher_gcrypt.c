@@ -214,4 +214,176 @@ GNUNET_AES_decrypt (const GNUNET_AES_SessionKey * sessionkey,
   return size;
 }
 
+/**
+ * Cipher context for a session key.
+ */
+struct GNUNET_AES_Context
+{
+  /**
+   * Serializes the use of the handle (every operation
+   * sets the IV and then runs the cipher).
+   */
+  struct GNUNET_Mutex *lock;
+
+  gcry_cipher_hd_t handle;
+
+  /**
+   * Reference count.
+   */
+  int rc;
+};
+
+/**
+ * Create a cipher context for the given session key.  The
+ * key schedule is computed (and the key checked) only once;
+ * operations on the context do not take the global gcrypt
+ * lock.
+ *
+ * @return NULL on error (the reference count of a new
+ *         context is one)
+ */
+struct GNUNET_AES_Context *
+GNUNET_AES_context_create (const GNUNET_AES_SessionKey * sessionkey)
+{
+  struct GNUNET_AES_Context *ctx;
+  gcry_cipher_hd_t handle;
+  int rc;
+
+  if (sessionkey->crc32 !=
+      htonl (GNUNET_crc32_n (sessionkey, GNUNET_SESSIONKEY_LEN)))
+    {
+      GNUNET_GE_BREAK (NULL, 0);
+      return NULL;
+    }
+  GNUNET_lock_gcrypt_ ();
+  rc = gcry_cipher_open (&handle,
+                         GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_CFB, 0);
+  if (rc)
+    {
+      LOG_GCRY (NULL,
+                GNUNET_GE_ERROR | GNUNET_GE_USER | GNUNET_GE_DEVELOPER |
+                GNUNET_GE_BULK, "gcry_cipher_open", rc);
+      GNUNET_unlock_gcrypt_ ();
+      return NULL;
+    }
+  rc = gcry_cipher_setkey (handle, sessionkey, GNUNET_SESSIONKEY_LEN);
+  if (rc && ((char) rc != GPG_ERR_WEAK_KEY))
+    {
+      LOG_GCRY (NULL,
+                GNUNET_GE_ERROR | GNUNET_GE_USER | GNUNET_GE_DEVELOPER |
+                GNUNET_GE_BULK, "gcry_cipher_setkey", rc);
+      gcry_cipher_close (handle);
+      GNUNET_unlock_gcrypt_ ();
+      return NULL;
+    }
+  GNUNET_unlock_gcrypt_ ();
+  ctx = GNUNET_malloc (sizeof (struct GNUNET_AES_Context));
+  ctx->lock = GNUNET_mutex_create (GNUNET_NO);
+  ctx->handle = handle;
+  ctx->rc = 1;
+  return ctx;
+}
+
+/**
+ * Obtain another reference to the cipher context.
+ */
+void
+GNUNET_AES_context_retain (struct GNUNET_AES_Context *ctx)
+{
+  __sync_fetch_and_add (&ctx->rc, 1);
+}
+
+/**
+ * Release a reference to the cipher context; the
+ * context is destroyed once the last reference is gone.
+ */
+void
+GNUNET_AES_context_release (struct GNUNET_AES_Context *ctx)
+{
+  if (0 != __sync_sub_and_fetch (&ctx->rc, 1))
+    return;
+  GNUNET_lock_gcrypt_ ();
+  gcry_cipher_close (ctx->handle);
+  GNUNET_unlock_gcrypt_ ();
+  GNUNET_mutex_destroy (ctx->lock);
+  GNUNET_free (ctx);
+}
+
+/**
+ * Run the cipher of the context in the given direction.
+ */
+static int
+contextRun (struct GNUNET_AES_Context *ctx,
+            int encrypt,
+            const void *block,
+            unsigned short len,
+            const GNUNET_AES_InitializationVector * iv, void *result)
+{
+  int rc;
+
+  GNUNET_mutex_lock (ctx->lock);
+  rc = gcry_cipher_setiv (ctx->handle, iv,
+                          sizeof (GNUNET_AES_InitializationVector));
+  if (rc && ((char) rc != GPG_ERR_WEAK_KEY))
+    {
+      GNUNET_mutex_unlock (ctx->lock);
+      LOG_GCRY (NULL,
+                GNUNET_GE_ERROR | GNUNET_GE_USER | GNUNET_GE_DEVELOPER |
+                GNUNET_GE_BULK, "gcry_cipher_setiv", rc);
+      return -1;
+    }
+  if (encrypt)
+    rc = gcry_cipher_encrypt (ctx->handle, result, len, block, len);
+  else
+    rc = gcry_cipher_decrypt (ctx->handle, result, len, block, len);
+  GNUNET_mutex_unlock (ctx->lock);
+  if (rc)
+    {
+      LOG_GCRY (NULL,
+                GNUNET_GE_ERROR | GNUNET_GE_USER | GNUNET_GE_DEVELOPER |
+                GNUNET_GE_BULK,
+                encrypt ? "gcry_cipher_encrypt" : "gcry_cipher_decrypt", rc);
+      return -1;
+    }
+  return len;
+}
+
+/**
+ * Encrypt a block using a cipher context.
+ * @param ctx the context for the session key
+ * @param block the block to encrypt
+ * @param len the size of the block
+ * @param iv the initialization vector to use
+ * @param result the output parameter in which to store the encrypted result
+ * @returns the size of the encrypted block, -1 for errors
+ */
+int
+GNUNET_AES_context_encrypt (struct GNUNET_AES_Context *ctx,
+                            const void *block,
+                            unsigned short len,
+                            const GNUNET_AES_InitializationVector * iv,
+                            void *result)
+{
+  return contextRun (ctx, GNUNET_YES, block, len, iv, result);
+}
+
+/**
+ * Decrypt a block using a cipher context.
+ * @param ctx the context for the session key
+ * @param block the data to decrypt, encoded as returned by encrypt
+ * @param size the size of the block to decrypt
+ * @param iv the initialization vector to use
+ * @param result address to store the result at
+ * @return -1 on failure, size of decrypted block on success
+ */
+int
+GNUNET_AES_context_decrypt (struct GNUNET_AES_Context *ctx,
+                            const void *block,
+                            unsigned short size,
+                            const GNUNET_AES_InitializationVector * iv,
+                            void *result)
+{
+  return contextRun (ctx, GNUNET_NO, block, size, iv, result);
+}
+
 /* end of symcipher_gcrypt.c */
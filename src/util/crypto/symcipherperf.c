@@ -0,0 +1,124 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * Throughput of AES with and without cached cipher contexts
+ * @author Christian Grothoff
+ * @file util/crypto/symcipherperf.c
+ */
+
+#include "gnunet_util.h"
+#include "gnunet_util_crypto.h"
+#include "platform.h"
+
+#define THREADS 4
+
+#define BLOCK_SIZE 1400
+
+#define ROUNDS 8192
+
+static GNUNET_AES_SessionKey key;
+
+static int use_context;
+
+static int failed;
+
+static void *
+encryptThread (void *unused)
+{
+  struct GNUNET_AES_Context *ctx;
+  GNUNET_AES_InitializationVector iv;
+  char plain[BLOCK_SIZE];
+  char cipher[BLOCK_SIZE];
+  char result[BLOCK_SIZE];
+  int i;
+
+  /* one context per session key (and thus per thread) */
+  ctx = GNUNET_AES_context_create (&key);
+  if (ctx == NULL)
+    {
+      failed = GNUNET_YES;
+      return NULL;
+    }
+  memset (plain, 42, sizeof (plain));
+  memset (&iv, 0, sizeof (iv));
+  for (i = 0; i < ROUNDS; i++)
+    {
+      memcpy (&iv, &i, sizeof (i));
+      if (use_context)
+        {
+          GNUNET_AES_context_encrypt (ctx, plain, BLOCK_SIZE, &iv, cipher);
+          GNUNET_AES_context_decrypt (ctx, cipher, BLOCK_SIZE, &iv, result);
+        }
+      else
+        {
+          GNUNET_AES_encrypt (plain, BLOCK_SIZE, &key, &iv, cipher);
+          GNUNET_AES_decrypt (&key, cipher, BLOCK_SIZE, &iv, result);
+        }
+      if (0 != memcmp (plain, result, BLOCK_SIZE))
+        failed = GNUNET_YES;
+    }
+  GNUNET_AES_context_release (ctx);
+  return NULL;
+}
+
+static void
+perfAES (int context, unsigned int threads)
+{
+  struct GNUNET_ThreadHandle *handles[THREADS];
+  GNUNET_CronTime start;
+  GNUNET_CronTime delta;
+  double mb;
+  void *unused;
+  unsigned int i;
+
+  use_context = context;
+  start = GNUNET_get_time ();
+  for (i = 0; i < threads; i++)
+    handles[i] = GNUNET_thread_create (&encryptThread, NULL, 32 * 1024);
+  for (i = 0; i < threads; i++)
+    if (handles[i] != NULL)
+      GNUNET_thread_join (handles[i], &unused);
+  delta = GNUNET_get_time () - start;
+  if (delta == 0)
+    delta = 1;
+  mb = 2.0 * ROUNDS * BLOCK_SIZE / 1024 / 1024;
+  printf ("AES %s, %u thread(s): %.1f MB/s total, %.1f MB/s per thread\n",
+          context ? "with cached context" : "per call", threads,
+          mb * threads * 1000 / delta, mb * 1000 / delta);
+}
+
+int
+main (int argc, char *argv[])
+{
+  GNUNET_AES_create_session_key (&key);
+  perfAES (GNUNET_NO, 1);
+  perfAES (GNUNET_YES, 1);
+  perfAES (GNUNET_NO, THREADS);
+  perfAES (GNUNET_YES, THREADS);
+  if (failed)
+    {
+      printf ("AES perf test failed\n");
+      return 1;
+    }
+  return 0;
+}
+
+/* end of symcipherperf.c */
@@ -0,0 +1,493 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file util/network/bufferpool.c
+ * @brief reference counted network buffers carved from slabs
+ *        of fixed-size chunks
+ * @author Christian Grothoff
+ *
+ * Buffers of up to GNUNET_MAX_BUFFER_SIZE bytes are taken from
+ * one of a few size classes; each class allocates its chunks
+ * in slabs and keeps released chunks on a free list.  Larger
+ * buffers are allocated individually.  Slabs whose chunks are
+ * all free are given back to the system, except for IDLE_SLABS
+ * of them per class, so that the pool shrinks again after a
+ * burst of traffic.  The pool stays alive until it was
+ * destroyed and all of its buffers were released, so buffers
+ * may safely outlive the select that allocated them.
+ */
+
+#include "platform.h"
+#include "gnunet_util.h"
+
+/**
+ * Number of size classes.
+ */
+#define CLASS_COUNT 4
+
+/**
+ * Usable size of the chunks of each class.
+ */
+static const unsigned int class_size[CLASS_COUNT] = {
+  1024, 4 * 1024, 16 * 1024, GNUNET_MAX_BUFFER_SIZE
+};
+
+/**
+ * Size class used for buffers allocated individually.
+ */
+#define CLASS_LARGE CLASS_COUNT
+
+/**
+ * How many bytes should we allocate at once for a slab?
+ * (a slab always holds at least one chunk)
+ */
+#define SLAB_SIZE (256 * 1024)
+
+/**
+ * How many completely unused slabs should we keep
+ * for each size class?
+ */
+#define IDLE_SLABS 1
+
+struct GNUNET_Buffer
+{
+  /**
+   * Pool this buffer belongs to.
+   */
+  struct GNUNET_BufferPool *pool;
+
+  /**
+   * Slab holding this buffer (NULL if not from a slab).
+   */
+  struct Slab *slab;
+
+  /**
+   * Next buffer in the free list of the size class.
+   */
+  struct GNUNET_Buffer *next;
+
+  /**
+   * Previous buffer in the free list of the size class.
+   */
+  struct GNUNET_Buffer *prev;
+
+  /**
+   * Usable size of the buffer.
+   */
+  unsigned int size;
+
+  /**
+   * Size class of the buffer (CLASS_LARGE if not from a slab).
+   */
+  unsigned int klass;
+
+  /**
+   * Reference count.
+   */
+  int rc;
+
+  /**
+   * Does this buffer count against the quota (it was
+   * allocated without force)?
+   */
+  int quota;
+
+  /**
+   * Make sure the data that follows is 8-byte aligned.
+   */
+  unsigned long long align;
+
+};
+
+/**
+ * Header of a slab (padded to the size of a buffer header).
+ */
+struct Slab
+{
+  struct Slab *next;
+
+  struct Slab *prev;
+
+  /**
+   * Number of chunks in the slab.
+   */
+  unsigned int count;
+
+  /**
+   * Number of chunks of the slab on the free list.
+   */
+  unsigned int free;
+};
+
+struct GNUNET_BufferPool
+{
+
+  struct GNUNET_Mutex *lock;
+
+  /**
+   * Free chunks for each size class.
+   */
+  struct GNUNET_Buffer *free[CLASS_COUNT];
+
+  /**
+   * All slabs (released when the pool goes away).
+   */
+  struct Slab *slabs;
+
+  /**
+   * Number of slabs of each class without any chunk in use.
+   */
+  unsigned int idle[CLASS_COUNT];
+
+  /**
+   * Maximum number of bytes in buffers allocated
+   * without force (0 for unlimited).
+   */
+  unsigned long long quota;
+
+  /**
+   * Number of bytes in buffers allocated without force.
+   */
+  unsigned long long quota_used;
+
+  /**
+   * Number of bytes in allocated buffers.
+   */
+  unsigned long long used;
+
+  /**
+   * Number of times the pool allocated memory
+   * (for a slab or a large buffer).
+   */
+  unsigned long long allocations;
+
+  /**
+   * Number of allocated buffers plus one while the pool
+   * has not been destroyed.
+   */
+  unsigned int rc;
+
+};
+
+/**
+ * Free the pool and its slabs.  Called once the pool was
+ * destroyed and the last buffer was released.
+ */
+static void
+freePool (struct GNUNET_BufferPool *pool)
+{
+  struct Slab *slab;
+
+  while (NULL != (slab = pool->slabs))
+    {
+      pool->slabs = slab->next;
+      GNUNET_free (slab);
+    }
+  GNUNET_mutex_destroy (pool->lock);
+  GNUNET_free (pool);
+}
+
+/**
+ * Allocate another slab for the given size class and
+ * put its chunks on the free list.  The lock must be held.
+ */
+static void
+growClass (struct GNUNET_BufferPool *pool, unsigned int klass)
+{
+  struct Slab *slab;
+  struct GNUNET_Buffer *buf;
+  unsigned int chunk;
+  unsigned int count;
+  unsigned int i;
+  char *pos;
+
+  chunk = sizeof (struct GNUNET_Buffer) + class_size[klass];
+  count = (SLAB_SIZE - sizeof (struct GNUNET_Buffer)) / chunk;
+  if (count == 0)
+    count = 1;
+  /* the slab header is padded to the size of a buffer header
+     to keep the chunks aligned */
+  slab = GNUNET_malloc (sizeof (struct GNUNET_Buffer) + count * chunk);
+  pool->allocations++;
+  slab->next = pool->slabs;
+  slab->prev = NULL;
+  if (pool->slabs != NULL)
+    pool->slabs->prev = slab;
+  pool->slabs = slab;
+  slab->count = count;
+  slab->free = count;
+  pool->idle[klass]++;
+  pos = ((char *) slab) + sizeof (struct GNUNET_Buffer);
+  for (i = 0; i < count; i++)
+    {
+      buf = (struct GNUNET_Buffer *) pos;
+      buf->pool = pool;
+      buf->slab = slab;
+      buf->size = class_size[klass];
+      buf->klass = klass;
+      buf->prev = NULL;
+      buf->next = pool->free[klass];
+      if (buf->next != NULL)
+        buf->next->prev = buf;
+      pool->free[klass] = buf;
+      pos += chunk;
+    }
+}
+
+/**
+ * Give a slab without any chunk in use back to the system.
+ * The lock must be held.
+ */
+static void
+shrinkClass (struct GNUNET_BufferPool *pool, struct Slab *slab,
+             unsigned int klass)
+{
+  struct GNUNET_Buffer *buf;
+  unsigned int chunk;
+  unsigned int i;
+  char *pos;
+
+  chunk = sizeof (struct GNUNET_Buffer) + class_size[klass];
+  pos = ((char *) slab) + sizeof (struct GNUNET_Buffer);
+  for (i = 0; i < slab->count; i++)
+    {
+      buf = (struct GNUNET_Buffer *) pos;
+      if (buf->prev != NULL)
+        buf->prev->next = buf->next;
+      else
+        pool->free[klass] = buf->next;
+      if (buf->next != NULL)
+        buf->next->prev = buf->prev;
+      pos += chunk;
+    }
+  if (slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    pool->slabs = slab->next;
+  if (slab->next != NULL)
+    slab->next->prev = slab->prev;
+  pool->idle[klass]--;
+  GNUNET_free (slab);
+}
+
+/**
+ * Create a buffer pool.
+ *
+ * @param quota maximum number of bytes in buffers that
+ *        were allocated without force (0 for unlimited);
+ *        buffers allocated with force do not count
+ */
+struct GNUNET_BufferPool *
+GNUNET_buffer_pool_create (unsigned long long quota)
+{
+  struct GNUNET_BufferPool *pool;
+
+  pool = GNUNET_malloc (sizeof (struct GNUNET_BufferPool));
+  memset (pool, 0, sizeof (struct GNUNET_BufferPool));
+  pool->lock = GNUNET_mutex_create (GNUNET_NO);
+  pool->quota = quota;
+  pool->rc = 1;
+  return pool;
+}
+
+/**
+ * Destroy a buffer pool.  The memory is released once
+ * all buffers from the pool have been released.
+ */
+void
+GNUNET_buffer_pool_destroy (struct GNUNET_BufferPool *pool)
+{
+  int last;
+
+  GNUNET_mutex_lock (pool->lock);
+  last = (0 == --pool->rc);
+  GNUNET_mutex_unlock (pool->lock);
+  if (last)
+    freePool (pool);
+}
+
+/**
+ * Get a buffer from the pool.  The buffer starts
+ * with a reference count of one.
+ *
+ * @param size minimum size of the buffer
+ * @param force allocate even if this exceeds the quota
+ * @return NULL if the quota does not permit the allocation
+ */
+struct GNUNET_Buffer *
+GNUNET_buffer_pool_get (struct GNUNET_BufferPool *pool,
+                        unsigned int size, int force)
+{
+  struct GNUNET_Buffer *buf;
+  unsigned int klass;
+
+  klass = 0;
+  while ((klass < CLASS_COUNT) && (class_size[klass] < size))
+    klass++;
+  GNUNET_mutex_lock (pool->lock);
+  if ((force == GNUNET_NO) &&
+      (pool->quota > 0) &&
+      (pool->quota_used +
+       ((klass == CLASS_LARGE) ? size : class_size[klass]) > pool->quota))
+    {
+      GNUNET_mutex_unlock (pool->lock);
+      return NULL;
+    }
+  if (klass == CLASS_LARGE)
+    {
+      buf = GNUNET_malloc (sizeof (struct GNUNET_Buffer) + size);
+      pool->allocations++;
+      buf->pool = pool;
+      buf->slab = NULL;
+      buf->size = size;
+      buf->klass = CLASS_LARGE;
+    }
+  else
+    {
+      if (pool->free[klass] == NULL)
+        growClass (pool, klass);
+      buf = pool->free[klass];
+      pool->free[klass] = buf->next;
+      if (buf->next != NULL)
+        buf->next->prev = NULL;
+      if (buf->slab->free-- == buf->slab->count)
+        pool->idle[klass]--;
+    }
+  buf->next = NULL;
+  buf->prev = NULL;
+  buf->rc = 1;
+  buf->quota = (force == GNUNET_NO) ? GNUNET_YES : GNUNET_NO;
+  if (buf->quota == GNUNET_YES)
+    pool->quota_used += buf->size;
+  pool->used += buf->size;
+  pool->rc++;
+  GNUNET_mutex_unlock (pool->lock);
+  return buf;
+}
+
+/**
+ * Get the data area of the buffer.
+ */
+char *
+GNUNET_buffer_get_data (struct GNUNET_Buffer *buf)
+{
+  return (char *) &buf[1];
+}
+
+/**
+ * Get the usable size of the buffer.
+ */
+unsigned int
+GNUNET_buffer_get_size (const struct GNUNET_Buffer *buf)
+{
+  return buf->size;
+}
+
+/**
+ * Is anyone but the caller holding a reference to the buffer?
+ */
+int
+GNUNET_buffer_test_shared (const struct GNUNET_Buffer *buf)
+{
+  return (buf->rc > 1) ? GNUNET_YES : GNUNET_NO;
+}
+
+/**
+ * Obtain another reference to the buffer.
+ */
+void
+GNUNET_buffer_retain (struct GNUNET_Buffer *buf)
+{
+  __sync_fetch_and_add (&buf->rc, 1);
+}
+
+/**
+ * Release a reference to the buffer.  The buffer returns
+ * to the pool once the last reference is gone.
+ */
+void
+GNUNET_buffer_release (struct GNUNET_Buffer *buf)
+{
+  struct GNUNET_BufferPool *pool;
+  int last;
+
+  if (0 != __sync_sub_and_fetch (&buf->rc, 1))
+    return;
+  pool = buf->pool;
+  GNUNET_mutex_lock (pool->lock);
+  pool->used -= buf->size;
+  if (buf->quota == GNUNET_YES)
+    pool->quota_used -= buf->size;
+  if (buf->klass == CLASS_LARGE)
+    {
+      GNUNET_free (buf);
+    }
+  else
+    {
+      buf->prev = NULL;
+      buf->next = pool->free[buf->klass];
+      if (buf->next != NULL)
+        buf->next->prev = buf;
+      pool->free[buf->klass] = buf;
+      if (++buf->slab->free == buf->slab->count)
+        {
+          pool->idle[buf->klass]++;
+          if (pool->idle[buf->klass] > IDLE_SLABS)
+            shrinkClass (pool, buf->slab, buf->klass);
+        }
+    }
+  last = (0 == --pool->rc);
+  GNUNET_mutex_unlock (pool->lock);
+  if (last)
+    freePool (pool);
+}
+
+/**
+ * How many bytes are currently in buffers allocated
+ * from the pool?
+ */
+unsigned long long
+GNUNET_buffer_pool_get_usage (struct GNUNET_BufferPool *pool)
+{
+  unsigned long long ret;
+
+  GNUNET_mutex_lock (pool->lock);
+  ret = pool->used;
+  GNUNET_mutex_unlock (pool->lock);
+  return ret;
+}
+
+/**
+ * How many times did the pool allocate memory
+ * (for a slab or a large buffer) so far?
+ */
+unsigned long long
+GNUNET_buffer_pool_get_allocations (struct GNUNET_BufferPool *pool)
+{
+  unsigned long long ret;
+
+  GNUNET_mutex_lock (pool->lock);
+  ret = pool->allocations;
+  GNUNET_mutex_unlock (pool->lock);
+  return ret;
+}
+
+/* end of bufferpool.c */
@@ -0,0 +1,138 @@
+/*
+     This file is part of GNUnet.
+     (C) 2008 Christian Grothoff (and other contributing authors)
+
+     GNUnet is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with GNUnet; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file util/network/bufferpooltest.c
+ * @brief testcase for util/network/bufferpool.c
+ */
+
+#include "platform.h"
+#include "gnunet_util.h"
+
+static int
+test ()
+{
+  struct GNUNET_BufferPool *pool;
+  struct GNUNET_Buffer *a;
+  struct GNUNET_Buffer *b;
+  struct GNUNET_Buffer *c;
+
+  pool = GNUNET_buffer_pool_create (8192);
+  a = GNUNET_buffer_pool_get (pool, 100, GNUNET_NO);
+  if ((a == NULL) || (GNUNET_buffer_get_size (a) < 100))
+    return 1;
+  if (0 != (((long) GNUNET_buffer_get_data (a)) & 7))
+    return 2;
+  memset (GNUNET_buffer_get_data (a), 42, GNUNET_buffer_get_size (a));
+  b = GNUNET_buffer_pool_get (pool, 4096, GNUNET_NO);
+  if (b == NULL)
+    return 3;
+  /* over quota */
+  if (NULL != GNUNET_buffer_pool_get (pool, 4096, GNUNET_NO))
+    return 4;
+  c = GNUNET_buffer_pool_get (pool, 100000, GNUNET_YES);
+  if ((c == NULL) || (GNUNET_buffer_get_size (c) < 100000))
+    return 5;
+  memset (GNUNET_buffer_get_data (c), 42, 100000);
+  GNUNET_buffer_release (b);
+  /* forced buffers do not count against the quota */
+  b = GNUNET_buffer_pool_get (pool, 4096, GNUNET_NO);
+  if (b == NULL)
+    return 12;
+  GNUNET_buffer_release (c);
+  /* references */
+  if (GNUNET_NO != GNUNET_buffer_test_shared (a))
+    return 6;
+  GNUNET_buffer_retain (a);
+  if (GNUNET_YES != GNUNET_buffer_test_shared (a))
+    return 7;
+  GNUNET_buffer_release (a);
+  if (GNUNET_NO != GNUNET_buffer_test_shared (a))
+    return 8;
+  if (GNUNET_buffer_pool_get_usage (pool) !=
+      GNUNET_buffer_get_size (a) + GNUNET_buffer_get_size (b))
+    return 9;
+  GNUNET_buffer_release (b);
+  /* released chunks are reused */
+  c = GNUNET_buffer_pool_get (pool, 4000, GNUNET_NO);
+  if (c != b)
+    return 10;
+  /* buffers may outlive the pool */
+  GNUNET_buffer_pool_destroy (pool);
+  if (GNUNET_buffer_get_data (a)[99] != 42)
+    return 11;
+  GNUNET_buffer_release (a);
+  GNUNET_buffer_release (c);
+  return 0;
+}
+
+/**
+ * Allocate and release many buffers so that slabs are
+ * created and given back (several times).
+ */
+static int
+testShrink ()
+{
+  struct GNUNET_BufferPool *pool;
+  struct GNUNET_Buffer *bufs[64];
+  unsigned int round;
+  unsigned int i;
+
+  pool = GNUNET_buffer_pool_create (0);
+  for (round = 0; round < 4; round++)
+    {
+      for (i = 0; i < 64; i++)
+        {
+          bufs[i] = GNUNET_buffer_pool_get (pool,
+                                            (i % 2) ? 1000 : 60000,
+                                            GNUNET_NO);
+          if (bufs[i] == NULL)
+            return 20;
+          memset (GNUNET_buffer_get_data (bufs[i]), i,
+                  GNUNET_buffer_get_size (bufs[i]));
+        }
+      for (i = 0; i < 64; i++)
+        if (GNUNET_buffer_get_data (bufs[i])[999] != (char) i)
+          return 21;
+      /* release in an order that empties the slabs one by one */
+      for (i = 0; i < 64; i += 2)
+        GNUNET_buffer_release (bufs[i]);
+      for (i = 1; i < 64; i += 2)
+        GNUNET_buffer_release (bufs[i]);
+      if (GNUNET_buffer_pool_get_usage (pool) != 0)
+        return 22;
+    }
+  GNUNET_buffer_pool_destroy (pool);
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int ret;
+  ret = test ();
+  if (ret == 0)
+    ret = testShrink ();
+  if (ret != 0)
+    fprintf (stderr, "ERROR %d.\n", ret);
+  return ret;
+}
+
+/* end of bufferpooltest.c */
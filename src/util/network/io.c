@@ -27,9 +27,18 @@
 #include "platform.h"
 #include "gnunet_util_network.h"
 #include "network.h"
+#ifndef MINGW
+#include <poll.h>
+#endif
 
 #define DEBUG_IO GNUNET_NO
 
+/**
+ * How many datagrams do we pass to the kernel per
+ * system call (at most)?
+ */
+#define MAX_DATAGRAMS 64
+
 #ifndef MINGW
 static struct GNUNET_SignalHandlerContext *sctx;
 
@@ -661,6 +670,246 @@ GNUNET_socket_send_to (struct GNUNET_SocketHandle *s,
   return GNUNET_YES;
 }
 
+/**
+ * Flags for sending or receiving datagrams on the socket.
+ * The datagram functions never block in the system call
+ * (they wait with wait_for_socket instead).
+ */
+static int
+datagram_flags (struct GNUNET_SocketHandle *s, GNUNET_NC_KIND nc)
+{
+  int flags;
+
+  flags = 0;
+#if SOLARIS
+  flags |= MSG_DONTWAIT;
+#elif OSX || FREEBSD
+  socket_set_nosigpipe (s, 0 == (nc & GNUNET_NC_IGNORE_INT));
+  flags |= MSG_DONTWAIT;
+#elif CYGWIN
+  flags |= MSG_NOSIGNAL;
+#elif LINUX
+  flags |= MSG_DONTWAIT;
+  flags |= MSG_NOSIGNAL;
+#endif
+  return flags;
+}
+
+/**
+ * Wait until the socket is ready for reading (or writing).
+ * Used instead of switching the socket to blocking mode,
+ * which would affect other threads using the same socket.
+ */
+static void
+wait_for_socket (struct GNUNET_SocketHandle *s, int write)
+{
+#ifndef MINGW
+  struct pollfd pfd;
+
+  pfd.fd = s->handle;
+  pfd.events = write ? POLLOUT : POLLIN;
+  pfd.revents = 0;
+  poll (&pfd, 1, -1);
+#else
+  fd_set set;
+
+  FD_ZERO (&set);
+  FD_SET (s->handle, &set);
+  SELECT (s->handle + 1, write ? NULL : &set, write ? &set : NULL, NULL,
+          NULL);
+#endif
+}
+
+/**
+ * Receive up to count datagrams.  In blocking mode, only
+ * the first datagram is waited for.  The mode of the socket
+ * is not changed (on systems without MSG_DONTWAIT it must
+ * be non-blocking).
+ */
+int
+GNUNET_socket_recv_from_multiple (struct GNUNET_SocketHandle *s,
+                                  GNUNET_NC_KIND nc,
+                                  struct GNUNET_Datagram *dgrams,
+                                  unsigned int count, unsigned int *received)
+{
+#if HAVE_RECVMMSG
+  struct mmsghdr msgs[MAX_DATAGRAMS];
+  struct iovec iov[MAX_DATAGRAMS];
+  unsigned int n;
+#else
+  socklen_t fromlen;
+#endif
+  unsigned int pos;
+  int flags;
+  int ret;
+  int i;
+
+  flags = datagram_flags (s, nc);
+  pos = 0;
+  while (pos < count)
+    {
+#if HAVE_RECVMMSG
+      n = count - pos;
+      if (n > MAX_DATAGRAMS)
+        n = MAX_DATAGRAMS;
+      memset (msgs, 0, n * sizeof (struct mmsghdr));
+      for (i = 0; i < n; i++)
+        {
+          iov[i].iov_base = dgrams[pos + i].data;
+          iov[i].iov_len = dgrams[pos + i].size;
+          msgs[i].msg_hdr.msg_iov = &iov[i];
+          msgs[i].msg_hdr.msg_iovlen = 1;
+          msgs[i].msg_hdr.msg_name = dgrams[pos + i].addr;
+          msgs[i].msg_hdr.msg_namelen = dgrams[pos + i].addr_len;
+        }
+      ret = recvmmsg (s->handle, msgs, n, flags, NULL);
+      for (i = 0; i < ret; i++)
+        {
+          dgrams[pos + i].size = msgs[i].msg_len;
+          dgrams[pos + i].addr_len = msgs[i].msg_hdr.msg_namelen;
+        }
+#else
+      fromlen = dgrams[pos].addr_len;
+      ret = RECVFROM (s->handle,
+                      dgrams[pos].data,
+                      dgrams[pos].size,
+                      flags, (struct sockaddr *) dgrams[pos].addr, &fromlen);
+      if (ret != -1)
+        {
+          dgrams[pos].size = ret;
+          dgrams[pos].addr_len = fromlen;
+          ret = 1;
+        }
+#endif
+      if (ret == -1)
+        {
+          if ((errno == EINTR) && (0 != (nc & GNUNET_NC_IGNORE_INT)))
+            continue;
+          if ((errno == EWOULDBLOCK) && (pos == 0) &&
+              (0 != (nc & GNUNET_NC_BLOCKING)))
+            {
+              wait_for_socket (s, GNUNET_NO);
+              continue;
+            }
+          if ((errno == EINTR) || (errno == EWOULDBLOCK))
+            {
+              *received = pos;
+              return (pos == 0) ? GNUNET_NO : GNUNET_YES;
+            }
+          GNUNET_GE_LOG_STRERROR (s->ectx,
+                                  GNUNET_GE_ERROR | GNUNET_GE_USER |
+                                  GNUNET_GE_BULK | GNUNET_GE_DEVELOPER,
+                                  "recvfrom");
+          *received = pos;
+          return GNUNET_SYSERR;
+        }
+      if (s->mon != NULL)
+        for (i = 0; i < ret; i++)
+          GNUNET_network_monitor_notify_transmission (s->mon,
+                                                      GNUNET_ND_DOWNLOAD,
+                                                      dgrams[pos + i].size);
+      pos += ret;
+      if (0 != (nc & GNUNET_NC_BLOCKING))
+        break;
+#if HAVE_RECVMMSG
+      if (ret < n)
+        break;                  /* socket drained */
+#endif
+    }
+  *received = pos;
+  return GNUNET_YES;
+}
+
+/**
+ * Send the given datagrams.  If a datagram can not be sent,
+ * GNUNET_SYSERR is returned and dgrams[*sent] is the datagram
+ * that failed; the caller may skip it and try the rest.  The
+ * mode of the socket is not changed (on systems without
+ * MSG_DONTWAIT it must be non-blocking).
+ */
+int
+GNUNET_socket_send_to_multiple (struct GNUNET_SocketHandle *s,
+                                GNUNET_NC_KIND nc,
+                                struct GNUNET_Datagram *dgrams,
+                                unsigned int count, unsigned int *sent)
+{
+#if HAVE_SENDMMSG
+  struct mmsghdr msgs[MAX_DATAGRAMS];
+  struct iovec iov[MAX_DATAGRAMS];
+  unsigned int n;
+#endif
+  unsigned int pos;
+  int flags;
+  int ret;
+  int i;
+
+  flags = datagram_flags (s, nc);
+  pos = 0;
+  while (pos < count)
+    {
+#if HAVE_SENDMMSG
+      n = count - pos;
+      if (n > MAX_DATAGRAMS)
+        n = MAX_DATAGRAMS;
+      memset (msgs, 0, n * sizeof (struct mmsghdr));
+      for (i = 0; i < n; i++)
+        {
+          iov[i].iov_base = dgrams[pos + i].data;
+          iov[i].iov_len = dgrams[pos + i].size;
+          msgs[i].msg_hdr.msg_iov = &iov[i];
+          msgs[i].msg_hdr.msg_iovlen = 1;
+          msgs[i].msg_hdr.msg_name = dgrams[pos + i].addr;
+          msgs[i].msg_hdr.msg_namelen = dgrams[pos + i].addr_len;
+        }
+      ret = sendmmsg (s->handle, msgs, n, flags);
+#else
+      ret = SENDTO (s->handle,
+                    dgrams[pos].data,
+                    dgrams[pos].size,
+                    flags,
+                    (const struct sockaddr *) dgrams[pos].addr,
+                    dgrams[pos].addr_len);
+      if (ret != -1)
+        ret = 1;
+#endif
+      if (ret == -1)
+        {
+          if ((errno == EINTR) && (0 != (nc & GNUNET_NC_IGNORE_INT)))
+            continue;
+          if (errno == EINTR)
+            {
+              *sent = pos;
+              return GNUNET_YES;
+            }
+          if (errno == EWOULDBLOCK)
+            {
+              if (0 != (nc & GNUNET_NC_BLOCKING))
+                {
+                  wait_for_socket (s, GNUNET_YES);
+                  continue;
+                }
+              *sent = pos;
+              return (pos == 0) ? GNUNET_NO : GNUNET_YES;
+            }
+#if DEBUG_IO
+          GNUNET_GE_LOG_STRERROR (s->ectx,
+                                  GNUNET_GE_DEBUG | GNUNET_GE_USER |
+                                  GNUNET_GE_REQUEST, "sendto");
+#endif
+          *sent = pos;
+          return GNUNET_SYSERR;
+        }
+      if (s->mon != NULL)
+        for (i = 0; i < ret; i++)
+          GNUNET_network_monitor_notify_transmission (s->mon,
+                                                      GNUNET_ND_UPLOAD,
+                                                      dgrams[pos + i].size);
+      pos += ret;
+    }
+  *sent = pos;
+  return GNUNET_YES;
+}
+
 /**
  * Check if socket is valid
  * @return 1 if valid, 0 otherwise
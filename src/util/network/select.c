@@ -27,13 +27,47 @@
 #include "platform.h"
 #include "gnunet_util.h"
 #include "network.h"
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #define DEBUG_SELECT GNUNET_NO
 
+/**
+ * How many epoll events do we process per wakeup (at most)?
+ */
+#define MAX_EPOLL_EVENTS 256
+
+/**
+ * Bits for Session.ready (epoll backend only).
+ */
+#define READY_READ 1
+#define READY_WRITE 2
+
+/**
+ * Minimum size of the read buffer of a session.
+ */
+#define READ_BUFFER_SIZE 4096
+
+/**
+ * How many datagrams does a UDP select receive per wakeup
+ * (at most)?  Each needs a buffer of GNUNET_MAX_BUFFER_SIZE.
+ */
+#define UDP_BATCH 16
+
+/**
+ * Use epoll for new select handles (if available)?
+ */
+#if HAVE_SYS_EPOLL_H
+static int use_epoll = GNUNET_YES;
+#else
+static int use_epoll = GNUNET_NO;
+#endif
+
 /**
  * Select Session handle.
  */
-typedef struct
+typedef struct Session
 {
 
   /**
@@ -47,12 +81,22 @@ typedef struct
   void *sock_ctx;
 
   /**
-   * The read buffer.
+   * The read buffer (NULL while nothing is buffered).
+   */
+  struct GNUNET_Buffer *rbuf;
+
+  /**
+   * The write buffer (NULL while nothing is queued).
+   */
+  struct GNUNET_Buffer *wbuf;
+
+  /**
+   * Data of the read buffer.
    */
   char *rbuff;
 
   /**
-   * The write buffer.
+   * Data of the write buffer.
    */
   char *wbuff;
 
@@ -83,6 +127,12 @@ typedef struct
    */
   unsigned int pos;
 
+  /**
+   * Start of the first message in the read buffer that
+   * has not yet been processed.
+   */
+  unsigned int rpos;
+
   /**
    * Current size of the read buffer.
    */
@@ -103,6 +153,25 @@ typedef struct
    */
   unsigned int wsize;
 
+  /**
+   * epoll backend: READY_READ and/or READY_WRITE if the socket
+   * was reported ready and we have not yet seen a short read
+   * (or write) since then.
+   */
+  int ready;
+
+  /**
+   * epoll backend: is this session in the ready list?
+   */
+  int in_ready;
+
+  /**
+   * epoll backend: ready list (DLL).
+   */
+  struct Session *ready_prev;
+
+  struct Session *ready_next;
+
 } Session;
 
 typedef struct GNUNET_SelectHandle
@@ -167,10 +236,77 @@ typedef struct GNUNET_SelectHandle
 
   unsigned int max_addr_len;
 
+  /**
+   * Maximum number of bytes queued for writing per session
+   * (0 for unlimited).
+   */
   unsigned int memory_quota;
 
   int socket_quota;
 
+  /**
+   * Pool for the read and write buffers of the sessions.
+   */
+  struct GNUNET_BufferPool *pool;
+
+  /**
+   * Buffer holding the message that is currently passed
+   * to the message handler.
+   */
+  struct GNUNET_Buffer *current;
+
+  /**
+   * Use the epoll backend?
+   */
+  int use_epoll;
+
+  /**
+   * epoll backend: the epoll handle.
+   */
+  int epoll_fd;
+
+  /**
+   * epoll backend: sessions indexed by socket handle.
+   */
+  Session **fdmap;
+
+  unsigned int fdmapSize;
+
+  /**
+   * epoll backend: head of the list of sessions that
+   * have work to do (read or write) without waiting.
+   */
+  Session *ready_head;
+
+  Session *ready_tail;
+
+  /**
+   * epoll backend: when do we need to look for sessions that
+   * timed out next?  (0 for "as soon as possible", -1 for never)
+   */
+  GNUNET_CronTime next_timeout_check;
+
+  /**
+   * epoll backend: has the signal pipe been written to
+   * since the select thread last drained it?
+   */
+  int signaled;
+
+  /**
+   * UDP: the datagrams received per wakeup.
+   */
+  struct GNUNET_Datagram dgrams[UDP_BATCH];
+
+  /**
+   * UDP: preallocated buffers for the data of the datagrams.
+   */
+  char *dgram_data;
+
+  /**
+   * UDP: preallocated buffers for the addresses of the datagrams.
+   */
+  char *dgram_addr;
+
 } SelectHandle;
 
 static void
@@ -203,6 +339,129 @@ signalSelect (SelectHandle * sh)
                             GNUNET_GE_BULK, "write");
 }
 
+/**
+ * Add the session to the ready list (epoll backend).
+ * The lock must be held.
+ */
+static void
+readyAdd (SelectHandle * sh, Session * s)
+{
+  if (s->in_ready == GNUNET_YES)
+    return;
+  s->in_ready = GNUNET_YES;
+  s->ready_next = NULL;
+  s->ready_prev = sh->ready_tail;
+  if (sh->ready_tail == NULL)
+    sh->ready_head = s;
+  else
+    sh->ready_tail->ready_next = s;
+  sh->ready_tail = s;
+}
+
+/**
+ * Remove the session from the ready list (epoll backend).
+ * The lock must be held.
+ */
+static void
+readyRemove (SelectHandle * sh, Session * s)
+{
+  if (s->in_ready != GNUNET_YES)
+    return;
+  s->in_ready = GNUNET_NO;
+  if (s->ready_prev == NULL)
+    sh->ready_head = s->ready_next;
+  else
+    s->ready_prev->ready_next = s->ready_next;
+  if (s->ready_next == NULL)
+    sh->ready_tail = s->ready_prev;
+  else
+    s->ready_next->ready_prev = s->ready_prev;
+  s->ready_prev = NULL;
+  s->ready_next = NULL;
+}
+
+/**
+ * Can we read or write on this session right now
+ * (epoll backend)?
+ */
+static int
+hasWork (Session * s)
+{
+  if ((0 != (s->ready & READY_READ)) && (s->no_read != GNUNET_YES))
+    return GNUNET_YES;
+  if ((0 != (s->ready & READY_WRITE)) && (s->wapos > s->wspos))
+    return GNUNET_YES;
+  return GNUNET_NO;
+}
+
+#if HAVE_SYS_EPOLL_H
+/**
+ * Register a handle with epoll.
+ *
+ * @param edge use edge-triggered notification
+ * @param events EPOLLIN and/or EPOLLOUT
+ */
+static int
+epollWatch (SelectHandle * sh, int fd, unsigned int events, int edge)
+{
+  struct epoll_event ev;
+
+  memset (&ev, 0, sizeof (struct epoll_event));
+  ev.events = events;
+  if (edge == GNUNET_YES)
+    ev.events |= EPOLLET;
+  ev.data.fd = fd;
+  if (0 != epoll_ctl (sh->epoll_fd, EPOLL_CTL_ADD, fd, &ev))
+    {
+      GNUNET_GE_LOG_STRERROR (sh->ectx,
+                              GNUNET_GE_ERROR | GNUNET_GE_ADMIN |
+                              GNUNET_GE_BULK, "epoll_ctl");
+      return GNUNET_SYSERR;
+    }
+  return GNUNET_OK;
+}
+
+/**
+ * Remove a handle from epoll.
+ */
+static void
+epollUnwatch (SelectHandle * sh, int fd)
+{
+  struct epoll_event ev;
+
+  /* old kernels require a non-NULL event */
+  memset (&ev, 0, sizeof (struct epoll_event));
+  epoll_ctl (sh->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+}
+#endif
+
+/**
+ * Add a session to the set of sessions managed
+ * by this select.  The lock must be held.
+ */
+static void
+addSession (SelectHandle * sh, Session * session)
+{
+  int fd;
+
+  if (sh->sessionArrayLength == sh->sessionCount)
+    GNUNET_array_grow (sh->sessions,
+                       sh->sessionArrayLength, sh->sessionArrayLength + 4);
+  sh->sessions[sh->sessionCount++] = session;
+  if (session->timeout != 0)
+    sh->next_timeout_check = 0;
+  if (sh->use_epoll != GNUNET_YES)
+    return;
+  fd = session->sock->handle;
+  if (fd >= sh->fdmapSize)
+    GNUNET_array_grow (sh->fdmap, sh->fdmapSize,
+                       GNUNET_MAX (fd + 1, 2 * sh->fdmapSize));
+  sh->fdmap[fd] = session;
+#if HAVE_SYS_EPOLL_H
+  epollWatch (sh, fd, EPOLLIN | EPOLLOUT, GNUNET_YES);
+#endif
+}
+
 /**
  * Destroy the given session by closing the socket,
  * releasing the buffers and removing it from the
@@ -248,16 +507,65 @@ destroySession (SelectHandle * sh, Session * s)
   if (sh->sessionCount * 2 < sh->sessionArrayLength)
     GNUNET_array_grow (sh->sessions, sh->sessionArrayLength,
                        sh->sessionCount);
+  if (sh->use_epoll == GNUNET_YES)
+    {
+      readyRemove (sh, s);
+      if ((s->sock->handle < sh->fdmapSize) &&
+          (sh->fdmap[s->sock->handle] == s))
+        sh->fdmap[s->sock->handle] = NULL;
+#if HAVE_SYS_EPOLL_H
+      epollUnwatch (sh, s->sock->handle);
+#endif
+    }
   GNUNET_mutex_unlock (sh->lock);
   sh->ch (sh->ch_cls, sh, s->sock, s->sock_ctx);
   GNUNET_mutex_lock (sh->lock);
   GNUNET_socket_destroy (s->sock);
   sh->socket_quota++;
-  GNUNET_array_grow (s->rbuff, s->rsize, 0);
-  GNUNET_array_grow (s->wbuff, s->wsize, 0);
+  if (s->rbuf != NULL)
+    GNUNET_buffer_release (s->rbuf);
+  if (s->wbuf != NULL)
+    GNUNET_buffer_release (s->wbuf);
   GNUNET_free (s);
 }
 
+/**
+ * Make sure that the unprocessed data in the read buffer of
+ * the session starts at offset zero and that the buffer can
+ * hold at least size bytes.  If a message handler still holds
+ * a reference to the old buffer, the unprocessed data is moved
+ * to a fresh buffer instead of being moved in place.
+ */
+static void
+prepareReadBuffer (SelectHandle * sh, Session * s, unsigned int size)
+{
+  struct GNUNET_Buffer *buf;
+  unsigned int have;
+
+  have = s->pos - s->rpos;
+  if ((s->rbuf != NULL) &&
+      (s->rsize >= size) && (GNUNET_NO == GNUNET_buffer_test_shared (s->rbuf)))
+    {
+      if (s->rpos > 0)
+        memmove (s->rbuff, &s->rbuff[s->rpos], have);
+    }
+  else
+    {
+      buf = GNUNET_buffer_pool_get (sh->pool,
+                                    GNUNET_MAX (size, READ_BUFFER_SIZE),
+                                    GNUNET_YES);
+      if (have > 0)
+        memcpy (GNUNET_buffer_get_data (buf), &s->rbuff[s->rpos], have);
+      if (s->rbuf != NULL)
+        GNUNET_buffer_release (s->rbuf);
+      s->rbuf = buf;
+      s->rbuff = GNUNET_buffer_get_data (buf);
+      s->rsize = GNUNET_buffer_get_size (buf);
+    }
+  s->rpos = 0;
+  s->pos = have;
+}
+
 /**
  * The socket of a session has data waiting, read and
  * process!
@@ -272,34 +580,39 @@ readAndProcess (SelectHandle * sh, Session * session)
   const GNUNET_MessageHeader *pack;
   int ret;
   size_t recvd;
+  size_t want;
   unsigned short len;
 
-  if (session->rsize == session->pos)
-    {
-      /* read buffer too small, grow */
-      GNUNET_array_grow (session->rbuff, session->rsize,
-                         session->rsize + 1024);
-    }
+  if ((session->rbuf == NULL) || (session->rsize == session->pos))
+    prepareReadBuffer (sh, session, READ_BUFFER_SIZE);
+  want = session->rsize - session->pos;
   ret = GNUNET_socket_recv (session->sock,
                             GNUNET_NC_NONBLOCKING | GNUNET_NC_IGNORE_INT,
-                            &session->rbuff[session->pos],
-                            session->rsize - session->pos, &recvd);
+                            &session->rbuff[session->pos], want, &recvd);
 #if DEBUG_SELECT
   GNUNET_GE_LOG (sh->ectx,
                  GNUNET_GE_DEBUG | GNUNET_GE_DEVELOPER | GNUNET_GE_BULK,
                  "Receiving from session %p of select %p return %d-%u (%s).\n",
                  sh, session, ret, recvd, STRERROR (errno));
 #endif
+  if (ret == GNUNET_NO)
+    {
+      /* nothing to read after all */
+      session->ready &= ~READY_READ;
+      return GNUNET_OK;
+    }
   if (ret != GNUNET_OK)
     {
       destroySession (sh, session);
       return GNUNET_SYSERR;     /* other side closed connection */
     }
+  if (recvd < want)
+    session->ready &= ~READY_READ;      /* drained socket buffer */
   session->pos += recvd;
   while ((sh->shutdown == GNUNET_NO)
-         && (session->pos >= sizeof (GNUNET_MessageHeader)))
+         && (session->pos - session->rpos >= sizeof (GNUNET_MessageHeader)))
     {
-      pack = (const GNUNET_MessageHeader *) &session->rbuff[0];
+      pack = (const GNUNET_MessageHeader *) &session->rbuff[session->rpos];
       len = ntohs (pack->size);
       /* check minimum size */
       if (len < sizeof (GNUNET_MessageHeader))
@@ -311,17 +624,21 @@ readAndProcess (SelectHandle * sh, Session * session)
           destroySession (sh, session);
           return GNUNET_SYSERR;
         }
-      if (len > session->rsize) /* if message larger than read buffer, grow! */
-        GNUNET_array_grow (session->rbuff, session->rsize, len);
-
       /* do we have the entire message? */
-      if (session->pos < len)
-        break;                  /* wait for more */
+      if (session->pos - session->rpos < len)
+        {
+          /* make sure the rest of the message fits */
+          if (session->rpos + len > session->rsize)
+            prepareReadBuffer (sh, session, len);
+          break;                /* wait for more */
+        }
       if (session->locked == 0)
         session->locked = 1;
+      sh->current = session->rbuf;
       GNUNET_mutex_unlock (sh->lock);
-      if (GNUNET_OK != sh->mh (sh->mh_cls,
-                               sh, session->sock, session->sock_ctx, pack))
+      ret = sh->mh (sh->mh_cls, sh, session->sock, session->sock_ctx, pack);
+      sh->current = NULL;
+      if (GNUNET_OK != ret)
         {
           GNUNET_mutex_lock (sh->lock);
           if (session->locked == 1)
@@ -334,13 +651,22 @@ readAndProcess (SelectHandle * sh, Session * session)
         {
           session->locked = 0;
           destroySession (sh, session);
-          return GNUNET_OK;
+          return GNUNET_SYSERR;
         }
       if (session->locked == 1)
         session->locked = 0;
-      /* shrink buffer adequately */
-      memmove (&session->rbuff[0], &session->rbuff[len], session->pos - len);
-      session->pos -= len;
+      session->rpos += len;
+    }
+  if ((session->rpos == session->pos) && (recvd < want))
+    {
+      /* socket drained and all messages processed; do not
+         hold on to a buffer while the session is idle */
+      GNUNET_buffer_release (session->rbuf);
+      session->rbuf = NULL;
+      session->rbuff = NULL;
+      session->rsize = 0;
+      session->rpos = 0;
+      session->pos = 0;
     }
   session->lastUse = GNUNET_get_time ();
   return GNUNET_OK;
@@ -404,6 +730,8 @@ writeAndProcess (SelectHandle * sh, Session * session)
               destroySession (sh, session);
               return GNUNET_SYSERR;
             }
+          if (size < session->wapos - session->wspos)
+            session->ready &= ~READY_WRITE;     /* socket buffer full */
           session->wspos += size;
           if (session->wspos == session->wapos)
             {
@@ -411,18 +739,22 @@ writeAndProcess (SelectHandle * sh, Session * session)
               session->wspos = 0;
               session->wapos = 0;
               session->no_read = GNUNET_NO;
-              if (session->wsize > sh->memory_quota)
-                {
-                  /* if we went over quota before because of
-                     force, use this opportunity to shrink
-                     back to size! */
-                  GNUNET_array_grow (session->wbuff, session->wsize,
-                                     sh->memory_quota);
-                }
+              /* return the buffer to the pool while we
+                 have nothing to send */
+              GNUNET_buffer_release (session->wbuf);
+              session->wbuf = NULL;
+              session->wbuff = NULL;
+              session->wsize = 0;
             }
           break;
         }
       GNUNET_GE_ASSERT (sh->ectx, ret == GNUNET_NO);
+      if (sh->use_epoll == GNUNET_YES)
+        {
+          /* wait for the next EPOLLOUT */
+          session->ready &= ~READY_WRITE;
+          break;
+        }
       /* this should only happen under Win9x because
          of a bug in the socket implementation (KB177346).
          Let's sleep and try again. */
@@ -432,6 +764,192 @@ writeAndProcess (SelectHandle * sh, Session * session)
   return GNUNET_OK;
 }
 
+/**
+ * The listen socket of a TCP select is ready, accept
+ * the new connection.  The lock must be held.
+ *
+ * @return GNUNET_OK on success, GNUNET_NO if the
+ *   rest of this round should be skipped, GNUNET_SYSERR
+ *   if the select thread should terminate
+ */
+static int
+acceptConnection (SelectHandle * sh, char *clientAddr)
+{
+  socklen_t lenOfIncomingAddr;
+  int s;
+  void *sctx;
+  SocketHandle *sock;
+  Session *session;
+
+  lenOfIncomingAddr = sh->max_addr_len;
+  memset (clientAddr, 0, lenOfIncomingAddr);
+  /* make sure this is non-blocking */
+  GNUNET_socket_set_blocking (sh->listen_sock, GNUNET_NO);
+  s = ACCEPT (sh->listen_sock->handle,
+              (struct sockaddr *) clientAddr, &lenOfIncomingAddr);
+  if (s == -1)
+    {
+      GNUNET_GE_LOG_STRERROR (sh->ectx,
+                              GNUNET_GE_WARNING | GNUNET_GE_ADMIN
+                              | GNUNET_GE_BULK, "accept");
+      GNUNET_GE_LOG (sh->ectx,
+                     GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
+                     GNUNET_GE_BULK,
+                     "Select %s failed to accept!\n", sh->description);
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        return GNUNET_NO;       /* not good, but not fatal either */
+      return GNUNET_SYSERR;
+    }
+  if (sh->socket_quota <= 0)
+    {
+      SHUTDOWN (s, SHUT_WR);
+      if (0 != CLOSE (s))
+        GNUNET_GE_LOG_STRERROR (sh->ectx,
+                                GNUNET_GE_WARNING |
+                                GNUNET_GE_ADMIN | GNUNET_GE_BULK, "close");
+      return GNUNET_NO;
+    }
+  sh->socket_quota--;
+#if DEBUG_SELECT
+  GNUNET_GE_LOG (sh->ectx,
+                 GNUNET_GE_DEBUG | GNUNET_GE_DEVELOPER |
+                 GNUNET_GE_BULK,
+                 "Select %p is accepting connection: %d\n", sh, s);
+#endif
+  sock = GNUNET_socket_create (sh->ectx, sh->load_monitor, s);
+  GNUNET_mutex_unlock (sh->lock);
+  sctx = sh->ah (sh->ah_cls, sh, sock, clientAddr, lenOfIncomingAddr);
+  GNUNET_mutex_lock (sh->lock);
+#if DEBUG_SELECT
+  GNUNET_GE_LOG (sh->ectx,
+                 GNUNET_GE_DEBUG | GNUNET_GE_DEVELOPER |
+                 GNUNET_GE_BULK,
+                 "Select %p is accepting connection: %p\n", sh, sctx);
+#endif
+  if (sctx == NULL)
+    {
+      GNUNET_socket_destroy (sock);
+      sh->socket_quota++;
+    }
+  else
+    {
+      session = GNUNET_malloc (sizeof (Session));
+      memset (session, 0, sizeof (Session));
+      session->timeout = sh->timeout;
+      session->sock = sock;
+      session->sock_ctx = sctx;
+      session->lastUse = GNUNET_get_time ();
+      addSession (sh, session);
+    }
+  return GNUNET_OK;
+}
+
+/**
+ * The socket of a UDP select is ready, receive up to
+ * UDP_BATCH datagrams into the preallocated buffers and
+ * process them.  The lock must be held.
+ */
+static void
+receiveDatagrams (SelectHandle * sh)
+{
+  const GNUNET_MessageHeader *hdr;
+  struct GNUNET_Datagram *dgram;
+  struct GNUNET_Buffer *buf;
+  unsigned int count;
+  unsigned int i;
+  void *sctx;
+  int ret;
+
+  for (i = 0; i < UDP_BATCH; i++)
+    {
+      sh->dgrams[i].data = &sh->dgram_data[i * GNUNET_MAX_BUFFER_SIZE];
+      sh->dgrams[i].size = GNUNET_MAX_BUFFER_SIZE;
+      sh->dgrams[i].addr = &sh->dgram_addr[i * sh->max_addr_len];
+      sh->dgrams[i].addr_len = sh->max_addr_len;
+    }
+  count = 0;
+  ret = GNUNET_socket_recv_from_multiple (sh->listen_sock,
+                                          GNUNET_NC_NONBLOCKING,
+                                          sh->dgrams, UDP_BATCH, &count);
+#if DEBUG_SELECT
+  GNUNET_GE_LOG (sh->ectx,
+                 GNUNET_GE_DEBUG | GNUNET_GE_DEVELOPER |
+                 GNUNET_GE_BULK,
+                 "Select %p received %u datagrams from UDP\n", sh, count);
+#endif
+  for (i = 0; i < count; i++)
+    {
+      /* validate msg format! (this also skips empty datagrams,
+         see report on bug-gnunet, 5/11/6) */
+      dgram = &sh->dgrams[i];
+      hdr = (const GNUNET_MessageHeader *) dgram->data;
+      if ((dgram->size < sizeof (GNUNET_MessageHeader)) ||
+          (ntohs (hdr->size) != dgram->size))
+        {
+#if DEBUG_SELECT
+          GNUNET_GE_BREAK (sh->ectx,
+                           dgram->size >= sizeof (GNUNET_MessageHeader));
+          GNUNET_GE_BREAK (sh->ectx,
+                           (dgram->size >= sizeof (GNUNET_MessageHeader))
+                           && (ntohs (hdr->size) == dgram->size));
+#endif
+          continue;
+        }
+      GNUNET_mutex_unlock (sh->lock);
+      sctx = sh->ah (sh->ah_cls, sh, NULL, dgram->addr, dgram->addr_len);
+      GNUNET_mutex_lock (sh->lock);
+      if (sctx == NULL)
+        {
+#if DEBUG_SELECT
+          GNUNET_GE_LOG (sh->ectx,
+                         GNUNET_GE_DEBUG | GNUNET_GE_DEVELOPER |
+                         GNUNET_GE_BULK,
+                         "Error in select %p -- connection refused\n", sh);
+#endif
+          continue;
+        }
+#if DEBUG_SELECT
+      GNUNET_GE_LOG (sh->ectx,
+                     GNUNET_GE_DEBUG | GNUNET_GE_DEVELOPER |
+                     GNUNET_GE_BULK,
+                     "Select %p is passing %u bytes from UDP to handler\n",
+                     sh, dgram->size);
+#endif
+      /* handlers may keep the message; copy it so that they
+         do not pin a receive buffer of the maximum size */
+      buf = GNUNET_buffer_pool_get (sh->pool, dgram->size, GNUNET_YES);
+      memcpy (GNUNET_buffer_get_data (buf), dgram->data, dgram->size);
+      sh->current = buf;
+      sh->mh (sh->mh_cls, sh, NULL, sctx,
+              (const GNUNET_MessageHeader *) GNUNET_buffer_get_data (buf));
+      sh->current = NULL;
+      sh->ch (sh->ch_cls, sh, NULL, sctx);
+      GNUNET_buffer_release (buf);
+    }
+  if (ret == GNUNET_SYSERR)
+    GNUNET_socket_close (sh->listen_sock);
+}
+
+/**
+ * Eat the signals written to the signal pipe.
+ */
+static void
+drainSignalPipe (SelectHandle * sh)
+{
+  /* allow reading multiple signals in one go in case we get many
+     in one shot... */
+#define MAXSIG_BUF 128
+  char buf[MAXSIG_BUF];
+  sh->signaled = GNUNET_NO;
+  /* just a signal to refresh sets, eat and continue */
+  if (0 >= READ (sh->signal_pipe[0], buf, MAXSIG_BUF))
+    {
+      GNUNET_GE_LOG_STRERROR (sh->ectx,
+                              GNUNET_GE_WARNING | GNUNET_GE_USER |
+                              GNUNET_GE_BULK, "read");
+    }
+}
+
 /**
  * Thread that selects until it is signaled to shut down.
  */
@@ -446,15 +964,11 @@ selectThread (void *ctx)
   fd_set errorSet;
   fd_set writeSet;
   struct stat buf;
-  socklen_t lenOfIncomingAddr;
   int i;
   int max;
   int ret;
-  int s;
-  void *sctx;
   SocketHandle *sock;
   Session *session;
-  size_t size;
   int old_errno;
   struct timeval tv;
 
@@ -570,227 +1084,24 @@ selectThread (void *ctx)
             }
           continue;
         }
-      if (sh->is_udp == GNUNET_NO)
+      if ((sh->listen_sock != NULL) &&
+          (FD_ISSET (sh->listen_sock->handle, &readSet)))
         {
-          if ((sh->listen_sock != NULL) &&
-              (FD_ISSET (sh->listen_sock->handle, &readSet)))
+          if (sh->is_udp == GNUNET_NO)
             {
-              lenOfIncomingAddr = sh->max_addr_len;
-              memset (clientAddr, 0, lenOfIncomingAddr);
-              /* make sure this is non-blocking */
-              GNUNET_socket_set_blocking (sh->listen_sock, GNUNET_NO);
-              s = ACCEPT (sh->listen_sock->handle,
-                          (struct sockaddr *) clientAddr, &lenOfIncomingAddr);
-              if (s == -1)
-                {
-                  GNUNET_GE_LOG_STRERROR (sh->ectx,
-                                          GNUNET_GE_WARNING | GNUNET_GE_ADMIN
-                                          | GNUNET_GE_BULK, "accept");
-                  GNUNET_GE_LOG (sh->ectx,
-                                 GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
-                                 GNUNET_GE_BULK,
-                                 "Select %s failed to accept!\n",
-                                 sh->description);
-                  if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-                    continue;   /* not good, but not fatal either */
-                  break;
-                }
-              if (sh->socket_quota <= 0)
-                {
-                  SHUTDOWN (s, SHUT_WR);
-                  if (0 != CLOSE (s))
-                    GNUNET_GE_LOG_STRERROR (sh->ectx,
-                                            GNUNET_GE_WARNING |
-                                            GNUNET_GE_ADMIN | GNUNET_GE_BULK,
-                                            "close");
-                  s = -1;
-                  continue;
-                }
-              sh->socket_quota--;
-#if DEBUG_SELECT
-              GNUNET_GE_LOG (sh->ectx,
-                             GNUNET_GE_DEBUG | GNUNET_GE_DEVELOPER |
-                             GNUNET_GE_BULK,
-                             "Select %p is accepting connection: %d\n", sh,
-                             s);
-#endif
-              sock = GNUNET_socket_create (sh->ectx, sh->load_monitor, s);
-              GNUNET_mutex_unlock (sh->lock);
-              sctx = sh->ah (sh->ah_cls,
-                             sh, sock, clientAddr, lenOfIncomingAddr);
-              GNUNET_mutex_lock (sh->lock);
-#if DEBUG_SELECT
-              GNUNET_GE_LOG (sh->ectx,
-                             GNUNET_GE_DEBUG | GNUNET_GE_DEVELOPER |
-                             GNUNET_GE_BULK,
-                             "Select %p is accepting connection: %p\n", sh,
-                             sctx);
-#endif
-              if (sctx == NULL)
-                {
-                  GNUNET_socket_destroy (sock);
-                  sh->socket_quota++;
-                }
-              else
-                {
-                  session = GNUNET_malloc (sizeof (Session));
-                  memset (session, 0, sizeof (Session));
-                  session->timeout = sh->timeout;
-                  session->sock = sock;
-                  session->sock_ctx = sctx;
-                  session->lastUse = GNUNET_get_time ();
-                  if (sh->sessionArrayLength == sh->sessionCount)
-                    GNUNET_array_grow (sh->sessions,
-                                       sh->sessionArrayLength,
-                                       sh->sessionArrayLength + 4);
-                  sh->sessions[sh->sessionCount++] = session;
-                }
+              ret = acceptConnection (sh, clientAddr);
+              if (ret == GNUNET_SYSERR)
+                break;
+              if (ret == GNUNET_NO)
+                continue;
             }
-        }
-      else
-        {                       /* is_udp == GNUNET_YES */
-          if ((sh->listen_sock != NULL) &&
-              (FD_ISSET (sh->listen_sock->handle, &readSet)))
-            {
-              int pending;
-              int udp_sock;
-              int error;
-              socklen_t optlen;
-
-              udp_sock = sh->listen_sock->handle;
-              lenOfIncomingAddr = sh->max_addr_len;
-              memset (clientAddr, 0, lenOfIncomingAddr);
-              pending = 0;
-              optlen = sizeof (pending);
-#ifdef OSX
-              error = GETSOCKOPT (udp_sock,
-                                  SOL_SOCKET, SO_NREAD, &pending, &optlen);
-#elif MINGW
-              error = ioctlsocket (udp_sock, FIONREAD, &pending);
-#else
-              error = ioctl (udp_sock, FIONREAD, &pending);
-#endif
-              if ((error != 0) || (optlen != sizeof (pending)))
-                {
-                  GNUNET_GE_LOG_STRERROR (sh->ectx,
-                                          GNUNET_GE_ERROR | GNUNET_GE_ADMIN |
-                                          GNUNET_GE_BULK, "ioctl");
-                  pending = 65535;      /* max */
-                }
-#if DEBUG_SELECT
-              GNUNET_GE_LOG (sh->ectx,
-                             GNUNET_GE_DEBUG | GNUNET_GE_DEVELOPER |
-                             GNUNET_GE_BULK,
-                             "Select %p is preparing to receive %u bytes from UDP\n",
-                             sh, pending);
-#endif
-              GNUNET_GE_ASSERT (sh->ectx, pending >= 0);
-              if (pending >= 65536)
-                pending = 65536;
-              if (pending == 0)
-                {
-                  /* maybe empty UDP packet was sent (see report on bug-gnunet,
-                     5/11/6; read 0 bytes from UDP just to kill potential empty packet! */
-                  GNUNET_socket_recv_from (sh->listen_sock,
-                                           GNUNET_NC_NONBLOCKING,
-                                           NULL,
-                                           0, &size, clientAddr,
-                                           &lenOfIncomingAddr);
-                }
-              else
-                {
-                  char *msg;
-
-                  msg = GNUNET_malloc (pending);
-                  size = 0;
-                  ret = GNUNET_socket_recv_from (sh->listen_sock,
-                                                 GNUNET_NC_NONBLOCKING,
-                                                 msg,
-                                                 pending,
-                                                 &size,
-                                                 clientAddr,
-                                                 &lenOfIncomingAddr);
-                  if (ret == GNUNET_SYSERR)
-                    {
-                      GNUNET_socket_close (sh->listen_sock);
-                    }
-                  else if (ret == GNUNET_OK)
-                    {
-                      /* validate msg format! */
-                      const GNUNET_MessageHeader *hdr;
-
-                      /* if size < pending, set pending to size */
-                      if (size < pending)
-                        pending = size;
-                      hdr = (const GNUNET_MessageHeader *) msg;
-                      if ((size == pending) &&
-                          (size >= sizeof (GNUNET_MessageHeader)) &&
-                          (ntohs (hdr->size) == size))
-                        {
-                          void *sctx;
-
-                          GNUNET_mutex_unlock (sh->lock);
-                          sctx = sh->ah (sh->ah_cls,
-                                         sh,
-                                         NULL, clientAddr, lenOfIncomingAddr);
-                          GNUNET_mutex_lock (sh->lock);
-                          if (sctx != NULL)
-                            {
-#if DEBUG_SELECT
-                              GNUNET_GE_LOG (sh->ectx,
-                                             GNUNET_GE_DEBUG |
-                                             GNUNET_GE_DEVELOPER |
-                                             GNUNET_GE_BULK,
-                                             "Select %p is passing %u bytes from UDP to handler\n",
-                                             sh, size);
-#endif
-                              sh->mh (sh->mh_cls, sh, NULL, sctx, hdr);
-                              sh->ch (sh->ch_cls, sh, NULL, sctx);
-                            }
-                          else
-                            {
-#if DEBUG_SELECT
-                              GNUNET_GE_LOG (sh->ectx,
-                                             GNUNET_GE_DEBUG |
-                                             GNUNET_GE_DEVELOPER |
-                                             GNUNET_GE_BULK,
-                                             "Error in select %p -- connection refused\n",
-                                             sh);
-#endif
-                            }
-                        }
-                      else
-                        {
-#if DEBUG_SELECT
-                          GNUNET_GE_BREAK (sh->ectx, size == pending);
-                          GNUNET_GE_BREAK (sh->ectx,
-                                           size >=
-                                           sizeof (GNUNET_MessageHeader));
-                          GNUNET_GE_BREAK (sh->ectx,
-                                           (size >=
-                                            sizeof (GNUNET_MessageHeader))
-                                           && (ntohs (hdr->size) == size));
-#endif
-                        }
-                    }
-                  GNUNET_free (msg);
-                }
-            }
-        }                       /* end UDP processing */
-      if (FD_ISSET (sh->signal_pipe[0], &readSet))
-        {
-          /* allow reading multiple signals in one go in case we get many
-             in one shot... */
-#define MAXSIG_BUF 128
-          char buf[MAXSIG_BUF];
-          /* just a signal to refresh sets, eat and continue */
-          if (0 >= READ (sh->signal_pipe[0], buf, MAXSIG_BUF))
+          else
             {
-              GNUNET_GE_LOG_STRERROR (sh->ectx,
-                                      GNUNET_GE_WARNING | GNUNET_GE_USER |
-                                      GNUNET_GE_BULK, "read");
+              receiveDatagrams (sh);
             }
         }
+      if (FD_ISSET (sh->signal_pipe[0], &readSet))
+        drainSignalPipe (sh);
       now = GNUNET_get_time ();
       for (i = 0; i < sh->sessionCount; i++)
         {
@@ -829,6 +1140,188 @@ selectThread (void *ctx)
   return NULL;
 }
 
+#if HAVE_SYS_EPOLL_H
+/**
+ * Close sessions that timed out and compute when we need
+ * to check again.  Only called when the earliest possible
+ * timeout has been reached, so idle sessions without a
+ * timeout cost nothing.  The lock must be held.
+ */
+static void
+checkTimeouts (SelectHandle * sh)
+{
+  GNUNET_CronTime now;
+  GNUNET_CronTime next;
+  Session *session;
+  int i;
+
+  now = GNUNET_get_time ();
+  if ((sh->next_timeout_check == -1) || (sh->next_timeout_check > now))
+    return;
+  next = -1;
+  for (i = 0; i < sh->sessionCount; i++)
+    {
+      session = sh->sessions[i];
+      if (session->timeout == 0)
+        continue;
+      if (now > session->lastUse + session->timeout)
+        {
+          destroySession (sh, session);
+          i--;
+          continue;
+        }
+      next = GNUNET_MIN (next, session->lastUse + session->timeout + 1);
+    }
+  sh->next_timeout_check = next;
+}
+
+/**
+ * Thread that waits on epoll until it is signaled to shut down.
+ * Sessions are registered edge-triggered; sessions that may have
+ * more data to read or write are kept in the ready list until
+ * a short read (or write) shows that the socket buffer is
+ * drained (or full).
+ */
+static void *
+epollThread (void *ctx)
+{
+  struct GNUNET_SelectHandle *sh = ctx;
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  GNUNET_CronTime now;
+  GNUNET_CronTime timeout;
+  char *clientAddr;
+  Session *session;
+  unsigned int count;
+  int i;
+  int n;
+  int fd;
+  int ret;
+  int old_errno;
+
+  if (sh->max_addr_len != 0)
+    clientAddr = GNUNET_malloc (sh->max_addr_len);
+  else
+    clientAddr = NULL;
+  GNUNET_mutex_lock (sh->lock);
+  while (sh->shutdown == GNUNET_NO)
+    {
+      checkTimeouts (sh);
+      if (sh->ready_head != NULL)
+        {
+          timeout = 0;
+        }
+      else if (sh->next_timeout_check == -1)
+        {
+          timeout = -1;
+        }
+      else
+        {
+          now = GNUNET_get_time ();
+          timeout = (sh->next_timeout_check > now)
+            ? sh->next_timeout_check - now : 0;
+        }
+      GNUNET_mutex_unlock (sh->lock);
+      n = epoll_wait (sh->epoll_fd,
+                      events,
+                      MAX_EPOLL_EVENTS,
+                      (timeout == -1) ? -1 : (int) GNUNET_MIN (timeout,
+                                                               0x7FFFFFFF));
+      old_errno = errno;
+      GNUNET_mutex_lock (sh->lock);
+      if ((n == -1) && ((old_errno == EAGAIN) || (old_errno == EINTR)))
+        continue;
+      if (n == -1)
+        {
+          errno = old_errno;
+          GNUNET_GE_DIE_STRERROR (sh->ectx,
+                                  GNUNET_GE_FATAL | GNUNET_GE_ADMIN |
+                                  GNUNET_GE_USER | GNUNET_GE_IMMEDIATE,
+                                  "epoll_wait");
+        }
+      ret = GNUNET_OK;
+      for (i = 0; (i < n) && (sh->shutdown == GNUNET_NO); i++)
+        {
+          fd = events[i].data.fd;
+          if (fd == sh->signal_pipe[0])
+            {
+              drainSignalPipe (sh);
+              continue;
+            }
+          if ((sh->listen_sock != NULL) && (fd == sh->listen_sock->handle))
+            {
+              if (0 != (events[i].events & (EPOLLERR | EPOLLHUP)))
+                {
+                  GNUNET_GE_LOG (sh->ectx,
+                                 GNUNET_GE_USER | GNUNET_GE_ERROR |
+                                 GNUNET_GE_BULK,
+                                 _
+                                 ("select listen socket for `%s' not valid!\n"),
+                                 sh->description);
+                  epollUnwatch (sh, fd);
+                  GNUNET_socket_destroy (sh->listen_sock);
+                  sh->listen_sock = NULL;
+                }
+              else if (sh->is_udp == GNUNET_NO)
+                {
+                  ret = acceptConnection (sh, clientAddr);
+                  if (ret == GNUNET_SYSERR)
+                    break;
+                }
+              else
+                {
+                  receiveDatagrams (sh);
+                }
+              continue;
+            }
+          if ((fd < 0) || (fd >= sh->fdmapSize) || (sh->fdmap[fd] == NULL))
+            continue;           /* session already destroyed */
+          session = sh->fdmap[fd];
+          if (0 != (events[i].events & EPOLLERR))
+            {
+              destroySession (sh, session);
+              continue;
+            }
+          if (0 != (events[i].events & EPOLLHUP))
+            session->ready |= READY_READ | READY_WRITE;
+          if (0 != (events[i].events & EPOLLIN))
+            session->ready |= READY_READ;
+          if (0 != (events[i].events & EPOLLOUT))
+            session->ready |= READY_WRITE;
+          if (GNUNET_YES == hasWork (session))
+            readyAdd (sh, session);
+        }
+      if (ret == GNUNET_SYSERR)
+        break;
+      /* process each session that was ready at this point at most
+         once per round (those that still have work are re-appended) */
+      count = 0;
+      for (session = sh->ready_head; session != NULL;
+           session = session->ready_next)
+        count++;
+      while ((count-- > 0) &&
+             (sh->ready_head != NULL) && (sh->shutdown == GNUNET_NO))
+        {
+          session = sh->ready_head;
+          readyRemove (sh, session);
+          if ((0 != (session->ready & READY_READ)) &&
+              (session->no_read != GNUNET_YES) &&
+              (GNUNET_SYSERR == readAndProcess (sh, session)))
+            continue;
+          if ((0 != (session->ready & READY_WRITE)) &&
+              (session->wapos > session->wspos) &&
+              (GNUNET_SYSERR == writeAndProcess (sh, session)))
+            continue;
+          if (GNUNET_YES == hasWork (session))
+            readyAdd (sh, session);
+        }
+    }
+  sh->description = "DEAD";
+  GNUNET_mutex_unlock (sh->lock);
+  GNUNET_free_non_null (clientAddr);
+  return NULL;
+}
+#endif
+
 int
 GNUNET_pipe_make_nonblocking (struct GNUNET_GE_Context *ectx, int handle)
 {
@@ -934,14 +1427,68 @@ GNUNET_select_create (const char *description,
   sh->ch = ch;
   sh->ch_cls = ch_cls;
   sh->memory_quota = memory_quota;
+  /* every session may queue up to memory_quota bytes; the pool
+     enforces the same bound for all sessions together (only for
+     writes without force, buffers for received data are always
+     forced and thus never make a write fail) */
+  if ((memory_quota > 0) && (socket_quota > 0))
+    sh->pool = GNUNET_buffer_pool_create ((unsigned long long) memory_quota
+                                          * socket_quota);
+  else
+    sh->pool = GNUNET_buffer_pool_create (0);
   sh->socket_quota = socket_quota;
   sh->timeout = timeout;
   sh->lock = GNUNET_mutex_create (GNUNET_YES);
+  sh->next_timeout_check = -1;
   if (sock != -1)
     sh->listen_sock = GNUNET_socket_create (ectx, mon, sock);
   else
     sh->listen_sock = NULL;
-  sh->thread = GNUNET_thread_create (&selectThread, sh, 256 * 1024);
+  if ((is_udp == GNUNET_YES) && (sh->listen_sock != NULL))
+    {
+      /* the datagram functions do not change the mode of the
+         socket, and the select thread must never block on it */
+      GNUNET_socket_set_blocking (sh->listen_sock, GNUNET_NO);
+      sh->dgram_data = GNUNET_malloc (UDP_BATCH * GNUNET_MAX_BUFFER_SIZE);
+      sh->dgram_addr = GNUNET_malloc (UDP_BATCH * max_addr_len);
+    }
+  sh->use_epoll = GNUNET_NO;
+  sh->epoll_fd = -1;
+#if HAVE_SYS_EPOLL_H
+  if (use_epoll == GNUNET_YES)
+    {
+      sh->epoll_fd = epoll_create (MAX_EPOLL_EVENTS);
+      if (sh->epoll_fd == -1)
+        {
+          GNUNET_GE_LOG_STRERROR (ectx,
+                                  GNUNET_GE_WARNING | GNUNET_GE_ADMIN |
+                                  GNUNET_GE_BULK, "epoll_create");
+        }
+      else if ((GNUNET_OK !=
+                epollWatch (sh, sh->signal_pipe[0], EPOLLIN, GNUNET_NO)) ||
+               ((sh->listen_sock != NULL) &&
+                (GNUNET_OK !=
+                 epollWatch (sh, sh->listen_sock->handle, EPOLLIN,
+                             GNUNET_NO))))
+        {
+          CLOSE (sh->epoll_fd);
+          sh->epoll_fd = -1;
+        }
+      else
+        {
+          sh->use_epoll = GNUNET_YES;
+        }
+      if (sh->use_epoll != GNUNET_YES)
+        GNUNET_GE_LOG (ectx,
+                       GNUNET_GE_WARNING | GNUNET_GE_ADMIN | GNUNET_GE_BULK,
+                       _("Failed to use epoll for `%s', using select.\n"),
+                       description);
+    }
+  if (sh->use_epoll == GNUNET_YES)
+    sh->thread = GNUNET_thread_create (&epollThread, sh, 256 * 1024);
+  else
+#endif
+    sh->thread = GNUNET_thread_create (&selectThread, sh, 256 * 1024);
   if (sh->thread == NULL)
     {
       GNUNET_GE_LOG_STRERROR (ectx,
@@ -949,18 +1496,36 @@ GNUNET_select_create (const char *description,
                               GNUNET_GE_ADMIN, "pthread_create");
       if (sh->listen_sock != NULL)
         GNUNET_socket_destroy (sh->listen_sock);
+      if ((sh->epoll_fd != -1) && (0 != CLOSE (sh->epoll_fd)))
+        GNUNET_GE_LOG_STRERROR (ectx,
+                                GNUNET_GE_ERROR | GNUNET_GE_IMMEDIATE |
+                                GNUNET_GE_ADMIN, "close");
       if ((0 != CLOSE (sh->signal_pipe[0])) ||
           (0 != CLOSE (sh->signal_pipe[1])))
         GNUNET_GE_LOG_STRERROR (ectx,
                                 GNUNET_GE_ERROR | GNUNET_GE_IMMEDIATE |
                                 GNUNET_GE_ADMIN, "close");
       GNUNET_mutex_destroy (sh->lock);
+      GNUNET_buffer_pool_destroy (sh->pool);
+      GNUNET_free_non_null (sh->dgram_data);
+      GNUNET_free_non_null (sh->dgram_addr);
       GNUNET_free (sh);
       return NULL;
     }
   return sh;
 }
 
+/**
+ * Choose the backend for select handles created from now on.
+ */
+void
+GNUNET_select_set_epoll (int enable)
+{
+#if HAVE_SYS_EPOLL_H
+  use_epoll = enable;
+#endif
+}
+
 /**
  * Terminate the select thread, close the socket and
  * all associated connections.
@@ -984,8 +1549,10 @@ GNUNET_select_destroy (struct GNUNET_SelectHandle *sh)
   while (sh->sessionCount > 0)
     destroySession (sh, sh->sessions[0]);
   GNUNET_array_grow (sh->sessions, sh->sessionArrayLength, 0);
+  GNUNET_array_grow (sh->fdmap, sh->fdmapSize, 0);
   GNUNET_mutex_unlock (sh->lock);
   GNUNET_mutex_destroy (sh->lock);
+  GNUNET_buffer_pool_destroy (sh->pool);
   if (0 != CLOSE (sh->signal_pipe[1]))
     GNUNET_GE_LOG_STRERROR (sh->ectx,
                             GNUNET_GE_ERROR | GNUNET_GE_USER | GNUNET_GE_ADMIN
@@ -994,11 +1561,118 @@ GNUNET_select_destroy (struct GNUNET_SelectHandle *sh)
     GNUNET_GE_LOG_STRERROR (sh->ectx,
                             GNUNET_GE_ERROR | GNUNET_GE_USER | GNUNET_GE_ADMIN
                             | GNUNET_GE_BULK, "close");
+  if ((sh->epoll_fd != -1) && (0 != CLOSE (sh->epoll_fd)))
+    GNUNET_GE_LOG_STRERROR (sh->ectx,
+                            GNUNET_GE_ERROR | GNUNET_GE_USER | GNUNET_GE_ADMIN
+                            | GNUNET_GE_BULK, "close");
   if (sh->listen_sock != NULL)
     GNUNET_socket_destroy (sh->listen_sock);
+  GNUNET_free_non_null (sh->dgram_data);
+  GNUNET_free_non_null (sh->dgram_addr);
   GNUNET_free (sh);
 }
 
+/**
+ * Find the session for the given socket.  The lock must be held.
+ */
+static Session *
+findSession (struct GNUNET_SelectHandle *sh, struct GNUNET_SocketHandle *sock)
+{
+  Session *session;
+  int i;
+
+  if (sh->use_epoll == GNUNET_YES)
+    {
+      if ((sock->handle < 0) || (sock->handle >= sh->fdmapSize))
+        return NULL;
+      session = sh->fdmap[sock->handle];
+      if ((session == NULL) || (session->sock != sock))
+        return NULL;
+      return session;
+    }
+  for (i = 0; i < sh->sessionCount; i++)
+    if (sh->sessions[i]->sock == sock)
+      return sh->sessions[i];
+  return NULL;
+}
+
+/**
+ * Make room for len more bytes in the write buffer of
+ * the session.  The lock must be held.
+ *
+ * @param force message is important, grow even if
+ *        there is not enough space
+ * @return GNUNET_OK on success, GNUNET_NO if there
+ *         is not enough memory
+ */
+static int
+reserveWriteBuffer (SelectHandle * sh, Session * session,
+                    unsigned int len, int force)
+{
+  struct GNUNET_Buffer *newBuffer;
+  unsigned int newBufferSize;
+
+  if (session->wsize - session->wapos >= len)
+    return GNUNET_OK;
+  /* need to make space in some way or other */
+  if (session->wapos - session->wspos + len <= session->wsize)
+    {
+      /* can compact buffer to get space */
+      memmove (session->wbuff,
+               &session->wbuff[session->wspos],
+               session->wapos - session->wspos);
+      session->wapos -= session->wspos;
+      session->wspos = 0;
+      return GNUNET_OK;
+    }
+  /* need to grow buffer */
+  newBufferSize = session->wsize;
+  if (session->wsize == 0)
+    newBufferSize = 4092;
+  while (newBufferSize < len + session->wapos - session->wspos)
+    newBufferSize *= 2;
+  if ((sh->memory_quota > 0) &&
+      (newBufferSize > sh->memory_quota) && (force == GNUNET_NO))
+    newBufferSize = sh->memory_quota;
+  if (newBufferSize > GNUNET_MAX_GNUNET_malloc_CHECKED)
+    {
+      /* not enough free space, not allowed to grow that much,
+         even with forcing! */
+      return GNUNET_NO;
+    }
+  GNUNET_GE_ASSERT (NULL,
+                    newBufferSize >= len + session->wapos - session->wspos);
+  if (newBufferSize != session->wsize)
+    {
+      newBuffer = GNUNET_buffer_pool_get (sh->pool, newBufferSize, force);
+      if (newBuffer == NULL)
+        {
+          /* pool is over quota */
+          return GNUNET_NO;
+        }
+      if (session->wapos > session->wspos)
+        memcpy (GNUNET_buffer_get_data (newBuffer),
+                &session->wbuff[session->wspos],
+                session->wapos - session->wspos);
+      if (session->wbuf != NULL)
+        GNUNET_buffer_release (session->wbuf);
+      session->wbuf = newBuffer;
+      session->wbuff = GNUNET_buffer_get_data (newBuffer);
+      newBufferSize = GNUNET_buffer_get_size (newBuffer);
+    }
+  else
+    {
+      if (session->wspos != 0)
+        memmove (session->wbuff,
+                 &session->wbuff[session->wspos],
+                 session->wapos - session->wspos);
+    }
+  session->wsize = newBufferSize;
+  session->wapos = session->wapos - session->wspos;
+  session->wspos = 0;
+  return GNUNET_OK;
+}
+
 /**
  * Queue the given message with the select thread.
  *
@@ -1015,29 +1689,48 @@ GNUNET_select_write (struct GNUNET_SelectHandle *sh,
                      struct GNUNET_SocketHandle *sock,
                      const GNUNET_MessageHeader * msg, int mayBlock,
                      int force)
+{
+  struct GNUNET_IOVec iov;
+
+  iov.base = msg;
+  iov.size = ntohs (msg->size);
+  return GNUNET_select_writev (sh, sock, &iov, 1, mayBlock, force);
+}
+
+/**
+ * Queue a message given in parts with the select thread.
+ *
+ * @param mayBlock if GNUNET_YES, blocks this thread until message
+ *        has been sent
+ * @param force message is important, queue even if
+ *        there is not enough space
+ * @return GNUNET_OK if the message was sent or queued,
+ *         GNUNET_NO if there was not enough memory to queue it,
+ *         GNUNET_SYSERR if the sock does not belong with this select
+ */
+int
+GNUNET_select_writev (struct GNUNET_SelectHandle *sh,
+                      struct GNUNET_SocketHandle *sock,
+                      const struct GNUNET_IOVec *iov,
+                      unsigned int iovcnt, int mayBlock, int force)
 {
   Session *session;
-  int i;
-  unsigned short len;
-  char *newBuffer;
-  unsigned int newBufferSize;
+  unsigned int len;
+  unsigned int i;
   int do_sig;
 
+  len = 0;
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].size;
 #if DEBUG_SELECT
   GNUNET_GE_LOG (sh->ectx,
                  GNUNET_GE_DEBUG | GNUNET_GE_DEVELOPER | GNUNET_GE_BULK,
                  "Adding message of size %u to %p of select %p\n",
-                 ntohs (msg->size), sock, sh);
+                 len, sock, sh);
 #endif
   session = NULL;
-  len = ntohs (msg->size);
   GNUNET_mutex_lock (sh->lock);
-  for (i = 0; i < sh->sessionCount; i++)
-    if (sh->sessions[i]->sock == sock)
-      {
-        session = sh->sessions[i];
-        break;
-      }
+  session = findSession (sh, sock);
   if (session == NULL)
     {
       GNUNET_mutex_unlock (sh->lock);
@@ -1056,65 +1749,35 @@ GNUNET_select_write (struct GNUNET_SelectHandle *sh,
     do_sig = GNUNET_YES;
   else
     do_sig = GNUNET_NO;
-  if (session->wsize - session->wapos < len)
+  if (GNUNET_OK != reserveWriteBuffer (sh, session, len, force))
     {
-      /* need to make space in some way or other */
-      if (session->wapos - session->wspos + len <= session->wsize)
+      GNUNET_mutex_unlock (sh->lock);
+      return GNUNET_NO;
+    }
+  GNUNET_GE_ASSERT (NULL, session->wapos + len <= session->wsize);
+  for (i = 0; i < iovcnt; i++)
+    {
+      memcpy (&session->wbuff[session->wapos], iov[i].base, iov[i].size);
+      session->wapos += iov[i].size;
+    }
+  if (mayBlock)
+    session->no_read = GNUNET_YES;
+  if ((do_sig == GNUNET_YES) && (sh->use_epoll == GNUNET_YES))
+    {
+      if ((0 != (session->ready & READY_WRITE)) &&
+          (sh->signaled == GNUNET_NO))
         {
-          /* can compact buffer to get space */
-          memmove (session->wbuff,
-                   &session->wbuff[session->wspos],
-                   session->wapos - session->wspos);
-          session->wapos -= session->wspos;
-          session->wspos = 0;
+          readyAdd (sh, session);
+          sh->signaled = GNUNET_YES;
         }
       else
         {
-          /* need to grow buffer */
-          newBufferSize = session->wsize;
-          if (session->wsize == 0)
-            newBufferSize = 4092;
-          while (newBufferSize < len + session->wapos - session->wspos)
-            newBufferSize *= 2;
-          if ((sh->memory_quota > 0) &&
-              (newBufferSize > sh->memory_quota) && (force == GNUNET_NO))
-            newBufferSize = sh->memory_quota;
-          if (newBufferSize > GNUNET_MAX_GNUNET_malloc_CHECKED)
-            {
-              /* not enough free space, not allowed to grow that much,
-                 even with forcing! */
-              GNUNET_mutex_unlock (sh->lock);
-              return GNUNET_NO;
-            }
-          GNUNET_GE_ASSERT (NULL,
-                            newBufferSize >=
-                            len + session->wapos - session->wspos);
-          if (newBufferSize != session->wsize)
-            {
-              newBuffer = GNUNET_malloc (newBufferSize);
-              memcpy (newBuffer,
-                      &session->wbuff[session->wspos],
-                      session->wapos - session->wspos);
-              GNUNET_free_non_null (session->wbuff);
-              session->wbuff = newBuffer;
-            }
-          else
-            {
-              if (session->wspos != 0)
-                memmove (session->wbuff,
-                         &session->wbuff[session->wspos],
-                         session->wapos - session->wspos);
-            }
-          session->wsize = newBufferSize;
-          session->wapos = session->wapos - session->wspos;
-          session->wspos = 0;
+          /* EPOLLOUT (or the pending signal) will wake us up */
+          if (0 != (session->ready & READY_WRITE))
+            readyAdd (sh, session);
+          do_sig = GNUNET_NO;
         }
     }
-  GNUNET_GE_ASSERT (NULL, session->wapos + len <= session->wsize);
-  memcpy (&session->wbuff[session->wapos], msg, len);
-  session->wapos += len;
-  if (mayBlock)
-    session->no_read = GNUNET_YES;
   GNUNET_mutex_unlock (sh->lock);
   if (do_sig)
     signalSelect (sh);
@@ -1130,16 +1793,10 @@ GNUNET_select_update_closure (struct GNUNET_SelectHandle *sh,
                               void *old_sock_ctx, void *new_sock_ctx)
 {
   Session *session;
-  int i;
 
   session = NULL;
   GNUNET_mutex_lock (sh->lock);
-  for (i = 0; i < sh->sessionCount; i++)
-    if (sh->sessions[i]->sock == sock)
-      {
-        session = sh->sessions[i];
-        break;
-      }
+  session = findSession (sh, sock);
   if (session == NULL)
     {
       GNUNET_mutex_unlock (sh->lock);
@@ -1172,27 +1829,14 @@ GNUNET_select_connect (struct GNUNET_SelectHandle *sh,
   session->sock_ctx = sock_ctx;
   session->lastUse = GNUNET_get_time ();
   GNUNET_mutex_lock (sh->lock);
-  if (sh->sessionArrayLength == sh->sessionCount)
-    GNUNET_array_grow (sh->sessions, sh->sessionArrayLength,
-                       sh->sessionArrayLength + 4);
-  sh->sessions[sh->sessionCount++] = session;
+  addSession (sh, session);
   sh->socket_quota--;
   GNUNET_mutex_unlock (sh->lock);
-  signalSelect (sh);
+  if (sh->use_epoll != GNUNET_YES)
+    signalSelect (sh);          /* epoll: already registered */
   return GNUNET_OK;
 }
 
-static Session *
-findSession (struct GNUNET_SelectHandle *sh, struct GNUNET_SocketHandle *sock)
-{
-  int i;
-
-  for (i = 0; i < sh->sessionCount; i++)
-    if (sh->sessions[i]->sock == sock)
-      return sh->sessions[i];
-  return NULL;
-}
-
 /**
  * Close the associated socket and remove it from the
  * set of sockets managed by select.
@@ -1221,6 +1865,26 @@ GNUNET_select_disconnect (struct GNUNET_SelectHandle *sh,
   return GNUNET_OK;
 }
 
+/**
+ * Get the buffer that holds the message currently being
+ * passed to the message handler of this select.
+ */
+struct GNUNET_Buffer *
+GNUNET_select_get_message_buffer (struct GNUNET_SelectHandle *sh)
+{
+  return sh->current;
+}
+
+/**
+ * How many times did this select allocate memory for read
+ * and write buffers so far?
+ */
+unsigned long long
+GNUNET_select_get_allocations (struct GNUNET_SelectHandle *sh)
+{
+  return GNUNET_buffer_pool_get_allocations (sh->pool);
+}
+
 /**
  * Change the timeout for this socket to a custom
  * value.  Use 0 to use the default timeout for
@@ -1241,7 +1905,9 @@ GNUNET_select_change_timeout (struct GNUNET_SelectHandle *sh,
       return GNUNET_SYSERR;
     }
   session->timeout = timeout;
+  sh->next_timeout_check = 0;
   GNUNET_mutex_unlock (sh->lock);
+  signalSelect (sh);
   return GNUNET_OK;
 }
 
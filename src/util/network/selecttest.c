@@ -68,6 +68,61 @@ static unsigned int recvPos;
 
 static unsigned long long throughput;
 
+/**
+ * Port used by the many-connections test.
+ */
+#define MANY_PORT 10001
+
+/**
+ * How many connections should the many-connections test
+ * open when using epoll?
+ */
+#define MANY_CONNECTIONS 10000
+
+/**
+ * How many connections can we use with select?  Both ends
+ * of each connection live in this process and select can
+ * not handle descriptors beyond FD_SETSIZE.
+ */
+#define MANY_CONNECTIONS_SELECT ((FD_SETSIZE - 128) / 2)
+
+/**
+ * How many messages should we send over each connection
+ * in the throughput part of the many-connections test?
+ */
+#define MANY_ROUNDS 10
+
+/**
+ * Size of the messages for the many-connections test.
+ */
+#define MANY_SIZE 1024
+
+/**
+ * How many ping-pongs for the latency part of the
+ * many-connections test?
+ */
+#define MANY_PINGS 200
+
+static unsigned int manyAccepted;
+
+static unsigned int manyEchoed;
+
+static int manyLatency;
+
+static struct GNUNET_Semaphore *manyPong;
+
+/**
+ * How many received messages does the client keep
+ * (without copying) to check that they stay intact?
+ */
+#define MANY_HELD 64
+
+static struct GNUNET_Buffer *heldBuffers[MANY_HELD];
+
+static const GNUNET_MessageHeader *heldMessages[MANY_HELD];
+
+static unsigned int heldCount;
+
 
 /**
  * @brief callback for handling messages received by select
@@ -276,11 +331,263 @@ check ()
   return 0;
 }
 
+/**
+ * Server side of the many-connections test: echo
+ * every message back to the sender.
+ */
+static int
+many_server_mh (void *mh_cls,
+                struct GNUNET_SelectHandle *sh,
+                struct GNUNET_SocketHandle *sock,
+                void *sock_ctx, const GNUNET_MessageHeader * msg)
+{
+  if (GNUNET_OK != GNUNET_select_write (sh, sock, msg, GNUNET_NO, GNUNET_YES))
+    return GNUNET_SYSERR;
+  return GNUNET_OK;
+}
+
+static void *
+many_server_ah (void *ah_cls,
+                struct GNUNET_SelectHandle *sh,
+                struct GNUNET_SocketHandle *sock, const void *addr,
+                unsigned int addr_len)
+{
+  static int ret_addr;
+
+  manyAccepted++;
+  return &ret_addr;
+}
+
+/**
+ * Client side of the many-connections test: count
+ * the echoed messages.
+ */
+static int
+many_client_mh (void *mh_cls,
+                struct GNUNET_SelectHandle *sh,
+                struct GNUNET_SocketHandle *sock,
+                void *sock_ctx, const GNUNET_MessageHeader * msg)
+{
+  manyEchoed++;
+  if ((heldCount < MANY_HELD) && (manyEchoed % 97 == 0))
+    {
+      heldBuffers[heldCount] = GNUNET_select_get_message_buffer (sh);
+      GNUNET_buffer_retain (heldBuffers[heldCount]);
+      heldMessages[heldCount++] = msg;
+    }
+  if (manyLatency == GNUNET_YES)
+    GNUNET_semaphore_up (manyPong);
+  return GNUNET_OK;
+}
+
+static void
+many_ch (void *ch_cls,
+         struct GNUNET_SelectHandle *sh, struct GNUNET_SocketHandle *sock,
+         void *sock_ctx)
+{
+}
+
+/**
+ * Wait until the counter reaches the given value.
+ *
+ * @return GNUNET_OK on success, GNUNET_SYSERR on timeout
+ */
+static int
+waitFor (volatile unsigned int *counter, unsigned int value,
+         GNUNET_CronTime timeout)
+{
+  GNUNET_CronTime end;
+
+  end = GNUNET_get_time () + timeout;
+  while (*counter < value)
+    {
+      if (GNUNET_get_time () > end)
+        return GNUNET_SYSERR;
+      GNUNET_thread_sleep (5 * GNUNET_CRON_MILLISECONDS);
+    }
+  return GNUNET_OK;
+}
+
+/**
+ * Open many connections to one select (and manage the
+ * client ends with another one), then measure the
+ * throughput with all connections busy and the latency
+ * of a single connection while all others are idle.
+ */
+static int
+checkMany (int epoll)
+{
+  struct sockaddr_in serverAddr;
+  struct GNUNET_SelectHandle *server;
+  struct GNUNET_SelectHandle *client;
+  struct GNUNET_SocketHandle **socks;
+  GNUNET_MessageHeader *h;
+  GNUNET_CronTime start;
+  GNUNET_CronTime delta;
+  unsigned int count;
+  unsigned int i;
+  unsigned int j;
+  int listen_sock;
+  int s;
+  int on;
+  int ret;
+
+  count = MANY_CONNECTIONS_SELECT;
+  if ((epoll == GNUNET_YES) &&
+      (GNUNET_OK ==
+       GNUNET_set_fd_limit (NULL, 2 * MANY_CONNECTIONS + 256)))
+    count = MANY_CONNECTIONS;
+  GNUNET_select_set_epoll (epoll);
+  listen_sock = SOCKET (PF_INET, SOCK_STREAM, 6);
+  if (listen_sock == -1)
+    return 1;
+  on = 1;
+  SETSOCKOPT (listen_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+  memset (&serverAddr, 0, sizeof (serverAddr));
+  serverAddr.sin_family = AF_INET;
+  serverAddr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  serverAddr.sin_port = htons (MANY_PORT);
+  if (BIND (listen_sock,
+            (struct sockaddr *) &serverAddr, sizeof (serverAddr)) < 0)
+    {
+      CLOSE (listen_sock);
+      return 1;
+    }
+  manyAccepted = 0;
+  manyEchoed = 0;
+  manyLatency = GNUNET_NO;
+  server = GNUNET_select_create ("Select Many Server", GNUNET_NO,
+                                 NULL, NULL,
+                                 listen_sock, sizeof (struct sockaddr_in),
+                                 GNUNET_CRON_MINUTES,
+                                 many_server_mh, NULL, many_server_ah, NULL,
+                                 many_ch, NULL,
+                                 64 * 1024, count + 16);
+  client = GNUNET_select_create ("Select Many Client", GNUNET_NO,
+                                 NULL, NULL,
+                                 -1, 0,
+                                 0,
+                                 many_client_mh, NULL, NULL, NULL,
+                                 many_ch, NULL, 64 * 1024, count + 16);
+  if ((server == NULL) || (client == NULL))
+    return 1;
+  /* select_create uses a tiny backlog, we connect in bursts */
+  LISTEN (listen_sock, 1024);
+  ret = 0;
+  socks = GNUNET_malloc (sizeof (struct GNUNET_SocketHandle *) * count);
+  start = GNUNET_get_time ();
+  for (i = 0; i < count; i++)
+    {
+      s = SOCKET (PF_INET, SOCK_STREAM, 6);
+      if ((s == -1) ||
+          (0 != CONNECT (s,
+                         (struct sockaddr *) &serverAddr,
+                         sizeof (serverAddr))))
+        {
+          fprintf (stderr, "Failed to open connection %u: %s\n",
+                   i, STRERROR (errno));
+          if (s != -1)
+            CLOSE (s);
+          count = i;
+          ret = 1;
+          break;
+        }
+      socks[i] = GNUNET_socket_create (NULL, NULL, s);
+      GNUNET_socket_set_blocking (socks[i], GNUNET_NO);
+      GNUNET_select_connect (client, socks[i], NULL);
+      if ((i % 512 == 511) &&
+          (GNUNET_OK != waitFor (&manyAccepted, i + 1,
+                                 10 * GNUNET_CRON_SECONDS)))
+        {
+          fprintf (stderr, "Server failed to accept connections\n");
+          count = i + 1;
+          ret = 1;
+          break;
+        }
+    }
+  if ((ret == 0) &&
+      (GNUNET_OK != waitFor (&manyAccepted, count,
+                             10 * GNUNET_CRON_SECONDS)))
+    ret = 1;
+  fprintf (stderr,
+           "%s: %u connections established in %llu ms\n",
+           (epoll == GNUNET_YES) ? "epoll" : "select",
+           count, GNUNET_get_time () - start);
+  h = GNUNET_malloc (MANY_SIZE);
+  memset (h, 42, MANY_SIZE);
+  h->size = htons (MANY_SIZE);
+  h->type = htons (0);
+  if (ret == 0)
+    {
+      start = GNUNET_get_time ();
+      for (j = 0; j < MANY_ROUNDS; j++)
+        for (i = 0; i < count; i++)
+          GNUNET_select_write (client, socks[i], h, GNUNET_NO, GNUNET_YES);
+      if (GNUNET_OK != waitFor (&manyEchoed, count * MANY_ROUNDS,
+                                60 * GNUNET_CRON_SECONDS))
+        {
+          fprintf (stderr, "Only %u of %u messages echoed\n",
+                   manyEchoed, count * MANY_ROUNDS);
+          ret = 1;
+        }
+      delta = GNUNET_get_time () - start;
+      if (delta == 0)
+        delta = 1;
+      for (i = 0; i < heldCount; i++)
+        {
+          if ((ntohs (heldMessages[i]->size) != MANY_SIZE) ||
+              (0 != memcmp (&heldMessages[i][1], &h[1],
+                            MANY_SIZE - sizeof (GNUNET_MessageHeader))))
+            {
+              fprintf (stderr, "Retained message was modified!\n");
+              ret = 1;
+            }
+          GNUNET_buffer_release (heldBuffers[i]);
+        }
+      heldCount = 0;
+      fprintf (stderr,
+               "%s: echoed %u messages in %llu ms (%llu kbps)\n",
+               (epoll == GNUNET_YES) ? "epoll" : "select",
+               manyEchoed, delta,
+               2LL * manyEchoed * MANY_SIZE / 1024 * GNUNET_CRON_SECONDS /
+               delta);
+    }
+  if (ret == 0)
+    {
+      manyPong = GNUNET_semaphore_create (0);
+      manyLatency = GNUNET_YES;
+      start = GNUNET_get_time ();
+      for (j = 0; j < MANY_PINGS; j++)
+        {
+          GNUNET_select_write (client, socks[j % count], h, GNUNET_NO,
+                               GNUNET_YES);
+          GNUNET_semaphore_down (manyPong, GNUNET_YES);
+        }
+      delta = GNUNET_get_time () - start;
+      manyLatency = GNUNET_NO;
+      GNUNET_semaphore_destroy (manyPong);
+      fprintf (stderr,
+               "%s: %u round trips with %u idle connections took %llu ms\n",
+               (epoll == GNUNET_YES) ? "epoll" : "select",
+               MANY_PINGS, count - 1, delta);
+    }
+  GNUNET_free (h);
+  GNUNET_select_destroy (client);
+  GNUNET_select_destroy (server);
+  GNUNET_free (socks);
+  GNUNET_select_set_epoll (GNUNET_YES);
+  return ret;
+}
+
 int
 main (int argc, char *argv[])
 {
   int ret;
   ret = check ();
+  if (ret == 0)
+    ret = checkMany (GNUNET_NO);
+  if (ret == 0)
+    ret = checkMany (GNUNET_YES);
   if (ret != 0)
     fprintf (stderr, "ERROR %d.\n", ret);
   return ret;
@@ -169,6 +169,36 @@ GNUNET_mutex_lock_at_file_line_ (Mutex * mutex, const char *file,
     }
 }
 
+int
+GNUNET_mutex_trylock_at_file_line_ (Mutex * mutex, const char *file,
+                                    unsigned int line)
+{
+  int ret;
+
+  GNUNET_GE_ASSERT_FL (NULL, mutex != NULL, file, line);
+  ret = pthread_mutex_trylock (&mutex->pt);
+  if (ret == EBUSY)
+    return GNUNET_NO;
+  if (ret != 0)
+    {
+      if (ret == EINVAL)
+        GNUNET_GE_LOG (NULL,
+                       GNUNET_GE_FATAL | GNUNET_GE_DEVELOPER | GNUNET_GE_USER
+                       | GNUNET_GE_IMMEDIATE,
+                       _("Invalid argument for `%s'.\n"),
+                       "pthread_mutex_trylock");
+      GNUNET_GE_ASSERT_FL (NULL, 0, file, line);
+      return GNUNET_NO;
+    }
+  if (mutex->locked_depth++ == 0)
+    {
+      mutex->locked_file = file;
+      mutex->locked_line = line;
+      mutex->locked_time = GNUNET_get_time ();
+    }
+  return GNUNET_OK;
+}
+
 void
 GNUNET_mutex_unlock (Mutex * mutex)
 {
@@ -134,6 +134,46 @@ testRecursiveMutex ()
   return 0;                     /* ok -- fails by hanging! */
 }
 
+static void *
+tryLockIt (void *unused)
+{
+  if (GNUNET_OK == GNUNET_mutex_trylock (lock))
+    {
+      GNUNET_mutex_unlock (lock);
+      tv = 1;                   /* should have been busy */
+      return NULL;
+    }
+  tv = 2;
+  return NULL;
+}
+
+static int
+testTryLock ()
+{
+  struct GNUNET_ThreadHandle *pt;
+  void *unused;
+
+  lock = GNUNET_mutex_create (GNUNET_YES);
+  if ((GNUNET_OK != GNUNET_mutex_trylock (lock)) ||
+      (GNUNET_OK != GNUNET_mutex_trylock (lock)))
+    {
+      printf ("MUTEX trylock failed at %s:%u\n", __FILE__, __LINE__);
+      return 1;
+    }
+  tv = 0;
+  pt = GNUNET_thread_create (&tryLockIt, NULL, 1024);
+  GNUNET_thread_join (pt, &unused);
+  GNUNET_mutex_unlock (lock);
+  GNUNET_mutex_unlock (lock);
+  GNUNET_mutex_destroy (lock);
+  if (tv != 2)
+    {
+      printf ("MUTEX trylock test failed at %s:%u\n", __FILE__, __LINE__);
+      return 1;
+    }
+  return 0;
+}
+
 static void *
 semUpDown (void *unused)
 {
@@ -212,6 +252,7 @@ main (int argc, char *argv[])
   ret += testPTHREAD_CREATE ();
   ret += testMutex ();
   ret += testRecursiveMutex ();
+  ret += testTryLock ();
   ret += testSemaphore ();
   return ret;
 }